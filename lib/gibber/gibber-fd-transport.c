@@ -29,12 +29,51 @@
 # include <unistd.h>
 #endif
 
+#ifdef HAVE_SYS_UIO_H
+# include <sys/uio.h>
+#endif
+
 #include "gibber-sockets.h"
 #include "gibber-fd-transport.h"
 
 #define DEBUG_FLAG DEBUG_NET
 #include "gibber-debug.h"
 
+/* Data which couldn't be written straight away is queued in chunks of at
+ * least this many bytes; small sends are appended to the last chunk when it
+ * has room, and the queue is flushed with one writev () of up to MAX_IOVECS
+ * chunks at a time. */
+#define CHUNK_SIZE 16384
+#define MAX_IOVECS 16
+
+/* Once more than the high watermark is queued, the transport reports its
+ * buffer as full until it has drained to the low watermark, at which point
+ * buffer-drained is emitted so writers can resume. buffer-empty is only
+ * emitted once nothing at all is queued. */
+#define DEFAULT_HIGH_WATERMARK (64 * 1024)
+#define DEFAULT_LOW_WATERMARK (16 * 1024)
+
+/* Reads start at READ_SIZE_MIN bytes. The size doubles (up to the
+ * max-read-size property) each time a read fills the buffer, and halves
+ * again after READ_SHRINK_AFTER reads in a row which used less than a
+ * quarter of it. */
+#define READ_SIZE_MIN (64 * 1024)
+#define READ_SHRINK_AFTER 8
+#define DEFAULT_MAX_READ_SIZE (512 * 1024)
+
+/* Read buffers are only needed for the duration of a read, so they're
+ * pooled between all transports rather than kept by each of them: one
+ * stack of free buffers per size, from READ_SIZE_MIN up to
+ * READ_SIZE_MIN << (READ_POOL_SIZES - 1). The free buffers stay allocated
+ * whether or not any transport is reading, so together they are kept under
+ * READ_POOL_MAX_BYTES; buffers which would not fit are freed. */
+#define READ_POOL_SIZES 9
+#define READ_POOL_MAX_BYTES (1024 * 1024)
+
+/* Most bytes moved through the pipe by one splice; this is the default
+ * capacity of a pipe on Linux */
+#define SPLICE_SIZE (64 * 1024)
+
 static gboolean _channel_io_out (GIOChannel *source,
     GIOCondition condition, gpointer data);
 
@@ -56,9 +95,22 @@ static void _do_disconnect (GibberFdTransport *self);
 static gboolean gibber_fd_transport_buffer_is_empty (
     GibberTransport *transport);
 
+static gboolean gibber_fd_transport_buffer_is_full (
+    GibberTransport *transport);
+
+static gsize gibber_fd_transport_get_buffered_bytes (
+    GibberTransport *transport);
+
 static void gibber_fd_transport_block_receiving (GibberTransport *transport,
     gboolean block);
 
+static void _splice_stop (GibberFdTransport *self, gboolean drain);
+
+#ifdef HAVE_SPLICE
+static GibberFdIOResult _splice_read (GibberFdTransport *self,
+    GError **error);
+#endif
+
 G_DEFINE_TYPE(GibberFdTransport, gibber_fd_transport, GIBBER_TYPE_TRANSPORT)
 
 GQuark
@@ -72,6 +124,31 @@ gibber_fd_transport_error_quark (void)
   return quark;
 }
 
+/* properties */
+enum
+{
+  PROP_HIGH_WATERMARK = 1,
+  PROP_LOW_WATERMARK,
+  PROP_MAX_READ_SIZE,
+  PROP_READ_BUDGET,
+  LAST_PROPERTY
+};
+
+G_LOCK_DEFINE_STATIC (read_pool);
+static GTrashStack *read_pool[READ_POOL_SIZES];
+static gsize read_pool_bytes = 0;
+
+typedef struct {
+  /* bytes allocated after this header */
+  gsize size;
+  /* offset of the first byte which hasn't been written yet */
+  gsize start;
+  /* offset just after the last byte queued */
+  gsize end;
+} OutputChunk;
+
+#define CHUNK_DATA(chunk) ((guint8 *) ((chunk) + 1))
+
 /* private structure */
 typedef struct _GibberFdTransportPrivate GibberFdTransportPrivate;
 
@@ -82,8 +159,36 @@ struct _GibberFdTransportPrivate
   guint watch_in;
   guint watch_out;
   guint watch_err;
-  GString *output_buffer;
+  /* OutputChunk, oldest first */
+  GQueue output_chunks;
+  /* total number of bytes queued in output_chunks */
+  gsize output_len;
+  gsize high_watermark;
+  gsize low_watermark;
+  /* TRUE from when output_len goes over high_watermark until it drains back
+   * to low_watermark */
+  gboolean output_full;
+  /* the current read size is READ_SIZE_MIN << read_shift */
+  guint read_shift;
+  guint max_read_shift;
+  /* number of reads in a row which used less than a quarter of the buffer */
+  guint small_reads;
+  /* bytes returned by the last read, and whether it filled the buffer */
+  gsize last_read;
+  gboolean last_read_full;
+  guint read_budget;
   gboolean receiving_blocked;
+
+  /* Set while what is read from this transport is spliced straight into
+   * splice_dest, see gibber_fd_transport_splice () */
+  GibberFdTransport *splice_dest;
+  int splice_pipe[2];
+  /* bytes sitting in the pipe, waiting for splice_dest to be writable */
+  gsize splice_pending;
+  /* watch for splice_dest becoming writable, while splice_pending > 0 */
+  guint splice_watch;
+  GibberFdTransportSplicedFunc splice_func;
+  gpointer splice_user_data;
 };
 
 #define GIBBER_FD_TRANSPORT_GET_PRIVATE(o)  \
@@ -97,10 +202,13 @@ gibber_fd_transport_init (GibberFdTransport *self)
   GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
   self->fd = -1;
   priv->channel = NULL;
-  priv->output_buffer = NULL;
+  g_queue_init (&priv->output_chunks);
+  priv->output_len = 0;
   priv->watch_in = 0;
   priv->watch_out = 0;
   priv->watch_err = 0;
+  priv->splice_pipe[0] = -1;
+  priv->splice_pipe[1] = -1;
 }
 
 static void gibber_fd_transport_dispose (GObject *object);
@@ -109,6 +217,74 @@ static GibberFdIOResult gibber_fd_transport_write (
    GibberFdTransport *fd_transport, GIOChannel *channel, const guint8 *data,
    int len, gsize *written, GError **error);
 
+static void
+gibber_fd_transport_get_property (GObject *object,
+    guint property_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  GibberFdTransport *self = GIBBER_FD_TRANSPORT (object);
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+
+  switch (property_id)
+    {
+      case PROP_HIGH_WATERMARK:
+        g_value_set_uint (value, priv->high_watermark);
+        break;
+      case PROP_LOW_WATERMARK:
+        g_value_set_uint (value, priv->low_watermark);
+        break;
+      case PROP_MAX_READ_SIZE:
+        g_value_set_uint (value, READ_SIZE_MIN << priv->max_read_shift);
+        break;
+      case PROP_READ_BUDGET:
+        g_value_set_uint (value, priv->read_budget);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+
+static void
+gibber_fd_transport_set_property (GObject *object,
+    guint property_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  GibberFdTransport *self = GIBBER_FD_TRANSPORT (object);
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+
+  switch (property_id)
+    {
+      case PROP_HIGH_WATERMARK:
+        priv->high_watermark = g_value_get_uint (value);
+        break;
+      case PROP_LOW_WATERMARK:
+        priv->low_watermark = g_value_get_uint (value);
+        break;
+      case PROP_MAX_READ_SIZE:
+        {
+          guint size = g_value_get_uint (value);
+
+          /* round down to one of the sizes we pool */
+          priv->max_read_shift = 0;
+          while (priv->max_read_shift < READ_POOL_SIZES - 1 &&
+              (READ_SIZE_MIN << (priv->max_read_shift + 1)) <= size)
+            priv->max_read_shift++;
+
+          priv->read_shift = MIN (priv->read_shift, priv->max_read_shift);
+        }
+        break;
+      case PROP_READ_BUDGET:
+        priv->read_budget = g_value_get_uint (value);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+
 static void
 gibber_fd_transport_class_init (
     GibberFdTransportClass *gibber_fd_transport_class)
@@ -120,6 +296,8 @@ gibber_fd_transport_class_init (
   g_type_class_add_private (gibber_fd_transport_class,
                             sizeof (GibberFdTransportPrivate));
 
+  object_class->get_property = gibber_fd_transport_get_property;
+  object_class->set_property = gibber_fd_transport_set_property;
   object_class->dispose = gibber_fd_transport_dispose;
   object_class->finalize = gibber_fd_transport_finalize;
 
@@ -128,10 +306,40 @@ gibber_fd_transport_class_init (
   transport_class->get_peeraddr = gibber_fd_transport_get_peeraddr;
   transport_class->get_sockaddr = gibber_fd_transport_get_sockaddr;
   transport_class->buffer_is_empty = gibber_fd_transport_buffer_is_empty;
+  transport_class->buffer_is_full = gibber_fd_transport_buffer_is_full;
+  transport_class->get_buffered_bytes =
+      gibber_fd_transport_get_buffered_bytes;
   transport_class->block_receiving = gibber_fd_transport_block_receiving;
 
   gibber_fd_transport_class->read = gibber_fd_transport_read;
   gibber_fd_transport_class->write = gibber_fd_transport_write;
+
+  g_object_class_install_property (object_class, PROP_HIGH_WATERMARK,
+      g_param_spec_uint ("high-watermark", "High watermark",
+          "Number of queued bytes above which the buffer is reported as full",
+          0, G_MAXUINT, DEFAULT_HIGH_WATERMARK,
+          G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (object_class, PROP_LOW_WATERMARK,
+      g_param_spec_uint ("low-watermark", "Low watermark",
+          "Number of queued bytes a full buffer must drain to before "
+          "buffer-drained is emitted",
+          0, G_MAXUINT, DEFAULT_LOW_WATERMARK,
+          G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (object_class, PROP_MAX_READ_SIZE,
+      g_param_spec_uint ("max-read-size", "Maximum read size",
+          "Largest number of bytes read, and passed to the handler, at once",
+          READ_SIZE_MIN, G_MAXUINT, DEFAULT_MAX_READ_SIZE,
+          G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (object_class, PROP_READ_BUDGET,
+      g_param_spec_uint ("read-budget", "Read budget",
+          "Number of bytes to keep reading for, while data is available, "
+          "before letting other sources on the main loop run; 0 to read "
+          "only once",
+          0, G_MAXUINT, 0,
+          G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS));
 }
 
 void
@@ -145,6 +353,7 @@ gibber_fd_transport_dispose (GObject *object)
 
   priv->dispose_has_run = TRUE;
 
+  _splice_stop (self, FALSE);
   _do_disconnect (self);
 
   if (G_OBJECT_CLASS (gibber_fd_transport_parent_class)->dispose)
@@ -157,6 +366,19 @@ gibber_fd_transport_finalize (GObject *object)
   G_OBJECT_CLASS (gibber_fd_transport_parent_class)->finalize (object);
 }
 
+static void
+_clear_output (GibberFdTransport *self)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+  OutputChunk *chunk;
+
+  while ((chunk = g_queue_pop_head (&priv->output_chunks)) != NULL)
+    g_free (chunk);
+
+  priv->output_len = 0;
+  priv->output_full = FALSE;
+}
+
 static void
 _do_disconnect (GibberFdTransport *self)
 {
@@ -169,6 +391,10 @@ _do_disconnect (GibberFdTransport *self)
 
   DEBUG ("Closing the fd transport");
 
+  /* Anything still in the splice pipe was read before we were closed, so
+   * pass it on */
+  _splice_stop (self, TRUE);
+
   if (priv->channel != NULL)
     {
       if (priv->watch_in != 0)
@@ -190,11 +416,7 @@ _do_disconnect (GibberFdTransport *self)
     }
   self->fd = -1;
 
-  if (priv->output_buffer)
-    {
-      g_string_free (priv->output_buffer, TRUE);
-      priv->output_buffer = NULL;
-    }
+  _clear_output (self);
 
   if (!priv->dispose_has_run)
     /* If we are disposing we don't care about the state anymore */
@@ -203,16 +425,9 @@ _do_disconnect (GibberFdTransport *self)
 }
 
 static gboolean
-_try_write (GibberFdTransport *self, const guint8 *data, int len,
-    gsize *written, GError **err)
+_check_write_result (GibberFdTransport *self, GibberFdIOResult result,
+    GError *error, GError **err)
 {
-  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
-  GibberFdTransportClass *cls = GIBBER_FD_TRANSPORT_GET_CLASS (self);
-  GibberFdIOResult result;
-  GError *error = NULL;
-
-  result = cls->write (self, priv->channel, data, len, written, &error);
-
   switch (result)
     {
       case GIBBER_FD_IO_RESULT_SUCCESS:
@@ -233,6 +448,162 @@ _try_write (GibberFdTransport *self, const guint8 *data, int len,
     return TRUE;
 }
 
+static gboolean
+_try_write (GibberFdTransport *self, const guint8 *data, int len,
+    gsize *written, GError **err)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+  GibberFdTransportClass *cls = GIBBER_FD_TRANSPORT_GET_CLASS (self);
+  GibberFdIOResult result;
+  GError *error = NULL;
+
+  result = cls->write (self, priv->channel, data, len, written, &error);
+
+  return _check_write_result (self, result, error, err);
+}
+
+#ifdef HAVE_SYS_UIO_H
+/* Writes the first MAX_IOVECS queued chunks with a single writev (). This
+ * bypasses the write vfunc, so it must only be used if the default
+ * implementation (which just writes to the fd) hasn't been overridden. */
+static gboolean
+_try_writev (GibberFdTransport *self, gsize *written, GError **err)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+  struct iovec iov[MAX_IOVECS];
+  GList *l;
+  int n = 0;
+  ssize_t ret;
+  int saved_errno;
+  GibberFdIOResult result;
+  GError *error = NULL;
+
+  for (l = priv->output_chunks.head; l != NULL && n < MAX_IOVECS; l = l->next)
+    {
+      OutputChunk *chunk = l->data;
+
+      iov[n].iov_base = CHUNK_DATA (chunk) + chunk->start;
+      iov[n].iov_len = chunk->end - chunk->start;
+      n++;
+    }
+
+  do
+    ret = writev (self->fd, iov, n);
+  while (ret < 0 && errno == EINTR);
+
+  saved_errno = errno;
+  *written = 0;
+
+  if (ret >= 0)
+    {
+      *written = ret;
+      result = GIBBER_FD_IO_RESULT_SUCCESS;
+    }
+  else if (saved_errno == EAGAIN || saved_errno == EWOULDBLOCK)
+    {
+      result = GIBBER_FD_IO_RESULT_AGAIN;
+    }
+  else
+    {
+      error = g_error_new_literal (GIBBER_FD_TRANSPORT_ERROR,
+          saved_errno == EPIPE ? GIBBER_FD_TRANSPORT_ERROR_PIPE
+                               : GIBBER_FD_TRANSPORT_ERROR_FAILED,
+          g_strerror (saved_errno));
+      result = GIBBER_FD_IO_RESULT_ERROR;
+    }
+
+  return _check_write_result (self, result, error, err);
+}
+#endif
+
+/* Appends @len bytes to the output queue, filling up the last chunk before
+ * allocating a new one */
+static void
+_queue_output (GibberFdTransport *self, const guint8 *data, gsize len)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+  OutputChunk *chunk = g_queue_peek_tail (&priv->output_chunks);
+
+  if (chunk != NULL && chunk->end < chunk->size)
+    {
+      gsize n = MIN (len, chunk->size - chunk->end);
+
+      memcpy (CHUNK_DATA (chunk) + chunk->end, data, n);
+      chunk->end += n;
+      priv->output_len += n;
+      data += n;
+      len -= n;
+    }
+
+  if (len > 0)
+    {
+      gsize size = MAX (len, CHUNK_SIZE);
+
+      chunk = g_malloc (sizeof (OutputChunk) + size);
+      chunk->size = size;
+      chunk->start = 0;
+      chunk->end = len;
+      memcpy (CHUNK_DATA (chunk), data, len);
+
+      g_queue_push_tail (&priv->output_chunks, chunk);
+      priv->output_len += len;
+    }
+
+  if (priv->output_len > priv->high_watermark)
+    priv->output_full = TRUE;
+}
+
+/* Drops the first @written bytes from the output queue */
+static void
+_consume_output (GibberFdTransport *self, gsize written)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+
+  g_assert (written <= priv->output_len);
+  priv->output_len -= written;
+
+  while (written > 0)
+    {
+      OutputChunk *chunk = g_queue_peek_head (&priv->output_chunks);
+      gsize n = MIN (written, chunk->end - chunk->start);
+
+      chunk->start += n;
+      written -= n;
+
+      if (chunk->start == chunk->end)
+        g_free (g_queue_pop_head (&priv->output_chunks));
+    }
+}
+
+static gboolean
+_flush_output (GibberFdTransport *self, GError **error)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+  gsize written = 0;
+
+#ifdef HAVE_SYS_UIO_H
+  if (priv->output_chunks.length > 1 &&
+      GIBBER_FD_TRANSPORT_GET_CLASS (self)->write == gibber_fd_transport_write)
+    {
+      if (!_try_writev (self, &written, error))
+        return FALSE;
+    }
+  else
+#endif
+    {
+      OutputChunk *chunk = g_queue_peek_head (&priv->output_chunks);
+
+      if (!_try_write (self, CHUNK_DATA (chunk) + chunk->start,
+              chunk->end - chunk->start, &written, error))
+        return FALSE;
+    }
+
+  DEBUG ("Wrote %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT " queued bytes",
+      written, priv->output_len);
+  _consume_output (self, written);
+  return TRUE;
+}
+
 static gboolean
 _writeout (GibberFdTransport *self, const guint8 *data, gsize len,
     GError **error)
@@ -241,31 +612,22 @@ _writeout (GibberFdTransport *self, const guint8 *data, gsize len,
   gsize written = 0;
 
   DEBUG ("Writing out %" G_GSIZE_FORMAT " bytes", len);
-  if (priv->output_buffer == NULL || priv->output_buffer->len == 0)
+  if (priv->output_len == 0)
     {
       /* We've got nothing buffer yet so try to write out directly */
       if (!_try_write (self, data, len, &written, error))
         {
           return FALSE;
         }
-    }
 
-  if (written == len)
-    {
-      gibber_transport_emit_buffer_empty (GIBBER_TRANSPORT (self));
-      return TRUE;
+      if (written == len)
+        {
+          gibber_transport_emit_buffer_empty (GIBBER_TRANSPORT (self));
+          return TRUE;
+        }
     }
 
-  if (priv->output_buffer)
-    {
-      g_string_append_len (priv->output_buffer, (gchar *) data + written,
-        len - written);
-    }
-  else
-    {
-      priv->output_buffer = g_string_new_len ((gchar *) data + written,
-          len - written);
-    }
+  _queue_output (self, data + written, len - written);
 
   if (!priv->watch_out)
     {
@@ -285,23 +647,49 @@ _channel_io_in (GIOChannel *source, GIOCondition condition, gpointer data)
   GibberFdIOResult result;
   GError *error = NULL;
   GibberFdTransportClass *cls = GIBBER_FD_TRANSPORT_GET_CLASS(self);
+  gsize total = 0;
 
-  result = cls->read (self, priv->channel, &error);
+  /* The handler could drop the last ref to us while we're still reading */
+  g_object_ref (self);
 
-  switch (result)
+  do
     {
-      case GIBBER_FD_IO_RESULT_SUCCESS:
-      case GIBBER_FD_IO_RESULT_AGAIN:
-        break;
-      case GIBBER_FD_IO_RESULT_ERROR:
-        gibber_transport_emit_error (GIBBER_TRANSPORT(self), error);
-        /* Deliberately falling through */
-      case GIBBER_FD_IO_RESULT_EOF:
-        DEBUG("Failed to read from the transport, closing..");
-        _do_disconnect (self);
-        return FALSE;
-    }
+      priv->last_read = 0;
+      priv->last_read_full = FALSE;
+
+#ifdef HAVE_SPLICE
+      if (priv->splice_dest != NULL)
+        result = _splice_read (self, &error);
+      else
+#endif
+        result = cls->read (self, priv->channel, &error);
+
+      switch (result)
+        {
+          case GIBBER_FD_IO_RESULT_SUCCESS:
+          case GIBBER_FD_IO_RESULT_AGAIN:
+            break;
+          case GIBBER_FD_IO_RESULT_ERROR:
+            gibber_transport_emit_error (GIBBER_TRANSPORT(self), error);
+            /* Deliberately falling through */
+          case GIBBER_FD_IO_RESULT_EOF:
+            DEBUG("Failed to read from the transport, closing..");
+            _do_disconnect (self);
+            g_object_unref (self);
+            return FALSE;
+        }
 
+      total += priv->last_read;
+    }
+  /* Keep going while the budget allows, as long as the last read filled the
+   * buffer (so there's probably more to come) and the handler didn't block
+   * receiving or disconnect us */
+  while (result == GIBBER_FD_IO_RESULT_SUCCESS &&
+      priv->last_read_full &&
+      total < priv->read_budget &&
+      priv->watch_in != 0);
+
+  g_object_unref (self);
   return TRUE;
 }
 
@@ -311,28 +699,41 @@ _channel_io_out (GIOChannel *source, GIOCondition condition, gpointer data)
   GibberFdTransport *self = GIBBER_FD_TRANSPORT (data);
   GibberFdTransportPrivate *priv =
      GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
-  gsize written;
+  gboolean connected, empty;
 
-  g_assert (priv->output_buffer);
-  if (!_try_write (self, (guint8 *) priv->output_buffer->str,
-                   priv->output_buffer->len, &written, NULL))
+  g_assert (priv->output_len > 0);
+  if (!_flush_output (self, NULL))
     {
       return FALSE;
     }
 
-  if (written > 0 )
-    {
-      priv->output_buffer = g_string_erase (priv->output_buffer, 0, written);
-    }
+  if (priv->output_len > 0 &&
+      (!priv->output_full || priv->output_len > priv->low_watermark))
+    return TRUE;
+
+  /* Let writers know, bearing in mind that they might send more, disconnect
+   * us, or drop the last ref to us, while we're emitting */
+  g_object_ref (self);
 
-  if (priv->output_buffer->len == 0)
+  empty = (priv->output_len == 0);
+  if (empty)
+    priv->watch_out = 0;
+
+  if (priv->output_full)
     {
-      priv->watch_out = 0;
-      gibber_transport_emit_buffer_empty (GIBBER_TRANSPORT (self));
-      return FALSE;
+      priv->output_full = FALSE;
+      gibber_transport_emit_buffer_drained (GIBBER_TRANSPORT (self));
     }
 
-  return TRUE;
+  /* Sending from a buffer-drained handler re-adds the watch if we have
+   * dropped ours, and then the buffer isn't empty any more */
+  if (empty && priv->channel != NULL && priv->output_len == 0)
+    gibber_transport_emit_buffer_empty (GIBBER_TRANSPORT (self));
+
+  connected = (priv->channel != NULL);
+  g_object_unref (self);
+
+  return connected && !empty;
 }
 
 static gboolean
@@ -411,17 +812,52 @@ gibber_fd_transport_write (GibberFdTransport *fd_transport,
     g_assert_not_reached ();
 }
 
-#define BUFSIZE 1024
+static guint8 *
+read_buffer_get (guint shift)
+{
+  guint8 *buf;
+
+  G_LOCK (read_pool);
+  buf = g_trash_stack_pop (&read_pool[shift]);
+  if (buf != NULL)
+    read_pool_bytes -= READ_SIZE_MIN << shift;
+  G_UNLOCK (read_pool);
+
+  if (buf == NULL)
+    /* one more byte so the data can be NUL-terminated */
+    buf = g_malloc ((READ_SIZE_MIN << shift) + 1);
+
+  return buf;
+}
+
+static void
+read_buffer_put (guint shift, guint8 *buf)
+{
+  G_LOCK (read_pool);
+  if (read_pool_bytes + (READ_SIZE_MIN << shift) <= READ_POOL_MAX_BYTES)
+    {
+      g_trash_stack_push (&read_pool[shift], buf);
+      read_pool_bytes += READ_SIZE_MIN << shift;
+      buf = NULL;
+    }
+  G_UNLOCK (read_pool);
+
+  g_free (buf);
+}
 
 GibberFdIOResult
 gibber_fd_transport_read (GibberFdTransport *transport,
     GIOChannel *channel, GError **error)
 {
-  guint8  buf[BUFSIZE + 1];
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (transport);
+  guint shift = priv->read_shift;
+  gsize size = READ_SIZE_MIN << shift;
+  guint8 *buf = read_buffer_get (shift);
   GIOStatus status;
   gsize bytes_read;
+  GibberFdIOResult result;
 
-  status = g_io_channel_read_chars (channel, (gchar *) buf, BUFSIZE,
+  status = g_io_channel_read_chars (channel, (gchar *) buf, size,
     &bytes_read, error);
 
   switch (status)
@@ -429,18 +865,50 @@ gibber_fd_transport_read (GibberFdTransport *transport,
       case G_IO_STATUS_NORMAL:
         buf[bytes_read] = '\0';
         DEBUG ("Received %" G_GSIZE_FORMAT " bytes", bytes_read);
+
+        /* Adapt the size of the next read before handing the data over, as
+         * the handler is allowed to dispose us */
+        priv->last_read = bytes_read;
+        priv->last_read_full = (bytes_read == size);
+
+        if (priv->last_read_full)
+          {
+            priv->small_reads = 0;
+            if (priv->read_shift < priv->max_read_shift)
+              priv->read_shift++;
+          }
+        else if (bytes_read < size / 4 && priv->read_shift > 0)
+          {
+            if (++priv->small_reads >= READ_SHRINK_AFTER)
+              {
+                priv->small_reads = 0;
+                priv->read_shift--;
+              }
+          }
+        else
+          {
+            priv->small_reads = 0;
+          }
+
         gibber_transport_received_data (GIBBER_TRANSPORT (transport),
             buf, bytes_read);
-        return GIBBER_FD_IO_RESULT_SUCCESS;
+        result = GIBBER_FD_IO_RESULT_SUCCESS;
+        break;
       case G_IO_STATUS_ERROR:
-        return GIBBER_FD_IO_RESULT_ERROR;
+        result = GIBBER_FD_IO_RESULT_ERROR;
+        break;
       case G_IO_STATUS_EOF:
-        return GIBBER_FD_IO_RESULT_EOF;
+        result = GIBBER_FD_IO_RESULT_EOF;
+        break;
       case G_IO_STATUS_AGAIN:
-        return GIBBER_FD_IO_RESULT_AGAIN;
+        result = GIBBER_FD_IO_RESULT_AGAIN;
+        break;
+      default:
+        g_assert_not_reached ();
     }
 
-  g_assert_not_reached ();
+  read_buffer_put (shift, buf);
+  return result;
 }
 
 
@@ -554,7 +1022,27 @@ gibber_fd_transport_buffer_is_empty (GibberTransport *transport)
   GibberFdTransportPrivate *priv =
      GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
 
-  return (priv->output_buffer == NULL || priv->output_buffer->len == 0);
+  return (priv->output_len == 0);
+}
+
+static gboolean
+gibber_fd_transport_buffer_is_full (GibberTransport *transport)
+{
+  GibberFdTransport *self = GIBBER_FD_TRANSPORT (transport);
+  GibberFdTransportPrivate *priv =
+     GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+
+  return priv->output_full;
+}
+
+static gsize
+gibber_fd_transport_get_buffered_bytes (GibberTransport *transport)
+{
+  GibberFdTransport *self = GIBBER_FD_TRANSPORT (transport);
+  GibberFdTransportPrivate *priv =
+     GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+
+  return priv->output_len;
 }
 
 static void
@@ -570,8 +1058,10 @@ gibber_fd_transport_block_receiving (GibberTransport *transport,
       g_source_remove (priv->watch_in);
       priv->watch_in = 0;
     }
-  else if (!block && priv->watch_in == 0)
+  else if (!block && priv->watch_in == 0 && priv->splice_pending == 0)
     {
+      /* (if data is waiting in the splice pipe, receiving will be resumed
+       * once it has been written out) */
       DEBUG ("unblock receiving from the transport");
       if (priv->channel != NULL)
         {
@@ -595,3 +1085,326 @@ gibber_fd_transport_block_receiving (GibberTransport *transport,
 
   priv->receiving_blocked = block;
 }
+
+#ifdef HAVE_SPLICE
+
+static void
+_splice_resume_receiving (GibberFdTransport *self)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+
+  if (priv->channel != NULL && !priv->receiving_blocked &&
+      priv->watch_in == 0)
+    priv->watch_in = g_io_add_watch (priv->channel, G_IO_IN, _channel_io_in,
+        self);
+}
+
+static gboolean _splice_dest_writable_cb (GIOChannel *source,
+    GIOCondition condition, gpointer data);
+
+/* Moves what's in the pipe into the destination, for as long as it will
+ * take it. If it won't take all of it, we stop reading until it's writable
+ * again. */
+static void
+_splice_flush (GibberFdTransport *self)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+  GibberFdTransport *dest = priv->splice_dest;
+  GibberFdTransportPrivate *dest_priv;
+  ssize_t n;
+
+  while (priv->splice_pending > 0)
+    {
+      if (dest == NULL || priv->splice_dest != dest || dest->fd < 0)
+        {
+          DEBUG ("splice destination has gone away");
+          _splice_stop (self, FALSE);
+          return;
+        }
+
+      n = splice (priv->splice_pipe[0], NULL, dest->fd, NULL,
+          priv->splice_pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+
+      if (n < 0 && errno == EAGAIN)
+        {
+          if (priv->watch_in != 0)
+            {
+              g_source_remove (priv->watch_in);
+              priv->watch_in = 0;
+            }
+
+          dest_priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (dest);
+
+          if (priv->splice_watch == 0)
+            priv->splice_watch = g_io_add_watch (dest_priv->channel,
+                G_IO_OUT | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                _splice_dest_writable_cb, self);
+
+          return;
+        }
+
+      if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+        {
+          DEBUG ("can't splice into fd %d, falling back to copying",
+              dest->fd);
+          _splice_stop (self, TRUE);
+          return;
+        }
+
+      if (n <= 0)
+        {
+          DEBUG ("splicing into fd %d failed: %s", dest->fd,
+              n == 0 ? "nothing written" : g_strerror (errno));
+
+          /* The data in the pipe is lost along with the destination */
+          priv->splice_pending = 0;
+          g_object_ref (dest);
+          _splice_stop (self, FALSE);
+          gibber_transport_disconnect (GIBBER_TRANSPORT (dest));
+          g_object_unref (dest);
+          return;
+        }
+
+      priv->splice_pending -= n;
+
+      if (priv->splice_func != NULL)
+        priv->splice_func (self, n, priv->splice_user_data);
+    }
+
+  if (priv->splice_watch != 0)
+    {
+      g_source_remove (priv->splice_watch);
+      priv->splice_watch = 0;
+    }
+
+  _splice_resume_receiving (self);
+}
+
+static gboolean
+_splice_dest_writable_cb (GIOChannel *source,
+    GIOCondition condition,
+    gpointer data)
+{
+  GibberFdTransport *self = GIBBER_FD_TRANSPORT (data);
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+  gboolean stalled;
+
+  g_object_ref (self);
+  _splice_flush (self);
+  stalled = (priv->splice_watch != 0);
+  g_object_unref (self);
+
+  return stalled;
+}
+
+static GibberFdIOResult
+_splice_read (GibberFdTransport *self,
+    GError **error)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+  GibberFdTransportClass *cls = GIBBER_FD_TRANSPORT_GET_CLASS (self);
+  ssize_t n;
+
+  g_assert (priv->splice_pending == 0);
+
+  do
+    n = splice (self->fd, NULL, priv->splice_pipe[1], NULL, SPLICE_SIZE,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  while (n < 0 && errno == EINTR);
+
+  if (n == 0)
+    return GIBBER_FD_IO_RESULT_EOF;
+
+  if (n < 0)
+    {
+      if (errno == EAGAIN)
+        return GIBBER_FD_IO_RESULT_AGAIN;
+
+      if (errno == EINVAL || errno == ENOSYS)
+        {
+          DEBUG ("can't splice from fd %d, falling back to reading",
+              self->fd);
+          _splice_stop (self, FALSE);
+          return cls->read (self, priv->channel, error);
+        }
+
+      g_set_error_literal (error, GIBBER_FD_TRANSPORT_ERROR,
+          GIBBER_FD_TRANSPORT_ERROR_FAILED, g_strerror (errno));
+      return GIBBER_FD_IO_RESULT_ERROR;
+    }
+
+  priv->splice_pending = n;
+  priv->last_read = n;
+  priv->last_read_full = (n == SPLICE_SIZE);
+
+  _splice_flush (self);
+  return GIBBER_FD_IO_RESULT_SUCCESS;
+}
+
+static void
+_splice_dest_finalized_cb (gpointer data,
+    GObject *where_the_object_was)
+{
+  GibberFdTransport *self = GIBBER_FD_TRANSPORT (data);
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+
+  DEBUG ("splice destination has been destroyed");
+  priv->splice_dest = NULL;
+  _splice_stop (self, FALSE);
+}
+
+#endif
+
+/* Stops splicing, if we are. If @drain is TRUE, whatever is left in the
+ * pipe is copied to the destination rather than thrown away. */
+static void
+_splice_stop (GibberFdTransport *self,
+    gboolean drain)
+{
+#ifdef HAVE_SPLICE
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+  GibberFdTransport *dest = priv->splice_dest;
+  GibberFdTransportSplicedFunc func = priv->splice_func;
+  gpointer user_data = priv->splice_user_data;
+  gsize pending = priv->splice_pending;
+  int pipe_out = priv->splice_pipe[0];
+
+  if (pipe_out < 0)
+    return;
+
+  DEBUG ("stop splicing from fd %d", self->fd);
+
+  if (priv->splice_watch != 0)
+    {
+      g_source_remove (priv->splice_watch);
+      priv->splice_watch = 0;
+    }
+
+  if (dest != NULL)
+    g_object_weak_unref (G_OBJECT (dest), _splice_dest_finalized_cb, self);
+
+  close (priv->splice_pipe[1]);
+  priv->splice_dest = NULL;
+  priv->splice_pipe[0] = -1;
+  priv->splice_pipe[1] = -1;
+  priv->splice_pending = 0;
+  priv->splice_func = NULL;
+  priv->splice_user_data = NULL;
+
+  /* From here on, this transport is back to normal, so the callback can do
+   * what it likes */
+  if (drain && pending > 0 && dest != NULL && dest->fd >= 0)
+    {
+      guint8 *buf = read_buffer_get (0);
+      ssize_t n;
+
+      g_object_ref (dest);
+
+      while (pending > 0 && dest->fd >= 0)
+        {
+          n = read (pipe_out, buf, MIN (pending, READ_SIZE_MIN));
+
+          if (n < 0 && errno == EINTR)
+            continue;
+
+          if (n <= 0 ||
+              !gibber_transport_send (GIBBER_TRANSPORT (dest), buf, n, NULL))
+            break;
+
+          pending -= n;
+
+          if (func != NULL)
+            func (self, n, user_data);
+        }
+
+      g_object_unref (dest);
+      read_buffer_put (0, buf);
+    }
+
+  close (pipe_out);
+  _splice_resume_receiving (self);
+#endif
+}
+
+/**
+ * gibber_fd_transport_splice:
+ * @self: the transport to read from
+ * @dest: the transport to write to
+ * @func: called with the number of bytes each time data has been written to
+ *  @dest
+ * @user_data: passed to @func
+ *
+ * Starts moving everything received on @self to @dest with splice (), so
+ * that it never gets copied to userspace and @self's handler isn't called.
+ * Splicing stops when either transport is disconnected, or when
+ * gibber_fd_transport_unsplice () is called; if the kernel turns out not to
+ * be able to splice between these fds, @self quietly goes back to calling its
+ * handler. The read vfunc is bypassed, so subclasses which need to see the
+ * data they receive can't be spliced.
+ *
+ * Returns: %TRUE if splicing started, %FALSE if it isn't supported here or
+ *  @dest still has buffered data which would be overtaken
+ */
+gboolean
+gibber_fd_transport_splice (GibberFdTransport *self,
+    GibberFdTransport *dest,
+    GibberFdTransportSplicedFunc func,
+    gpointer user_data)
+{
+#ifdef HAVE_SPLICE
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+  int i;
+
+  g_return_val_if_fail (priv->splice_pipe[0] < 0, FALSE);
+  g_return_val_if_fail (self != dest, FALSE);
+
+  if (self->fd < 0 || dest->fd < 0)
+    return FALSE;
+
+  if (!gibber_transport_buffer_is_empty (GIBBER_TRANSPORT (dest)))
+    {
+      DEBUG ("fd %d has data waiting to be written, not splicing into it",
+          dest->fd);
+      return FALSE;
+    }
+
+  if (pipe (priv->splice_pipe) != 0)
+    {
+      DEBUG ("couldn't create a pipe to splice through: %s",
+          g_strerror (errno));
+      priv->splice_pipe[0] = -1;
+      priv->splice_pipe[1] = -1;
+      return FALSE;
+    }
+
+  for (i = 0; i < 2; i++)
+    fcntl (priv->splice_pipe[i], F_SETFL, O_NONBLOCK);
+
+  DEBUG ("splicing fd %d into fd %d", self->fd, dest->fd);
+
+  priv->splice_dest = dest;
+  priv->splice_pending = 0;
+  priv->splice_func = func;
+  priv->splice_user_data = user_data;
+  g_object_weak_ref (G_OBJECT (dest), _splice_dest_finalized_cb, self);
+
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+/**
+ * gibber_fd_transport_unsplice:
+ * @self: a transport previously passed to gibber_fd_transport_splice ()
+ *
+ * Stops splicing, after passing on anything already read from @self.
+ */
+void
+gibber_fd_transport_unsplice (GibberFdTransport *self)
+{
+  _splice_stop (self, TRUE);
+}
@@ -91,6 +91,15 @@ GibberFdIOResult gibber_fd_transport_read (GibberFdTransport *transport,
     GIOChannel *channel,
     GError **error);
 
+typedef void (*GibberFdTransportSplicedFunc) (GibberFdTransport *source,
+    gsize count, gpointer user_data);
+
+gboolean gibber_fd_transport_splice (GibberFdTransport *self,
+    GibberFdTransport *dest, GibberFdTransportSplicedFunc func,
+    gpointer user_data);
+
+void gibber_fd_transport_unsplice (GibberFdTransport *self);
+
 G_END_DECLS
 
 #endif /* #ifndef __GIBBER_FD_TRANSPORT_H__*/
@@ -52,6 +52,8 @@ struct _GibberTCPTransportPrivate
   GList *addresses;
   guint16 port;
   guint watch_in;
+  /* cancels looking up the host's addresses, if we're doing so */
+  GCancellable *resolving;
 
   gboolean dispose_has_run;
 };
@@ -112,6 +114,13 @@ clean_all_connect_attempts (GibberTCPTransport *self)
 
   clean_connect_attempt (self);
 
+  if (priv->resolving != NULL)
+    {
+      g_cancellable_cancel (priv->resolving);
+      g_object_unref (priv->resolving);
+      priv->resolving = NULL;
+    }
+
   g_resolver_free_addresses (priv->addresses);
   priv->addresses = NULL;
 }
@@ -278,14 +287,75 @@ failed:
       GIBBER_TRANSPORT_DISCONNECTED);
 }
 
+typedef struct {
+    GibberTCPTransport *self;
+    GCancellable *cancellable;
+} ResolveData;
+
+static void
+resolve_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  ResolveData *data = user_data;
+  GibberTCPTransport *self = data->self;
+  GibberTCPTransportPrivate *priv;
+  GList *addresses;
+  GError *error = NULL;
+
+  addresses = g_resolver_lookup_by_name_finish (G_RESOLVER (source), result,
+      &error);
+
+  /* If we've been cancelled, self may have gone */
+  if (g_cancellable_is_cancelled (data->cancellable))
+    {
+      g_resolver_free_addresses (addresses);
+      g_clear_error (&error);
+      goto out;
+    }
+
+  priv = GIBBER_TCP_TRANSPORT_GET_PRIVATE (self);
+  g_object_unref (priv->resolving);
+  priv->resolving = NULL;
+
+  if (addresses == NULL)
+    {
+      DEBUG ("Address lookup failed: %s", error->message);
+      g_error_free (error);
+
+      gibber_transport_set_state (GIBBER_TRANSPORT (self),
+          GIBBER_TRANSPORT_DISCONNECTED);
+      goto out;
+    }
+
+  if (gibber_transport_get_state (GIBBER_TRANSPORT (self)) !=
+      GIBBER_TRANSPORT_CONNECTING)
+    {
+      DEBUG ("disconnected while looking up the address");
+      g_resolver_free_addresses (addresses);
+      goto out;
+    }
+
+  priv->addresses = addresses;
+  new_connect_attempt (self);
+
+out:
+  g_object_unref (data->cancellable);
+  g_slice_free (ResolveData, data);
+}
+
+/* Connects to @host, which may be a host name or an address. Looking up a
+ * host name doesn't block: the transport stays in the connecting state
+ * until the lookup and then the connection succeed or fail. */
 void
 gibber_tcp_transport_connect (GibberTCPTransport *tcp_transport,
     const gchar *host, guint16 port)
 {
   GibberTCPTransportPrivate *priv = GIBBER_TCP_TRANSPORT_GET_PRIVATE (
       tcp_transport);
-  GResolver *resolver = g_resolver_get_default ();
-  GError *error = NULL;
+  GResolver *resolver;
+  GInetAddress *address;
+  ResolveData *data;
 
   gibber_transport_set_state (GIBBER_TRANSPORT (tcp_transport),
                              GIBBER_TRANSPORT_CONNECTING);
@@ -294,22 +364,27 @@ gibber_tcp_transport_connect (GibberTCPTransport *tcp_transport,
 
   g_assert (priv->addresses == NULL);
   g_assert (priv->channel == NULL);
+  g_assert (priv->resolving == NULL);
 
-  priv->addresses = g_resolver_lookup_by_name (resolver, host, NULL, &error);
+  address = g_inet_address_new_from_string (host);
 
-  if (priv->addresses == NULL)
+  if (address != NULL)
     {
-      DEBUG("Address lookup failed: %s", error->message);
+      priv->addresses = g_list_prepend (NULL, address);
+      new_connect_attempt (tcp_transport);
+      return;
+    }
 
-      gibber_transport_set_state (GIBBER_TRANSPORT (tcp_transport),
-          GIBBER_TRANSPORT_DISCONNECTED);
+  DEBUG ("Looking up %s", host);
 
-      g_error_free (error);
-      goto out;
-    }
+  priv->resolving = g_cancellable_new ();
 
-  new_connect_attempt (tcp_transport);
+  data = g_slice_new0 (ResolveData);
+  data->self = tcp_transport;
+  data->cancellable = g_object_ref (priv->resolving);
 
-out:
+  resolver = g_resolver_get_default ();
+  g_resolver_lookup_by_name_async (resolver, host, priv->resolving,
+      resolve_cb, data);
   g_object_unref (resolver);
 }
@@ -39,6 +39,7 @@ enum
   DISCONNECTING,
   ERROR,
   BUFFER_EMPTY,
+  BUFFER_DRAINED,
   LAST_SIGNAL
 };
 
@@ -83,6 +84,15 @@ gibber_transport_class_init (GibberTransportClass *gibber_transport_class)
                   g_cclosure_marshal_VOID__VOID,
                   G_TYPE_NONE, 0);
 
+  signals[BUFFER_DRAINED] =
+    g_signal_new ("buffer-drained",
+                  G_OBJECT_CLASS_TYPE (gibber_transport_class),
+                  G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
+                  0,
+                  NULL, NULL,
+                  g_cclosure_marshal_VOID__VOID,
+                  G_TYPE_NONE, 0);
+
   signals[CONNECTED] =
     g_signal_new ("connected",
                   G_OBJECT_CLASS_TYPE (gibber_transport_class),
@@ -278,12 +288,52 @@ gibber_transport_buffer_is_empty (GibberTransport *transport)
   return cls->buffer_is_empty (transport);
 }
 
+/* Whether writers should stop sending until buffer-drained is emitted.
+ * Closing the transport without losing data still has to wait until
+ * gibber_transport_buffer_is_empty() is TRUE and buffer-empty is emitted. */
+gboolean
+gibber_transport_buffer_is_full (GibberTransport *transport)
+{
+  GibberTransportClass *cls = GIBBER_TRANSPORT_GET_CLASS (transport);
+
+  if (cls->buffer_is_full != NULL)
+    return cls->buffer_is_full (transport);
+
+  return !gibber_transport_buffer_is_empty (transport);
+}
+
+/* How much data has been sent but not yet written out, for debugging and
+ * accounting. Transports which can't tell return 0. */
+gsize
+gibber_transport_get_buffered_bytes (GibberTransport *transport)
+{
+  GibberTransportClass *cls = GIBBER_TRANSPORT_GET_CLASS (transport);
+
+  if (cls->get_buffered_bytes != NULL)
+    return cls->get_buffered_bytes (transport);
+
+  return 0;
+}
+
 void
 gibber_transport_emit_buffer_empty (GibberTransport *transport)
 {
+  GibberTransportClass *cls = GIBBER_TRANSPORT_GET_CLASS (transport);
+
+  /* Without buffer_is_full, a transport is full until it is empty, so
+   * emptying is also when it drains */
+  if (cls->buffer_is_full == NULL)
+    g_signal_emit (transport, signals[BUFFER_DRAINED], 0);
+
   g_signal_emit (transport, signals[BUFFER_EMPTY], 0);
 }
 
+void
+gibber_transport_emit_buffer_drained (GibberTransport *transport)
+{
+  g_signal_emit (transport, signals[BUFFER_DRAINED], 0);
+}
+
 void
 gibber_transport_block_receiving (GibberTransport *transport,
                                   gboolean block)
@@ -58,6 +58,12 @@ struct _GibberTransportClass {
         struct sockaddr_storage *addr, socklen_t *len);
     gboolean (*buffer_is_empty) (GibberTransport *transport);
     void (*block_receiving) (GibberTransport *transport, gboolean block);
+    /* Optional; if not implemented, any buffered data means the buffer is
+     * full */
+    gboolean (*buffer_is_full) (GibberTransport *transport);
+    /* Optional; if not implemented, the amount of buffered data is unknown
+     * and reported as 0 */
+    gsize (*get_buffered_bytes) (GibberTransport *transport);
 };
 
 struct _GibberTransport {
@@ -121,8 +127,14 @@ gboolean gibber_transport_get_sockaddr (GibberTransport *transport,
 
 gboolean gibber_transport_buffer_is_empty (GibberTransport *transport);
 
+gboolean gibber_transport_buffer_is_full (GibberTransport *transport);
+
+gsize gibber_transport_get_buffered_bytes (GibberTransport *transport);
+
 void gibber_transport_emit_buffer_empty (GibberTransport *transport);
 
+void gibber_transport_emit_buffer_drained (GibberTransport *transport);
+
 void gibber_transport_block_receiving (GibberTransport *transport,
     gboolean block);
 
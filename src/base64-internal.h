@@ -0,0 +1,38 @@
+/*
+ * base64-internal.h - implementation details of base64.c shared with the
+ *                     tests
+ * Copyright (C) 2006 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __BASE64_INTERNAL_H__
+#define __BASE64_INTERNAL_H__
+
+#include "base64.h"
+
+/* Which code does the work; the fastest one the CPU supports is used unless
+ * the tests ask for another */
+typedef enum {
+  BASE64_IMPLEMENTATION_AUTO = 0,
+  BASE64_IMPLEMENTATION_SCALAR,
+  BASE64_IMPLEMENTATION_SSSE3,
+  BASE64_IMPLEMENTATION_AVX2
+} Base64Implementation;
+
+gboolean base64_set_implementation (Base64Implementation implementation);
+Base64Implementation base64_get_implementation (void);
+
+#endif /* __BASE64_INTERNAL_H__ */
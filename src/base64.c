@@ -19,13 +19,16 @@
 
 #include "config.h"
 #include "base64.h"
+#include "base64-internal.h"
 
 #define DEBUG_FLAG GABBLE_DEBUG_VCARD
 #include "debug.h"
 
-#include <ctype.h>
 #include <string.h>
 
+#ifdef HAVE_X86_SIMD
+# include <immintrin.h>
+#endif
 
 /*
 |AAAA AABB|BBBB CCCC|CCDD DDDD|
@@ -45,33 +48,35 @@
 static const gchar *encoding =
   "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-static const guint decoding[256] =
-{
-  /* ... */
-   0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-   0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-   0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-   0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-   0, 0, 0,
-  /* + */
-  62,
-  /* ... */
-   0, 0, 0,
-  /* / , 0-9 */
-  63,
-  52, 53, 54, 55, 56, 57, 58, 59, 60, 61,
-  /* ... */
-   0, 0, 0, 0, 0, 0, 0,
-  /* A */
-   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12,
-  13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,
-  /* ... */
-   0, 0, 0, 0, 0, 0,
-  /* a */
-  26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38,
-  39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51
+/* Characters which aren't part of the alphabet */
+#define X -1 /* invalid */
+#define S -2 /* whitespace, which is skipped */
+#define P -3 /* padding */
+
+static const gint8 decoding[256] =
+{
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  S,  S,  S,  S,  S,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   S,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, 62,  X,  X,  X, 63,
+  52, 53, 54, 55, 56, 57, 58, 59, 60, 61,  X,  X,  X,  P,  X,  X,
+   X,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,  X,  X,  X,  X,  X,
+   X, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+  41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X
 };
 
+#undef X
+#undef S
+#undef P
+
 #define GET_6_BITS_0(s) (((s)[0] & 0xFC) >> 2)
 #define GET_6_BITS_1(s) (((s)[0] & 0x03) << 4) | \
                         (((s)[1] & 0xF0) >> 4)
@@ -79,118 +84,672 @@ static const guint decoding[256] =
                         (((s)[2] & 0xC0) >> 6)
 #define GET_6_BITS_3(s) (((s)[2] & 0x3F) << 0)
 
-#define GET_BYTE_0(s) (((decoding[(guchar)(s)[0]] & 0x3F) << 2) | \
-                       ((decoding[(guchar)(s)[1]] & 0x30) >> 4))
-#define GET_BYTE_1(s) (((decoding[(guchar)(s)[1]] & 0x0F) << 4) | \
-                       ((decoding[(guchar)(s)[2]] & 0x3C) >> 2))
-#define GET_BYTE_2(s) (((decoding[(guchar)(s)[2]] & 0x03) << 6) | \
-                       ((decoding[(guchar)(s)[3]] & 0xFF) << 0))
+/* these take groups of 6-bit values rather than characters */
+#define GET_BYTE_0(g) ((((g)[0] & 0x3F) << 2) | (((g)[1] & 0x30) >> 4))
+#define GET_BYTE_1(g) ((((g)[1] & 0x0F) << 4) | (((g)[2] & 0x3C) >> 2))
+#define GET_BYTE_2(g) ((((g)[2] & 0x03) << 6) | (((g)[3] & 0x3F) << 0))
+
+/* The vectorized kernels each handle as much of their input as they can in
+ * whole blocks, and return how much of it they consumed; the scalar code
+ * does the rest. They're NULL when the scalar code does everything. */
+typedef gsize (*EncodeKernel) (const guchar *in, gsize len, gchar *out);
+typedef gsize (*DecodeKernel) (const gchar *in, gsize len, guchar *out);
+
+static Base64Implementation implementation = BASE64_IMPLEMENTATION_AUTO;
+static EncodeKernel encode_kernel = NULL;
+static DecodeKernel decode_kernel = NULL;
+
+#ifdef HAVE_X86_SIMD
+
+/* These follow Wojciech Mula and Daniel Lemire, "Faster Base64 Encoding and
+ * Decoding Using AVX2 Instructions" (ACM TWEB 12(3), 2018). Encoding gathers
+ * each 3 input bytes into a 32-bit lane, moves the four 6-bit fields into
+ * separate bytes with two multiplies, then maps those to ASCII by adding an
+ * offset picked from a 16-entry table. Decoding uses two nibble-indexed
+ * tables to reject anything outside the alphabet (including whitespace and
+ * padding, which are left to the scalar code), a third to map ASCII back to
+ * 6-bit values, and two multiply-adds to pack those together again. */
+
+__attribute__ ((target ("ssse3")))
+static inline __m128i
+encode_lookup_ssse3 (__m128i indices)
+{
+  /* the offset to add to each range of indices: A-Z, a-z, 0-9, + and / */
+  const __m128i offsets = _mm_setr_epi8 ('a' - 26, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  __m128i result, less;
+
+  /* 0 for A-Z and a-z, 1-10 for 0-9, 11 for + and 12 for / */
+  result = _mm_subs_epu8 (indices, _mm_set1_epi8 (51));
+  /* then 13 for A-Z */
+  less = _mm_cmpgt_epi8 (_mm_set1_epi8 (26), indices);
+  result = _mm_or_si128 (result, _mm_and_si128 (less, _mm_set1_epi8 (13)));
+
+  return _mm_add_epi8 (_mm_shuffle_epi8 (offsets, result), indices);
+}
+
+__attribute__ ((target ("ssse3")))
+static gsize
+encode_ssse3 (const guchar *in,
+    gsize len,
+    gchar *out)
+{
+  const __m128i shuffle = _mm_set_epi8 (10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3,
+      4, 1, 2, 0, 1);
+  gsize i;
+
+  /* each iteration loads 16 bytes but only encodes the first 12 */
+  for (i = 0; i + 16 <= len; i += 12)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (in + i));
+      __m128i ac, bd;
+
+      v = _mm_shuffle_epi8 (v, shuffle);
+      ac = _mm_mulhi_epu16 (_mm_and_si128 (v, _mm_set1_epi32 (0x0fc0fc00)),
+          _mm_set1_epi32 (0x04000040));
+      bd = _mm_mullo_epi16 (_mm_and_si128 (v, _mm_set1_epi32 (0x003f03f0)),
+          _mm_set1_epi32 (0x01000010));
+
+      _mm_storeu_si128 ((__m128i *) out,
+          encode_lookup_ssse3 (_mm_or_si128 (ac, bd)));
+      out += 16;
+    }
+
+  return i;
+}
+
+__attribute__ ((target ("ssse3")))
+static gsize
+decode_ssse3 (const gchar *in,
+    gsize len,
+    guchar *out)
+{
+  const __m128i lut_lo = _mm_setr_epi8 (0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+      0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m128i lut_hi = _mm_setr_epi8 (0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+      0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m128i lut_roll = _mm_setr_epi8 (0, 16, 19, 4, -65, -65, -71, -71,
+      0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i pack = _mm_setr_epi8 (2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+      -1, -1, -1, -1);
+  const __m128i nibbles = _mm_set1_epi8 (0x0f);
+  gsize i;
+
+  /* Each iteration decodes 16 characters into 12 bytes but stores 16. The
+   * caller's buffer has room for 3/4 of the input it gave us (give or take a
+   * partial group), so making sure there are at least 28 characters left
+   * keeps the extra 4 bytes inside it. */
+  for (i = 0; i + 28 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (in + i));
+      __m128i hi = _mm_and_si128 (_mm_srli_epi32 (v, 4), nibbles);
+      __m128i lo = _mm_and_si128 (v, nibbles);
+      __m128i invalid, roll;
+
+      invalid = _mm_and_si128 (_mm_shuffle_epi8 (lut_lo, lo),
+          _mm_shuffle_epi8 (lut_hi, hi));
+
+      if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (invalid,
+              _mm_setzero_si128 ())) != 0xffff)
+        break;
+
+      roll = _mm_shuffle_epi8 (lut_roll,
+          _mm_add_epi8 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('/')), hi));
+      v = _mm_add_epi8 (v, roll);
+
+      v = _mm_maddubs_epi16 (v, _mm_set1_epi32 (0x01400140));
+      v = _mm_madd_epi16 (v, _mm_set1_epi32 (0x00011000));
+      _mm_storeu_si128 ((__m128i *) out, _mm_shuffle_epi8 (v, pack));
+      out += 12;
+    }
+
+  return i;
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256i
+encode_lookup_avx2 (__m256i indices)
+{
+  const __m256i offsets = _mm256_broadcastsi128_si256 (_mm_setr_epi8 (
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0));
+  __m256i result, less;
+
+  result = _mm256_subs_epu8 (indices, _mm256_set1_epi8 (51));
+  less = _mm256_cmpgt_epi8 (_mm256_set1_epi8 (26), indices);
+  result = _mm256_or_si256 (result,
+      _mm256_and_si256 (less, _mm256_set1_epi8 (13)));
+
+  return _mm256_add_epi8 (_mm256_shuffle_epi8 (offsets, result), indices);
+}
+
+__attribute__ ((target ("avx2")))
+static gsize
+encode_avx2 (const guchar *in,
+    gsize len,
+    gchar *out)
+{
+  const __m256i shuffle = _mm256_broadcastsi128_si256 (_mm_set_epi8 (10, 11,
+      9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  gsize i;
+
+  /* each iteration encodes 24 bytes, 12 in each 128-bit lane, but the
+   * second lane's load reaches 4 bytes past them */
+  for (i = 0; i + 28 <= len; i += 24)
+    {
+      __m256i v, ac, bd;
+
+      v = _mm256_inserti128_si256 (_mm256_castsi128_si256 (
+              _mm_loadu_si128 ((const __m128i *) (in + i))),
+          _mm_loadu_si128 ((const __m128i *) (in + i + 12)), 1);
+      v = _mm256_shuffle_epi8 (v, shuffle);
+      ac = _mm256_mulhi_epu16 (
+          _mm256_and_si256 (v, _mm256_set1_epi32 (0x0fc0fc00)),
+          _mm256_set1_epi32 (0x04000040));
+      bd = _mm256_mullo_epi16 (
+          _mm256_and_si256 (v, _mm256_set1_epi32 (0x003f03f0)),
+          _mm256_set1_epi32 (0x01000010));
+
+      _mm256_storeu_si256 ((__m256i *) out,
+          encode_lookup_avx2 (_mm256_or_si256 (ac, bd)));
+      out += 32;
+    }
+
+  /* finish off with a 16-byte block if there's room */
+  return i + encode_ssse3 (in + i, len - i, out);
+}
+
+__attribute__ ((target ("avx2")))
+static gsize
+decode_avx2 (const gchar *in,
+    gsize len,
+    guchar *out)
+{
+  const __m256i lut_lo = _mm256_broadcastsi128_si256 (_mm_setr_epi8 (0x15,
+      0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b,
+      0x1b, 0x1b, 0x1a));
+  const __m256i lut_hi = _mm256_broadcastsi128_si256 (_mm_setr_epi8 (0x10,
+      0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10,
+      0x10, 0x10, 0x10));
+  const __m256i lut_roll = _mm256_broadcastsi128_si256 (_mm_setr_epi8 (0, 16,
+      19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0));
+  const __m256i pack = _mm256_broadcastsi128_si256 (_mm_setr_epi8 (2, 1, 0,
+      6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+  const __m256i nibbles = _mm256_set1_epi8 (0x0f);
+  gsize i;
+
+  /* 32 characters into 24 bytes, storing 32; as above, 48 characters left
+   * means there's room for that */
+  for (i = 0; i + 48 <= len; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (in + i));
+      __m256i hi = _mm256_and_si256 (_mm256_srli_epi32 (v, 4), nibbles);
+      __m256i lo = _mm256_and_si256 (v, nibbles);
+      __m256i invalid, roll;
+
+      invalid = _mm256_and_si256 (_mm256_shuffle_epi8 (lut_lo, lo),
+          _mm256_shuffle_epi8 (lut_hi, hi));
+
+      if (_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (invalid,
+              _mm256_setzero_si256 ())) != -1)
+        break;
+
+      roll = _mm256_shuffle_epi8 (lut_roll,
+          _mm256_add_epi8 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('/')), hi));
+      v = _mm256_add_epi8 (v, roll);
+
+      v = _mm256_maddubs_epi16 (v, _mm256_set1_epi32 (0x01400140));
+      v = _mm256_madd_epi16 (v, _mm256_set1_epi32 (0x00011000));
+      v = _mm256_shuffle_epi8 (v, pack);
+      /* move the 12 bytes in the upper lane down next to the lower ones */
+      v = _mm256_permutevar8x32_epi32 (v,
+          _mm256_setr_epi32 (0, 1, 2, 4, 5, 6, 3, 7));
+      _mm256_storeu_si256 ((__m256i *) out, v);
+      out += 24;
+    }
+
+  return i + decode_ssse3 (in + i, len - i, out);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+/**
+ * base64_set_implementation:
+ * @impl: which code to use, or %BASE64_IMPLEMENTATION_AUTO for the fastest
+ *  one available
+ *
+ * Only meant for the tests.
+ *
+ * Returns: %FALSE if @impl isn't supported by this build or this CPU
+ */
+gboolean
+base64_set_implementation (Base64Implementation impl)
+{
+  switch (impl)
+    {
+    case BASE64_IMPLEMENTATION_AUTO:
+#ifdef HAVE_X86_SIMD
+      if (__builtin_cpu_supports ("avx2"))
+        return base64_set_implementation (BASE64_IMPLEMENTATION_AVX2);
+
+      if (__builtin_cpu_supports ("ssse3"))
+        return base64_set_implementation (BASE64_IMPLEMENTATION_SSSE3);
+#endif
+      return base64_set_implementation (BASE64_IMPLEMENTATION_SCALAR);
+
+    case BASE64_IMPLEMENTATION_SCALAR:
+      encode_kernel = NULL;
+      decode_kernel = NULL;
+      break;
+
+#ifdef HAVE_X86_SIMD
+    case BASE64_IMPLEMENTATION_SSSE3:
+      if (!__builtin_cpu_supports ("ssse3"))
+        return FALSE;
+
+      encode_kernel = encode_ssse3;
+      decode_kernel = decode_ssse3;
+      break;
+
+    case BASE64_IMPLEMENTATION_AVX2:
+      if (!__builtin_cpu_supports ("avx2"))
+        return FALSE;
+
+      encode_kernel = encode_avx2;
+      decode_kernel = decode_avx2;
+      break;
+#endif
+
+    default:
+      return FALSE;
+    }
+
+  implementation = impl;
+  return TRUE;
+}
+
+Base64Implementation
+base64_get_implementation (void)
+{
+  if (implementation == BASE64_IMPLEMENTATION_AUTO)
+    base64_set_implementation (BASE64_IMPLEMENTATION_AUTO);
+
+  return implementation;
+}
+
+/* Encodes @len bytes, which must be a multiple of 3, without padding */
+static gsize
+encode_groups (const guchar *str,
+    gsize len,
+    gchar *out)
+{
+  gchar *p = out;
+  gsize i = 0;
+
+  if (base64_get_implementation () != BASE64_IMPLEMENTATION_SCALAR)
+    {
+      i = encode_kernel (str, len, p);
+      p += i / 3 * 4;
+    }
+
+  for (; i < len; i += 3)
+    {
+      *p++ = encoding[GET_6_BITS_0 (str + i)];
+      *p++ = encoding[GET_6_BITS_1 (str + i)];
+      *p++ = encoding[GET_6_BITS_2 (str + i)];
+      *p++ = encoding[GET_6_BITS_3 (str + i)];
+    }
+
+  return p - out;
+}
+
+/* Encodes the last 0-2 bytes of some data, with padding */
+static gsize
+encode_tail (const guchar *str,
+    gsize len,
+    gchar *out)
+{
+  switch (len)
+    {
+    case 2:
+      out[0] = encoding[GET_6_BITS_0 (str)];
+      out[1] = encoding[GET_6_BITS_1 (str)];
+      /* can't use GET_6_BITS_2 because str[2] is out of range */
+      out[2] = encoding[(str[1] & 0x0f) << 2];
+      out[3] = '=';
+      return 4;
+    case 1:
+      out[0] = encoding[GET_6_BITS_0 (str)];
+      /* can't use GET_6_BITS_1 because str[1] is out of range */
+      out[1] = encoding[(str[0] & 0x03) << 4];
+      out[2] = '=';
+      out[3] = '=';
+      return 4;
+    default:
+      return 0;
+    }
+}
+
+/* Encodes @len bytes of @str, which need not be a multiple of 3, into @out
+ * without line breaks; returns the number of characters written */
+static gsize
+encode_block (const guchar *str, gsize len, gchar *out)
+{
+  gsize whole = len - len % 3;
+  gsize written = encode_groups (str, whole, out);
+
+  return written + encode_tail (str + whole, len % 3, out + written);
+}
+
+/* 76 characters per line, as in MIME */
+#define LINE_INPUT_LEN 57
 
 gchar *base64_encode (guint len, const gchar *str, gboolean split_lines)
 {
+  gsize out_len = BASE64_ENCODED_LEN (len);
+  gchar *out, *p;
   guint i;
-  GString *tmp;
 
-  /* TODO: calculate requisite output string length and allocate that big a
-   * GString */
-  tmp = g_string_new ("");
+  if (split_lines && len > LINE_INPUT_LEN)
+    out_len += (len - 1) / LINE_INPUT_LEN;
 
-  for (i = 0; i < len; i += 3)
-    {
-      guint c1, c2, c3, c4;
+  out = g_malloc (out_len + 1);
 
-      if (split_lines && i > 0 && (i * 4) % 76 == 0)
-          g_string_append_c (tmp, '\n');
+  if (!split_lines)
+    {
+      p = out + encode_block ((const guchar *) str, len, out);
+    }
+  else
+    {
+      p = out;
 
-      switch (i + 3 - len)
+      for (i = 0; i < len; i += LINE_INPUT_LEN)
         {
-        case 1:
-          c1 = encoding[GET_6_BITS_0 (str + i)];
-          c2 = encoding[GET_6_BITS_1 (str + i)];
-          /* can't use GET_6_BITS_2 because str[i+2] is out of range */
-          c3 = encoding[(str[i + 1] & 0x0f) << 2];
-          c4 = '=';
-          break;
-        case 2:
-          c1 = encoding[GET_6_BITS_0 (str + i)];
-          /* can't use GET_6_BITS_1 because str[i+1] is out of range */
-          c2 = encoding[(str[i] & 0x03) << 4];
-          c3 = '=';
-          c4 = '=';
-          break;
-        default:
-          c1 = encoding[GET_6_BITS_0 (str + i)];
-          c2 = encoding[GET_6_BITS_1 (str + i)];
-          c3 = encoding[GET_6_BITS_2 (str + i)];
-          c4 = encoding[GET_6_BITS_3 (str + i)];
-        }
+          if (i > 0)
+            *p++ = '\n';
 
-      g_string_append_printf (tmp, "%c%c%c%c", c1, c2, c3, c4);
+          p += encode_block ((const guchar *) str + i,
+              MIN (LINE_INPUT_LEN, len - i), p);
+        }
     }
 
-  return g_string_free (tmp, FALSE);
+  g_assert ((gsize) (p - out) == out_len);
+  *p = '\0';
+  return out;
 }
 
-GString *base64_decode (const gchar *str)
+/**
+ * base64_encode_into:
+ * @len: the number of bytes to encode
+ * @str: the data to encode
+ * @out: where to write the encoded data, which must have room for at least
+ *  BASE64_ENCODED_LEN (@len) + 1 characters
+ *
+ * Encodes @str into @out without line breaks and NUL-terminates it, so that
+ * callers encoding many blocks can reuse a single buffer.
+ *
+ * Returns: the length of the encoded data, excluding the NUL
+ */
+gsize
+base64_encode_into (gsize len,
+    const gchar *str,
+    gchar *out)
 {
-  guint i;
-  GString *tmp;
-  char group[4];
-  guint filled = 0;
+  gsize written = encode_block ((const guchar *) str, len, out);
+
+  out[written] = '\0';
+  return written;
+}
+
+void
+base64_encoder_init (Base64Encoder *encoder)
+{
+  encoder->n_pending = 0;
+}
+
+/**
+ * base64_encoder_step:
+ * @encoder: an encoder
+ * @in: the next part of the data to encode
+ * @len: the length of @in
+ * @out: where to write the encoding, which must have room for at least
+ *  BASE64_ENCODED_LEN (@len) characters
+ *
+ * Encodes as much of @in as makes whole groups together with the bytes left
+ * over from previous calls, and keeps the rest for the next call. No line
+ * breaks or NUL are written.
+ *
+ * Returns: the number of characters written to @out
+ */
+gsize
+base64_encoder_step (Base64Encoder *encoder,
+    const gchar *in,
+    gsize len,
+    gchar *out)
+{
+  const guchar *str = (const guchar *) in;
+  gsize written = 0;
+  gsize whole;
 
-  for (i = 0; str[i]; i++)
+  if (encoder->n_pending > 0)
     {
-      if (str[i] != 'A' &&
-          str[i] != '=' &&
-          !isspace (str[i]) &&
-          decoding[(guchar) str[i]] == 0)
+      while (encoder->n_pending < 3 && len > 0)
         {
-          DEBUG ("bad character %x at byte %u", (guchar)str[i], i);
-          return NULL;
+          encoder->pending[encoder->n_pending++] = *str++;
+          len--;
         }
+
+      if (encoder->n_pending < 3)
+        return 0;
+
+      written = encode_groups (encoder->pending, 3, out);
+      encoder->n_pending = 0;
+    }
+
+  whole = len - len % 3;
+  written += encode_groups (str, whole, out + written);
+
+  for (str += whole; whole < len; whole++)
+    encoder->pending[encoder->n_pending++] = *str++;
+
+  return written;
+}
+
+/**
+ * base64_encoder_finish:
+ * @encoder: an encoder
+ * @out: where to write the end of the encoding, which must have room for 4
+ *  characters
+ *
+ * Encodes anything left over from base64_encoder_step (), with padding, and
+ * resets @encoder so it can be used again.
+ *
+ * Returns: the number of characters written to @out
+ */
+gsize
+base64_encoder_finish (Base64Encoder *encoder,
+    gchar *out)
+{
+  gsize written = encode_tail (encoder->pending, encoder->n_pending, out);
+
+  encoder->n_pending = 0;
+  return written;
+}
+
+void
+base64_decoder_init (Base64Decoder *decoder)
+{
+  decoder->filled = 0;
+  decoder->padding = 0;
+}
+
+/* Decodes whole groups of 4 characters from the alphabet from the start of
+ * @in, stopping at the first group with whitespace, padding or anything
+ * else in it; returns how many characters were consumed */
+static gsize
+decode_groups (const gchar *in,
+    gsize len,
+    guchar *out)
+{
+  gsize i = 0;
+
+  if (base64_get_implementation () != BASE64_IMPLEMENTATION_SCALAR)
+    {
+      i = decode_kernel (in, len, out);
+      out += i / 4 * 3;
+    }
+
+  for (; i + 4 <= len; i += 4)
+    {
+      gint8 group[4];
+
+      group[0] = decoding[(guchar) in[i]];
+      group[1] = decoding[(guchar) in[i + 1]];
+      group[2] = decoding[(guchar) in[i + 2]];
+      group[3] = decoding[(guchar) in[i + 3]];
+
+      if ((group[0] | group[1] | group[2] | group[3]) < 0)
+        break;
+
+      *out++ = GET_BYTE_0 (group);
+      *out++ = GET_BYTE_1 (group);
+      *out++ = GET_BYTE_2 (group);
     }
 
-  tmp = g_string_new ("");
+  return i;
+}
+
+/**
+ * base64_decoder_step:
+ * @decoder: a decoder
+ * @in: the next part of the text to decode
+ * @len: the length of @in
+ * @out: where to write the decoded data, which must have room for at least
+ *  BASE64_DECODED_MAX_LEN (@len) bytes
+ * @written: used to return the number of bytes written to @out
+ *
+ * Decodes @in, skipping whitespace, and keeps any incomplete group for the
+ * next call. Padded groups may appear anywhere, as in the output of
+ * concatenating several encodings.
+ *
+ * Returns: %FALSE if @in contains characters other than the alphabet,
+ *  whitespace and padding, in which case the contents of @out and @decoder
+ *  are undefined
+ */
+gboolean
+base64_decoder_step (Base64Decoder *decoder,
+    const gchar *in,
+    gsize len,
+    gchar *out,
+    gsize *written)
+{
+  guchar *p = (guchar *) out;
+  gsize i = 0;
 
-  for (i = 0; str[i]; i++)
+  while (i < len)
     {
-      if (isspace (str[i]))
-        continue;
+      gint8 value;
+
+      if (decoder->filled == 0)
+        {
+          gsize consumed = decode_groups (in + i, len - i, p);
+
+          i += consumed;
+          p += consumed / 4 * 3;
+
+          if (i == len)
+            break;
+        }
+
+      value = decoding[(guchar) in[i]];
+
+      if (value == -2)
+        {
+          i++;
+          continue;
+        }
+
+      if (value == -1)
+        {
+          DEBUG ("bad character %x", (guchar) in[i]);
+          return FALSE;
+        }
+
+      if (value == -3)
+        {
+          decoder->padding |= 1 << decoder->filled;
+          value = 0;
+        }
 
-      group[filled++] = str[i];
+      decoder->group[decoder->filled++] = value;
+      i++;
 
-      if (filled == 4)
+      if (decoder->filled == 4)
         {
-          if (group[3] == '=')
+          *p++ = GET_BYTE_0 (decoder->group);
+
+          if (!(decoder->padding & (1 << 3)))
             {
-              if (group[2] == '=')
-                {
-                  g_string_append_c (tmp, GET_BYTE_0(group));
-                }
-              else
-                {
-                  g_string_append_c (tmp, GET_BYTE_0(group));
-                  g_string_append_c (tmp, GET_BYTE_1(group));
-                }
-             }
-           else
+              *p++ = GET_BYTE_1 (decoder->group);
+              *p++ = GET_BYTE_2 (decoder->group);
+            }
+          else if (!(decoder->padding & (1 << 2)))
             {
-              g_string_append_c (tmp, GET_BYTE_0(group));
-              g_string_append_c (tmp, GET_BYTE_1(group));
-              g_string_append_c (tmp, GET_BYTE_2(group));
+              *p++ = GET_BYTE_1 (decoder->group);
             }
-          filled = 0;
+
+          decoder->filled = 0;
+          decoder->padding = 0;
         }
     }
 
-  if (filled)
+  *written = p - (guchar *) out;
+  return TRUE;
+}
+
+/**
+ * base64_decoder_finish:
+ * @decoder: a decoder
+ *
+ * Checks that the text given to @decoder ended with a complete group, and
+ * resets @decoder so it can be used again.
+ *
+ * Returns: %FALSE if there were characters left over
+ */
+gboolean
+base64_decoder_finish (Base64Decoder *decoder)
+{
+  gboolean complete = (decoder->filled == 0);
+
+  base64_decoder_init (decoder);
+  return complete;
+}
+
+GString *base64_decode (const gchar *str)
+{
+  gsize len = strlen (str);
+  Base64Decoder decoder;
+  GString *tmp;
+  gsize written;
+
+  tmp = g_string_sized_new (BASE64_DECODED_MAX_LEN (len));
+  base64_decoder_init (&decoder);
+
+  if (!base64_decoder_step (&decoder, str, len, tmp->str, &written))
+    {
+      g_string_free (tmp, TRUE);
+      return NULL;
+    }
+
+  if (!base64_decoder_finish (&decoder))
     {
       DEBUG ("insufficient padding at end of base64 string:\n%s", str);
       g_string_free (tmp, TRUE);
       return NULL;
     }
 
+  tmp->len = written;
+  tmp->str[written] = '\0';
   return tmp;
 }
-
-
@@ -22,7 +22,38 @@
 
 #include <glib.h>
 
+/* The length of the encoding of @len bytes, without line breaks or NUL */
+#define BASE64_ENCODED_LEN(len) ((((gsize) (len) + 2) / 3) * 4)
+/* The most bytes @len characters of base 64 can decode to */
+#define BASE64_DECODED_MAX_LEN(len) ((((gsize) (len) + 3) / 4) * 3)
+
 gchar *base64_encode (guint len, const gchar *str, gboolean split_lines);
+gsize base64_encode_into (gsize len, const gchar *str, gchar *out);
 GString *base64_decode (const gchar *str);
 
+/* Incremental encoding and decoding into caller-supplied buffers. The
+ * structures are meant to be allocated by the caller, but their contents are
+ * private. */
+
+typedef struct {
+  guchar pending[3];
+  guint n_pending;
+} Base64Encoder;
+
+void base64_encoder_init (Base64Encoder *encoder);
+gsize base64_encoder_step (Base64Encoder *encoder, const gchar *in, gsize len,
+    gchar *out);
+gsize base64_encoder_finish (Base64Encoder *encoder, gchar *out);
+
+typedef struct {
+  guchar group[4];
+  guint filled;
+  guint padding;
+} Base64Decoder;
+
+void base64_decoder_init (Base64Decoder *decoder);
+gboolean base64_decoder_step (Base64Decoder *decoder, const gchar *in,
+    gsize len, gchar *out, gsize *written);
+gboolean base64_decoder_finish (Base64Decoder *decoder);
+
 #endif /* __BASE64_H__ */
@@ -0,0 +1,53 @@
+/*
+ * bytestream-factory-internal.h - implementation details of
+ *                                 bytestream-factory.c shared with the tests
+ * Copyright (C) 2007-2008 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __BYTESTREAM_FACTORY_INTERNAL_H__
+#define __BYTESTREAM_FACTORY_INTERNAL_H__
+
+#include "bytestream-factory.h"
+
+/* The number of streamhosts we remember how connecting to went */
+#define STREAMHOST_STATS_MAX 128
+/* How long we remember a streamhost we haven't used, in seconds: 30 days */
+#define STREAMHOST_STATS_MAX_AGE (30 * 24 * 60 * 60)
+
+/* See gabble_bytestream_factory_get_streamhost_cost () */
+#define UNKNOWN_STREAMHOST_COST 1000
+#define STREAMHOST_FAILURE_PENALTY (10 * 1000)
+#define STREAMHOST_COST_TRANSFER_SIZE (64 * 1024)
+
+typedef struct {
+    GabbleStreamhostStats stats;
+    GTimeVal last_used;
+    /* when the proxy last answered a query, or 0 */
+    glong last_probed;
+    /* TRUE if this is a proxy which answered our query, rather than a
+     * streamhost a contact offered us; only proxies are stored on disk */
+    gboolean proxy;
+} StreamhostRecord;
+
+GHashTable *streamhost_records_new (void);
+void streamhost_records_add_from_data (GHashTable *records,
+    const gchar *data, gsize length, glong now);
+gchar *streamhost_records_to_data (GHashTable *records, gsize *length);
+
+guint streamhost_stats_get_cost (const GabbleStreamhostStats *stats);
+
+#endif /* __BYTESTREAM_FACTORY_INTERNAL_H__ */
@@ -19,12 +19,15 @@
 
 #include "config.h"
 #include "bytestream-factory.h"
+#include "bytestream-factory-internal.h"
 
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include <dbus/dbus-glib.h>
 #include <dbus/dbus-glib-lowlevel.h>
+#include <gio/gio.h>
 #include <loudmouth/loudmouth.h>
 #include <telepathy-glib/interfaces.h>
 
@@ -57,6 +60,12 @@ G_DEFINE_TYPE (GabbleBytestreamFactory, gabble_bytestream_factory,
 /* 6 hours */
 #define PROXIES_LIST_LIFE_TIME 6 * 60 * 60
 
+/* How old (in seconds) the last answer from a proxy we offer can be before
+ * we query it again, to check that it still works */
+#define PROXY_PROBE_LIFE_TIME (30 * 60)
+
+#define STREAMHOST_STORE_GROUP_PREFIX "streamhost "
+
 /* properties */
 enum
 {
@@ -179,6 +188,19 @@ struct _GabbleBytestreamFactoryPrivate
   /* Time stamp of the proxies list received from TELEPATHY_PROXIES_SERVICE */
   GTimeVal proxies_list_stamp;
 
+  /* "jid host:port" -> owned StreamhostRecord, for SOCKS5 streamhosts we've
+   * tried to connect to, and proxies we've queried. The proxies' records are
+   * kept on disk between connections, in a file of the account's own. */
+  GHashTable *streamhost_stats;
+  /* where the proxies' records are kept, or NULL if they aren't */
+  gchar *streamhost_store_path;
+  /* owned JID we queried -> owned GTimeVal at which we sent it a query we
+   * haven't had a reply to yet */
+  GHashTable *proxy_probes;
+
+  /* Pre-connected sessions with the proxies we offer */
+  GabbleSocks5SessionPool *socks5_sessions;
+
   gboolean dispose_has_run;
 };
 
@@ -205,6 +227,37 @@ static void query_proxies (GabbleBytestreamFactory *self,
 
 static GSList * randomize_g_slist (GSList *list);
 
+static void
+streamhost_record_free (gpointer record)
+{
+  g_slice_free (StreamhostRecord, record);
+}
+
+/**
+ * streamhost_records_new:
+ *
+ * Returns: a new table mapping "jid host:port" to StreamhostRecord, which
+ *  owns its keys and values
+ */
+GHashTable *
+streamhost_records_new (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      streamhost_record_free);
+}
+
+static void
+time_val_free (gpointer tv)
+{
+  g_slice_free (GTimeVal, tv);
+}
+
+static StreamhostRecord *lookup_streamhost (GabbleBytestreamFactory *self,
+    const gchar *jid, const gchar *host, guint16 port, gboolean create);
+
+static void load_streamhost_stats (GabbleBytestreamFactory *self);
+static void save_streamhost_stats (GabbleBytestreamFactory *self);
+
 static void
 gabble_bytestream_factory_init (GabbleBytestreamFactory *self)
 {
@@ -226,6 +279,12 @@ gabble_bytestream_factory_init (GabbleBytestreamFactory *self)
       bytestream_id_equal, bytestream_id_free, g_object_unref);
 
   memset (&priv->proxies_list_stamp, 0, sizeof (GTimeVal));
+
+  priv->streamhost_stats = streamhost_records_new ();
+  priv->proxy_probes = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, time_val_free);
+
+  priv->socks5_sessions = gabble_socks5_session_pool_new ();
 }
 
 static gint
@@ -239,6 +298,13 @@ cmp_proxy (gconstpointer a,
   return strcmp (proxy_a->jid, proxy_b->jid);
 }
 
+static gint
+cmp_proxy_jid (gconstpointer proxy,
+    gconstpointer jid)
+{
+  return strcmp (((GabbleSocks5Proxy *) proxy)->jid, jid);
+}
+
 static void
 add_proxy_to_list (GabbleBytestreamFactory *self,
     GabbleSocks5Proxy *proxy,
@@ -266,6 +332,7 @@ add_proxy_to_list (GabbleBytestreamFactory *self,
           fallback ? "Fallback": "Discovered",
           proxy->jid, proxy->host, proxy->port);
 
+      gabble_socks5_proxy_free (found->data);
       *list = g_slist_delete_link (*list, found);
     }
   else
@@ -293,6 +360,35 @@ add_proxy_to_list (GabbleBytestreamFactory *self,
   *list = g_slist_prepend (*list, proxy);
 }
 
+/* Remembers that the proxy @jid didn't answer our query properly. We keep
+ * offering it, since it may only have had a hiccup, but its cost goes up, so
+ * it's offered after the proxies which work. */
+static void
+record_proxy_failure (GabbleBytestreamFactory *self,
+    const gchar *jid)
+{
+  GabbleBytestreamFactoryPrivate *priv = GABBLE_BYTESTREAM_FACTORY_GET_PRIVATE (
+      self);
+  GSList *lists[] = { priv->socks5_proxies, priv->socks5_fallback_proxies };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (lists); i++)
+    {
+      GSList *found;
+      GabbleSocks5Proxy *proxy;
+
+      found = g_slist_find_custom (lists[i], jid, cmp_proxy_jid);
+      if (found == NULL)
+        continue;
+
+      proxy = found->data;
+      DEBUG ("%s (%s:%d) failed", proxy->jid, proxy->host, proxy->port);
+
+      gabble_bytestream_factory_record_streamhost (self, proxy->jid,
+          proxy->host, proxy->port, GABBLE_STREAMHOST_FAILED, 0);
+    }
+}
+
 static LmHandlerResult
 socks5_proxy_query_reply_cb (GabbleConnection *conn,
                              LmMessage *sent_msg,
@@ -304,18 +400,24 @@ socks5_proxy_query_reply_cb (GabbleConnection *conn,
   GabbleBytestreamFactoryPrivate *priv = GABBLE_BYTESTREAM_FACTORY_GET_PRIVATE (
       self);
   LmMessageNode *query, *streamhost;
-  const gchar *from;
+  const gchar *queried;
   const gchar *jid, *host, *portstr;
   gint64 port;
   GabbleSocks5Proxy *proxy;
   gboolean fallback = GPOINTER_TO_INT (user_data);
   GSList *found = NULL;
-
-  from = lm_message_node_get_attribute (
-    wocky_stanza_get_top_node (reply_msg), "from");
-  if (from == NULL)
+  GTimeVal *sent = NULL;
+  StreamhostRecord *record;
+
+  /* The reply's 'from' may not be the JID we queried, if the proxy
+   * answers from a different resource for instance, so go by the query */
+  queried = lm_message_node_get_attribute (
+    wocky_stanza_get_top_node (sent_msg), "to");
+  if (queried == NULL)
     goto fail;
 
+  sent = g_hash_table_lookup (priv->proxy_probes, queried);
+
   if (lm_message_get_sub_type (reply_msg) != LM_MESSAGE_SUB_TYPE_RESULT)
     goto fail;
 
@@ -342,20 +444,46 @@ socks5_proxy_query_reply_cb (GabbleConnection *conn,
 
   proxy = gabble_socks5_proxy_new (jid, host, port);
 
+  record = lookup_streamhost (self, jid, host, port, TRUE);
+
+  if (record != NULL)
+    record->proxy = TRUE;
+
+  if (record != NULL && sent != NULL)
+    {
+      guint ms = MAX (gabble_time_val_elapsed_ms (sent), 1);
+
+      if (record->stats.rtt == 0)
+        record->stats.rtt = ms;
+      else
+        record->stats.rtt = (3 * record->stats.rtt + ms) / 4;
+
+      record->last_probed = sent->tv_sec;
+      DEBUG ("%s answered in %u ms", jid, ms);
+    }
+
+  g_hash_table_remove (priv->proxy_probes, queried);
+
   add_proxy_to_list (self , proxy, fallback);
 
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 
 fail:
-  if (fallback && from != NULL)
+  if (queried != NULL)
+    {
+      g_hash_table_remove (priv->proxy_probes, queried);
+      record_proxy_failure (self, queried);
+    }
+
+  if (fallback && queried != NULL)
     {
       /* Remove the buggy proxy so we won't query it anymore */
       found = g_slist_find_custom (priv->socks5_potential_proxies,
-          from, (GCompareFunc) strcmp);
+          queried, (GCompareFunc) strcmp);
 
       if (found != NULL)
         {
-          DEBUG ("remove proxy %s", from);
+          DEBUG ("remove proxy %s", queried);
           g_free (found->data);
 
           priv->socks5_potential_proxies = g_slist_delete_link (
@@ -376,9 +504,14 @@ send_proxy_query (GabbleBytestreamFactory *self,
   GabbleBytestreamFactoryPrivate *priv = GABBLE_BYTESTREAM_FACTORY_GET_PRIVATE (
       self);
   LmMessage *query;
+  GTimeVal *sent;
 
   DEBUG ("send SOCKS5 query to %s", jid);
 
+  sent = g_slice_new (GTimeVal);
+  g_get_current_time (sent);
+  g_hash_table_insert (priv->proxy_probes, g_strdup (jid), sent);
+
   query = lm_message_build (jid, LM_MESSAGE_TYPE_IQ,
       '@', "type", "get",
       '(', "query", "",
@@ -498,6 +631,51 @@ get_proxies_list (GabbleBytestreamFactory *self)
       NULL);
 }
 
+/* Query the proxies we offer which haven't answered us for a while again, in
+ * the background, so we notice when they stop working and know how quick
+ * they are */
+static void
+probe_stale_proxies (GabbleBytestreamFactory *self)
+{
+  GabbleBytestreamFactoryPrivate *priv = GABBLE_BYTESTREAM_FACTORY_GET_PRIVATE (
+      self);
+  GSList *lists[] = { priv->socks5_proxies, priv->socks5_fallback_proxies };
+  GTimeVal now;
+  guint i;
+
+  g_get_current_time (&now);
+
+  for (i = 0; i < G_N_ELEMENTS (lists); i++)
+    {
+      GSList *l;
+
+      for (l = lists[i]; l != NULL; l = g_slist_next (l))
+        {
+          GabbleSocks5Proxy *proxy = l->data;
+          StreamhostRecord *record;
+          GTimeVal *sent;
+
+          sent = g_hash_table_lookup (priv->proxy_probes, proxy->jid);
+
+          if (sent != NULL &&
+              now.tv_sec - sent->tv_sec < PROXY_PROBE_LIFE_TIME)
+            /* we're already waiting for it */
+            continue;
+
+          record = lookup_streamhost (self, proxy->jid, proxy->host,
+              proxy->port, FALSE);
+
+          if (record != NULL &&
+              now.tv_sec - record->last_probed < PROXY_PROBE_LIFE_TIME)
+            continue;
+
+          DEBUG ("%s hasn't been checked for a while", proxy->jid);
+          /* lists[1] is the fallback proxies */
+          send_proxy_query (self, proxy->jid, i == 1);
+        }
+    }
+}
+
 /* ask to the factory to try to find more proxies if needed */
 void
 gabble_bytestream_factory_query_socks5_proxies (GabbleBytestreamFactory *self)
@@ -539,6 +717,7 @@ gabble_bytestream_factory_query_socks5_proxies (GabbleBytestreamFactory *self)
     }
 
   query_proxies (self, nb_proxies_needed);
+  probe_stale_proxies (self);
 }
 
 static GSList *
@@ -584,6 +763,9 @@ conn_status_changed_cb (GabbleConnection *conn,
       GStrv jids;
       guint i;
 
+      /* we need to know who we are to find our account's file */
+      load_streamhost_stats (self);
+
       /* we can't intialize socks5_potential_proxies in the constructor
        * because Connection's properties are not set yet at this point */
       g_object_get (priv->conn, "fallback-socks5-proxies", &jids, NULL);
@@ -709,6 +891,18 @@ gabble_bytestream_factory_dispose (GObject *object)
   g_slist_free (priv->socks5_potential_proxies);
   priv->socks5_potential_proxies = NULL;
 
+  save_streamhost_stats (self);
+  g_hash_table_destroy (priv->streamhost_stats);
+  priv->streamhost_stats = NULL;
+  g_free (priv->streamhost_store_path);
+  priv->streamhost_store_path = NULL;
+
+  g_hash_table_destroy (priv->proxy_probes);
+  priv->proxy_probes = NULL;
+
+  gabble_socks5_session_pool_free (priv->socks5_sessions);
+  priv->socks5_sessions = NULL;
+
   if (G_OBJECT_CLASS (gabble_bytestream_factory_parent_class)->dispose)
     G_OBJECT_CLASS (gabble_bytestream_factory_parent_class)->dispose (object);
 }
@@ -2301,12 +2495,606 @@ gabble_bytestream_factory_make_multi_accept_iq (const gchar *full_jid,
   return msg;
 }
 
+typedef struct {
+    GabbleSocks5Proxy *proxy;
+    guint cost;
+    /* position in the unsorted list, so that the sort is stable */
+    guint position;
+} ProxyCost;
+
+static gint
+cmp_proxy_cost (gconstpointer a,
+    gconstpointer b)
+{
+  const ProxyCost *cost_a = a;
+  const ProxyCost *cost_b = b;
+
+  if (cost_a->cost != cost_b->cost)
+    return cost_a->cost < cost_b->cost ? -1 : 1;
+
+  return cost_a->position < cost_b->position ? -1 : 1;
+}
+
 GSList *
 gabble_bytestream_factory_get_socks5_proxies (GabbleBytestreamFactory *self)
 {
   GabbleBytestreamFactoryPrivate *priv = GABBLE_BYTESTREAM_FACTORY_GET_PRIVATE (
       self);
+  GSList *lists[] = { priv->socks5_proxies, priv->socks5_fallback_proxies };
+  GArray *costs = g_array_new (FALSE, FALSE, sizeof (ProxyCost));
+  GSList *proxies = NULL;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (lists); i++)
+    {
+      GSList *l;
+
+      for (l = lists[i]; l != NULL; l = g_slist_next (l))
+        {
+          ProxyCost cost;
+
+          cost.proxy = l->data;
+          cost.cost = gabble_bytestream_factory_get_streamhost_cost (self,
+              cost.proxy->jid, cost.proxy->host, cost.proxy->port);
+          cost.position = costs->len;
+          g_array_append_val (costs, cost);
+        }
+    }
+
+  /* proxies we know nothing about keep their order */
+  qsort (costs->data, costs->len, sizeof (ProxyCost), cmp_proxy_cost);
+
+  for (i = costs->len; i > 0; i--)
+    proxies = g_slist_prepend (proxies,
+        g_array_index (costs, ProxyCost, i - 1).proxy);
+
+  g_array_free (costs, TRUE);
+  return proxies;
+}
+
+/**
+ * gabble_bytestream_factory_get_socks5_sessions:
+ * @self: the factory
+ *
+ * Returns: the pool of pre-connected sessions with SOCKS5 proxies, which
+ *  SOCKS5 bytestreams share, or %NULL if the factory has been disposed
+ */
+GabbleSocks5SessionPool *
+gabble_bytestream_factory_get_socks5_sessions (GabbleBytestreamFactory *self)
+{
+  GabbleBytestreamFactoryPrivate *priv = GABBLE_BYTESTREAM_FACTORY_GET_PRIVATE (
+      self);
+
+  return priv->socks5_sessions;
+}
+
+static gchar *
+streamhost_key (const gchar *jid,
+    const gchar *host,
+    guint16 port)
+{
+  return g_strdup_printf ("%s %s:%u", jid, host, port);
+}
+
+static void
+forget_least_recently_used_streamhost (GabbleBytestreamFactory *self)
+{
+  GabbleBytestreamFactoryPrivate *priv = GABBLE_BYTESTREAM_FACTORY_GET_PRIVATE (
+      self);
+  GHashTableIter iter;
+  gpointer key, value;
+  gpointer oldest_key = NULL;
+  GTimeVal oldest = { G_MAXLONG, 0 };
+
+  g_hash_table_iter_init (&iter, priv->streamhost_stats);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      StreamhostRecord *record = value;
+
+      if (record->last_used.tv_sec < oldest.tv_sec ||
+          (record->last_used.tv_sec == oldest.tv_sec &&
+           record->last_used.tv_usec < oldest.tv_usec))
+        {
+          oldest = record->last_used;
+          oldest_key = key;
+        }
+    }
+
+  if (oldest_key != NULL)
+    g_hash_table_remove (priv->streamhost_stats, oldest_key);
+}
+
+/* Returns the record for the streamhost, creating it if @create is TRUE, or
+ * NULL */
+static StreamhostRecord *
+lookup_streamhost (GabbleBytestreamFactory *self,
+    const gchar *jid,
+    const gchar *host,
+    guint16 port,
+    gboolean create)
+{
+  GabbleBytestreamFactoryPrivate *priv = GABBLE_BYTESTREAM_FACTORY_GET_PRIVATE (
+      self);
+  gchar *key;
+  StreamhostRecord *record;
+
+  if (priv->streamhost_stats == NULL)
+    /* we've been disposed */
+    return NULL;
+
+  key = streamhost_key (jid, host, port);
+  record = g_hash_table_lookup (priv->streamhost_stats, key);
+
+  if (record != NULL || !create)
+    {
+      g_free (key);
+      return record;
+    }
+
+  if (g_hash_table_size (priv->streamhost_stats) >= STREAMHOST_STATS_MAX)
+    forget_least_recently_used_streamhost (self);
+
+  record = g_slice_new0 (StreamhostRecord);
+  g_get_current_time (&record->last_used);
+  g_hash_table_insert (priv->streamhost_stats, key, record);
+  return record;
+}
+
+/**
+ * gabble_bytestream_factory_record_streamhost:
+ * @self: the factory
+ * @jid: the streamhost's JID
+ * @host: the host we connected to
+ * @port: the port we connected to
+ * @result: how the attempt ended
+ * @latency: for %GABBLE_STREAMHOST_SUCCEEDED, how long it took from starting
+ *  to connect to completing the SOCKS5 handshake, in milliseconds
+ *
+ * Records the outcome of an attempt to connect to a SOCKS5 streamhost, so
+ * that streamhosts which worked well before can be tried first next time.
+ */
+void
+gabble_bytestream_factory_record_streamhost (GabbleBytestreamFactory *self,
+    const gchar *jid,
+    const gchar *host,
+    guint16 port,
+    GabbleStreamhostResult result,
+    guint latency)
+{
+  StreamhostRecord *record = lookup_streamhost (self, jid, host, port, TRUE);
+
+  if (record == NULL)
+    return;
+
+  g_get_current_time (&record->last_used);
+  record->stats.attempts++;
+
+  switch (result)
+    {
+      case GABBLE_STREAMHOST_SUCCEEDED:
+        if (record->stats.successes == 0)
+          record->stats.latency = latency;
+        else
+          record->stats.latency = (3 * record->stats.latency + latency) / 4;
+
+        /* don't confuse "never succeeded" with "instantaneous" */
+        record->stats.latency = MAX (record->stats.latency, 1);
+        record->stats.successes++;
+        break;
+      case GABBLE_STREAMHOST_FAILED:
+        record->stats.failures++;
+        break;
+      case GABBLE_STREAMHOST_CANCELLED:
+        break;
+    }
+}
+
+/**
+ * gabble_bytestream_factory_record_streamhost_bandwidth:
+ * @self: the factory
+ * @jid: the streamhost's JID
+ * @host: its host
+ * @port: its port
+ * @bandwidth: the throughput of a bytestream which used the streamhost, in
+ *  bytes per second
+ */
+void
+gabble_bytestream_factory_record_streamhost_bandwidth (
+    GabbleBytestreamFactory *self,
+    const gchar *jid,
+    const gchar *host,
+    guint16 port,
+    guint bandwidth)
+{
+  StreamhostRecord *record = lookup_streamhost (self, jid, host, port, TRUE);
+
+  if (record == NULL || bandwidth == 0)
+    return;
+
+  g_get_current_time (&record->last_used);
+
+  if (record->stats.bandwidth == 0)
+    record->stats.bandwidth = bandwidth;
+  else
+    record->stats.bandwidth = (guint) (((guint64) 3 * record->stats.bandwidth +
+          bandwidth) / 4);
+}
+
+/**
+ * gabble_bytestream_factory_get_streamhost_stats:
+ * @self: the factory
+ * @jid: the streamhost's JID
+ * @host: its host
+ * @port: its port
+ * @stats: filled in with what we know about the streamhost
+ *
+ * Returns: %FALSE if we've never tried to connect to this streamhost (or
+ *  have forgotten about it), in which case @stats is zeroed
+ */
+gboolean
+gabble_bytestream_factory_get_streamhost_stats (GabbleBytestreamFactory *self,
+    const gchar *jid,
+    const gchar *host,
+    guint16 port,
+    GabbleStreamhostStats *stats)
+{
+  StreamhostRecord *record = lookup_streamhost (self, jid, host, port, FALSE);
+
+  if (record == NULL)
+    {
+      memset (stats, 0, sizeof (GabbleStreamhostStats));
+      return FALSE;
+    }
+
+  *stats = record->stats;
+  return TRUE;
+}
+
+/**
+ * gabble_bytestream_factory_get_streamhost_cost:
+ * @self: the factory
+ * @jid: the streamhost's JID
+ * @host: its host
+ * @port: its port
+ *
+ * Returns: a score for the streamhost, lower being better, roughly in
+ *  milliseconds: how long the SOCKS5 handshake with it usually takes (or how
+ *  long it takes to answer our queries, if it's a proxy we haven't used yet),
+ *  plus penalties for how often it failed and for how long moving
+ *  STREAMHOST_COST_TRANSFER_SIZE bytes through it takes. Streamhosts we
+ *  don't know anything about all get the same cost, and those which never
+ *  worked come last.
+ */
+guint
+gabble_bytestream_factory_get_streamhost_cost (GabbleBytestreamFactory *self,
+    const gchar *jid,
+    const gchar *host,
+    guint16 port)
+{
+  GabbleStreamhostStats stats;
+
+  /* zeroes @stats if we don't know this streamhost */
+  gabble_bytestream_factory_get_streamhost_stats (self, jid, host, port,
+      &stats);
+  return streamhost_stats_get_cost (&stats);
+}
+
+/**
+ * streamhost_stats_get_cost:
+ * @stats: what we know about a streamhost
+ *
+ * Returns: the streamhost's score, as described for
+ *  gabble_bytestream_factory_get_streamhost_cost ()
+ */
+guint
+streamhost_stats_get_cost (const GabbleStreamhostStats *stats)
+{
+  guint cost;
+
+  if (stats->successes == 0 && stats->failures > 0)
+    /* it never worked; try it last */
+    return STREAMHOST_FAILURE_PENALTY + MIN (stats->failures, 1000);
+
+  if (stats->successes > 0)
+    cost = stats->latency;
+  else if (stats->rtt > 0)
+    cost = stats->rtt;
+  else
+    cost = UNKNOWN_STREAMHOST_COST;
+
+  if (stats->failures > 0)
+    cost += STREAMHOST_FAILURE_PENALTY * stats->failures /
+        MAX (stats->attempts, stats->failures);
+
+  if (stats->bandwidth > 0)
+    cost += (guint) (MIN ((guint64) STREAMHOST_COST_TRANSFER_SIZE * 1000 /
+          stats->bandwidth, STREAMHOST_FAILURE_PENALTY));
+
+  return cost;
+}
+
+/* The statistics about the proxies an account used are kept in
+ * $XDG_CACHE_HOME/telepathy/gabble/streamhosts/<SHA-1 of the account's bare
+ * JID>, so that accounts connected at the same time don't overwrite each
+ * other's. The directory can be moved by setting GABBLE_STREAMHOST_CACHE;
+ * setting it to ":memory:" means we only remember them until we disconnect.
+ * Streamhosts contacts offered us are never stored, so the file doesn't say
+ * who we've exchanged files with, or where they were. */
+static gchar *
+get_streamhost_store_path (const gchar *account)
+{
+  const gchar *dir = g_getenv ("GABBLE_STREAMHOST_CACHE");
+  gchar *account_hash, *path;
+
+  if (dir != NULL && (dir[0] == '\0' || !tp_strdiff (dir, ":memory:")))
+    return NULL;
+
+  account_hash = sha1_hex (account, strlen (account));
+
+  if (dir == NULL)
+    path = g_build_filename (g_get_user_cache_dir (), "telepathy", "gabble",
+        "streamhosts", account_hash, NULL);
+  else
+    path = g_build_filename (dir, account_hash, NULL);
+
+  g_free (account_hash);
+  return path;
+}
+
+/* missing, malformed and negative values are 0 */
+static guint
+key_file_get_uint (GKeyFile *file,
+    const gchar *group,
+    const gchar *key)
+{
+  gint value = g_key_file_get_integer (file, group, key, NULL);
+
+  return MAX (value, 0);
+}
+
+/**
+ * streamhost_records_add_from_data:
+ * @records: a table returned by streamhost_records_new ()
+ * @data: what streamhost_records_to_data () returned
+ * @length: the length of @data
+ * @now: the current time, in seconds since the epoch
+ *
+ * Adds the proxies recorded in @data to @records, apart from those which
+ * haven't been used for STREAMHOST_STATS_MAX_AGE seconds and those
+ * @records already knows about, until it has STREAMHOST_STATS_MAX entries.
+ */
+void
+streamhost_records_add_from_data (GHashTable *records,
+    const gchar *data,
+    gsize length,
+    glong now)
+{
+  GKeyFile *file = g_key_file_new ();
+  gchar **groups;
+  GError *error = NULL;
+  guint i;
+
+  if (!g_key_file_load_from_data (file, data, length, G_KEY_FILE_NONE,
+        &error))
+    {
+      DEBUG ("couldn't parse the stored streamhosts: %s", error->message);
+      g_clear_error (&error);
+      goto out;
+    }
+
+  groups = g_key_file_get_groups (file, NULL);
+
+  for (i = 0; groups[i] != NULL; i++)
+    {
+      StreamhostRecord *record;
+      const gchar *key;
+      gchar *last_used;
+
+      if (!g_str_has_prefix (groups[i], STREAMHOST_STORE_GROUP_PREFIX))
+        continue;
+
+      key = groups[i] + strlen (STREAMHOST_STORE_GROUP_PREFIX);
+
+      if (g_hash_table_size (records) >= STREAMHOST_STATS_MAX)
+        break;
+
+      /* we may already have learnt something newer during this connection */
+      if (g_hash_table_lookup (records, key) != NULL)
+        continue;
+
+      record = g_slice_new0 (StreamhostRecord);
+      record->proxy = TRUE;
+
+      /* g_key_file_get_int64 () needs GLib 2.26 */
+      last_used = g_key_file_get_value (file, groups[i], "last-used", NULL);
+      if (last_used != NULL)
+        record->last_used.tv_sec = g_ascii_strtoll (last_used, NULL, 10);
+      g_free (last_used);
+
+      if (now - record->last_used.tv_sec > STREAMHOST_STATS_MAX_AGE)
+        {
+          streamhost_record_free (record);
+          continue;
+        }
+
+      record->stats.attempts = key_file_get_uint (file, groups[i], "attempts");
+      record->stats.successes =
+          key_file_get_uint (file, groups[i], "successes");
+      record->stats.failures = key_file_get_uint (file, groups[i], "failures");
+      record->stats.latency = key_file_get_uint (file, groups[i], "latency");
+      record->stats.rtt = key_file_get_uint (file, groups[i], "rtt");
+      record->stats.bandwidth =
+          key_file_get_uint (file, groups[i], "bandwidth");
+
+      /* the failure penalty relies on this */
+      record->stats.attempts = MAX (record->stats.attempts,
+          record->stats.successes + record->stats.failures);
+
+      g_hash_table_insert (records, g_strdup (key), record);
+    }
+
+  g_strfreev (groups);
+
+out:
+  g_key_file_free (file);
+}
+
+/* Streamhosts' JIDs and hosts come from the network; don't let them break
+ * the key file's syntax */
+static gboolean
+is_storable (const gchar *key)
+{
+  const gchar *c;
+
+  for (c = key; *c != '\0'; c++)
+    {
+      if (*c == '[' || *c == ']' || g_ascii_iscntrl (*c))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * streamhost_records_to_data:
+ * @records: a table returned by streamhost_records_new ()
+ * @length: set to the length of the result
+ *
+ * Returns: what we know about the proxies in @records, for
+ *  streamhost_records_add_from_data (), as a new string. Streamhosts
+ *  contacts offered us are left out.
+ */
+gchar *
+streamhost_records_to_data (GHashTable *records,
+    gsize *length)
+{
+  GKeyFile *file = g_key_file_new ();
+  GHashTableIter iter;
+  gpointer key, value;
+  gchar *data;
+
+  g_hash_table_iter_init (&iter, records);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      StreamhostRecord *record = value;
+      gchar *group, *last_used;
+
+      if (!record->proxy || !is_storable (key))
+        continue;
+
+      group = g_strconcat (STREAMHOST_STORE_GROUP_PREFIX, key, NULL);
+      last_used = g_strdup_printf ("%" G_GINT64_FORMAT,
+          (gint64) record->last_used.tv_sec);
+      g_key_file_set_value (file, group, "last-used", last_used);
+      g_free (last_used);
+      g_key_file_set_integer (file, group, "attempts",
+          record->stats.attempts);
+      g_key_file_set_integer (file, group, "successes",
+          record->stats.successes);
+      g_key_file_set_integer (file, group, "failures",
+          record->stats.failures);
+      g_key_file_set_integer (file, group, "latency", record->stats.latency);
+      g_key_file_set_integer (file, group, "rtt", record->stats.rtt);
+      g_key_file_set_integer (file, group, "bandwidth",
+          record->stats.bandwidth);
+      g_free (group);
+    }
+
+  data = g_key_file_to_data (file, length, NULL);
+  g_key_file_free (file);
+  return data;
+}
+
+static void
+load_streamhost_stats (GabbleBytestreamFactory *self)
+{
+  GabbleBytestreamFactoryPrivate *priv = GABBLE_BYTESTREAM_FACTORY_GET_PRIVATE (
+      self);
+  TpBaseConnection *base = (TpBaseConnection *) priv->conn;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+      TP_HANDLE_TYPE_CONTACT);
+  const gchar *path;
+  gchar *dir, *data;
+  gsize length;
+  GError *error = NULL;
+  GTimeVal now;
+
+  if (priv->streamhost_stats == NULL || priv->streamhost_store_path != NULL)
+    return;
+
+  priv->streamhost_store_path = get_streamhost_store_path (
+      tp_handle_inspect (contact_repo, base->self_handle));
+  path = priv->streamhost_store_path;
+
+  if (path == NULL)
+    return;
+
+  /* Create the directory now, so that saving the file when we're disposed
+   * doesn't have to block on it; this is only done once per connection, and
+   * usually finds it already exists */
+  dir = g_path_get_dirname (path);
+
+  if (g_mkdir_with_parents (dir, 0700) != 0)
+    DEBUG ("couldn't create %s: %s", dir, g_strerror (errno));
+
+  g_free (dir);
+
+  if (!g_file_get_contents (path, &data, &length, &error))
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        DEBUG ("couldn't load %s: %s", path, error->message);
+
+      g_clear_error (&error);
+      return;
+    }
+
+  g_get_current_time (&now);
+  streamhost_records_add_from_data (priv->streamhost_stats, data, length,
+      now.tv_sec);
+  g_free (data);
+
+  DEBUG ("loaded what we know about %u proxies from %s",
+      g_hash_table_size (priv->streamhost_stats), path);
+}
+
+static void
+streamhost_stats_saved_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  GError *error = NULL;
+
+  if (!g_file_replace_contents_finish (G_FILE (source), result, NULL,
+        &error))
+    {
+      gchar *path = g_file_get_path (G_FILE (source));
+
+      DEBUG ("couldn't save %s: %s", path, error->message);
+      g_free (path);
+      g_clear_error (&error);
+    }
+
+  /* the data being written */
+  g_free (user_data);
+}
+
+/* Starts saving what we know about the proxies; the write doesn't need the
+ * factory, so it can finish after we've been disposed */
+static void
+save_streamhost_stats (GabbleBytestreamFactory *self)
+{
+  GabbleBytestreamFactoryPrivate *priv = GABBLE_BYTESTREAM_FACTORY_GET_PRIVATE (
+      self);
+  GFile *file;
+  gchar *data;
+  gsize length;
+
+  if (priv->streamhost_store_path == NULL)
+    return;
 
-  return g_slist_concat (g_slist_copy (priv->socks5_proxies),
-      g_slist_copy (priv->socks5_fallback_proxies));
+  data = streamhost_records_to_data (priv->streamhost_stats, &length);
+  file = g_file_new_for_path (priv->streamhost_store_path);
+  g_file_replace_contents_async (file, data, length, NULL, FALSE,
+      G_FILE_CREATE_PRIVATE, NULL, streamhost_stats_saved_cb, data);
+  g_object_unref (file);
 }
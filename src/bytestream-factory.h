@@ -112,6 +112,54 @@ GSList *gabble_bytestream_factory_get_socks5_proxies (
 void gabble_bytestream_factory_query_socks5_proxies (
     GabbleBytestreamFactory *self);
 
+GabbleSocks5SessionPool *gabble_bytestream_factory_get_socks5_sessions (
+    GabbleBytestreamFactory *self);
+
+typedef enum {
+    GABBLE_STREAMHOST_SUCCEEDED,
+    GABBLE_STREAMHOST_FAILED,
+    /* another streamhost won the race */
+    GABBLE_STREAMHOST_CANCELLED
+} GabbleStreamhostResult;
+
+/**
+ * GabbleStreamhostStats:
+ * @attempts: number of times we started connecting to the streamhost
+ * @successes: number of times we completed the SOCKS5 handshake with it
+ * @failures: number of times connecting to it or the handshake failed or
+ *  timed out, or, for proxies, it didn't answer our query properly
+ * @latency: smoothed time taken from starting to connect to completing the
+ *  handshake, in milliseconds, or 0 if that never happened
+ * @rtt: for proxies, smoothed time taken to answer our queries, in
+ *  milliseconds, or 0 if we never queried it
+ * @bandwidth: smoothed throughput of bytestreams which used it, in bytes per
+ *  second, or 0 if unknown
+ */
+typedef struct {
+    guint attempts;
+    guint successes;
+    guint failures;
+    guint latency;
+    guint rtt;
+    guint bandwidth;
+} GabbleStreamhostStats;
+
+void gabble_bytestream_factory_record_streamhost (
+    GabbleBytestreamFactory *self, const gchar *jid, const gchar *host,
+    guint16 port, GabbleStreamhostResult result, guint latency);
+
+void gabble_bytestream_factory_record_streamhost_bandwidth (
+    GabbleBytestreamFactory *self, const gchar *jid, const gchar *host,
+    guint16 port, guint bandwidth);
+
+gboolean gabble_bytestream_factory_get_streamhost_stats (
+    GabbleBytestreamFactory *self, const gchar *jid, const gchar *host,
+    guint16 port, GabbleStreamhostStats *stats);
+
+guint gabble_bytestream_factory_get_streamhost_cost (
+    GabbleBytestreamFactory *self, const gchar *jid, const gchar *host,
+    guint16 port);
+
 G_END_DECLS
 
 #endif /* #ifndef __BYTESTREAM_FACTORY_H__ */
@@ -64,9 +64,34 @@ enum
 
 #define READ_BUFFER_MAX_SIZE (512 * 1024)
 
-/* the number of not acked stanzas allowed. Once this number reached, we stop
- * sending and wait for acks. */
-#define WINDOW_SIZE 10
+/* Received data is decoded straight into a buffer taken from this pool, which
+ * is given back as soon as the data has been passed on, so that open
+ * bytestreams don't each hold a buffer while idle. Buffers which grew beyond
+ * RECV_POOL_BUFFER_MAX_SIZE while reading was blocked aren't kept. */
+#define RECV_POOL_SIZE 4
+#define RECV_POOL_BUFFER_MAX_SIZE (64 * 1024)
+
+static GString *recv_pool[RECV_POOL_SIZE];
+static guint recv_pool_len = 0;
+
+/* The number of not acked stanzas allowed. Once this number reached, we stop
+ * sending and wait for acks. It starts at WINDOW_INITIAL and then grows while
+ * acks come back about as fast as they did when the stream was idle, and
+ * shrinks when they start taking much longer, which means stanzas are being
+ * queued somewhere between us and the peer. */
+#define WINDOW_INITIAL 10
+#define WINDOW_MIN 2
+#define WINDOW_MAX 64
+
+/* Once the window is as small as it can get, we send smaller stanzas so that
+ * they don't hold up everything else on the connection; they go back up to
+ * the negotiated block size before the window grows again. */
+#define BLOCK_SIZE_MIN 1024
+
+/* Acks are considered slow if the smoothed round-trip time goes above
+ * RTT_SLOW_FACTOR times the fastest one we've seen plus RTT_SLOW_SLACK ms */
+#define RTT_SLOW_FACTOR 2
+#define RTT_SLOW_SLACK 50
 
 struct _GabbleBytestreamIBBPrivate
 {
@@ -84,17 +109,33 @@ struct _GabbleBytestreamIBBPrivate
   LmMessage *close_iq_to_ack;
 
   /* We can't stop receving IBB data so if user wants to block the bytestream
-   * we buffer them until he unblocks it. */
+   * we buffer them until he unblocks it. Taken from recv_pool; NULL when
+   * there is nothing buffered. */
   gboolean read_blocked;
   GString *read_buffer;
   /* list of reffed (LmMessage *) */
   GSList *received_stanzas_not_acked;
 
-  /* (LmMessage *) -> TRUE
+  /* (LmMessage *) -> (GTimeVal *) when it was sent
    * We don't keep a ref on the LmMessage as we just use this table to track
    * stanzas waiting for reply. The stanza is never used (and so deferenced). */
   GHashTable *sent_stanzas_not_acked;
+  guint window_size;
+  /* the amount of data we currently put in each stanza; never more than
+   * block_size */
+  guint send_block_size;
+  /* acks received since window_size or send_block_size last changed */
+  guint acks_since_resize;
+  /* smoothed and smallest ack round-trip times in ms, or 0 if unknown */
+  guint srtt;
+  guint min_rtt;
+  /* reused to base64-encode each block we send */
+  gchar *encode_buffer;
+  gsize encode_buffer_size;
+
   GString *write_buffer;
+  /* data before this offset in write_buffer has already been sent */
+  gsize write_buffer_offset;
   gboolean write_blocked;
 
   gboolean dispose_has_run;
@@ -102,6 +143,36 @@ struct _GabbleBytestreamIBBPrivate
 
 #define GABBLE_BYTESTREAM_IBB_GET_PRIVATE(obj) ((obj)->priv)
 
+static void
+sent_time_free (gpointer sent)
+{
+  g_slice_free (GTimeVal, sent);
+}
+
+static GString *
+recv_buffer_get (gsize size)
+{
+  if (recv_pool_len > 0)
+    return recv_pool[--recv_pool_len];
+
+  return g_string_sized_new (size);
+}
+
+static void
+recv_buffer_put (GString *buffer)
+{
+  if (recv_pool_len < RECV_POOL_SIZE &&
+      buffer->allocated_len <= RECV_POOL_BUFFER_MAX_SIZE)
+    {
+      g_string_truncate (buffer, 0);
+      recv_pool[recv_pool_len++] = buffer;
+    }
+  else
+    {
+      g_string_free (buffer, TRUE);
+    }
+}
+
 static void
 gabble_bytestream_ibb_init (GabbleBytestreamIBB *self)
 {
@@ -113,8 +184,9 @@ gabble_bytestream_ibb_init (GabbleBytestreamIBB *self)
   priv->read_buffer = NULL;
   priv->received_stanzas_not_acked = NULL;
 
-  priv->sent_stanzas_not_acked = g_hash_table_new (g_direct_hash,
-      g_direct_equal);
+  priv->sent_stanzas_not_acked = g_hash_table_new_full (g_direct_hash,
+      g_direct_equal, NULL, sent_time_free);
+  priv->window_size = WINDOW_INITIAL;
   priv->write_buffer = NULL;
   priv->write_blocked = FALSE;
 }
@@ -161,11 +233,12 @@ gabble_bytestream_ibb_finalize (GObject *object)
   g_free (priv->peer_jid);
 
   if (priv->read_buffer != NULL)
-    g_string_free (priv->read_buffer, TRUE);
+    recv_buffer_put (priv->read_buffer);
 
   if (priv->write_buffer != NULL)
     g_string_free (priv->write_buffer, TRUE);
 
+  g_free (priv->encode_buffer);
   g_hash_table_destroy (priv->sent_stanzas_not_acked);
 
   G_OBJECT_CLASS (gabble_bytestream_ibb_parent_class)->finalize (object);
@@ -256,6 +329,7 @@ gabble_bytestream_ibb_set_property (GObject *object,
         break;
       case PROP_BLOCK_SIZE:
         priv->block_size = g_value_get_uint (value);
+        priv->send_block_size = priv->block_size;
         break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -406,6 +480,54 @@ static gboolean
 send_data (GabbleBytestreamIBB *self, const gchar *str, guint len,
     gboolean *result);
 
+static void
+adapt_window (GabbleBytestreamIBB *self,
+              guint rtt)
+{
+  GabbleBytestreamIBBPrivate *priv = GABBLE_BYTESTREAM_IBB_GET_PRIVATE (self);
+  guint min_block_size = MIN (BLOCK_SIZE_MIN, priv->block_size);
+
+  if (priv->min_rtt == 0 || rtt < priv->min_rtt)
+    priv->min_rtt = MAX (rtt, 1);
+
+  if (priv->srtt == 0)
+    priv->srtt = rtt;
+  else
+    priv->srtt = (7 * priv->srtt + rtt) / 8;
+
+  /* Only resize once per window's worth of acks, so that each decision is
+   * based on stanzas sent since the previous one took effect */
+  if (++priv->acks_since_resize < priv->window_size)
+    return;
+
+  priv->acks_since_resize = 0;
+
+  if (priv->srtt > priv->min_rtt * RTT_SLOW_FACTOR + RTT_SLOW_SLACK)
+    {
+      if (priv->window_size > WINDOW_MIN)
+        priv->window_size = MAX (WINDOW_MIN, priv->window_size / 2);
+      else if (priv->send_block_size > min_block_size)
+        priv->send_block_size = MAX (min_block_size,
+            priv->send_block_size / 2);
+      else
+        return;
+    }
+  else
+    {
+      if (priv->send_block_size < priv->block_size)
+        priv->send_block_size = MIN (priv->block_size,
+            priv->send_block_size * 2);
+      else if (priv->window_size < WINDOW_MAX)
+        priv->window_size++;
+      else
+        return;
+    }
+
+  DEBUG ("acks take %ums (fastest: %ums); window is now %u stanzas of %u "
+      "bytes", priv->srtt, priv->min_rtt, priv->window_size,
+      priv->send_block_size);
+}
+
 static LmHandlerResult
 iq_acked_cb (GabbleConnection *conn,
              LmMessage *sent_msg,
@@ -415,22 +537,41 @@ iq_acked_cb (GabbleConnection *conn,
 {
   GabbleBytestreamIBB *self = GABBLE_BYTESTREAM_IBB (obj);
   GabbleBytestreamIBBPrivate *priv = GABBLE_BYTESTREAM_IBB_GET_PRIVATE (self);
+  GTimeVal *sent_at;
+
+  sent_at = g_hash_table_lookup (priv->sent_stanzas_not_acked, sent_msg);
+
+  if (lm_message_get_sub_type (reply_msg) != LM_MESSAGE_SUB_TYPE_RESULT)
+    {
+      /* The peer might be telling us to slow down (XEP-0047 suggests
+       * <resource-constraint/>), so be as gentle as we can from now on */
+      DEBUG ("IBB stanza was not acked successfully; shrinking the window");
+      priv->window_size = WINDOW_MIN;
+      priv->send_block_size = MIN (BLOCK_SIZE_MIN, priv->block_size);
+      priv->acks_since_resize = 0;
+    }
+  else if (sent_at != NULL)
+    {
+      adapt_window (self, gabble_time_val_elapsed_ms (sent_at));
+    }
 
   g_hash_table_remove (priv->sent_stanzas_not_acked, sent_msg);
 
   if (priv->write_buffer != NULL)
     {
+      gsize pending = priv->write_buffer->len - priv->write_buffer_offset;
       guint sent;
 
       DEBUG ("A stanza has been acked. Try to flush the buffer");
 
-      sent = send_data (self, priv->write_buffer->str, priv->write_buffer->len,
-          NULL);
-      if (sent == priv->write_buffer->len)
+      sent = send_data (self,
+          priv->write_buffer->str + priv->write_buffer_offset, pending, NULL);
+      if (sent == pending)
         {
           DEBUG ("buffer has been flushed; unblock write the bytestream");
           g_string_free (priv->write_buffer, TRUE);
           priv->write_buffer = NULL;
+          priv->write_buffer_offset = 0;
 
           change_write_blocked_state (self, FALSE);
 
@@ -444,11 +585,20 @@ iq_acked_cb (GabbleConnection *conn,
         }
       else
         {
-          g_string_erase (priv->write_buffer, 0, sent);
+          priv->write_buffer_offset += sent;
+
+          /* Don't move the rest of the buffer down after every ack, only
+           * once most of it has been sent */
+          if (priv->write_buffer_offset > priv->write_buffer->len / 2)
+            {
+              g_string_erase (priv->write_buffer, 0,
+                  priv->write_buffer_offset);
+              priv->write_buffer_offset = 0;
+            }
 
           DEBUG ("buffer has not been completely flushed; %" G_GSIZE_FORMAT
               " bytes left",
-              priv->write_buffer->len);
+              priv->write_buffer->len - priv->write_buffer_offset);
         }
     }
 
@@ -470,7 +620,9 @@ send_data (GabbleBytestreamIBB *self,
     {
       LmMessage *iq;
       guint send_now, remaining;
-      gchar *seq, *encoded;
+      /* big enough for any guint16 */
+      gchar seq[6];
+      GTimeVal *sent_at;
       GError *error = NULL;
       gboolean ret;
       guint nb_stanzas_waiting;
@@ -478,7 +630,7 @@ send_data (GabbleBytestreamIBB *self,
       remaining = (len - sent);
 
       nb_stanzas_waiting = g_hash_table_size (priv->sent_stanzas_not_acked);
-      if (nb_stanzas_waiting >= WINDOW_SIZE)
+      if (nb_stanzas_waiting >= priv->window_size)
         {
           DEBUG ("Window is full (%u). Stop sending stanzas",
               nb_stanzas_waiting);
@@ -486,10 +638,10 @@ send_data (GabbleBytestreamIBB *self,
         }
 
       /* We can send stanzas */
-      if (remaining > priv->block_size)
+      if (remaining > priv->send_block_size)
         {
           /* We can't send all the remaining data in one stanza */
-          send_now = priv->block_size;
+          send_now = priv->send_block_size;
         }
       else
         {
@@ -497,12 +649,19 @@ send_data (GabbleBytestreamIBB *self,
           send_now = remaining;
         }
 
-      encoded = base64_encode (send_now, str + sent, FALSE);
-      seq = g_strdup_printf ("%u", priv->seq++);
+      if (priv->encode_buffer_size < BASE64_ENCODED_LEN (send_now) + 1)
+        {
+          priv->encode_buffer_size = BASE64_ENCODED_LEN (send_now) + 1;
+          priv->encode_buffer = g_realloc (priv->encode_buffer,
+              priv->encode_buffer_size);
+        }
+
+      base64_encode_into (send_now, str + sent, priv->encode_buffer);
+      g_snprintf (seq, sizeof (seq), "%u", priv->seq++);
 
       iq = lm_message_build (priv->peer_jid, LM_MESSAGE_TYPE_IQ,
           '@', "type", "set",
-          '(', "data", encoded,
+          '(', "data", priv->encode_buffer,
             '@', "xmlns", NS_IBB,
             '@', "sid", priv->stream_id,
             '@', "seq", seq,
@@ -511,8 +670,6 @@ send_data (GabbleBytestreamIBB *self,
       ret = _gabble_connection_send_with_reply (priv->conn, iq, iq_acked_cb,
           G_OBJECT (self), NULL, &error);
 
-      g_free (encoded);
-      g_free (seq);
       lm_message_unref (iq);
 
       if (!ret)
@@ -529,8 +686,9 @@ send_data (GabbleBytestreamIBB *self,
           return sent;
         }
 
-      g_hash_table_insert (priv->sent_stanzas_not_acked, iq,
-          GUINT_TO_POINTER (TRUE));
+      sent_at = g_slice_new (GTimeVal);
+      g_get_current_time (sent_at);
+      g_hash_table_insert (priv->sent_stanzas_not_acked, iq, sent_at);
 
       DEBUG ("send %d bytes (window size: %u)", send_now,
           nb_stanzas_waiting + 1);
@@ -607,6 +765,23 @@ gabble_bytestream_ibb_send (GabbleBytestreamIface *iface,
   return result;
 }
 
+/* Drops anything decoded into read_buffer after the first @len bytes, and
+ * gives it back to the pool if that leaves it empty */
+static void
+release_read_buffer (GabbleBytestreamIBB *self,
+                     gsize len)
+{
+  GabbleBytestreamIBBPrivate *priv = GABBLE_BYTESTREAM_IBB_GET_PRIVATE (self);
+
+  g_string_truncate (priv->read_buffer, len);
+
+  if (len == 0)
+    {
+      recv_buffer_put (priv->read_buffer);
+      priv->read_buffer = NULL;
+    }
+}
+
 void
 gabble_bytestream_ibb_receive (GabbleBytestreamIBB *self,
                                LmMessage *msg,
@@ -614,7 +789,10 @@ gabble_bytestream_ibb_receive (GabbleBytestreamIBB *self,
 {
   GabbleBytestreamIBBPrivate *priv = GABBLE_BYTESTREAM_IBB_GET_PRIVATE (self);
   LmMessageNode *data;
-  GString *str;
+  const gchar *text;
+  gsize text_len, buffered, decoded;
+  Base64Decoder decoder;
+  GString *buffer;
   TpHandle sender;
 
   /* caller must have checked for this in order to know which bytestream to
@@ -639,47 +817,53 @@ gabble_bytestream_ibb_receive (GabbleBytestreamIBB *self,
 
   /* FIXME: check sequence number */
 
-  str = base64_decode (lm_message_node_get_value (data));
-  if (str == NULL)
+  text = lm_message_node_get_value (data);
+  if (text == NULL)
+    text = "";
+
+  text_len = strlen (text);
+
+  if (priv->read_buffer == NULL)
+    priv->read_buffer = recv_buffer_get (BASE64_DECODED_MAX_LEN (text_len));
+
+  /* Decode after whatever is already buffered */
+  buffer = priv->read_buffer;
+  buffered = buffer->len;
+  g_string_set_size (buffer, buffered + BASE64_DECODED_MAX_LEN (text_len));
+
+  base64_decoder_init (&decoder);
+  if (!base64_decoder_step (&decoder, text, text_len, buffer->str + buffered,
+          &decoded) ||
+      !base64_decoder_finish (&decoder))
     {
       DEBUG ("base64 decoding failed");
+      release_read_buffer (self, buffered);
+
       if (is_iq)
         _gabble_connection_send_iq_error (priv->conn, msg,
             XMPP_ERROR_BAD_REQUEST, "base64 decoding failed");
       return;
     }
 
+  g_string_truncate (buffer, buffered + decoded);
+
   if (priv->read_blocked)
     {
-      gsize current_buffer_len = 0;
-
       DEBUG ("Bytestream is blocked. Buffering data");
-      if (priv->read_buffer != NULL)
-        current_buffer_len = priv->read_buffer->len;
 
-      if (current_buffer_len + str->len > READ_BUFFER_MAX_SIZE)
+      if (buffer->len > READ_BUFFER_MAX_SIZE)
         {
           DEBUG ("Buffer is full. Closing the bytestream");
+          release_read_buffer (self, buffered);
 
           if (is_iq)
             _gabble_connection_send_iq_error (priv->conn, msg,
                 XMPP_ERROR_NOT_ACCEPTABLE, "buffer is full");
 
           gabble_bytestream_iface_close (GABBLE_BYTESTREAM_IFACE (self), NULL);
-          g_string_free (str, TRUE);
           return;
         }
 
-      if (priv->read_buffer == NULL)
-        {
-          priv->read_buffer = str;
-        }
-      else
-        {
-          g_string_append_len (priv->read_buffer, str->str, str->len);
-          g_string_free (str, TRUE);
-        }
-
       if (is_iq)
         {
           priv->received_stanzas_not_acked = g_slist_prepend (
@@ -689,8 +873,11 @@ gabble_bytestream_ibb_receive (GabbleBytestreamIBB *self,
       return;
     }
 
-  g_signal_emit_by_name (G_OBJECT (self), "data-received", sender, str);
-  g_string_free (str, TRUE);
+  /* The buffer is detached while it's being emitted, in case a handler
+   * blocks and unblocks reading */
+  priv->read_buffer = NULL;
+  g_signal_emit_by_name (G_OBJECT (self), "data-received", sender, buffer);
+  recv_buffer_put (buffer);
 
   if (is_iq)
     _gabble_connection_acknowledge_set_iq (priv->conn, msg);
@@ -914,15 +1101,15 @@ gabble_bytestream_ibb_block_reading (GabbleBytestreamIface *iface,
 
   if (priv->read_buffer != NULL && !block)
     {
+      GString *buffer = priv->read_buffer;
       GSList *l;
 
       DEBUG ("Bytestream unblocked, flushing the buffer");
 
-      g_signal_emit_by_name (G_OBJECT (self), "data-received",
-          priv->peer_handle, priv->read_buffer);
-
-      g_string_free (priv->read_buffer, TRUE);
       priv->read_buffer = NULL;
+      g_signal_emit_by_name (G_OBJECT (self), "data-received",
+          priv->peer_handle, buffer);
+      recv_buffer_put (buffer);
 
       /* ack pending stanzas */
       priv->received_stanzas_not_acked = g_slist_reverse (
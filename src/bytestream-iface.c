@@ -133,6 +133,9 @@ gabble_bytestream_iface_base_init (gpointer klass)
           G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
       g_object_interface_install_property (klass, param_spec);
 
+      /* The GString belongs to the bytestream, which may reuse it once the
+       * signal has been emitted, so handlers must copy anything they want to
+       * keep and must not modify it */
       g_signal_new ("data-received",
           G_TYPE_FROM_INTERFACE (klass),
           G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
@@ -180,6 +183,37 @@ gabble_bytestream_iface_block_reading (GabbleBytestreamIface *self,
   /* else: do nothing. Some bytestreams like IBB can't implement read_block. */
 }
 
+/*
+ * gabble_bytestream_iface_splice:
+ * @local: the transport to the local client
+ * @incoming: if %TRUE, data flows from the bytestream to @local; otherwise
+ *  from @local to the bytestream
+ *
+ * Asks the bytestream to move data between itself and @local without it
+ * going through userspace; see gibber_fd_transport_splice (). When this
+ * succeeds, neither the data-received signal nor @local's handler are used
+ * any more, and @func is called instead to report progress.
+ *
+ * Returns: %TRUE if the bytestream is splicing, %FALSE if it can't, in which
+ *  case nothing has changed
+ */
+gboolean
+gabble_bytestream_iface_splice (GabbleBytestreamIface *self,
+                                GibberTransport *local,
+                                gboolean incoming,
+                                GibberFdTransportSplicedFunc func,
+                                gpointer user_data)
+{
+  gboolean (*virtual_method)(GabbleBytestreamIface *, GibberTransport *,
+      gboolean, GibberFdTransportSplicedFunc, gpointer) =
+    GABBLE_BYTESTREAM_IFACE_GET_CLASS (self)->splice;
+
+  if (virtual_method == NULL)
+    return FALSE;
+
+  return virtual_method (self, local, incoming, func, user_data);
+}
+
 GType
 gabble_bytestream_iface_get_type (void)
 {
@@ -23,6 +23,8 @@
 #include <glib-object.h>
 #include <loudmouth/loudmouth.h>
 
+#include <gibber/gibber-fd-transport.h>
+
 G_BEGIN_DECLS
 
 typedef enum
@@ -58,6 +60,9 @@ struct _GabbleBytestreamIfaceClass {
   void (*accept) (GabbleBytestreamIface *bytestream,
       GabbleBytestreamAugmentSiAcceptReply func, gpointer user_data);
   void (*block_reading) (GabbleBytestreamIface *bytestream, gboolean block);
+  gboolean (*splice) (GabbleBytestreamIface *bytestream,
+      GibberTransport *local, gboolean incoming,
+      GibberFdTransportSplicedFunc func, gpointer user_data);
 };
 
 GType gabble_bytestream_iface_get_type (void);
@@ -88,6 +93,10 @@ void gabble_bytestream_iface_accept (GabbleBytestreamIface *bytestream,
 void gabble_bytestream_iface_block_reading (GabbleBytestreamIface *bytestream,
     gboolean block);
 
+gboolean gabble_bytestream_iface_splice (GabbleBytestreamIface *bytestream,
+    GibberTransport *local, gboolean incoming,
+    GibberFdTransportSplicedFunc func, gpointer user_data);
+
 G_END_DECLS
 
 #endif /* #ifndef __GABBLE_BYTESTREAM_IFACE_H__ */
@@ -657,6 +657,24 @@ gabble_bytestream_multiple_block_reading (GabbleBytestreamIface *iface,
   gabble_bytestream_iface_block_reading (priv->active_bytestream, block);
 }
 
+static gboolean
+gabble_bytestream_multiple_splice (GabbleBytestreamIface *iface,
+                                   GibberTransport *local,
+                                   gboolean incoming,
+                                   GibberFdTransportSplicedFunc func,
+                                   gpointer user_data)
+{
+  GabbleBytestreamMultiple *self = GABBLE_BYTESTREAM_MULTIPLE (iface);
+  GabbleBytestreamMultiplePrivate *priv =
+    GABBLE_BYTESTREAM_MULTIPLE_GET_PRIVATE (self);
+
+  if (priv->active_bytestream == NULL)
+    return FALSE;
+
+  return gabble_bytestream_iface_splice (priv->active_bytestream, local,
+      incoming, func, user_data);
+}
+
 static void
 bytestream_iface_init (gpointer g_iface,
                        gpointer iface_data)
@@ -668,4 +686,5 @@ bytestream_iface_init (gpointer g_iface,
   klass->close = gabble_bytestream_multiple_close;
   klass->accept = gabble_bytestream_multiple_accept;
   klass->block_reading = gabble_bytestream_multiple_block_reading;
+  klass->splice = gabble_bytestream_multiple_splice;
 }
@@ -24,29 +24,20 @@
 #include <gibber/gibber-sockets.h>
 
 #include <errno.h>
-
-/* on Darwin, net/if.h requires sys/sockets.h, which is included by
- * gibber-sockets.h; so this must come after that header */
-#ifdef HAVE_NET_IF_H
-# include <net/if.h>
-#endif
-
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
 #endif
 
-#ifdef HAVE_IFADDRS_H
- #include <ifaddrs.h>
-#endif
-
 #include <dbus/dbus-glib.h>
 #include <dbus/dbus-glib-lowlevel.h>
 #include <telepathy-glib/interfaces.h>
 
 #include <gibber/gibber-transport.h>
+#include <gibber/gibber-fd-transport.h>
 #include <gibber/gibber-tcp-transport.h>
 #include <gibber/gibber-listener.h>
 
@@ -59,6 +50,7 @@
 #include "debug.h"
 #include "disco.h"
 #include "gabble-signals-marshal.h"
+#include "local-addresses.h"
 #include "namespaces.h"
 #include "util.h"
 
@@ -121,11 +113,35 @@ typedef enum _Socks5State Socks5State;
 #define CONNECT_REPLY_TIMEOUT 30
 #define CONNECT_TIMEOUT 10
 
+/* As target, we start connecting to the next streamhost if the ones we're
+ * already trying haven't completed the SOCKS5 handshake after this long, in
+ * milliseconds, and use whichever gets there first */
+#define STREAMHOST_STAGGER 250
+
+/* We only estimate the bandwidth of streamhosts from bytestreams which carried
+ * at least this much data */
+#define BANDWIDTH_MIN_BYTES (256 * 1024)
+
+/* How much a bytestream's socket may read in one go, while data keeps
+ * arriving, before other sources on the main loop get a turn */
+#define READ_BUDGET (1024 * 1024)
+
+/* The most proxies we keep a pre-connected session with (see
+ * GabbleSocks5SessionPool), and how long (in seconds) we keep a session
+ * nobody took */
+#define MAX_WARM_SESSIONS 3
+#define WARM_SESSION_LIFETIME 60
+/* How long (in seconds) after the target of one of our offers picked a
+ * proxy, rather than connecting to us directly, we keep pre-connecting to
+ * the best proxy when making offers */
+#define WARM_AFTER_PROXY_USED (10 * 60)
+
 struct _Streamhost
 {
   gchar *jid;
   gchar *host;
   guint16 port;
+  guint cost;
 };
 typedef struct _Streamhost Streamhost;
 
@@ -175,6 +191,16 @@ struct _GabbleBytestreamSocks5Private
 
   /* List of Streamhost */
   GSList *streamhosts;
+  /* The next streamhost in streamhosts to start connecting to */
+  GSList *next_streamhost;
+  /* owned Socks5Attempt, one for each streamhost we're connecting to */
+  GSList *attempts;
+  guint stagger_id;
+  /* As target, the streamhost whose connection won; as initiator, the proxy
+   * the target connected to, if any. Borrowed from streamhosts. */
+  Streamhost *used_streamhost;
+  /* As initiator, when we started to connect to used_streamhost */
+  GTimeVal proxy_connect_started;
 
   /* Connections to streamhosts are async, so we keep the IQ set message
    * around */
@@ -189,6 +215,13 @@ struct _GabbleBytestreamSocks5Private
 
   GString *read_buffer;
 
+  /* When the bytestream was opened and how many bytes it has carried since */
+  GTimeVal opened;
+  guint64 bytes_transferred;
+
+  GibberFdTransportSplicedFunc spliced_func;
+  gpointer spliced_user_data;
+
   gboolean dispose_has_run;
 };
 
@@ -204,6 +237,10 @@ static void socks5_error (GabbleBytestreamSocks5 *self);
 static void transport_handler (GibberTransport *transport,
     GibberBuffer *data, gpointer user_data);
 
+static gboolean send_auth_request (GibberTransport *transport);
+
+static void cancel_attempts (GabbleBytestreamSocks5 *self);
+
 static void
 gabble_bytestream_socks5_init (GabbleBytestreamSocks5 *self)
 {
@@ -226,6 +263,53 @@ stop_timer (GabbleBytestreamSocks5 *self)
   priv->timer_id = 0;
 }
 
+static void
+record_streamhost (GabbleBytestreamSocks5 *self,
+                   Streamhost *streamhost,
+                   GabbleStreamhostResult result,
+                   const GTimeVal *started)
+{
+  GabbleBytestreamSocks5Private *priv = GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (
+      self);
+
+  if (priv->conn->bytestream_factory == NULL)
+    /* the connection is being torn down */
+    return;
+
+  gabble_bytestream_factory_record_streamhost (priv->conn->bytestream_factory,
+      streamhost->jid, streamhost->host, streamhost->port, result,
+      gabble_time_val_elapsed_ms (started));
+}
+
+static void
+record_bandwidth (GabbleBytestreamSocks5 *self)
+{
+  GabbleBytestreamSocks5Private *priv = GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (
+      self);
+  guint ms;
+  guint64 bandwidth;
+
+  if (priv->used_streamhost == NULL ||
+      priv->bytes_transferred < BANDWIDTH_MIN_BYTES ||
+      priv->conn->bytestream_factory == NULL)
+    return;
+
+  ms = gabble_time_val_elapsed_ms (&priv->opened);
+
+  if (ms == 0)
+    return;
+
+  bandwidth = priv->bytes_transferred * 1000 / ms;
+
+  DEBUG ("%" G_GUINT64_FORMAT " bytes through %s in %u ms",
+      priv->bytes_transferred, priv->used_streamhost->jid, ms);
+
+  gabble_bytestream_factory_record_streamhost_bandwidth (
+      priv->conn->bytestream_factory, priv->used_streamhost->jid,
+      priv->used_streamhost->host, priv->used_streamhost->port,
+      (guint) MIN (bandwidth, G_MAXUINT));
+}
+
 static void
 gabble_bytestream_socks5_dispose (GObject *object)
 {
@@ -241,6 +325,7 @@ gabble_bytestream_socks5_dispose (GObject *object)
   priv->dispose_has_run = TRUE;
 
   stop_timer (self);
+  cancel_attempts (self);
 
   tp_handle_unref (contact_repo, priv->peer_handle);
 
@@ -356,6 +441,11 @@ gabble_bytestream_socks5_set_property (GObject *object,
       case PROP_STATE:
         if (priv->bytestream_state != g_value_get_uint (value))
             {
+              if (g_value_get_uint (value) == GABBLE_BYTESTREAM_STATE_OPEN)
+                g_get_current_time (&priv->opened);
+              else if (priv->bytestream_state == GABBLE_BYTESTREAM_STATE_OPEN)
+                record_bandwidth (self);
+
               priv->bytestream_state = g_value_get_uint (value);
               g_signal_emit_by_name (object, "state-changed",
                   priv->bytestream_state);
@@ -503,25 +593,14 @@ transport_connected_cb (GibberTransport *transport,
 
   stop_timer (self);
 
-  if (priv->socks5_state == SOCKS5_STATE_TARGET_TRYING_CONNECT ||
-      priv->socks5_state == SOCKS5_STATE_INITIATOR_TRYING_CONNECT)
+  /* As target, we connect to streamhosts using a Socks5Attempt each, and
+   * only take the transport over once the SOCKS5 handshake is done */
+  if (priv->socks5_state == SOCKS5_STATE_INITIATOR_TRYING_CONNECT)
     {
-      gchar msg[3];
-
       DEBUG ("transport is connected. Sending auth request");
 
-      msg[0] = SOCKS5_VERSION;
-      /* Number of auth methods we are offering, we support just
-       * SOCKS5_AUTH_NONE */
-      msg[1] = 1;
-      msg[2] = SOCKS5_AUTH_NONE;
-
-      write_to_transport (self, msg, 3, NULL);
-
-      if (priv->socks5_state == SOCKS5_STATE_TARGET_TRYING_CONNECT)
-        priv->socks5_state = SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT;
-      else
-        priv->socks5_state = SOCKS5_STATE_INITIATOR_AUTH_REQUEST_SENT;
+      send_auth_request (transport);
+      priv->socks5_state = SOCKS5_STATE_INITIATOR_AUTH_REQUEST_SENT;
     }
 }
 
@@ -554,6 +633,8 @@ socks5_close_transport (GabbleBytestreamSocks5 *self)
   GabbleBytestreamSocks5Private *priv =
     GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
 
+  cancel_attempts (self);
+
   if (priv->read_buffer != NULL)
     {
       g_string_free (priv->read_buffer, TRUE);
@@ -588,10 +669,18 @@ transport_buffer_empty_cb (GibberTransport *transport,
       DEBUG ("buffer is now empty. Bytestream can be closed");
       bytestream_closed (self);
     }
-  else if (priv->write_blocked)
-    {
-      change_write_blocked_state (self, FALSE);
-    }
+}
+
+static void
+transport_buffer_drained_cb (GibberTransport *transport,
+                             GabbleBytestreamSocks5 *self)
+{
+  GabbleBytestreamSocks5Private *priv = GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE
+      (self);
+
+  if (priv->bytestream_state != GABBLE_BYTESTREAM_STATE_CLOSING &&
+      priv->write_blocked)
+    change_write_blocked_state (self, FALSE);
 }
 
 static void
@@ -608,12 +697,17 @@ set_transport (GabbleBytestreamSocks5 *self,
 
   gibber_transport_set_handler (transport, transport_handler, self);
 
+  if (GIBBER_IS_FD_TRANSPORT (transport))
+    g_object_set (transport, "read-budget", READ_BUDGET, NULL);
+
   g_signal_connect (transport, "connected",
       G_CALLBACK (transport_connected_cb), self);
   g_signal_connect (transport, "disconnected",
       G_CALLBACK (transport_disconnected_cb), self);
   g_signal_connect (priv->transport, "buffer-empty",
       G_CALLBACK (transport_buffer_empty_cb), self);
+  g_signal_connect (priv->transport, "buffer-drained",
+      G_CALLBACK (transport_buffer_drained_cb), self);
 }
 
 static void
@@ -633,27 +727,9 @@ socks5_error (GabbleBytestreamSocks5 *self)
       case SOCKS5_STATE_TARGET_TRYING_CONNECT:
       case SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT:
       case SOCKS5_STATE_TARGET_CONNECT_REQUESTED:
-        /* The attempt for connect to the streamhost failed */
+        /* The attempts to connect to every streamhost failed */
         socks5_close_transport (self);
 
-        if (priv->streamhosts != NULL)
-          {
-            /* Remove the failed streamhost */
-            streamhost_free (priv->streamhosts->data);
-            priv->streamhosts = g_slist_delete_link (priv->streamhosts,
-                priv->streamhosts);
-          }
-
-        if (priv->streamhosts != NULL)
-          {
-            DEBUG ("connection to streamhost failed, trying the next one");
-
-            socks5_connect (self);
-            return;
-          }
-
-        DEBUG ("no more streamhosts to try");
-
         g_signal_emit_by_name (self, "connection-error");
 
         g_assert (priv->msg_for_acknowledge_connection != NULL);
@@ -671,6 +747,16 @@ socks5_error (GabbleBytestreamSocks5 *self)
             "the bytestream yet as the target can still try other streamhosts");
         break;
 
+      case SOCKS5_STATE_INITIATOR_TRYING_CONNECT:
+      case SOCKS5_STATE_INITIATOR_AUTH_REQUEST_SENT:
+      case SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED:
+        DEBUG ("couldn't use the proxy chosen by the target, closing the "
+            "connection");
+        record_streamhost (self, priv->used_streamhost,
+            GABBLE_STREAMHOST_FAILED, &priv->proxy_connect_started);
+        gabble_bytestream_socks5_close (GABBLE_BYTESTREAM_IFACE (self), NULL);
+        break;
+
       default:
         DEBUG ("error, closing the connection\n");
         gabble_bytestream_socks5_close (GABBLE_BYTESTREAM_IFACE (self), NULL);
@@ -706,6 +792,379 @@ check_domain (const gchar *domain,
   return TRUE;
 }
 
+/* Sends the SOCKS5 greeting, offering just SOCKS5_AUTH_NONE */
+static gboolean
+send_auth_request (GibberTransport *transport)
+{
+  guint8 msg[3];
+
+  msg[0] = SOCKS5_VERSION;
+  /* Number of auth methods we are offering */
+  msg[1] = 1;
+  msg[2] = SOCKS5_AUTH_NONE;
+
+  return gibber_transport_send (transport, msg, 3, NULL);
+}
+
+/* Returns the length of the auth reply at the start of @string, 0 if we
+ * haven't received all of it yet, or -1 if we weren't authorized */
+static gssize
+check_auth_reply (const GString *string)
+{
+  /* the response is 2 bytes-long */
+  if (string->len < 2)
+    return 0;
+
+  if (string->str[0] != SOCKS5_VERSION ||
+      string->str[1] != SOCKS5_STATUS_OK)
+    {
+      DEBUG ("Authentication failed");
+      return -1;
+    }
+
+  return 2;
+}
+
+static gboolean
+send_connect_request (GibberTransport *transport,
+                      const gchar *domain)
+{
+  guint8 msg[SOCKS5_CONNECT_LENGTH];
+
+  msg[0] = SOCKS5_VERSION;
+  msg[1] = SOCKS5_CMD_CONNECT;
+  msg[2] = SOCKS5_RESERVED;
+  msg[3] = SOCKS5_ATYP_DOMAIN;
+  /* Length of a hex SHA1 */
+  msg[4] = SHA1_LENGTH;
+  /* Domain name: SHA-1(sid + initiator + target) */
+  memcpy (&msg[5], domain, SHA1_LENGTH);
+  /* Port: 0 */
+  msg[45] = 0x00;
+  msg[46] = 0x00;
+
+  return gibber_transport_send (transport, msg, SOCKS5_CONNECT_LENGTH, NULL);
+}
+
+/* Returns the length of the reply to our CONNECT request at the start of
+ * @string, 0 if we haven't received all of it yet, or -1 if the connection
+ * was refused */
+static gssize
+check_connect_reply (const GString *string,
+                     const gchar *domain)
+{
+  /* the length of the BND.ADDR field */
+  guint addr_len;
+
+  if (string->len < SOCKS5_MIN_LENGTH)
+    return 0;
+
+  if (string->str[0] != SOCKS5_VERSION ||
+      string->str[1] != SOCKS5_STATUS_OK ||
+      string->str[2] != SOCKS5_RESERVED)
+    {
+      DEBUG ("Connection refused");
+      return -1;
+    }
+
+  if (string->str[3] == SOCKS5_ATYP_DOMAIN)
+    {
+      /* correct domain. The first byte of the domain contains its
+       * length */
+      addr_len = (guint8) string->str[4];
+      addr_len += 1;
+    }
+  else if (string->str[3] == 0x00)
+    {
+      DEBUG ("Got 0x00 as domain. Pretend it's ok to be able to interop "
+          "with ejabberd < 2.0.2");
+      addr_len = 0;
+    }
+  else
+    {
+      DEBUG ("Wrong domain");
+      return -1;
+    }
+
+  if (string->len < SOCKS5_MIN_LENGTH + addr_len)
+    /* We didn't receive the full packet yet */
+    return 0;
+
+  if (
+      /* first half of the port number */
+      string->str[4 + addr_len] != 0 ||
+      /* second half of the port number */
+      string->str[5 + addr_len] != 0)
+    {
+      DEBUG ("Connection refused");
+      return -1;
+    }
+
+  if (addr_len > 0)
+    {
+      if (!check_domain (&string->str[5], addr_len - 1, domain))
+        {
+          /* Thanks Pidgin... */
+          DEBUG ("Ignoring to interop with buggy implementations");
+        }
+    }
+
+  return SOCKS5_MIN_LENGTH + addr_len;
+}
+
+/* When we offer proxies as initiator, the target may pick one of them, after
+ * which we have to connect to it too before the bytestream can open. That
+ * used to start from scratch, once the target had told us which proxy it
+ * used: a TCP connection and the SOCKS5 greeting, before the CONNECT command
+ * which actually depends on the bytestream. So, if targets have recently
+ * had to use a proxy because they couldn't connect to us directly, we start
+ * the TCP connection and greeting with the best proxy while the target is
+ * still connecting, and keep the resulting session in a pool owned by the
+ * bytestream factory for a while, for this bytestream or the next ones to
+ * take. */
+
+struct _GabbleSocks5SessionPool
+{
+  /* "jid host:port" -> owned WarmSession */
+  GHashTable *sessions;
+  /* until when offers should warm up a session, because a target recently
+   * picked one of our proxies; 0 if none has, or the last session we
+   * warmed up went unused */
+  time_t warm_until;
+};
+
+typedef struct {
+    GabbleSocks5SessionPool *pool;
+    gchar *key;
+    GibberTransport *transport;
+    GString *read_buffer;
+    /* TRUE once the proxy has accepted our greeting */
+    gboolean ready;
+    guint timer_id;
+} WarmSession;
+
+static gchar *
+warm_session_key (const gchar *jid,
+                  const gchar *host,
+                  guint16 port)
+{
+  return g_strdup_printf ("%s %s:%u", jid, host, port);
+}
+
+static void
+warm_session_free (gpointer data)
+{
+  WarmSession *session = data;
+
+  if (session->timer_id != 0)
+    g_source_remove (session->timer_id);
+
+  g_signal_handlers_disconnect_matched (session->transport,
+      G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, session);
+  gibber_transport_set_handler (session->transport, NULL, NULL);
+  /* disposing the transport disconnects it, unless it has been taken */
+  g_object_unref (session->transport);
+
+  g_string_free (session->read_buffer, TRUE);
+  g_free (session->key);
+  g_slice_free (WarmSession, session);
+}
+
+static void
+warm_session_drop (WarmSession *session)
+{
+  DEBUG ("dropping session with %s", session->key);
+
+  /* frees session */
+  g_hash_table_remove (session->pool->sessions, session->key);
+}
+
+static gboolean
+warm_session_timeout_cb (gpointer user_data)
+{
+  WarmSession *session = user_data;
+
+  session->timer_id = 0;
+
+  /* Targets are connecting to us directly again, or not at all; either
+   * way, wait until one picks a proxy before warming up another session */
+  if (session->ready)
+    session->pool->warm_until = 0;
+
+  warm_session_drop (session);
+  return FALSE;
+}
+
+static void
+warm_session_handler (GibberTransport *transport,
+                      GibberBuffer *data,
+                      gpointer user_data)
+{
+  WarmSession *session = user_data;
+  gssize used;
+
+  g_string_append_len (session->read_buffer, (const gchar *) data->data,
+      data->length);
+
+  if (session->ready)
+    {
+      DEBUG ("%s sent data before being asked to connect", session->key);
+      warm_session_drop (session);
+      return;
+    }
+
+  used = check_auth_reply (session->read_buffer);
+
+  if (used == 0)
+    return;
+
+  if (used < 0 || (gsize) used != session->read_buffer->len)
+    {
+      warm_session_drop (session);
+      return;
+    }
+
+  DEBUG ("session with %s is ready", session->key);
+  g_string_truncate (session->read_buffer, 0);
+  session->ready = TRUE;
+
+  g_source_remove (session->timer_id);
+  session->timer_id = g_timeout_add_seconds (WARM_SESSION_LIFETIME,
+      warm_session_timeout_cb, session);
+}
+
+static void
+warm_session_connected_cb (GibberTransport *transport,
+                           WarmSession *session)
+{
+  send_auth_request (transport);
+}
+
+static void
+warm_session_disconnected_cb (GibberTransport *transport,
+                              WarmSession *session)
+{
+  warm_session_drop (session);
+}
+
+GabbleSocks5SessionPool *
+gabble_socks5_session_pool_new (void)
+{
+  GabbleSocks5SessionPool *pool = g_slice_new0 (GabbleSocks5SessionPool);
+
+  pool->sessions = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      warm_session_free);
+  return pool;
+}
+
+void
+gabble_socks5_session_pool_free (GabbleSocks5SessionPool *pool)
+{
+  if (pool == NULL)
+    return;
+
+  g_hash_table_destroy (pool->sessions);
+  g_slice_free (GabbleSocks5SessionPool, pool);
+}
+
+/* Remembers whether the target of one of our offers picked a proxy */
+static void
+warm_session_note_proxy_used (GabbleSocks5SessionPool *pool,
+                              gboolean used)
+{
+  if (pool == NULL)
+    return;
+
+  pool->warm_until = used ? time (NULL) + WARM_AFTER_PROXY_USED : 0;
+}
+
+/* Starts connecting to a proxy and greeting it, if a target recently picked
+ * a proxy, unless we already have a session with it or enough sessions
+ * already */
+static void
+warm_session_start (GabbleSocks5SessionPool *pool,
+                    const gchar *jid,
+                    const gchar *host,
+                    guint16 port)
+{
+  WarmSession *session;
+  GibberTransport *transport;
+  gchar *key;
+
+  if (pool == NULL)
+    /* the factory has been disposed */
+    return;
+
+  if (time (NULL) >= pool->warm_until)
+    return;
+
+  if (g_hash_table_size (pool->sessions) >= MAX_WARM_SESSIONS)
+    return;
+
+  key = warm_session_key (jid, host, port);
+
+  if (g_hash_table_lookup (pool->sessions, key) != NULL)
+    {
+      g_free (key);
+      return;
+    }
+
+  DEBUG ("pre-connecting to %s", key);
+
+  session = g_slice_new0 (WarmSession);
+  session->pool = pool;
+  session->key = key;
+  session->transport = GIBBER_TRANSPORT (gibber_tcp_transport_new ());
+  session->read_buffer = g_string_new ("");
+
+  g_hash_table_insert (pool->sessions, key, session);
+
+  gibber_transport_set_handler (session->transport, warm_session_handler,
+      session);
+  g_signal_connect (session->transport, "connected",
+      G_CALLBACK (warm_session_connected_cb), session);
+  g_signal_connect (session->transport, "disconnected",
+      G_CALLBACK (warm_session_disconnected_cb), session);
+
+  session->timer_id = g_timeout_add_seconds (CONNECT_TIMEOUT,
+      warm_session_timeout_cb, session);
+
+  /* This can fail straight away, in which case session has been freed by
+   * the time it returns; keep the transport alive until then */
+  transport = g_object_ref (session->transport);
+  gibber_tcp_transport_connect (GIBBER_TCP_TRANSPORT (transport), host, port);
+  g_object_unref (transport);
+}
+
+/* Returns a connected transport to the proxy which it has accepted our
+ * greeting on, ready for a CONNECT command, or NULL */
+static GibberTransport *
+warm_session_take (GabbleSocks5SessionPool *pool,
+                   const gchar *jid,
+                   const gchar *host,
+                   guint16 port)
+{
+  WarmSession *session;
+  GibberTransport *transport;
+  gchar *key;
+
+  if (pool == NULL)
+    return NULL;
+
+  key = warm_session_key (jid, host, port);
+  session = g_hash_table_lookup (pool->sessions, key);
+  g_free (key);
+
+  if (session == NULL || !session->ready)
+    return NULL;
+
+  DEBUG ("taking the session with %s", session->key);
+
+  transport = g_object_ref (session->transport);
+  warm_session_drop (session);
+  return transport;
+}
+
 static gboolean
 socks5_timer_cb (gpointer data)
 {
@@ -758,7 +1217,7 @@ target_got_connect_reply (GabbleBytestreamSocks5 *self)
        * but if we are using an external proxy we need to know which
        * one was selected */
       node = lm_message_node_add_child (node, "streamhost-used", "");
-      current_streamhost = priv->streamhosts->data;
+      current_streamhost = priv->used_streamhost;
       lm_message_node_set_attribute (node, "jid",
           current_streamhost->jid);
 
@@ -800,6 +1259,9 @@ socks5_activation_reply_cb (GabbleConnection *conn,
 
   DEBUG ("Proxy activated the bytestream. It's now open");
 
+  record_streamhost (self, priv->used_streamhost, GABBLE_STREAMHOST_SUCCEEDED,
+      &priv->proxy_connect_started);
+
   priv->socks5_state = SOCKS5_STATE_CONNECTED;
   g_object_set (self, "state", GABBLE_BYTESTREAM_STATE_OPEN, NULL);
   /* We can read data from the sock5 socket now */
@@ -807,6 +1269,10 @@ socks5_activation_reply_cb (GabbleConnection *conn,
 
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 activation_failed:
+  if (priv->used_streamhost != NULL)
+    record_streamhost (self, priv->used_streamhost, GABBLE_STREAMHOST_FAILED,
+        &priv->proxy_connect_started);
+
   g_signal_emit_by_name (self, "connection-error");
   g_object_set (self, "state", GABBLE_BYTESTREAM_STATE_CLOSED, NULL);
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
@@ -847,6 +1313,28 @@ initiator_got_connect_reply (GabbleBytestreamSocks5 *self)
   lm_message_unref (iq);
 }
 
+static void
+initiator_send_connect_request (GabbleBytestreamSocks5 *self)
+{
+  GabbleBytestreamSocks5Private *priv = GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (
+      self);
+  gchar *domain;
+
+  domain = compute_domain (priv->stream_id, priv->self_full_jid,
+      priv->peer_jid);
+  send_connect_request (priv->transport, domain);
+  g_free (domain);
+
+  priv->socks5_state = SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED;
+
+  /* Older version of Gabble (pre 0.7.22) are bugged and just send 2
+   * bytes as CONNECT reply. We set a timer to not wait the full reply
+   * forever if we are connected to such Gabble.
+   * Once timed out, the SOCKS5 negotiation will fail and Gabble
+   * will switch to IBB as a fallback. */
+  start_timer (self, CONNECT_REPLY_TIMEOUT);
+}
+
 /* Process the received data and returns the number of bytes that have been
  * used */
 static gssize
@@ -862,157 +1350,50 @@ socks5_handle_received_data (GabbleBytestreamSocks5 *self,
   /* the length of the BND.ADDR field */
   guint8 addr_len;
   gsize len;
+  gssize used;
 
   switch (priv->socks5_state)
     {
-      case SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT:
       case SOCKS5_STATE_INITIATOR_AUTH_REQUEST_SENT:
         /* We sent an authorization request and we are awaiting for a
-         * response, the response is 2 bytes-long */
-        if (string->len < 2)
-          return 0;
-
-        if (string->str[0] != SOCKS5_VERSION ||
-            string->str[1] != SOCKS5_STATUS_OK)
+         * response */
+        used = check_auth_reply (string);
+        if (used <= 0)
           {
-            DEBUG ("Authentication failed");
+            if (used < 0)
+              socks5_error (self);
 
-            socks5_error (self);
-            return -1;
+            return used;
           }
 
         /* We have been authorized, let's send a CONNECT command */
 
         DEBUG ("Received auth reply. Sending CONNECT command");
+        initiator_send_connect_request (self);
 
-        if (priv->socks5_state == SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT)
-          {
-            domain = compute_domain (priv->stream_id, priv->peer_jid,
-                priv->self_full_jid);
-          }
-        else
-          {
-            /* SOCKS5_STATE_INITIATOR_AUTH_REQUEST_SENT */
-            domain = compute_domain (priv->stream_id, priv->self_full_jid,
-                priv->peer_jid);
-          }
-
-        msg[0] = SOCKS5_VERSION;
-        msg[1] = SOCKS5_CMD_CONNECT;
-        msg[2] = SOCKS5_RESERVED;
-        msg[3] = SOCKS5_ATYP_DOMAIN;
-        /* Length of a hex SHA1 */
-        msg[4] = 40;
-        /* Domain name: SHA-1(sid + initiator + target) */
-        memcpy (&msg[5], domain, 40);
-        /* Port: 0 */
-        msg[45] = 0x00;
-        msg[46] = 0x00;
+        return used;
 
+      case SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED:
+        /* We sent a CONNECT request and are awaiting for the response */
+        domain = compute_domain (priv->stream_id, priv->self_full_jid,
+            priv->peer_jid);
+        used = check_connect_reply (string, domain);
         g_free (domain);
 
-        write_to_transport (self, msg, SOCKS5_CONNECT_LENGTH, NULL);
-
-        if (priv->socks5_state == SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT)
-          priv->socks5_state = SOCKS5_STATE_TARGET_CONNECT_REQUESTED;
-        else
-          /* SOCKS5_STATE_INITIATOR_AUTH_REQUEST_SENT */
-          priv->socks5_state = SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED;
-
-        /* Older version of Gabble (pre 0.7.22) are bugged and just send 2
-         * bytes as CONNECT reply. We set a timer to not wait the full reply
-         * forever if we are connected to such Gabble.
-         * Once timed out, the SOCKS5 negotiation will fail and Gabble
-         * will switch to IBB as a fallback. */
-        start_timer (self, CONNECT_REPLY_TIMEOUT);
+        if (used == 0)
+          return 0;
 
-        return 2;
+        stop_timer (self);
 
-      case SOCKS5_STATE_TARGET_CONNECT_REQUESTED:
-      case SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED:
-        /* We sent a CONNECT request and are awaiting for the response */
-        if (string->len < SOCKS5_MIN_LENGTH)
-          return 0;
-
-        if (string->str[0] != SOCKS5_VERSION ||
-            string->str[1] != SOCKS5_STATUS_OK ||
-            string->str[2] != SOCKS5_RESERVED)
+        if (used < 0)
           {
-            DEBUG ("Connection refused");
-
             socks5_error (self);
             return -1;
           }
 
-        if (string->str[3] == SOCKS5_ATYP_DOMAIN)
-          {
-            /* correct domain. The first byte of the domain contains its
-             * length */
-            addr_len = (guint8) string->str[4];
-            addr_len += 1;
-          }
-        else if (string->str[3] == 0x00)
-          {
-            DEBUG ("Got 0x00 as domain. Pretend it's ok to be able to interop "
-                "with ejabberd < 2.0.2");
-            addr_len = 0;
-          }
-        else
-          {
-            DEBUG ("Wrong domain");
-
-            socks5_error (self);
-            return -1;
-          }
-
-        if ((guint8) string->len < SOCKS5_MIN_LENGTH + addr_len)
-          /* We didn't receive the full packet yet */
-          return 0;
-
-        stop_timer (self);
-
-        if (
-            /* first half of the port number */
-            string->str[4 + addr_len] != 0 ||
-            /* second half of the port number */
-            string->str[5 + addr_len] != 0)
-          {
-            DEBUG ("Connection refused");
-
-            socks5_error (self);
-            return -1;
-          }
-
-        if (priv->socks5_state == SOCKS5_STATE_TARGET_CONNECT_REQUESTED)
-          {
-            domain = compute_domain (priv->stream_id, priv->peer_jid,
-                priv->self_full_jid);
-          }
-        else
-          {
-            /* SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED */
-            domain = compute_domain (priv->stream_id, priv->self_full_jid,
-                priv->peer_jid);
-          }
-
-        if (addr_len > 0)
-          {
-            if (!check_domain (&string->str[5], addr_len - 1, domain))
-              {
-                /* Thanks Pidgin... */
-                DEBUG ("Ignoring to interop with buggy implementations");
-              }
-          }
-
-        g_free (domain);
-
-        if (priv->socks5_state == SOCKS5_STATE_TARGET_CONNECT_REQUESTED)
-          target_got_connect_reply (self);
-        else
-          /* SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED */
-          initiator_got_connect_reply (self);
+        initiator_got_connect_reply (self);
 
-        return SOCKS5_MIN_LENGTH + addr_len;
+        return used;
 
       case SOCKS5_STATE_INITIATOR_AWAITING_AUTH_REQUEST:
         /* A client connected to us and we are awaiting for the authorization
@@ -1139,6 +1520,7 @@ socks5_handle_received_data (GabbleBytestreamSocks5 *self,
          * data-received callback, the bytestream could be freed and so the
          * priv->read_buffer */
         len = string->len;
+        priv->bytes_transferred += len;
         g_signal_emit_by_name (G_OBJECT (self), "data-received",
             priv->peer_handle, string);
 
@@ -1150,12 +1532,17 @@ socks5_handle_received_data (GabbleBytestreamSocks5 *self,
         DEBUG ("An error occurred, throwing away received data");
         return string->len;
 
-      case SOCKS5_STATE_TARGET_TRYING_CONNECT:
       case SOCKS5_STATE_INITIATOR_TRYING_CONNECT:
         DEBUG ("Impossible to receive data when not yet connected to the "
             "socket");
         break;
 
+      case SOCKS5_STATE_TARGET_TRYING_CONNECT:
+      case SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT:
+      case SOCKS5_STATE_TARGET_CONNECT_REQUESTED:
+        DEBUG ("Shouldn't receive data before a streamhost won the race");
+        break;
+
       case SOCKS5_STATE_INITIATOR_OFFER_SENT:
         DEBUG ("Shouldn't receive data when we just sent the offer");
         break;
@@ -1173,6 +1560,32 @@ socks5_handle_received_data (GabbleBytestreamSocks5 *self,
   return string->len;
 }
 
+/* The caller must hold a reference to @self, as it can be closed and
+ * disposed if something goes wrong */
+static void
+process_read_buffer (GabbleBytestreamSocks5 *self)
+{
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+  gssize used_bytes;
+
+  do
+    {
+      /* socks5_handle_received_data() processes the data and returns the
+       * number of bytes that have been used. 0 means that there is not enough
+       * data to do anything, so we just wait for more data from the socket */
+      used_bytes = socks5_handle_received_data (self, priv->read_buffer);
+
+      if (priv->read_buffer == NULL)
+        /* If something did wrong in socks5_handle_received_data, the
+         * bytestream can be closed and so destroyed. */
+        break;
+
+      g_string_erase (priv->read_buffer, 0, used_bytes);
+    }
+  while (used_bytes > 0 && priv->read_buffer->len > 0);
+}
+
 static void
 transport_handler (GibberTransport *transport,
                    GibberBuffer *data,
@@ -1182,7 +1595,6 @@ transport_handler (GibberTransport *transport,
   GabbleBytestreamSocks5 *self = GABBLE_BYTESTREAM_SOCKS5 (user_data);
   GabbleBytestreamSocks5Private *priv =
       GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
-  gssize used_bytes;
 
   g_assert (priv->read_buffer != NULL);
   g_string_append_len (priv->read_buffer, (const gchar *) data->data,
@@ -1192,62 +1604,356 @@ transport_handler (GibberTransport *transport,
    * could be closed and disposed. Ref it to artificially keep this bytestream
    * object alive while we are in this function. */
   g_object_ref (self);
+  process_read_buffer (self);
+  g_object_unref (self);
+}
 
-  do
+/* As target, we race connections to the streamhosts we've been offered:
+ * we start with the one which worked best before and, every
+ * STREAMHOST_STAGGER ms until one of them completes the SOCKS5 handshake,
+ * start connecting to the next one as well. The first to complete the
+ * handshake is used and the others are cancelled. */
+typedef struct {
+    GabbleBytestreamSocks5 *self;
+    /* borrowed from priv->streamhosts */
+    Streamhost *streamhost;
+    GibberTransport *transport;
+    GString *read_buffer;
+    /* one of the SOCKS5_STATE_TARGET_* states */
+    Socks5State state;
+    guint timer_id;
+    GTimeVal started;
+} Socks5Attempt;
+
+static void
+attempt_free (Socks5Attempt *attempt)
+{
+  if (attempt->timer_id != 0)
+    g_source_remove (attempt->timer_id);
+
+  if (attempt->transport != NULL)
     {
-      /* socks5_handle_received_data() processes the data and returns the
-       * number of bytes that have been used. 0 means that there is not enough
-       * data to do anything, so we just wait for more data from the socket */
-      used_bytes = socks5_handle_received_data (self, priv->read_buffer);
+      g_signal_handlers_disconnect_matched (attempt->transport,
+          G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, attempt);
+      gibber_transport_set_handler (attempt->transport, NULL, NULL);
+      /* disposing the transport disconnects it */
+      g_object_unref (attempt->transport);
+    }
 
-      if (priv->read_buffer == NULL)
-        /* If something did wrong in socks5_handle_received_data, the
-         * bytestream can be closed and so destroyed. */
-        break;
+  g_string_free (attempt->read_buffer, TRUE);
+  g_slice_free (Socks5Attempt, attempt);
+}
 
-      g_string_erase (priv->read_buffer, 0, used_bytes);
+static void
+record_attempt (Socks5Attempt *attempt,
+                GabbleStreamhostResult result)
+{
+  record_streamhost (attempt->self, attempt->streamhost, result,
+      &attempt->started);
+}
+
+static void
+cancel_attempts (GabbleBytestreamSocks5 *self)
+{
+  GabbleBytestreamSocks5Private *priv = GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (
+      self);
+
+  if (priv->stagger_id != 0)
+    {
+      g_source_remove (priv->stagger_id);
+      priv->stagger_id = 0;
     }
-  while (used_bytes > 0 && priv->read_buffer->len > 0);
+
+  priv->next_streamhost = NULL;
+
+  g_slist_foreach (priv->attempts, (GFunc) attempt_free, NULL);
+  g_slist_free (priv->attempts);
+  priv->attempts = NULL;
+}
+
+static void start_next_attempt (GabbleBytestreamSocks5 *self);
+
+static void
+attempt_failed (Socks5Attempt *attempt)
+{
+  GabbleBytestreamSocks5 *self = attempt->self;
+  GabbleBytestreamSocks5Private *priv = GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (
+      self);
+
+  DEBUG ("connection to streamhost %s (%s:%d) failed", attempt->streamhost->jid,
+      attempt->streamhost->host, attempt->streamhost->port);
+
+  record_attempt (attempt, GABBLE_STREAMHOST_FAILED);
+
+  priv->attempts = g_slist_remove (priv->attempts, attempt);
+  attempt_free (attempt);
+
+  if (priv->next_streamhost != NULL)
+    {
+      /* no point waiting for the stagger delay */
+      start_next_attempt (self);
+      return;
+    }
+
+  if (priv->attempts != NULL)
+    /* we're still waiting for other streamhosts */
+    return;
+
+  DEBUG ("no more streamhosts to try");
+  socks5_error (self);
+}
+
+static void
+attempt_succeeded (Socks5Attempt *attempt)
+{
+  GabbleBytestreamSocks5 *self = attempt->self;
+  GabbleBytestreamSocks5Private *priv = GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (
+      self);
+  GibberTransport *transport = attempt->transport;
+  GSList *l;
+
+  DEBUG ("streamhost %s (%s:%d) won the race", attempt->streamhost->jid,
+      attempt->streamhost->host, attempt->streamhost->port);
+
+  record_attempt (attempt, GABBLE_STREAMHOST_SUCCEEDED);
+  priv->attempts = g_slist_remove (priv->attempts, attempt);
+
+  for (l = priv->attempts; l != NULL; l = g_slist_next (l))
+    record_attempt (l->data, GABBLE_STREAMHOST_CANCELLED);
+
+  cancel_attempts (self);
+
+  /* Take the transport over from the attempt */
+  g_signal_handlers_disconnect_matched (transport, G_SIGNAL_MATCH_DATA,
+      0, 0, NULL, NULL, attempt);
+  gibber_transport_set_handler (transport, NULL, NULL);
+  attempt->transport = NULL;
+
+  g_assert (priv->transport == NULL);
+  set_transport (self, transport);
+  g_object_unref (transport);
+
+  /* the initiator may have already started sending data */
+  g_string_append_len (priv->read_buffer, attempt->read_buffer->str,
+      attempt->read_buffer->len);
+
+  priv->used_streamhost = attempt->streamhost;
+  attempt_free (attempt);
+
+  g_object_ref (self);
+
+  target_got_connect_reply (self);
+
+  if (priv->read_buffer != NULL && priv->read_buffer->len > 0)
+    process_read_buffer (self);
 
   g_object_unref (self);
 }
 
+static void
+attempt_handler (GibberTransport *transport,
+                 GibberBuffer *data,
+                 gpointer user_data)
+{
+  Socks5Attempt *attempt = user_data;
+  GabbleBytestreamSocks5Private *priv = GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (
+      attempt->self);
+  gchar *domain;
+  gssize used;
+
+  g_string_append_len (attempt->read_buffer, (const gchar *) data->data,
+      data->length);
+
+  if (attempt->state == SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT)
+    {
+      used = check_auth_reply (attempt->read_buffer);
+
+      if (used == 0)
+        return;
+
+      if (used < 0)
+        {
+          attempt_failed (attempt);
+          return;
+        }
+
+      g_string_erase (attempt->read_buffer, 0, used);
+
+      DEBUG ("Received auth reply from %s. Sending CONNECT command",
+          attempt->streamhost->host);
+
+      domain = compute_domain (priv->stream_id, priv->peer_jid,
+          priv->self_full_jid);
+      send_connect_request (transport, domain);
+      g_free (domain);
+
+      attempt->state = SOCKS5_STATE_TARGET_CONNECT_REQUESTED;
+    }
+
+  if (attempt->state == SOCKS5_STATE_TARGET_CONNECT_REQUESTED)
+    {
+      domain = compute_domain (priv->stream_id, priv->peer_jid,
+          priv->self_full_jid);
+      used = check_connect_reply (attempt->read_buffer, domain);
+      g_free (domain);
+
+      if (used == 0)
+        return;
+
+      if (used < 0)
+        {
+          attempt_failed (attempt);
+          return;
+        }
+
+      g_string_erase (attempt->read_buffer, 0, used);
+      attempt_succeeded (attempt);
+    }
+}
+
+static gboolean
+attempt_timeout_cb (gpointer user_data)
+{
+  Socks5Attempt *attempt = user_data;
+
+  DEBUG ("Timed out connecting to %s", attempt->streamhost->host);
+
+  attempt->timer_id = 0;
+  attempt_failed (attempt);
+  return FALSE;
+}
+
+static void
+attempt_connected_cb (GibberTransport *transport,
+                      Socks5Attempt *attempt)
+{
+  DEBUG ("connected to %s. Sending auth request", attempt->streamhost->host);
+
+  send_auth_request (transport);
+  attempt->state = SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT;
+
+  /* The connect timeout is replaced by one for the whole SOCKS5 handshake.
+   * Older version of Gabble (pre 0.7.22) are bugged and just send 2 bytes as
+   * CONNECT reply, so we mustn't wait for the full reply forever. */
+  g_source_remove (attempt->timer_id);
+  attempt->timer_id = g_timeout_add_seconds (CONNECT_REPLY_TIMEOUT,
+      attempt_timeout_cb, attempt);
+}
+
+static void
+attempt_disconnected_cb (GibberTransport *transport,
+                         Socks5Attempt *attempt)
+{
+  attempt_failed (attempt);
+}
+
+static gboolean
+stagger_cb (gpointer user_data)
+{
+  GabbleBytestreamSocks5 *self = GABBLE_BYTESTREAM_SOCKS5 (user_data);
+  GabbleBytestreamSocks5Private *priv = GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (
+      self);
+
+  priv->stagger_id = 0;
+  start_next_attempt (self);
+  return FALSE;
+}
+
+static void
+start_next_attempt (GabbleBytestreamSocks5 *self)
+{
+  GabbleBytestreamSocks5Private *priv = GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (
+      self);
+  Socks5Attempt *attempt;
+
+  if (priv->stagger_id != 0)
+    {
+      g_source_remove (priv->stagger_id);
+      priv->stagger_id = 0;
+    }
+
+  g_assert (priv->next_streamhost != NULL);
+
+  attempt = g_slice_new0 (Socks5Attempt);
+  attempt->self = self;
+  attempt->streamhost = priv->next_streamhost->data;
+  attempt->transport = GIBBER_TRANSPORT (gibber_tcp_transport_new ());
+  attempt->read_buffer = g_string_new ("");
+  attempt->state = SOCKS5_STATE_TARGET_TRYING_CONNECT;
+  g_get_current_time (&attempt->started);
+
+  priv->next_streamhost = g_slist_next (priv->next_streamhost);
+
+  DEBUG ("Trying streamhost %s on port %d", attempt->streamhost->host,
+      attempt->streamhost->port);
+
+  gibber_transport_set_handler (attempt->transport, attempt_handler, attempt);
+  g_signal_connect (attempt->transport, "connected",
+      G_CALLBACK (attempt_connected_cb), attempt);
+  g_signal_connect (attempt->transport, "disconnected",
+      G_CALLBACK (attempt_disconnected_cb), attempt);
+
+  priv->attempts = g_slist_prepend (priv->attempts, attempt);
+
+  /* We don't want to wait for the TCP timeout if the host is unreachable */
+  attempt->timer_id = g_timeout_add_seconds (CONNECT_TIMEOUT,
+      attempt_timeout_cb, attempt);
+
+  if (priv->next_streamhost != NULL)
+    priv->stagger_id = g_timeout_add (STREAMHOST_STAGGER, stagger_cb, self);
+
+  /* This can fail straight away, in which case attempt has been freed and
+   * the next streamhost tried when it returns. We'll send the auth request
+   * once the transport is connected. */
+  gibber_tcp_transport_connect (GIBBER_TCP_TRANSPORT (attempt->transport),
+      attempt->streamhost->host, attempt->streamhost->port);
+}
+
+static gint
+compare_streamhosts (gconstpointer a,
+                     gconstpointer b)
+{
+  const Streamhost *streamhost_a = a;
+  const Streamhost *streamhost_b = b;
+
+  if (streamhost_a->cost < streamhost_b->cost)
+    return -1;
+
+  return streamhost_a->cost > streamhost_b->cost;
+}
+
 static void
 socks5_connect (GabbleBytestreamSocks5 *self)
 {
   GabbleBytestreamSocks5Private *priv =
       GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
-  Streamhost* streamhost;
-  GibberTCPTransport *transport;
+  GSList *l;
 
   priv->socks5_state = SOCKS5_STATE_TARGET_TRYING_CONNECT;
 
-  if (priv->streamhosts != NULL)
-    {
-      streamhost = priv->streamhosts->data;
-    }
-  else
+  if (priv->streamhosts == NULL)
     {
-      DEBUG ("No more streamhosts to try, closing");
+      DEBUG ("No streamhost to try, closing");
 
       socks5_error (self);
       return;
     }
 
-  DEBUG ("Trying streamhost %s on port %d", streamhost->host,
-      streamhost->port);
-
-  transport = gibber_tcp_transport_new ();
-  set_transport (self, GIBBER_TRANSPORT (transport));
-  g_object_unref (transport);
+  for (l = priv->streamhosts; l != NULL; l = g_slist_next (l))
+    {
+      Streamhost *streamhost = l->data;
 
-  /* We don't wait to wait for the TCP timeout is the host is unreachable */
-  start_timer (self, CONNECT_TIMEOUT);
+      streamhost->cost = gabble_bytestream_factory_get_streamhost_cost (
+          priv->conn->bytestream_factory, streamhost->jid, streamhost->host,
+          streamhost->port);
+    }
 
-  gibber_tcp_transport_connect (transport, streamhost->host,
-      streamhost->port);
+  /* g_slist_sort () is stable, so streamhosts we know nothing about are tried
+   * in the order the initiator gave them to us */
+  priv->streamhosts = g_slist_sort (priv->streamhosts, compare_streamhosts);
+  priv->next_streamhost = priv->streamhosts;
 
-  /* We'll send the auth request once the transport is connected */
+  start_next_attempt (self);
 }
 
 /**
@@ -1386,9 +2092,11 @@ gabble_bytestream_socks5_send (GabbleBytestreamIface *iface,
   /* At this point we know that the bytestream has not been closed */
   g_object_unref (self);
 
-  if (!gibber_transport_buffer_is_empty (priv->transport))
+  priv->bytes_transferred += len;
+
+  if (gibber_transport_buffer_is_full (priv->transport))
     {
-      /* We >don't want to send more data while the buffer isn't empty */
+      /* We don't want to send more data until the buffer has drained */
       change_write_blocked_state (self, TRUE);
     }
 
@@ -1520,6 +2228,7 @@ initiator_connected_to_proxy (GabbleBytestreamSocks5 *self)
   GSList *proxies, *l;
   GabbleSocks5Proxy *proxy = NULL;
   GibberTCPTransport *transport;
+  GibberTransport *warm;
 
   proxies = gabble_bytestream_factory_get_socks5_proxies (
       priv->conn->bytestream_factory);
@@ -1542,6 +2251,27 @@ initiator_connected_to_proxy (GabbleBytestreamSocks5 *self)
       return;
     }
 
+  priv->used_streamhost = streamhost_new (proxy->jid, proxy->host,
+      proxy->port);
+  priv->streamhosts = g_slist_prepend (priv->streamhosts,
+      priv->used_streamhost);
+  g_get_current_time (&priv->proxy_connect_started);
+
+  warm = warm_session_take (gabble_bytestream_factory_get_socks5_sessions (
+        priv->conn->bytestream_factory), proxy->jid, proxy->host,
+      proxy->port);
+
+  if (warm != NULL)
+    {
+      DEBUG ("already connected to proxy: %s (%s:%d)", proxy->jid,
+          proxy->host, proxy->port);
+      set_transport (self, warm);
+      g_object_unref (warm);
+
+      initiator_send_connect_request (self);
+      return;
+    }
+
   DEBUG ("connect to proxy: %s (%s:%d)", proxy->jid, proxy->host, proxy->port);
   priv->socks5_state = SOCKS5_STATE_INITIATOR_TRYING_CONNECT;
 
@@ -1599,6 +2329,10 @@ socks5_init_reply_cb (GabbleConnection *conn,
               goto socks5_init_error;
             }
 
+          warm_session_note_proxy_used (
+              gabble_bytestream_factory_get_socks5_sessions (
+                  priv->conn->bytestream_factory), TRUE);
+
           priv->proxy_jid = g_strdup (jid);
           initiator_connected_to_proxy (self);
           return LM_HANDLER_RESULT_REMOVE_MESSAGE;
@@ -1606,6 +2340,9 @@ socks5_init_reply_cb (GabbleConnection *conn,
 
       /* No proxy used */
       DEBUG ("Target is connected to us");
+      warm_session_note_proxy_used (
+          gabble_bytestream_factory_get_socks5_sessions (
+              priv->conn->bytestream_factory), FALSE);
 
       if (priv->socks5_state != SOCKS5_STATE_CONNECTED)
         {
@@ -1632,235 +2369,6 @@ socks5_init_error:
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
 
-#ifdef G_OS_WIN32
-
-static GSList *
-get_local_interfaces_ips (void)
-{
-  gint sockfd;
-  INTERFACE_INFO *iflist = NULL;
-  gsize size = 0;
-  int ret;
-  int error;
-  gsize bytes;
-  gsize num;
-  gsize i;
-  struct sockaddr_in *sa;
-  GSList *ips = NULL;
-
-  /* FIXME: add IPv6 addresses */
-  if ((sockfd = socket (AF_INET, SOCK_DGRAM, IPPROTO_IP)) == INVALID_SOCKET)
-    {
-      DEBUG ("Cannot open socket to retrieve interface list");
-      return NULL;
-    }
-
-  /* Loop and get each interface the system has, one by one... */
-  do
-    {
-      size += sizeof (INTERFACE_INFO);
-      /* realloc buffer size until no overflow occurs  */
-      if (NULL == (iflist = realloc (iflist, size)))
-        {
-          DEBUG ("Out of memory while allocation interface configuration"
-              " structure");
-          closesocket (sockfd);
-          return NULL;
-        }
-
-        ret = WSAIoctl (sockfd, SIO_GET_INTERFACE_LIST, NULL, 0, iflist,
-                        size, &bytes, NULL, NULL);
-        error = WSAGetLastError ();
-
-        if (ret == SOCKET_ERROR && error != WSAEFAULT)
-          {
-            DEBUG ("Cannot retrieve interface list");
-            closesocket (sockfd);
-            free (iflist);
-            return NULL;
-          }
-    } while (ret == SOCKET_ERROR);
-
-  num = bytes / sizeof (INTERFACE_INFO);
-
-  /* Loop throught the interface list and get the IP address of each IF */
-  for (i = 0; i < num; i++)
-    {
-      /* no ip address from interface that is down */
-      if ((iflist[i].iiFlags & IFF_UP) == 0)
-        continue;
-
-      if ((iflist[i].iiFlags & IFF_LOOPBACK) == IFF_LOOPBACK)
-        {
-          DEBUG ("Ignoring loopback interface");
-          continue;
-        }
-
-      sa = (struct sockaddr_in *) &(iflist[i].iiAddress);
-      ips = g_slist_prepend (ips, g_strdup (inet_ntoa (sa->sin_addr)));
-      DEBUG ("IP Address: %s", inet_ntoa (sa->sin_addr));
-    }
-
-  closesocket (sockfd);
-  free (iflist);
-
-  return ips;
-}
-
-#else
-
-/* get_local_interfaces_ips original code from Farsight 2 (function
- * fs_interfaces_get_local_ips in /gst-libs/gst/farsight/fs-interfaces.c).
- *   Copyright (C) 2006 Youness Alaoui <kakaroto@kakaroto.homelinux.net>
- *   Copyright (C) 2007 Collabora
- */
-#ifdef HAVE_GETIFADDRS
-
-static GSList *
-get_local_interfaces_ips (void)
-{
-  struct ifaddrs *ifa, *results;
-  GSList *ips = NULL;
-
-  if (getifaddrs (&results) < 0)
-    return NULL;
-
-  /* Loop through the interface list and get the IP address of each IF */
-  for (ifa = results; ifa; ifa = ifa->ifa_next)
-    {
-      char straddr[INET6_ADDRSTRLEN];
-
-      /* no ip address from interface that is down */
-      if ((ifa->ifa_flags & IFF_UP) == 0)
-        continue;
-
-      if (ifa->ifa_addr == NULL)
-        continue;
-
-      if ((ifa->ifa_flags & IFF_LOOPBACK) == IFF_LOOPBACK)
-        {
-          DEBUG ("Ignoring loopback interface");
-          continue;
-        }
-
-      if (ifa->ifa_addr->sa_family == AF_INET)
-        {
-          struct sockaddr_in *sa = (struct sockaddr_in *) ifa->ifa_addr;
-
-          inet_ntop (AF_INET, &sa->sin_addr, straddr, sizeof (straddr));
-
-          /* Add IPv4 addresses to the end of the list */
-          ips = g_slist_append (ips, g_strdup (straddr));
-        }
-      else if (ifa->ifa_addr->sa_family == AF_INET6)
-        {
-          struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *) ifa->ifa_addr;
-
-          inet_ntop (AF_INET6, &sa6->sin6_addr, straddr, sizeof (straddr));
-
-          if (IN6_IS_ADDR_LINKLOCAL (&sa6->sin6_addr))
-            {
-              DEBUG ("Ignoring link-local address: %s", straddr);
-              continue;
-            }
-
-          /* Add IPv6 addresss to the begin of the list */
-          ips = g_slist_prepend (ips, g_strdup (straddr));
-        }
-      else
-        {
-          continue;
-        }
-
-      DEBUG ("Interface:  %s", ifa->ifa_name);
-      DEBUG ("IP Address: %s", straddr);
-    }
-
-  freeifaddrs (results);
-
-  return ips;
-}
-
-#else /* ! HAVE_GETIFADDRS */
-
-static GSList *
-get_local_interfaces_ips (void)
-{
-  gint sockfd;
-  gint size = 0;
-  struct ifreq *ifr;
-  struct ifconf ifc;
-  struct sockaddr_in *sa;
-  GSList *ips = NULL;
-
-  /* FIXME: add IPv6 addresses */
-  if ((sockfd = socket (AF_INET, SOCK_DGRAM, IPPROTO_IP)) < 0)
-    {
-      DEBUG ("Cannot open socket to retreive interface list");
-      return NULL;
-    }
-
-  ifc.ifc_len = 0;
-  ifc.ifc_req = NULL;
-
-  /* Loop and get each interface the system has, one by one... */
-  do
-    {
-      size += sizeof (struct ifreq);
-      /* realloc buffer size until no overflow occurs  */
-      if (NULL == (ifc.ifc_req = realloc (ifc.ifc_req, size)))
-        {
-          DEBUG ("Out of memory while allocation interface configuration"
-              " structure");
-          close (sockfd);
-          return NULL;
-        }
-      ifc.ifc_len = size;
-
-      if (ioctl (sockfd, SIOCGIFCONF, &ifc))
-        {
-          DEBUG ("ioctl SIOCFIFCONF");
-          close (sockfd);
-          free (ifc.ifc_req);
-          return NULL;
-        }
-    } while  (size <= ifc.ifc_len);
-
-  /* Loop throught the interface list and get the IP address of each IF */
-  for (ifr = ifc.ifc_req;
-      (gchar *) ifr < (gchar *) ifc.ifc_req + ifc.ifc_len;
-      ++ifr)
-    {
-
-      if (ioctl (sockfd, SIOCGIFFLAGS, ifr))
-        {
-          DEBUG ("Unable to get IP information for interface %s. Skipping...",
-              ifr->ifr_name);
-          continue;  /* failed to get flags, skip it */
-        }
-      sa = (struct sockaddr_in *) &ifr->ifr_addr;
-      DEBUG ("Interface:  %s", ifr->ifr_name);
-      DEBUG ("IP Address: %s", inet_ntoa (sa->sin_addr));
-      if ((ifr->ifr_flags & IFF_LOOPBACK) == IFF_LOOPBACK)
-        {
-          DEBUG ("Ignoring loopback interface");
-        }
-      else
-        {
-          ips = g_slist_prepend (ips, g_strdup (inet_ntoa (sa->sin_addr)));
-        }
-    }
-
-  close (sockfd);
-  free (ifc.ifc_req);
-
-  return ips;
-}
-
-#endif /* ! HAVE_GETIFADDRS */
-
-#endif /* ! G_OS_WIN32 */
-
 static void
 new_connection_cb (GibberListener *listener,
                    GibberTransport *transport,
@@ -1901,7 +2409,7 @@ gabble_bytestream_socks5_initiate (GabbleBytestreamIface *iface)
       return FALSE;
     }
 
-  ips = get_local_interfaces_ips ();
+  ips = gabble_local_addresses_get ();
   if (ips == NULL)
     {
       DEBUG ("Can't get IP addresses");
@@ -1954,6 +2462,9 @@ gabble_bytestream_socks5_initiate (GabbleBytestreamIface *iface)
   if (!priv->muc_contact)
     {
       GSList *proxies, *l;
+      GabbleSocks5SessionPool *sessions =
+          gabble_bytestream_factory_get_socks5_sessions (
+              priv->conn->bytestream_factory);
 
       proxies = gabble_bytestream_factory_get_socks5_proxies (
           priv->conn->bytestream_factory);
@@ -1976,6 +2487,12 @@ gabble_bytestream_socks5_initiate (GabbleBytestreamIface *iface)
               "port", portstr,
               NULL);
           g_free (portstr);
+
+          /* proxies come best first, so only the first one gets a
+           * session */
+          if (l == proxies)
+            warm_session_start (sessions, proxy->jid, proxy->host,
+                proxy->port);
         }
       g_slist_free (proxies);
     }
@@ -2018,6 +2535,59 @@ gabble_bytestream_socks5_block_reading (GabbleBytestreamIface *iface,
     gibber_transport_block_receiving (priv->transport, block);
 }
 
+/* Counts spliced data before passing it on, for record_bandwidth () */
+static void
+spliced_cb (GibberFdTransport *source,
+            gsize count,
+            gpointer user_data)
+{
+  GabbleBytestreamSocks5 *self = GABBLE_BYTESTREAM_SOCKS5 (user_data);
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+
+  priv->bytes_transferred += count;
+
+  if (priv->spliced_func != NULL)
+    priv->spliced_func (source, count, priv->spliced_user_data);
+}
+
+static gboolean
+gabble_bytestream_socks5_splice (GabbleBytestreamIface *iface,
+                                 GibberTransport *local,
+                                 gboolean incoming,
+                                 GibberFdTransportSplicedFunc func,
+                                 gpointer user_data)
+{
+  GabbleBytestreamSocks5 *self = GABBLE_BYTESTREAM_SOCKS5 (iface);
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+
+  if (priv->bytestream_state != GABBLE_BYTESTREAM_STATE_OPEN ||
+      priv->socks5_state != SOCKS5_STATE_CONNECTED ||
+      priv->transport == NULL ||
+      !GIBBER_IS_FD_TRANSPORT (priv->transport) ||
+      !GIBBER_IS_FD_TRANSPORT (local))
+    return FALSE;
+
+  priv->spliced_func = func;
+  priv->spliced_user_data = user_data;
+
+  if (incoming)
+    {
+      /* Anything we have already read would be overtaken */
+      if (priv->read_buffer != NULL && priv->read_buffer->len > 0)
+        return FALSE;
+
+      return gibber_fd_transport_splice (GIBBER_FD_TRANSPORT (priv->transport),
+          GIBBER_FD_TRANSPORT (local), spliced_cb, self);
+    }
+  else
+    {
+      return gibber_fd_transport_splice (GIBBER_FD_TRANSPORT (local),
+          GIBBER_FD_TRANSPORT (priv->transport), spliced_cb, self);
+    }
+}
+
 static void
 bytestream_iface_init (gpointer g_iface,
                        gpointer iface_data)
@@ -2029,4 +2599,5 @@ bytestream_iface_init (gpointer g_iface,
   klass->close = gabble_bytestream_socks5_close;
   klass->accept = gabble_bytestream_socks5_accept;
   klass->block_reading = gabble_bytestream_socks5_block_reading;
+  klass->splice = gabble_bytestream_socks5_splice;
 }
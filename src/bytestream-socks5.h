@@ -70,6 +70,13 @@ void gabble_bytestream_socks5_add_streamhost (GabbleBytestreamSocks5 *socks5,
 void gabble_bytestream_socks5_connect_to_streamhost (
     GabbleBytestreamSocks5 *socks5, LmMessage *msg);
 
+/* Sessions with SOCKS5 proxies which have got as far as they can before
+ * being used for a particular bytestream */
+typedef struct _GabbleSocks5SessionPool GabbleSocks5SessionPool;
+
+GabbleSocks5SessionPool *gabble_socks5_session_pool_new (void);
+void gabble_socks5_session_pool_free (GabbleSocks5SessionPool *pool);
+
 G_END_DECLS
 
 #endif /* #ifndef __GABBLE_BYTESTREAM_SOCKS5_H__ */
@@ -0,0 +1,32 @@
+/*
+ * capabilities-internal.h - implementation details of capabilities.c shared
+ *                           with the tests
+ *
+ * Copyright (C) 2005 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __CAPABILITIES_INTERNAL_H__
+#define __CAPABILITIES_INTERNAL_H__
+
+#include "capabilities.h"
+
+/* How many different features get a bit of their own in every
+ * GabbleCapabilitySet; a multiple of 32. Any more go in each set's overflow
+ * TpHandleSet instead. */
+#define KNOWN_FEATURES_MAX 128
+
+#endif /* __CAPABILITIES_INTERNAL_H__ */
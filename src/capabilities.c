@@ -20,6 +20,7 @@
 
 #include "config.h"
 #include "capabilities.h"
+#include "capabilities-internal.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -58,6 +59,7 @@ static const Feature self_advertised_features[] =
   { FEATURE_FIXED, NS_SI },
   { FEATURE_FIXED, NS_IBB },
   { FEATURE_FIXED, NS_TUBES },
+  { FEATURE_FIXED, NS_TUBES_MUX },
   { FEATURE_FIXED, NS_BYTESTREAMS },
   { FEATURE_FIXED, NS_VERSION },
 
@@ -227,6 +229,9 @@ static gsize feature_handles_refcount = 0;
  * QUIRK_OMITS_CONTENT_CREATORS). */
 static TpHandleRepoIface *feature_handles = NULL;
 
+static void known_features_init (void);
+static void known_features_finalize (void);
+
 void
 gabble_capabilities_init (gpointer conn)
 {
@@ -242,6 +247,7 @@ gabble_capabilities_init (gpointer conn)
        * to shut it up. */
       feature_handles = tp_dynamic_handle_repo_new (TP_HANDLE_TYPE_CONTACT,
           NULL, NULL);
+      known_features_init ();
 
       /* make the pre-cooked bundles */
 
@@ -348,20 +354,167 @@ gabble_capabilities_finalize (gpointer conn)
       olpc_caps = NULL;
 
       tp_clear_object (&feature_handles);
+      known_features_finalize ();
     }
 }
 
+/* Features which get a bit of their own in every GabbleCapabilitySet, in the
+ * order they were first added to any set: our own features and quirks, which
+ * known_features_init () adds first, then the first ones contacts advertise.
+ * Once KNOWN_FEATURES_MAX have been seen, anything new goes in each set's
+ * overflow TpHandleSet. A feature never moves between the two while
+ * feature_handles exists, so each one is only ever stored in one way. */
+static gchar *known_features[KNOWN_FEATURES_MAX];
+static guint n_known_features = 0;
+
+#define N_KNOWN_WORDS (KNOWN_FEATURES_MAX / 32)
+
+/* feature => GUINT_TO_POINTER (1 + its index in known_features) */
+static GHashTable *known_feature_bits = NULL;
+
+/* The contents of one or more GabbleCapabilitySets. Copying a set just
+ * shares its contents, which are only really copied when one of the sets
+ * sharing them is modified; so the thousands of contacts running the same
+ * client all point to a single copy of its caps. */
+typedef struct {
+    guint ref_count;
+    /* Bit i is set if the set contains known_features[i] */
+    guint32 known[N_KNOWN_WORDS];
+    /* Handles in feature_handles of other features, or NULL if there are
+     * none */
+    TpHandleSet *others;
+} CapabilitySetData;
+
 struct _GabbleCapabilitySet {
-    TpHandleSet *handles;
+    CapabilitySetData *data;
 };
 
+#define KNOWN_WORD(bit) ((bit) / 32)
+#define KNOWN_MASK(bit) (((guint32) 1) << ((bit) % 32))
+
+/* Returns the bit for @cap, or -1 if it's not a known feature */
+static gint
+known_feature_bit (const gchar *cap)
+{
+  return GPOINTER_TO_INT (g_hash_table_lookup (known_feature_bits, cap)) - 1;
+}
+
+/* Returns the bit for @cap, giving it the next one if it's never been seen
+ * and there are any left; or -1 if it doesn't have one */
+static gint
+known_feature_ensure_bit (const gchar *cap)
+{
+  gint bit = known_feature_bit (cap);
+
+  if (bit < 0 && n_known_features < KNOWN_FEATURES_MAX)
+    {
+      bit = n_known_features++;
+      known_features[bit] = g_strdup (cap);
+      g_hash_table_insert (known_feature_bits, known_features[bit],
+          GUINT_TO_POINTER (bit + 1));
+    }
+
+  return bit;
+}
+
+static void
+known_features_init (void)
+{
+  const Feature *feat;
+
+  known_feature_bits = g_hash_table_new (g_str_hash, g_str_equal);
+
+  for (feat = quirks; feat->ns != NULL; feat++)
+    known_feature_ensure_bit (feat->ns);
+
+  for (feat = self_advertised_features; feat->ns != NULL; feat++)
+    known_feature_ensure_bit (feat->ns);
+}
+
+static void
+known_features_finalize (void)
+{
+  tp_clear_pointer (&known_feature_bits, g_hash_table_destroy);
+
+  while (n_known_features > 0)
+    g_free (known_features[--n_known_features]);
+}
+
+static guint
+count_bits (guint32 word)
+{
+  word = word - ((word >> 1) & 0x55555555);
+  word = (word & 0x33333333) + ((word >> 2) & 0x33333333);
+  return (((word + (word >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+static CapabilitySetData *
+capability_set_data_new (void)
+{
+  CapabilitySetData *data = g_slice_new0 (CapabilitySetData);
+
+  data->ref_count = 1;
+  return data;
+}
+
+static void
+capability_set_data_unref (CapabilitySetData *data)
+{
+  g_assert (data->ref_count > 0);
+
+  if (--data->ref_count > 0)
+    return;
+
+  tp_clear_pointer (&data->others, tp_handle_set_destroy);
+  g_slice_free (CapabilitySetData, data);
+}
+
+/* Returns @caps' contents, first copying them if they're shared with another
+ * set. Call this before modifying them. */
+static CapabilitySetData *
+capability_set_make_writable (GabbleCapabilitySet *caps)
+{
+  CapabilitySetData *old = caps->data;
+
+  if (old->ref_count > 1)
+    {
+      caps->data = capability_set_data_new ();
+      memcpy (caps->data->known, old->known, sizeof (old->known));
+
+      if (old->others != NULL)
+        caps->data->others = tp_handle_set_copy (old->others);
+
+      capability_set_data_unref (old);
+    }
+
+  return caps->data;
+}
+
+static TpHandleSet *
+ensure_others (GabbleCapabilitySet *caps)
+{
+  CapabilitySetData *data = capability_set_make_writable (caps);
+
+  if (data->others == NULL)
+    data->others = tp_handle_set_new (feature_handles);
+
+  return data->others;
+}
+
+static gboolean
+others_is_empty (const GabbleCapabilitySet *caps)
+{
+  return (caps->data->others == NULL ||
+      tp_handle_set_size (caps->data->others) == 0);
+}
+
 GabbleCapabilitySet *
 gabble_capability_set_new (void)
 {
   GabbleCapabilitySet *ret = g_slice_new0 (GabbleCapabilitySet);
 
   g_assert (feature_handles != NULL);
-  ret->handles = tp_handle_set_new (feature_handles);
+  ret->data = capability_set_data_new ();
   return ret;
 }
 
@@ -416,9 +569,9 @@ gabble_capability_set_copy (const GabbleCapabilitySet *caps)
 
   g_return_val_if_fail (caps != NULL, NULL);
 
-  ret = gabble_capability_set_new ();
-
-  gabble_capability_set_update (ret, caps);
+  ret = g_slice_new0 (GabbleCapabilitySet);
+  ret->data = caps->data;
+  ret->data->ref_count++;
 
   return ret;
 }
@@ -427,14 +580,35 @@ void
 gabble_capability_set_update (GabbleCapabilitySet *target,
     const GabbleCapabilitySet *source)
 {
-  TpIntSet *ret;
+  guint i;
+
   g_return_if_fail (target != NULL);
   g_return_if_fail (source != NULL);
 
-  ret = tp_handle_set_update (target->handles,
-    tp_handle_set_peek (source->handles));
+  if (gabble_capability_set_at_least (target, source))
+    return;
+
+  if (gabble_capability_set_size (target) == 0)
+    {
+      /* share @source's contents rather than copying them */
+      capability_set_data_unref (target->data);
+      target->data = source->data;
+      target->data->ref_count++;
+      return;
+    }
 
-  tp_intset_destroy (ret);
+  capability_set_make_writable (target);
+
+  for (i = 0; i < N_KNOWN_WORDS; i++)
+    target->data->known[i] |= source->data->known[i];
+
+  if (!others_is_empty (source))
+    {
+      TpIntSet *ret = tp_handle_set_update (ensure_others (target),
+          tp_handle_set_peek (source->data->others));
+
+      tp_intset_destroy (ret);
+    }
 }
 
 typedef struct {
@@ -449,7 +623,8 @@ intersect_helper (TpHandleSet *unused G_GNUC_UNUSED,
 {
   IntersectHelper *data = p;
 
-  if (!tp_handle_set_is_member (data->intersect_with, handle))
+  if (data->intersect_with == NULL ||
+      !tp_handle_set_is_member (data->intersect_with, handle))
     data->deleted = g_slist_prepend (data->deleted, GUINT_TO_POINTER (handle));
 }
 
@@ -458,22 +633,47 @@ gabble_capability_set_intersect (GabbleCapabilitySet *target,
     const GabbleCapabilitySet *source)
 {
   IntersectHelper data = { NULL, NULL };
+  guint i;
 
   g_return_if_fail (target != NULL);
   g_return_if_fail (source != NULL);
 
-  if (target == source)
+  if (gabble_capability_set_at_least (source, target))
+    return;
+
+  capability_set_make_writable (target);
+
+  for (i = 0; i < N_KNOWN_WORDS; i++)
+    {
+      guint32 dropped = target->data->known[i] & ~source->data->known[i];
+
+      if (G_UNLIKELY (dropped != 0) && DEBUGGING)
+        {
+          guint bit;
+
+          for (bit = i * 32; bit < MIN ((i + 1) * 32, n_known_features);
+              bit++)
+            {
+              if (dropped & KNOWN_MASK (bit))
+                DEBUG ("dropping %s", known_features[bit]);
+            }
+        }
+
+      target->data->known[i] &= source->data->known[i];
+    }
+
+  if (target->data->others == NULL)
     return;
 
-  data.intersect_with = source->handles;
+  data.intersect_with = source->data->others;
 
-  tp_handle_set_foreach (target->handles, intersect_helper, &data);
+  tp_handle_set_foreach (target->data->others, intersect_helper, &data);
 
   while (data.deleted != NULL)
     {
       DEBUG ("dropping %s", tp_handle_inspect (feature_handles,
             GPOINTER_TO_UINT (data.deleted->data)));
-      tp_handle_set_remove (target->handles,
+      tp_handle_set_remove (target->data->others,
           GPOINTER_TO_UINT (data.deleted->data));
       data.deleted = g_slist_delete_link (data.deleted, data.deleted);
     }
@@ -491,6 +691,8 @@ void
 gabble_capability_set_exclude (GabbleCapabilitySet *caps,
     const GabbleCapabilitySet *removed)
 {
+  guint i;
+
   g_return_if_fail (caps != NULL);
   g_return_if_fail (removed != NULL);
 
@@ -500,7 +702,17 @@ gabble_capability_set_exclude (GabbleCapabilitySet *caps,
       return;
     }
 
-  tp_handle_set_foreach (removed->handles, remove_from_set, caps->handles);
+  if (!gabble_capability_set_has_one (caps, removed))
+    return;
+
+  capability_set_make_writable (caps);
+
+  for (i = 0; i < N_KNOWN_WORDS; i++)
+    caps->data->known[i] &= ~removed->data->known[i];
+
+  if (caps->data->others != NULL && removed->data->others != NULL)
+    tp_handle_set_foreach (removed->data->others, remove_from_set,
+        caps->data->others);
 }
 
 void
@@ -508,13 +720,26 @@ gabble_capability_set_add (GabbleCapabilitySet *caps,
     const gchar *cap)
 {
   TpHandle handle;
+  gint bit;
 
   g_return_if_fail (caps != NULL);
   g_return_if_fail (cap != NULL);
 
+  if (gabble_capability_set_has (caps, cap))
+    return;
+
+  bit = known_feature_ensure_bit (cap);
+
+  if (bit >= 0)
+    {
+      capability_set_make_writable (caps);
+      caps->data->known[KNOWN_WORD (bit)] |= KNOWN_MASK (bit);
+      return;
+    }
+
   handle = tp_handle_ensure (feature_handles, cap, NULL, NULL);
 
-  tp_handle_set_add (caps->handles, handle);
+  tp_handle_set_add (ensure_others (caps), handle);
   tp_handle_unref (feature_handles, handle);
 }
 
@@ -523,16 +748,25 @@ gabble_capability_set_remove (GabbleCapabilitySet *caps,
     const gchar *cap)
 {
   TpHandle handle;
+  gint bit;
 
   g_return_val_if_fail (caps != NULL, FALSE);
   g_return_val_if_fail (cap != NULL, FALSE);
 
-  handle = tp_handle_lookup (feature_handles, cap, NULL, NULL);
-
-  if (handle == 0)
+  if (!gabble_capability_set_has (caps, cap))
     return FALSE;
 
-  return tp_handle_set_remove (caps->handles, handle);
+  capability_set_make_writable (caps);
+  bit = known_feature_bit (cap);
+
+  if (bit >= 0)
+    {
+      caps->data->known[KNOWN_WORD (bit)] &= ~KNOWN_MASK (bit);
+      return TRUE;
+    }
+
+  handle = tp_handle_lookup (feature_handles, cap, NULL, NULL);
+  return tp_handle_set_remove (caps->data->others, handle);
 }
 
 void
@@ -540,9 +774,15 @@ gabble_capability_set_clear (GabbleCapabilitySet *caps)
 {
   g_return_if_fail (caps != NULL);
 
-  /* There is no tp_handle_set_clear, so do the next best thing */
-  tp_handle_set_destroy (caps->handles);
-  caps->handles = tp_handle_set_new (feature_handles);
+  if (caps->data->ref_count > 1)
+    {
+      capability_set_data_unref (caps->data);
+      caps->data = capability_set_data_new ();
+      return;
+    }
+
+  memset (caps->data->known, 0, sizeof (caps->data->known));
+  tp_clear_pointer (&caps->data->others, tp_handle_set_destroy);
 }
 
 void
@@ -550,15 +790,25 @@ gabble_capability_set_free (GabbleCapabilitySet *caps)
 {
   g_return_if_fail (caps != NULL);
 
-  tp_handle_set_destroy (caps->handles);
+  capability_set_data_unref (caps->data);
   g_slice_free (GabbleCapabilitySet, caps);
 }
 
 gint
 gabble_capability_set_size (const GabbleCapabilitySet *caps)
 {
+  gint size = 0;
+  guint i;
+
   g_return_val_if_fail (caps != NULL, 0);
-  return tp_handle_set_size (caps->handles);
+
+  for (i = 0; i < N_KNOWN_WORDS; i++)
+    size += count_bits (caps->data->known[i]);
+
+  if (caps->data->others != NULL)
+    size += tp_handle_set_size (caps->data->others);
+
+  return size;
 }
 
 /* By design, this function can be used as a GabbleCapabilitySetPredicate */
@@ -567,10 +817,19 @@ gabble_capability_set_has (const GabbleCapabilitySet *caps,
     const gchar *cap)
 {
   TpHandle handle;
+  gint bit;
 
   g_return_val_if_fail (caps != NULL, FALSE);
   g_return_val_if_fail (cap != NULL, FALSE);
 
+  bit = known_feature_bit (cap);
+
+  if (bit >= 0)
+    return (caps->data->known[KNOWN_WORD (bit)] & KNOWN_MASK (bit)) != 0;
+
+  if (caps->data->others == NULL)
+    return FALSE;
+
   handle = tp_handle_lookup (feature_handles, cap, NULL, NULL);
 
   if (handle == 0)
@@ -579,7 +838,7 @@ gabble_capability_set_has (const GabbleCapabilitySet *caps,
       return FALSE;
     }
 
-  return tp_handle_set_is_member (caps->handles, handle);
+  return tp_handle_set_is_member (caps->data->others, handle);
 }
 
 /* By design, this function can be used as a GabbleCapabilitySetPredicate */
@@ -588,15 +847,25 @@ gabble_capability_set_has_one (const GabbleCapabilitySet *caps,
     const GabbleCapabilitySet *alternatives)
 {
   TpIntSetIter iter;
+  guint i;
 
   g_return_val_if_fail (caps != NULL, FALSE);
   g_return_val_if_fail (alternatives != NULL, FALSE);
 
-  tp_intset_iter_init (&iter, tp_handle_set_peek (alternatives->handles));
+  for (i = 0; i < N_KNOWN_WORDS; i++)
+    {
+      if ((caps->data->known[i] & alternatives->data->known[i]) != 0)
+        return TRUE;
+    }
+
+  if (others_is_empty (caps) || others_is_empty (alternatives))
+    return FALSE;
+
+  tp_intset_iter_init (&iter, tp_handle_set_peek (alternatives->data->others));
 
   while (tp_intset_iter_next (&iter))
     {
-      if (tp_handle_set_is_member (caps->handles, iter.element))
+      if (tp_handle_set_is_member (caps->data->others, iter.element))
         {
           return TRUE;
         }
@@ -611,15 +880,28 @@ gabble_capability_set_at_least (const GabbleCapabilitySet *caps,
     const GabbleCapabilitySet *query)
 {
   TpIntSetIter iter;
+  guint i;
 
   g_return_val_if_fail (caps != NULL, FALSE);
   g_return_val_if_fail (query != NULL, FALSE);
 
-  tp_intset_iter_init (&iter, tp_handle_set_peek (query->handles));
+  for (i = 0; i < N_KNOWN_WORDS; i++)
+    {
+      if ((query->data->known[i] & ~caps->data->known[i]) != 0)
+        return FALSE;
+    }
+
+  if (others_is_empty (query))
+    return TRUE;
+
+  if (caps->data->others == NULL)
+    return FALSE;
+
+  tp_intset_iter_init (&iter, tp_handle_set_peek (query->data->others));
 
   while (tp_intset_iter_next (&iter))
     {
-      if (!tp_handle_set_is_member (caps->handles, iter.element))
+      if (!tp_handle_set_is_member (caps->data->others, iter.element))
         {
           return FALSE;
         }
@@ -635,21 +917,46 @@ gabble_capability_set_equals (const GabbleCapabilitySet *a,
   g_return_val_if_fail (a != NULL, FALSE);
   g_return_val_if_fail (b != NULL, FALSE);
 
-  return tp_intset_is_equal (tp_handle_set_peek (a->handles),
-      tp_handle_set_peek (b->handles));
+  if (a->data == b->data)
+    return TRUE;
+
+  if (memcmp (a->data->known, b->data->known, sizeof (a->data->known)) != 0)
+    return FALSE;
+
+  if (others_is_empty (a) || others_is_empty (b))
+    return others_is_empty (a) && others_is_empty (b);
+
+  return tp_intset_is_equal (tp_handle_set_peek (a->data->others),
+      tp_handle_set_peek (b->data->others));
 }
 
-/* Does not iterate over quirks, only real features. */
-void
-gabble_capability_set_foreach (const GabbleCapabilitySet *caps,
-    GFunc func, gpointer user_data)
+static void
+capability_set_foreach (const GabbleCapabilitySet *caps,
+    gboolean include_quirks,
+    GFunc func,
+    gpointer user_data)
 {
   TpIntSetIter iter;
+  guint bit;
 
   g_return_if_fail (caps != NULL);
   g_return_if_fail (func != NULL);
 
-  tp_intset_iter_init (&iter, tp_handle_set_peek (caps->handles));
+  for (bit = 0; bit < n_known_features; bit++)
+    {
+      const gchar *var = known_features[bit];
+
+      if ((caps->data->known[KNOWN_WORD (bit)] & KNOWN_MASK (bit)) == 0)
+        continue;
+
+      if (include_quirks || var[0] != QUIRK_PREFIX_CHAR)
+        func ((gchar *) var, user_data);
+    }
+
+  if (caps->data->others == NULL)
+    return;
+
+  tp_intset_iter_init (&iter, tp_handle_set_peek (caps->data->others));
 
   while (tp_intset_iter_next (&iter))
     {
@@ -657,36 +964,54 @@ gabble_capability_set_foreach (const GabbleCapabilitySet *caps,
 
       g_return_if_fail (var != NULL);
 
-      if (var[0] != QUIRK_PREFIX_CHAR)
+      if (include_quirks || var[0] != QUIRK_PREFIX_CHAR)
         func ((gchar *) var, user_data);
     }
 }
 
-static void
-append_intset (GString *ret,
-    const TpIntSet *cap_ints,
-    const gchar *indent)
+/* Does not iterate over quirks, only real features. */
+void
+gabble_capability_set_foreach (const GabbleCapabilitySet *caps,
+    GFunc func, gpointer user_data)
 {
-  TpIntSetFastIter iter;
-  guint element;
+  capability_set_foreach (caps, FALSE, func, user_data);
+}
 
-  tp_intset_fast_iter_init (&iter, cap_ints);
+/* Like gabble_capability_set_foreach (), but iterates over quirks too. */
+void
+gabble_capability_set_foreach_with_quirks (const GabbleCapabilitySet *caps,
+    GFunc func, gpointer user_data)
+{
+  capability_set_foreach (caps, TRUE, func, user_data);
+}
+
+static void
+append_feature (gpointer data,
+    gpointer user_data)
+{
+  const gchar *var = data;
+  gpointer *args = user_data;
+  GString *ret = args[0];
+  const gchar *indent = args[1];
 
-  while (tp_intset_fast_iter_next (&iter, &element))
+  if (var[0] == QUIRK_PREFIX_CHAR)
     {
-      const gchar *var = tp_handle_inspect (feature_handles, element);
+      g_string_append_printf (ret, "%sQuirk:   %s\n", indent, var + 1);
+    }
+  else
+    {
+      g_string_append_printf (ret, "%sFeature: %s\n", indent, var);
+    }
+}
 
-      g_return_if_fail (var != NULL);
+static void
+append_set (GString *ret,
+    const GabbleCapabilitySet *caps,
+    const gchar *indent)
+{
+  gpointer args[] = { ret, (gpointer) indent };
 
-      if (var[0] == QUIRK_PREFIX_CHAR)
-        {
-          g_string_append_printf (ret, "%sQuirk:   %s\n", indent, var + 1);
-        }
-      else
-        {
-          g_string_append_printf (ret, "%sFeature: %s\n", indent, var);
-        }
-    }
+  gabble_capability_set_foreach_with_quirks (caps, append_feature, args);
 }
 
 gchar *
@@ -702,7 +1027,7 @@ gabble_capability_set_dump (const GabbleCapabilitySet *caps,
 
   ret = g_string_new (indent);
   g_string_append (ret, "--begin--\n");
-  append_intset (ret, tp_handle_set_peek (caps->handles), indent);
+  append_set (ret, caps, indent);
   g_string_append (ret, indent);
   g_string_append (ret, "--end--\n");
   return g_string_free (ret, FALSE);
@@ -713,42 +1038,41 @@ gabble_capability_set_dump_diff (const GabbleCapabilitySet *old_caps,
     const GabbleCapabilitySet *new_caps,
     const gchar *indent)
 {
-  TpIntSet *old_ints, *new_ints, *rem, *add;
+  GabbleCapabilitySet *rem, *add;
   GString *ret;
 
   g_return_val_if_fail (old_caps != NULL, NULL);
   g_return_val_if_fail (new_caps != NULL, NULL);
 
-  old_ints = tp_handle_set_peek (old_caps->handles);
-  new_ints = tp_handle_set_peek (new_caps->handles);
-
-  if (tp_intset_is_equal (old_ints, new_ints))
+  if (gabble_capability_set_equals (old_caps, new_caps))
     return g_strdup_printf ("%s--no change--", indent);
 
-  rem = tp_intset_difference (old_ints, new_ints);
-  add = tp_intset_difference (new_ints, old_ints);
+  rem = gabble_capability_set_copy (old_caps);
+  gabble_capability_set_exclude (rem, new_caps);
+  add = gabble_capability_set_copy (new_caps);
+  gabble_capability_set_exclude (add, old_caps);
 
   ret = g_string_new ("");
 
-  if (!tp_intset_is_empty (rem))
+  if (gabble_capability_set_size (rem) > 0)
     {
       g_string_append (ret, indent);
       g_string_append (ret, "--removed--\n");
-      append_intset (ret, rem, indent);
+      append_set (ret, rem, indent);
     }
 
-  if (!tp_intset_is_empty (add))
+  if (gabble_capability_set_size (add) > 0)
     {
       g_string_append (ret, indent);
       g_string_append (ret, "--added--\n");
-      append_intset (ret, add, indent);
+      append_set (ret, add, indent);
     }
 
   g_string_append (ret, indent);
   g_string_append (ret, "--end--");
 
-  tp_intset_destroy (add);
-  tp_intset_destroy (rem);
+  gabble_capability_set_free (add);
+  gabble_capability_set_free (rem);
 
   return g_string_free (ret, FALSE);
 }
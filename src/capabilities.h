@@ -67,6 +67,9 @@ const GabbleCapabilitySet *gabble_capabilities_get_bundle_video_v1 (void);
 /* Return the capabilities we always have */
 const GabbleCapabilitySet *gabble_capabilities_get_fixed_caps (void);
 
+void gabble_capability_set_foreach_with_quirks (
+    const GabbleCapabilitySet *caps, GFunc func, gpointer user_data);
+
 void gabble_capabilities_init (gpointer conn);
 void gabble_capabilities_finalize (gpointer conn);
 
@@ -28,6 +28,7 @@
 
 #define DEBUG_FLAG GABBLE_DEBUG_CONNECTION
 
+#include "conn-presence.h"
 #include "connection.h"
 #include "debug.h"
 #include "namespaces.h"
@@ -265,7 +266,8 @@ aliases_request_basic_pep_cb (GabbleConnection *self,
     {
       /* no alias in PEP, get the vcard */
       gabble_vcard_manager_request (self->vcard_manager, handle, 0,
-        NULL, NULL, G_OBJECT (self));
+        GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND, NULL, NULL,
+        G_OBJECT (self));
     }
 }
 
@@ -310,7 +312,8 @@ aliases_request_pep_cb (GabbleConnection *self,
     {
       /* not in PEP and we have no vCard - chain to looking up their vCard */
       GabbleVCardManagerRequest *vcard_request = gabble_vcard_manager_request
-          (self->vcard_manager, handle, 0, aliases_request_vcard_cb,
+          (self->vcard_manager, handle, 0,
+           GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL, aliases_request_vcard_cb,
            aliases_request, G_OBJECT (self));
 
       g_free (alias);
@@ -350,6 +353,7 @@ static GabbleRequestPipelineItem *
 gabble_do_pep_request (GabbleConnection *self,
                        TpHandle handle,
                        TpHandleRepoIface *contact_handles,
+                       GabbleRequestPipelinePriority priority,
                        GabbleRequestPipelineCb callback,
                        gpointer user_data)
 {
@@ -381,7 +385,7 @@ gabble_do_pep_request (GabbleConnection *self,
       ')',
       NULL);
    pep_request = gabble_request_pipeline_enqueue (self->req_pipeline,
-      msg, 0, pep_request_cb, ctx);
+      msg, 0, priority, pep_request_cb, ctx);
    lm_message_unref (msg);
 
    return pep_request;
@@ -456,7 +460,9 @@ gabble_connection_request_aliases (TpSvcConnectionInterfaceAliasing *iface,
 
           request->pending_pep_requests++;
           request->pep_requests[i] = gabble_do_pep_request (self,
-              handle, contact_handles, aliases_request_pep_cb, data);
+              handle, contact_handles,
+              GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL, aliases_request_pep_cb,
+              data);
 
         }
       else
@@ -466,7 +472,8 @@ gabble_connection_request_aliases (TpSvcConnectionInterfaceAliasing *iface,
 
           g_free (alias);
           vcard_request = gabble_vcard_manager_request (self->vcard_manager,
-              handle, 0, aliases_request_vcard_cb, request, G_OBJECT (self));
+              handle, 0, GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL,
+              aliases_request_vcard_cb, request, G_OBJECT (self));
 
           request->vcard_requests[i] = vcard_request;
           request->pending_vcard_requests++;
@@ -795,18 +802,19 @@ gabble_conn_aliasing_pep_nick_reply_handler (GabbleConnection *conn,
 }
 
 
-void
-gabble_conn_aliasing_nickname_updated (GObject *object,
-                                       TpHandle handle,
-                                       gpointer user_data)
+/* Adds the alias change for @handle which @object has just told us about to
+ * @aliases, unless it's overridden by an alias from a better source. */
+static void
+add_alias_change (GabbleConnection *conn,
+    GObject *object,
+    TpHandle handle,
+    GPtrArray *aliases)
 {
-  GabbleConnection *conn = GABBLE_CONNECTION (user_data);
   GabbleConnectionAliasSource signal_source, current_source;
   gchar *alias = NULL;
-  GPtrArray *aliases;
   GValue entry = { 0, };
 
-  if (object == user_data)
+  if (object == (GObject *) conn)
     {
       /* actually PEP */
       signal_source = GABBLE_CONNECTION_ALIAS_FROM_PRESENCE;
@@ -853,14 +861,8 @@ gabble_conn_aliasing_nickname_updated (GObject *object,
       1, alias,
       G_MAXUINT);
 
-  aliases = g_ptr_array_sized_new (1);
-  g_ptr_array_add (aliases, g_value_get_boxed (&entry));
-
-
-  tp_svc_connection_interface_aliasing_emit_aliases_changed (conn, aliases);
-
+  g_ptr_array_add (aliases, g_value_dup_boxed (&entry));
   g_value_unset (&entry);
-  g_ptr_array_free (aliases, TRUE);
 
   /* Check whether the roster has an entry for the handle and if so, set the
    * roster alias so the vCard isn't fetched on every connect. */
@@ -872,6 +874,55 @@ OUT:
   g_free (alias);
 }
 
+static void
+emit_aliases_changed (GabbleConnection *conn,
+    GPtrArray *aliases)
+{
+  guint i;
+
+  if (aliases->len > 0)
+    {
+      conn_presence_flush_pending_updates (conn);
+      tp_svc_connection_interface_aliasing_emit_aliases_changed (conn,
+          aliases);
+    }
+
+  for (i = 0; i < aliases->len; i++)
+    g_boxed_free (TP_STRUCT_TYPE_ALIAS_PAIR, g_ptr_array_index (aliases, i));
+
+  g_ptr_array_free (aliases, TRUE);
+}
+
+void
+gabble_conn_aliasing_nickname_updated (GObject *object,
+                                       TpHandle handle,
+                                       gpointer user_data)
+{
+  GabbleConnection *conn = GABBLE_CONNECTION (user_data);
+  GPtrArray *aliases = g_ptr_array_sized_new (1);
+
+  add_alias_change (conn, object, handle, aliases);
+  emit_aliases_changed (conn, aliases);
+}
+
+/* Like gabble_conn_aliasing_nickname_updated(), but for several contacts at
+ * once, which are reported in a single AliasesChanged signal. */
+void
+gabble_conn_aliasing_nicknames_updated (GObject *object,
+    const GArray *handles,
+    gpointer user_data)
+{
+  GabbleConnection *conn = GABBLE_CONNECTION (user_data);
+  GPtrArray *aliases = g_ptr_array_sized_new (handles->len);
+  guint i;
+
+  for (i = 0; i < handles->len; i++)
+    add_alias_change (conn, object, g_array_index (handles, TpHandle, i),
+        aliases);
+
+  emit_aliases_changed (conn, aliases);
+}
+
 static void
 set_or_clear (gchar **target,
     gchar *source)
@@ -1074,12 +1125,14 @@ maybe_request_vcard (GabbleConnection *self, TpHandle handle,
             tp_base_connection_get_handles (base, TP_HANDLE_TYPE_CONTACT);
 
           gabble_do_pep_request (self, handle, contact_handles,
+            GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND,
             aliases_request_basic_pep_cb, GUINT_TO_POINTER (handle));
         }
       else
         {
           gabble_vcard_manager_request (self->vcard_manager,
-             handle, 0, NULL, NULL, G_OBJECT (self));
+             handle, 0, GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND, NULL,
+             NULL, G_OBJECT (self));
         }
     }
 }
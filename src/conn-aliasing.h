@@ -32,6 +32,8 @@ void conn_aliasing_iface_init (gpointer g_iface, gpointer iface_data);
 
 void gabble_conn_aliasing_nickname_updated (GObject *object,
     TpHandle handle, gpointer user_data);
+void gabble_conn_aliasing_nicknames_updated (GObject *object,
+    const GArray *handles, gpointer user_data);
 
 GabbleConnectionAliasSource _gabble_connection_get_cached_alias (
     GabbleConnection *, TpHandle, gchar **);
@@ -91,10 +91,15 @@ connection_avatar_update_cb (GabblePresenceCache *cache,
   g_assert (sha1 != NULL);
 
   if (handle == base->self_handle)
-    update_own_avatar_sha1 (conn, sha1, NULL);
+    {
+      update_own_avatar_sha1 (conn, sha1, NULL);
+    }
   else
-    tp_svc_connection_interface_avatars_emit_avatar_updated (conn,
-        handle, sha1);
+    {
+      conn_presence_flush_pending_updates (conn);
+      tp_svc_connection_interface_avatars_emit_avatar_updated (conn,
+          handle, sha1);
+    }
 }
 
 /* Called when our vCard is first fetched, so we can start putting the
@@ -618,7 +623,8 @@ gabble_connection_request_avatar (TpSvcConnectionInterfaceAvatars *iface,
   else
     {
       gabble_vcard_manager_request (self->vcard_manager, contact, 0,
-          _request_avatar_cb, context, NULL);
+          GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE, _request_avatar_cb,
+          context, NULL);
     }
 }
 
@@ -720,7 +726,8 @@ gabble_connection_request_avatars (TpSvcConnectionInterfaceAvatars *iface,
                   GUINT_TO_POINTER (contact), ctx);
 
               gabble_vcard_manager_request (self->vcard_manager,
-                contact, 0, request_avatars_cb, ctx, NULL);
+                contact, 0, GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND,
+                request_avatars_cb, ctx, NULL);
             }
         }
     }
@@ -27,6 +27,7 @@
 #include <extensions/extensions.h>
 
 #include "conn-client-types.h"
+#include "conn-presence.h"
 #include "disco.h"
 #include "namespaces.h"
 #include "presence.h"
@@ -196,6 +197,7 @@ idle_timeout (gpointer user_data)
 
   if (get_client_types_from_handle (data->conn, data->handle, &types))
     {
+      conn_presence_flush_pending_updates (data->conn);
       tp_svc_connection_interface_client_types_emit_client_types_updated (
           data->conn, data->handle, (const gchar **) types);
       g_strfreev (types);
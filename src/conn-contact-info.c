@@ -589,11 +589,12 @@ gabble_connection_refresh_contact_info (TpSvcConnectionInterfaceContactInfo *ifa
         {
           GabbleVCardManagerRequest *request;
 
-          gabble_vcard_manager_invalidate_cache (self->vcard_manager,
+          gabble_vcard_manager_invalidate_stored (self->vcard_manager,
             contact);
 
           request = gabble_vcard_manager_request (self->vcard_manager,
-            contact, 0, _request_vcards_cb, self, NULL);
+            contact, 0, GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL,
+            _request_vcards_cb, self, NULL);
 
           g_hash_table_insert (self->vcard_requests,
               GUINT_TO_POINTER (contact), request);
@@ -639,7 +640,8 @@ gabble_connection_request_contact_info (TpSvcConnectionInterfaceContactInfo *ifa
     _return_from_request_contact_info (vcard_node, NULL, context);
   else
     gabble_vcard_manager_request (self->vcard_manager, contact, 0,
-        _request_vcard_cb, context, NULL);
+        GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE, _request_vcard_cb,
+        context, NULL);
 }
 
 static GabbleVCardManagerEditInfo *
@@ -11,6 +11,7 @@
 #include <telepathy-glib/gtypes.h>
 #include <telepathy-glib/interfaces.h>
 
+#include "conn-presence.h"
 #include "debug.h"
 #include "namespaces.h"
 #include "presence-cache.h"
@@ -605,6 +606,7 @@ update_location_from_msg (GabbleConnection *conn,
       g_hash_table_insert (location, g_strdup (mapping->tp_name), value);
     }
 
+  conn_presence_flush_pending_updates (conn);
   tp_svc_connection_interface_location_emit_location_updated (conn,
       contact, location);
   gabble_presence_cache_update_location (conn->presence_cache, contact,
@@ -22,6 +22,7 @@
 
 #define DEBUG_FLAG GABBLE_DEBUG_CONNECTION
 #include "debug.h"
+#include "conn-presence.h"
 #include "namespaces.h"
 #include "util.h"
 #include "conn-util.h"
@@ -70,6 +71,9 @@ maybe_emit_power_saving_changed (GabbleConnection *self,
 
   if (enabling != enabled)
     {
+      /* presence changes are signalled straight away in power saving mode,
+       * so those still waiting should go first */
+      conn_presence_flush_pending_updates (self);
       g_object_set (self, "power-saving", enabling, NULL);
       tp_svc_connection_interface_power_saving_emit_power_saving_changed (
           self, enabling);
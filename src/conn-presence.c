@@ -48,6 +48,13 @@
 
 #define GOOGLE_SHARED_STATUS_VERSION "2"
 
+/* Presence changes reported by the cache are held back for up to this many
+ * milliseconds, so that the flood of presences after connecting becomes a
+ * few PresencesChanged signals rather than one per contact. It can be
+ * overridden with GABBLE_PRESENCE_COALESCE_DELAY; 0 means at the end of the
+ * current main loop iteration. */
+#define PRESENCE_COALESCE_DELAY 50
+
 typedef enum {
     INVISIBILITY_METHOD_NONE = 0,
     INVISIBILITY_METHOD_PRESENCE_INVISIBLE, /* presence type=invisible */
@@ -86,6 +93,11 @@ struct _GabbleConnectionPresencePrivate {
 
     /* The previous presence when using shared status */
     GabblePresenceId previous_shared_status;
+
+    /* Contacts whose presence changes haven't been signalled yet, and the
+     * source which will signal them */
+    TpHandleSet *pending_updates;
+    guint pending_updates_id;
 };
 
 static const TpPresenceStatusOptionalArgumentSpec gabble_status_arguments[] = {
@@ -235,6 +247,65 @@ construct_contact_statuses_cb (GObject *obj,
   return contact_statuses;
 }
 
+/**
+ * conn_presence_coalesce_delay:
+ *
+ * Returns: how many milliseconds presence and membership changes from a
+ *  flood of presences may be held back to be signalled together, 0 meaning
+ *  until the end of the current main loop iteration
+ */
+guint
+conn_presence_coalesce_delay (void)
+{
+  static gboolean initialized = FALSE;
+  static guint delay = PRESENCE_COALESCE_DELAY;
+
+  if (!initialized)
+    {
+      const gchar *str = g_getenv ("GABBLE_PRESENCE_COALESCE_DELAY");
+
+      if (str != NULL)
+        delay = (guint) g_ascii_strtoull (str, NULL, 10);
+
+      initialized = TRUE;
+    }
+
+  return delay;
+}
+
+/**
+ * conn_presence_coalesce_add:
+ * @function: called once the coalescing delay has passed
+ * @data: passed to @function
+ *
+ * Returns: the ID of the source calling @function
+ */
+guint
+conn_presence_coalesce_add (GSourceFunc function,
+    gpointer data)
+{
+  guint delay = conn_presence_coalesce_delay ();
+
+  if (delay == 0)
+    return g_idle_add (function, data);
+
+  return g_timeout_add (delay, function, data);
+}
+
+static void
+cancel_pending_updates (GabbleConnection *self)
+{
+  GabbleConnectionPresencePrivate *priv = self->presence_priv;
+
+  if (priv->pending_updates_id != 0)
+    {
+      g_source_remove (priv->pending_updates_id);
+      priv->pending_updates_id = 0;
+    }
+
+  tp_clear_pointer (&priv->pending_updates, tp_handle_set_destroy);
+}
+
 /**
  * conn_presence_emit_presence_update:
  * @self: A #GabbleConnection
@@ -242,19 +313,136 @@ construct_contact_statuses_cb (GObject *obj,
  *                    the contacts to emit presence for
  *
  * Emits the Telepathy PresenceUpdate signal with the current
- * stored presence information for the given contact.
+ * stored presence information for the given contact, straight away. Any
+ * changes queued by conn_presence_queue_presence_update () are signalled
+ * with it.
  */
 void
 conn_presence_emit_presence_update (
     GabbleConnection *self,
     const GArray *contact_handles)
 {
+  GabbleConnectionPresencePrivate *priv = self->presence_priv;
   GHashTable *contact_statuses;
+  GArray *merged = NULL;
+
+  if (priv->pending_updates != NULL)
+    {
+      guint i;
+
+      for (i = 0; i < contact_handles->len; i++)
+        tp_handle_set_add (priv->pending_updates,
+            g_array_index (contact_handles, TpHandle, i));
+
+      merged = tp_handle_set_to_array (priv->pending_updates);
+      contact_handles = merged;
+    }
 
   contact_statuses = construct_contact_statuses_cb ((GObject *) self,
       contact_handles, NULL);
   tp_presence_mixin_emit_presence_update ((GObject *) self, contact_statuses);
   g_hash_table_destroy (contact_statuses);
+
+  if (merged != NULL)
+    {
+      /* the pending set kept the handles valid until now */
+      g_array_free (merged, TRUE);
+      cancel_pending_updates (self);
+    }
+}
+
+/**
+ * conn_presence_flush_pending_updates:
+ * @self: A #GabbleConnection
+ *
+ * Signals any presence changes queued by
+ * conn_presence_queue_presence_update () straight away. This is called
+ * before signalling anything else about contacts, such as their aliases,
+ * capabilities or messages, so that clients see changes in the order they
+ * happened.
+ */
+void
+conn_presence_flush_pending_updates (GabbleConnection *self)
+{
+  GabbleConnectionPresencePrivate *priv = self->presence_priv;
+  TpHandleSet *pending = priv->pending_updates;
+  GArray *handles;
+
+  if (pending == NULL)
+    return;
+
+  if (priv->pending_updates_id != 0)
+    {
+      g_source_remove (priv->pending_updates_id);
+      priv->pending_updates_id = 0;
+    }
+
+  /* the set keeps the handles valid until they have been signalled */
+  priv->pending_updates = NULL;
+  handles = tp_handle_set_to_array (pending);
+
+  DEBUG ("signalling %u coalesced presence changes", handles->len);
+  conn_presence_emit_presence_update (self, handles);
+  g_array_free (handles, TRUE);
+  tp_handle_set_destroy (pending);
+}
+
+static gboolean
+emit_pending_updates_cb (gpointer data)
+{
+  GabbleConnection *self = data;
+
+  self->presence_priv->pending_updates_id = 0;
+  conn_presence_flush_pending_updates (self);
+  return FALSE;
+}
+
+/**
+ * conn_presence_queue_presence_update:
+ * @self: A #GabbleConnection
+ * @contact_handles: the contacts whose presence has changed
+ *
+ * Like conn_presence_emit_presence_update (), but waits for
+ * conn_presence_coalesce_delay () so that further changes to the same or
+ * other contacts are signalled together.
+ *
+ * In power saving mode, stanzas are already held back and then delivered
+ * in a burst, in order; each change in the burst is signalled as it's
+ * delivered, so that it's not reordered with the other signals the burst
+ * causes.
+ */
+void
+conn_presence_queue_presence_update (
+    GabbleConnection *self,
+    const GArray *contact_handles)
+{
+  GabbleConnectionPresencePrivate *priv = self->presence_priv;
+  gboolean power_saving;
+  guint i;
+
+  if (contact_handles->len == 0)
+    return;
+
+  g_object_get (self, "power-saving", &power_saving, NULL);
+
+  if (power_saving)
+    {
+      conn_presence_emit_presence_update (self, contact_handles);
+      return;
+    }
+
+  if (priv->pending_updates == NULL)
+    priv->pending_updates = tp_handle_set_new (
+        tp_base_connection_get_handles ((TpBaseConnection *) self,
+          TP_HANDLE_TYPE_CONTACT));
+
+  for (i = 0; i < contact_handles->len; i++)
+    tp_handle_set_add (priv->pending_updates,
+        g_array_index (contact_handles, TpHandle, i));
+
+  if (priv->pending_updates_id == 0)
+    priv->pending_updates_id = conn_presence_coalesce_add (
+        emit_pending_updates_cb, self);
 }
 
 
@@ -1883,7 +2071,7 @@ connection_presences_updated_cb (
 {
   GabbleConnection *conn = GABBLE_CONNECTION (user_data);
 
-  conn_presence_emit_presence_update (conn, handles);
+  conn_presence_queue_presence_update (conn, handles);
 }
 
 
@@ -1896,6 +2084,8 @@ connection_status_changed_cb (
 {
   if (status == TP_CONNECTION_STATUS_CONNECTED)
     emit_presences_changed_for_self (conn);
+  else if (status == TP_CONNECTION_STATUS_DISCONNECTED)
+    cancel_pending_updates (conn);
 }
 
 
@@ -2011,6 +2201,8 @@ conn_presence_dispose (GabbleConnection *self)
   GabbleConnectionPresencePrivate *priv = self->presence_priv;
   WockyPorter *porter;
 
+  cancel_pending_updates (self);
+
   if (self->session == NULL)
     return;
 
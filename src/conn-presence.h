@@ -47,6 +47,11 @@ void conn_presence_dispose (GabbleConnection *self);
 void conn_presence_iface_init (gpointer g_iface, gpointer iface_data);
 void conn_presence_emit_presence_update (
     GabbleConnection *, const GArray *contact_handles);
+void conn_presence_queue_presence_update (
+    GabbleConnection *, const GArray *contact_handles);
+void conn_presence_flush_pending_updates (GabbleConnection *self);
+guint conn_presence_coalesce_delay (void);
+guint conn_presence_coalesce_add (GSourceFunc function, gpointer data);
 gboolean conn_presence_signal_own_presence (GabbleConnection *self,
     const gchar *to, GError **error);
 gboolean conn_presence_visible_to (GabbleConnection *self,
@@ -394,6 +394,8 @@ gabble_connection_constructor (GType type,
   self->vcard_manager = gabble_vcard_manager_new (self);
   g_signal_connect (self->vcard_manager, "nickname-update", G_CALLBACK
       (gabble_conn_aliasing_nickname_updated), self);
+  g_signal_connect (self->vcard_manager, "nicknames-update", G_CALLBACK
+      (gabble_conn_aliasing_nicknames_updated), self);
 
   self->presence_cache = gabble_presence_cache_new (self);
   g_signal_connect (self->presence_cache, "nickname-update", G_CALLBACK
@@ -2960,6 +2962,8 @@ _emit_capabilities_changed (GabbleConnection *conn,
   if (gabble_capability_set_equals (old_set, new_set))
     return;
 
+  conn_presence_flush_pending_updates (conn);
+
   /* o.f.T.C.Capabilities */
 
   caps_arr = g_ptr_array_new ();
@@ -0,0 +1,241 @@
+/*
+ * dbus-reassembler.c - Splits a byte stream into D-Bus messages
+ *
+ * Copyright (C) 2011 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* 1-1 D-Bus tubes carry marshalled D-Bus messages over a stream bytestream,
+ * which doesn't preserve message boundaries. The reassembler finds them
+ * again.
+ *
+ * Messages which are wholly inside a received chunk are handed on where they
+ * are, without being copied. Only a message split between chunks is copied,
+ * into a buffer which never holds more than that one message; once it is
+ * complete and handed on, the buffer is emptied rather than shifted, so each
+ * byte is copied at most once however many messages a chunk holds.
+ */
+
+#include "config.h"
+#include "dbus-reassembler.h"
+
+#include <dbus/dbus.h>
+
+#define DEBUG_FLAG GABBLE_DEBUG_TUBES
+
+#include "debug.h"
+#include "util.h"
+
+/* Each D-Bus message has a 16-byte fixed header, in which
+ *
+ * * byte 0 is 'l' (ell) or 'B' for endianness
+ * * bytes 4-7 are body length "n" in bytes in that endianness
+ * * bytes 12-15 are length "m" of param array in bytes in that
+ *   endianness
+ *
+ * followed by m + n + ((8 - (m % 8)) % 8) bytes of other content.
+ */
+#define HEADER_LENGTH 16
+
+/* If a huge message made the buffer for split messages grow beyond this, it
+ * is freed once that message has been handed on */
+#define MAX_KEPT_BUFFER_SIZE (64 * 1024)
+
+struct _GabbleDBusReassembler
+{
+  /* The start of a message which was split between chunks */
+  GString *partial;
+  /* The length of that message, or 0 if we don't have all its header yet */
+  gsize needed;
+};
+
+GabbleDBusReassembler *
+gabble_dbus_reassembler_new (void)
+{
+  GabbleDBusReassembler *self = g_slice_new0 (GabbleDBusReassembler);
+
+  self->partial = g_string_sized_new (HEADER_LENGTH);
+  return self;
+}
+
+void
+gabble_dbus_reassembler_free (GabbleDBusReassembler *self)
+{
+  if (self == NULL)
+    return;
+
+  g_string_free (self->partial, TRUE);
+  g_slice_free (GabbleDBusReassembler, self);
+}
+
+static guint32
+collect_le32 (const gchar *str)
+{
+  const guchar *bytes = (const guchar *) str;
+
+  return (guint32) bytes[0] | ((guint32) bytes[1] << 8) |
+      ((guint32) bytes[2] << 16) | ((guint32) bytes[3] << 24);
+}
+
+/* Works out the length of the message starting with @header, which must be
+ * at least HEADER_LENGTH bytes long. Returns FALSE if it can't be a valid
+ * message. */
+static gboolean
+get_message_length (const gchar *header,
+    gsize *length)
+{
+  guint32 body_length, params_length, m;
+
+  if (header[0] == DBUS_BIG_ENDIAN)
+    {
+      body_length = gabble_collect_be32 (header + 4);
+      m = gabble_collect_be32 (header + 12);
+    }
+  else if (header[0] == DBUS_LITTLE_ENDIAN)
+    {
+      body_length = collect_le32 (header + 4);
+      m = collect_le32 (header + 12);
+    }
+  else
+    {
+      DEBUG ("D-Bus message has unknown endianness byte 0x%x",
+          (unsigned int) (guchar) header[0]);
+      return FALSE;
+    }
+
+  /* Check the parts before adding them up, so that the sum can't overflow
+   * on 32-bit platforms */
+  if (body_length > DBUS_MAXIMUM_MESSAGE_LENGTH ||
+      m > DBUS_MAXIMUM_ARRAY_LENGTH)
+    {
+      DEBUG ("D-Bus message is too large to be valid");
+      return FALSE;
+    }
+
+  /* pad to 8-byte boundary */
+  params_length = m + ((8 - (m % 8)) % 8);
+  *length = (gsize) params_length + body_length + HEADER_LENGTH;
+
+  if (*length > DBUS_MAXIMUM_MESSAGE_LENGTH)
+    {
+      DEBUG ("D-Bus message is too large to be valid");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Copies as much of [*data, end) into the buffer as it takes to make it
+ * @target bytes long. Returns TRUE if it now is. */
+static gboolean
+fill_partial (GabbleDBusReassembler *self,
+    gsize target,
+    const gchar **data,
+    const gchar *end)
+{
+  gsize available = end - *data;
+  gsize wanted = target - self->partial->len;
+  gsize take = MIN (wanted, available);
+
+  g_string_append_len (self->partial, *data, take);
+  *data += take;
+
+  return self->partial->len == target;
+}
+
+/**
+ * gabble_dbus_reassembler_push:
+ * @self: a reassembler
+ * @data: the next bytes received
+ * @len: the length of @data
+ * @func: called with each message completed by @data, in order
+ * @user_data: passed to @func
+ *
+ * Returns: %FALSE if the stream can't be a sequence of D-Bus messages, in
+ *  which case it should be closed; the reassembler must not be used again.
+ */
+gboolean
+gabble_dbus_reassembler_push (GabbleDBusReassembler *self,
+    const gchar *data,
+    gsize len,
+    GabbleDBusReassemblerFunc func,
+    gpointer user_data)
+{
+  const gchar *end = data + len;
+  gsize length;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (func != NULL, FALSE);
+
+  /* First finish the message left over from the last chunk, if any */
+  if (self->partial->len > 0)
+    {
+      if (self->needed == 0)
+        {
+          if (!fill_partial (self, HEADER_LENGTH, &data, end))
+            return TRUE;
+
+          if (!get_message_length (self->partial->str, &self->needed))
+            return FALSE;
+        }
+
+      if (!fill_partial (self, self->needed, &data, end))
+        return TRUE;
+
+      DEBUG ("Received complete D-Bus message of size %" G_GSIZE_FORMAT,
+          self->needed);
+      func (self->partial->str, self->partial->len, user_data);
+
+      self->needed = 0;
+
+      if (self->partial->allocated_len > MAX_KEPT_BUFFER_SIZE)
+        {
+          g_string_free (self->partial, TRUE);
+          self->partial = g_string_sized_new (HEADER_LENGTH);
+        }
+      else
+        {
+          g_string_truncate (self->partial, 0);
+        }
+    }
+
+  /* Then hand on every message which is wholly inside this chunk where it
+   * is */
+  while ((gsize) (end - data) >= HEADER_LENGTH)
+    {
+      if (!get_message_length (data, &length))
+        return FALSE;
+
+      if ((gsize) (end - data) < length)
+        {
+          self->needed = length;
+          break;
+        }
+
+      func (data, length, user_data);
+      data += length;
+    }
+
+  /* And keep the start of the next one for later */
+  if (data < end)
+    {
+      DEBUG ("keeping %" G_GSIZE_FORMAT " bytes of a split D-Bus message",
+          (gsize) (end - data));
+      g_string_append_len (self->partial, data, end - data);
+    }
+
+  return TRUE;
+}
@@ -0,0 +1,48 @@
+/*
+ * dbus-reassembler.h - Header for the D-Bus message reassembler
+ *
+ * Copyright (C) 2011 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GABBLE_DBUS_REASSEMBLER_H__
+#define __GABBLE_DBUS_REASSEMBLER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GabbleDBusReassembler GabbleDBusReassembler;
+
+/**
+ * GabbleDBusReassemblerFunc:
+ * @data: a complete marshalled D-Bus message, only valid during the call
+ * @len: its length in bytes
+ * @user_data: the user data passed to gabble_dbus_reassembler_push ()
+ */
+typedef void (*GabbleDBusReassemblerFunc) (const gchar *data, gsize len,
+    gpointer user_data);
+
+GabbleDBusReassembler *gabble_dbus_reassembler_new (void);
+void gabble_dbus_reassembler_free (GabbleDBusReassembler *self);
+
+gboolean gabble_dbus_reassembler_push (GabbleDBusReassembler *self,
+    const gchar *data, gsize len, GabbleDBusReassemblerFunc func,
+    gpointer user_data);
+
+G_END_DECLS
+
+#endif /* __GABBLE_DBUS_REASSEMBLER_H__ */
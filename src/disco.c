@@ -25,6 +25,7 @@
 #include "disco.h"
 
 #include <string.h>
+#include <time.h>
 
 #define DBUS_API_SUBJECT_TO_CHANGE
 
@@ -44,6 +45,20 @@
 #define DEFAULT_REQUEST_TIMEOUT 20
 #define DISCO_PIPELINE_SIZE 10
 
+/* Maximum number of disco IQs we have outstanding at once; any more wait in
+ * priv->queued until an earlier one is answered */
+#define DISCO_MAX_IN_FLIGHT 32
+
+/* How long answers to disco#info requests are remembered, in seconds; this is
+ * also how long an account's answers outlive its last connection */
+#define DISCO_CACHE_TTL (10 * 60)
+/* How long error replies to disco#info requests are remembered */
+#define DISCO_CACHE_ERROR_TTL 60
+/* How long we remember that a disco#info request went unanswered */
+#define DISCO_CACHE_TIMEOUT_TTL 30
+/* Maximum number of answers remembered per account */
+#define DISCO_CACHE_SIZE 512
+
 /* signals */
 enum
 {
@@ -63,17 +78,105 @@ enum
 
 G_DEFINE_TYPE(GabbleDisco, gabble_disco, G_TYPE_OBJECT);
 
+/* An IQ asking a particular (type, jid, node) question, shared by all the
+ * GabbleDiscoRequests asking it at the same time */
+typedef struct
+{
+  GabbleDisco *disco;
+  /* "<type> <jid>[ #<node>]", the key in priv->fetches */
+  gchar *key;
+  /* our key in priv->in_flight once we've been sent; never 0 */
+  guint id;
+
+  GabbleDiscoType type;
+  gchar *jid;
+  gchar *node;
+
+  /* GabbleDiscoRequests waiting for the answer, in the order they were
+   * made */
+  GQueue requests;
+  /* Our link in priv->queued, if we haven't been sent yet */
+  GList *queued_link;
+  /* fails every request if no answer has arrived in time */
+  guint timer_id;
+  GTimeVal sent;
+  /* TRUE once we're no longer in priv->fetches, because the answer has
+   * arrived or every request was cancelled */
+  gboolean finished;
+} DiscoFetch;
+
+typedef struct
+{
+  /* same as DiscoFetch.key; borrowed by DiscoCache.entries */
+  gchar *key;
+  /* a copy of the <query/> from the reply, or NULL if it was an error */
+  LmMessageNode *result;
+  /* the error, if @result is NULL */
+  GQuark error_domain;
+  gint error_code;
+  gchar *error_message;
+  time_t expires;
+  /* our link in DiscoCache.lru */
+  GList *link;
+} DiscoCacheEntry;
+
+/* Answers to the disco#info requests made by one account of bare JIDs:
+ * the server, services on it, and rooms. These are shared by all of the
+ * account's connections, and kept for a while after the last one goes away,
+ * so reconnecting doesn't mean asking about every room and component
+ * again. */
+typedef struct
+{
+  gchar *account;
+  guint refcount;
+  /* gchar *key (borrowed from the value) => owned DiscoCacheEntry */
+  GHashTable *entries;
+  /* DiscoCacheEntry, most recently used first */
+  GQueue lru;
+  /* frees the cache once nobody has used it for DISCO_CACHE_TTL */
+  guint expire_id;
+} DiscoCache;
+
+/* gchar *account (borrowed from the value) => DiscoCache */
+static GHashTable *shared_caches = NULL;
+
 struct _GabbleDiscoPrivate
 {
   GabbleConnection *connection;
   GSList *service_cache;
   GList *requests;
+
+  /* NULL until we're connected and know which account we are */
+  DiscoCache *cache;
+
+  /* gchar *key (borrowed from the value) => DiscoFetch, sent or not */
+  GHashTable *fetches;
+  /* GUINT_TO_POINTER (DiscoFetch.id) => DiscoFetch which has been sent and
+   * not yet answered. Replies carry the ID rather than the fetch, which may
+   * have been abandoned and freed by the time they arrive. */
+  GHashTable *in_flight;
+  guint last_fetch_id;
+  /* DiscoFetch waiting for room in in_flight, oldest first */
+  GQueue queued;
+
+  /* Counters, see GabbleDiscoStats */
+  guint n_requests;
+  guint cached;
+  guint coalesced;
+  guint sent;
+  guint max_queued;
+  guint completed;
+  guint failed;
+  guint timed_out;
+  GabbleSamples rtts;
+
   gboolean dispose_has_run;
 };
 
 struct _GabbleDiscoRequest
 {
   GabbleDisco *disco;
+  DiscoFetch *fetch;
   guint timer_id;
 
   GabbleDiscoType type;
@@ -82,6 +185,10 @@ struct _GabbleDiscoRequest
   GabbleDiscoCb callback;
   gpointer user_data;
   GObject *bound_object;
+
+  /* If this request is being answered from the cache, a copy of the
+   * answer */
+  DiscoCacheEntry *cached;
 };
 
 GQuark
@@ -93,12 +200,230 @@ gabble_disco_error_quark (void)
   return quark;
 }
 
+/* Exactly one of @result and @error should be non-%NULL */
+static DiscoCacheEntry *
+disco_cache_entry_new (const gchar *key,
+    LmMessageNode *result,
+    const GError *error)
+{
+  DiscoCacheEntry *entry = g_slice_new0 (DiscoCacheEntry);
+
+  entry->key = g_strdup (key);
+
+  if (result != NULL)
+    {
+      entry->result = lm_message_node_ref (result);
+    }
+  else
+    {
+      entry->error_domain = error->domain;
+      entry->error_code = error->code;
+      entry->error_message = g_strdup (error->message);
+    }
+
+  return entry;
+}
+
+static DiscoCacheEntry *
+disco_cache_entry_copy (const DiscoCacheEntry *entry)
+{
+  DiscoCacheEntry *copy = g_slice_new0 (DiscoCacheEntry);
+
+  copy->key = g_strdup (entry->key);
+
+  if (entry->result != NULL)
+    copy->result = lm_message_node_ref (entry->result);
+
+  copy->error_domain = entry->error_domain;
+  copy->error_code = entry->error_code;
+  copy->error_message = g_strdup (entry->error_message);
+  copy->expires = entry->expires;
+  return copy;
+}
+
+/* Returns a new error if @entry's answer is an error, or %NULL */
+static GError *
+disco_cache_entry_dup_error (const DiscoCacheEntry *entry)
+{
+  if (entry->result != NULL)
+    return NULL;
+
+  return g_error_new_literal (entry->error_domain, entry->error_code,
+      entry->error_message);
+}
+
+static void
+disco_cache_entry_free (gpointer data)
+{
+  DiscoCacheEntry *entry = data;
+
+  if (entry->result != NULL)
+    lm_message_node_unref (entry->result);
+
+  g_free (entry->error_message);
+  g_free (entry->key);
+  g_slice_free (DiscoCacheEntry, entry);
+}
+
+static void
+disco_cache_free (DiscoCache *cache)
+{
+  g_hash_table_remove (shared_caches, cache->account);
+
+  if (g_hash_table_size (shared_caches) == 0)
+    tp_clear_pointer (&shared_caches, g_hash_table_destroy);
+
+  g_queue_clear (&cache->lru);
+  g_hash_table_destroy (cache->entries);
+  g_free (cache->account);
+  g_slice_free (DiscoCache, cache);
+}
+
+static gboolean
+disco_cache_expire_cb (gpointer data)
+{
+  DiscoCache *cache = data;
+
+  DEBUG ("forgetting disco answers for %s", cache->account);
+  cache->expire_id = 0;
+  disco_cache_free (cache);
+  return FALSE;
+}
+
+static DiscoCache *
+disco_cache_dup (const gchar *account)
+{
+  DiscoCache *cache = NULL;
+
+  if (shared_caches == NULL)
+    shared_caches = g_hash_table_new (g_str_hash, g_str_equal);
+  else
+    cache = g_hash_table_lookup (shared_caches, account);
+
+  if (cache == NULL)
+    {
+      cache = g_slice_new0 (DiscoCache);
+      cache->account = g_strdup (account);
+      cache->entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+          disco_cache_entry_free);
+      g_queue_init (&cache->lru);
+      g_hash_table_insert (shared_caches, cache->account, cache);
+    }
+  else
+    {
+      DEBUG ("reusing %u disco answers for %s",
+          g_hash_table_size (cache->entries), account);
+    }
+
+  if (cache->expire_id != 0)
+    {
+      g_source_remove (cache->expire_id);
+      cache->expire_id = 0;
+    }
+
+  cache->refcount++;
+  return cache;
+}
+
+static void
+disco_cache_release (DiscoCache *cache)
+{
+  g_assert (cache->refcount > 0);
+
+  if (--cache->refcount > 0)
+    return;
+
+  if (g_hash_table_size (cache->entries) == 0)
+    disco_cache_free (cache);
+  else
+    cache->expire_id = g_timeout_add_seconds (DISCO_CACHE_TTL,
+        disco_cache_expire_cb, cache);
+}
+
+static void
+disco_cache_remove (DiscoCache *cache,
+    const gchar *key)
+{
+  DiscoCacheEntry *entry = g_hash_table_lookup (cache->entries, key);
+
+  if (entry == NULL)
+    return;
+
+  g_queue_delete_link (&cache->lru, entry->link);
+  g_hash_table_remove (cache->entries, key);
+}
+
+/* Returns TRUE if answers to @type requests made of @jid should be cached:
+ * that is, if they're disco#info, and @jid is a bare JID such as a server,
+ * a service on one or a room. Full JIDs are contacts' resources, whose
+ * answers are cached by capabilities hash instead. */
+static gboolean
+disco_cache_wants (GabbleDisco *disco,
+    GabbleDiscoType type,
+    const gchar *jid)
+{
+  return disco->priv->cache != NULL && type == GABBLE_DISCO_TYPE_INFO &&
+      strchr (jid, '/') == NULL;
+}
+
+/* Returns the unexpired answer for @key, if any */
+static DiscoCacheEntry *
+disco_cache_lookup (DiscoCache *cache,
+    const gchar *key)
+{
+  DiscoCacheEntry *entry = g_hash_table_lookup (cache->entries, key);
+
+  if (entry == NULL)
+    return NULL;
+
+  if (entry->expires <= time (NULL))
+    {
+      disco_cache_remove (cache, key);
+      return NULL;
+    }
+
+  g_queue_unlink (&cache->lru, entry->link);
+  g_queue_push_head_link (&cache->lru, entry->link);
+  return entry;
+}
+
+/* Remembers @result, or @error if it's %NULL, as the answer for @key */
+static void
+disco_cache_insert (DiscoCache *cache,
+    const gchar *key,
+    LmMessageNode *result,
+    const GError *error,
+    guint ttl)
+{
+  DiscoCacheEntry *entry;
+
+  disco_cache_remove (cache, key);
+
+  while (g_hash_table_size (cache->entries) >= DISCO_CACHE_SIZE)
+    {
+      DiscoCacheEntry *oldest = g_queue_peek_tail (&cache->lru);
+
+      disco_cache_remove (cache, oldest->key);
+    }
+
+  entry = disco_cache_entry_new (key, result, error);
+  entry->expires = time (NULL) + ttl;
+
+  g_queue_push_head (&cache->lru, entry);
+  entry->link = cache->lru.head;
+  g_hash_table_insert (cache->entries, entry->key, entry);
+}
+
 static void
 gabble_disco_init (GabbleDisco *obj)
 {
   GabbleDiscoPrivate *priv =
      G_TYPE_INSTANCE_GET_PRIVATE (obj, GABBLE_TYPE_DISCO, GabbleDiscoPrivate);
   obj->priv = priv;
+
+  priv->fetches = g_hash_table_new (g_str_hash, g_str_equal);
+  priv->in_flight = g_hash_table_new (NULL, NULL);
+  g_queue_init (&priv->queued);
 }
 
 static GObject *gabble_disco_constructor (GType type, guint n_props,
@@ -228,10 +553,31 @@ gabble_disco_dispose (GObject *object)
 
   DEBUG ("dispose called");
 
-  /* cancel request removes the element from the list after cancelling */
+  if (DEBUGGING)
+    {
+      GabbleDiscoStats stats;
+
+      gabble_disco_get_stats (self, &stats);
+      DEBUG ("%u requests, %u answered from the cache, %u by another "
+          "request in progress; %u IQs sent, %u errors, %u requests timed "
+          "out, at most %u queued; RTT p50 %ums, p90 %ums, p99 %ums",
+          stats.requests, stats.cached, stats.coalesced, stats.sent,
+          stats.failed,
+          stats.timed_out, stats.max_queued, stats.rtt_p50, stats.rtt_p90,
+          stats.rtt_p99);
+    }
+
+  /* cancel request removes the element from the list after cancelling, and
+   * abandons its fetch if it was the last request waiting for it */
   while (priv->requests)
     cancel_request (priv->requests->data);
 
+  g_assert (g_hash_table_size (priv->fetches) == 0);
+  g_assert (g_hash_table_size (priv->in_flight) == 0);
+  g_assert (g_queue_is_empty (&priv->queued));
+
+  tp_clear_pointer (&priv->cache, disco_cache_release);
+
   for (l = priv->service_cache; l; l = g_slist_next (l))
     {
       GabbleDiscoItem *item = (GabbleDiscoItem *) l->data;
@@ -253,8 +599,14 @@ gabble_disco_dispose (GObject *object)
 static void
 gabble_disco_finalize (GObject *object)
 {
+  GabbleDisco *self = GABBLE_DISCO (object);
+  GabbleDiscoPrivate *priv = self->priv;
+
   DEBUG ("called with %p", object);
 
+  g_hash_table_destroy (priv->fetches);
+  g_hash_table_destroy (priv->in_flight);
+
   G_OBJECT_CLASS (gabble_disco_parent_class)->finalize (object);
 }
 
@@ -281,6 +633,8 @@ gabble_disco_new (GabbleConnection *conn)
 
 
 static void notify_delete_request (gpointer data, GObject *obj);
+static void fetch_remove_request (DiscoFetch *fetch,
+    GabbleDiscoRequest *request);
 
 static void
 delete_request (GabbleDiscoRequest *request)
@@ -308,30 +662,27 @@ delete_request (GabbleDiscoRequest *request)
       g_source_remove (request->timer_id);
     }
 
+  if (request->fetch != NULL)
+    fetch_remove_request (request->fetch, request);
+
+  if (request->cached != NULL)
+    disco_cache_entry_free (request->cached);
+
   g_free (request->jid);
   g_free (request->node);
   g_slice_free (GabbleDiscoRequest, request);
 }
 
 static gboolean
-timeout_request (gpointer data)
+serve_cached_request (gpointer data)
 {
-  GabbleDiscoRequest *request = (GabbleDiscoRequest *) data;
-  GabbleDisco *disco;
-  GError *err = NULL;
-  g_return_val_if_fail (data != NULL, FALSE);
-
-  err = g_error_new (GABBLE_DISCO_ERROR, GABBLE_DISCO_ERROR_TIMEOUT,
-      "Request for %s on %s timed out",
-      (request->type == GABBLE_DISCO_TYPE_INFO)?"info":"items",
-      request->jid);
+  GabbleDiscoRequest *request = data;
+  GabbleDisco *disco = g_object_ref (request->disco);
+  GError *error = disco_cache_entry_dup_error (request->cached);
 
-  /* Temporarily ref the disco object to avoid crashing if the callback
-   * destroys us (as seen in test-disco-no-reply.py) */
-  disco = g_object_ref (request->disco);
+  request->timer_id = 0;
 
-  /* also, we're about to run the callback, so it's too late to cancel it -
-   * avoid crashing if running the callback destroys the bound object */
+  /* As in fetch_complete (), it's too late to cancel this now */
   if (NULL != request->bound_object)
     {
       g_object_weak_unref (request->bound_object, notify_delete_request,
@@ -339,15 +690,14 @@ timeout_request (gpointer data)
       request->bound_object = NULL;
     }
 
-  (request->callback)(request->disco, request, request->jid, request->node,
-                      NULL, err, request->user_data);
-  g_error_free (err);
-
-  request->timer_id = 0;
+  request->callback (request->disco, request, request->jid, request->node,
+                     request->cached->result, error, request->user_data);
   delete_request (request);
 
-  g_object_unref (disco);
+  if (error != NULL)
+    g_error_free (error);
 
+  g_object_unref (disco);
   return FALSE;
 }
 
@@ -384,24 +734,260 @@ disco_type_to_xmlns (GabbleDiscoType type)
   return NULL;
 }
 
+static gchar *
+make_key (GabbleDiscoType type,
+    const gchar *jid,
+    const gchar *node)
+{
+  return g_strdup_printf ("%s %s%s%s", disco_type_to_xmlns (type), jid,
+      node != NULL ? " #" : "", node != NULL ? node : "");
+}
+
+static DiscoFetch *
+fetch_new (GabbleDisco *disco,
+    const gchar *key,
+    GabbleDiscoType type,
+    const gchar *jid,
+    const gchar *node)
+{
+  DiscoFetch *fetch = g_slice_new0 (DiscoFetch);
+
+  fetch->disco = disco;
+  fetch->key = g_strdup (key);
+  fetch->type = type;
+  fetch->jid = g_strdup (jid);
+  fetch->node = g_strdup (node);
+  g_queue_init (&fetch->requests);
+
+  g_hash_table_insert (disco->priv->fetches, fetch->key, fetch);
+  return fetch;
+}
+
+static void
+fetch_free (DiscoFetch *fetch)
+{
+  g_assert (fetch->finished);
+  g_assert (g_queue_is_empty (&fetch->requests));
+
+  g_free (fetch->key);
+  g_free (fetch->jid);
+  g_free (fetch->node);
+  g_slice_free (DiscoFetch, fetch);
+}
+
+/* Stops @fetch from being found by new requests, and from being sent or
+ * answered */
+static void
+fetch_finish (DiscoFetch *fetch)
+{
+  GabbleDiscoPrivate *priv = fetch->disco->priv;
+
+  g_assert (!fetch->finished);
+  fetch->finished = TRUE;
+
+  if (fetch->timer_id != 0)
+    {
+      g_source_remove (fetch->timer_id);
+      fetch->timer_id = 0;
+    }
+
+  g_hash_table_remove (priv->fetches, fetch->key);
+
+  if (fetch->id != 0)
+    g_hash_table_remove (priv->in_flight, GUINT_TO_POINTER (fetch->id));
+
+  if (fetch->queued_link != NULL)
+    {
+      g_queue_delete_link (&priv->queued, fetch->queued_link);
+      fetch->queued_link = NULL;
+    }
+}
+
+static LmHandlerResult request_reply_cb (GabbleConnection *conn,
+    LmMessage *sent_msg, LmMessage *reply_msg, GObject *object,
+    gpointer user_data);
+
+static gboolean
+fetch_send (DiscoFetch *fetch,
+    GError **error)
+{
+  GabbleDisco *disco = fetch->disco;
+  GabbleDiscoPrivate *priv = disco->priv;
+  LmMessage *msg;
+  LmMessageNode *lm_node;
+  gboolean ret;
+
+  msg = lm_message_new_with_sub_type (fetch->jid, LM_MESSAGE_TYPE_IQ,
+                                           LM_MESSAGE_SUB_TYPE_GET);
+  lm_node = lm_message_node_add_child (
+      wocky_stanza_get_top_node (msg), "query", NULL);
+
+  lm_message_node_set_attribute (lm_node, "xmlns",
+      disco_type_to_xmlns (fetch->type));
+
+  if (fetch->node)
+    {
+      lm_message_node_set_attribute (lm_node, "node", fetch->node);
+    }
+
+  /* skip 0 if the counter wraps */
+  if (++priv->last_fetch_id == 0)
+    priv->last_fetch_id++;
+
+  ret = _gabble_connection_send_with_reply (priv->connection, msg,
+      request_reply_cb, G_OBJECT (disco),
+      GUINT_TO_POINTER (priv->last_fetch_id), error);
+
+  if (ret)
+    {
+      fetch->id = priv->last_fetch_id;
+      g_hash_table_insert (priv->in_flight, GUINT_TO_POINTER (fetch->id),
+          fetch);
+      g_get_current_time (&fetch->sent);
+      priv->sent++;
+    }
+
+  lm_message_unref (msg);
+  return ret;
+}
+
+static void disco_send_queued (GabbleDisco *disco);
+
+/* Gives the answer to @fetch's question to everyone who asked it, then frees
+ * @fetch */
+static void
+fetch_complete (DiscoFetch *fetch,
+    LmMessageNode *query_node,
+    GError *error)
+{
+  GabbleDiscoRequest *request;
+  /* Temporarily ref the disco object in case a callback destroys it */
+  GabbleDisco *disco = g_object_ref (fetch->disco);
+
+  fetch_finish (fetch);
+
+  /* Callbacks can cancel other requests, which removes them from the queue,
+   * so pop them one at a time */
+  while ((request = g_queue_pop_head (&fetch->requests)) != NULL)
+    {
+      request->fetch = NULL;
+
+      /* it's too late to cancel this request now; avoid crashing if running
+       * the callback destroys the bound object */
+      if (NULL != request->bound_object)
+        {
+          g_object_weak_unref (request->bound_object, notify_delete_request,
+              request);
+          request->bound_object = NULL;
+        }
+
+      request->callback (request->disco, request, request->jid, request->node,
+                         query_node, error, request->user_data);
+      delete_request (request);
+    }
+
+  fetch_free (fetch);
+  disco_send_queued (disco);
+  g_object_unref (disco);
+}
+
+/* Sends waiting IQs until DISCO_MAX_IN_FLIGHT are outstanding */
+static void
+disco_send_queued (GabbleDisco *disco)
+{
+  GabbleDiscoPrivate *priv = disco->priv;
+
+  if (priv->dispose_has_run)
+    return;
+
+  while (g_hash_table_size (priv->in_flight) < DISCO_MAX_IN_FLIGHT &&
+      !g_queue_is_empty (&priv->queued))
+    {
+      DiscoFetch *fetch = g_queue_pop_head (&priv->queued);
+      GError *error = NULL;
+
+      fetch->queued_link = NULL;
+
+      if (!fetch_send (fetch, &error))
+        {
+          DEBUG ("sending queued request %s failed: %s", fetch->key,
+              error->message);
+          fetch_complete (fetch, NULL, error);
+          g_error_free (error);
+        }
+    }
+}
+
+static gboolean
+fetch_timeout_cb (gpointer data)
+{
+  DiscoFetch *fetch = data;
+  GabbleDiscoPrivate *priv = fetch->disco->priv;
+  GError *err = NULL;
+
+  fetch->timer_id = 0;
+
+  err = g_error_new (GABBLE_DISCO_ERROR, GABBLE_DISCO_ERROR_TIMEOUT,
+      "Request for %s on %s timed out",
+      (fetch->type == GABBLE_DISCO_TYPE_INFO)?"info":"items",
+      fetch->jid);
+  priv->timed_out += g_queue_get_length (&fetch->requests);
+
+  /* Don't keep asking a service which isn't answering. (If the IQ was never
+   * sent, it's our fault, not theirs.) */
+  if (disco_cache_wants (fetch->disco, fetch->type, fetch->jid) &&
+      fetch->queued_link == NULL)
+    disco_cache_insert (priv->cache, fetch->key, NULL, err,
+        DISCO_CACHE_TIMEOUT_TTL);
+
+  fetch_complete (fetch, NULL, err);
+  g_error_free (err);
+  return FALSE;
+}
+
+static void
+fetch_remove_request (DiscoFetch *fetch,
+    GabbleDiscoRequest *request)
+{
+  GabbleDisco *disco = fetch->disco;
+
+  g_queue_remove (&fetch->requests, request);
+  request->fetch = NULL;
+
+  if (fetch->finished || !g_queue_is_empty (&fetch->requests))
+    return;
+
+  /* Nobody wants the answer any more. If the IQ is in flight, its reply will
+   * be ignored; either way, that frees up room for another one. */
+  DEBUG ("abandoning %s", fetch->key);
+  fetch_finish (fetch);
+  fetch_free (fetch);
+  disco_send_queued (disco);
+}
+
 static LmHandlerResult
 request_reply_cb (GabbleConnection *conn, LmMessage *sent_msg,
                   LmMessage *reply_msg, GObject *object, gpointer user_data)
 {
-  GabbleDiscoRequest *request = (GabbleDiscoRequest *) user_data;
   GabbleDisco *disco = GABBLE_DISCO (object);
   GabbleDiscoPrivate *priv = disco->priv;
+  DiscoFetch *fetch;
   LmMessageNode *query_node;
   GError *err = NULL;
 
-  g_assert (request);
+  /* if everyone gave up on it, the fetch has gone */
+  fetch = g_hash_table_lookup (priv->in_flight, user_data);
 
-  if (!g_list_find (priv->requests, request))
+  if (fetch == NULL)
     return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
 
+  gabble_samples_add (&priv->rtts,
+      gabble_time_val_elapsed_ms (&fetch->sent));
+  priv->completed++;
+
   query_node = lm_message_node_get_child_with_namespace (
       wocky_stanza_get_top_node (reply_msg),
-      "query", disco_type_to_xmlns (request->type));
+      "query", disco_type_to_xmlns (fetch->type));
 
   if (lm_message_get_sub_type (reply_msg) == LM_MESSAGE_SUB_TYPE_ERROR)
     {
@@ -420,9 +1006,14 @@ request_reply_cb (GabbleConnection *conn, LmMessage *sent_msg,
           "disco response contained no <query> node");
     }
 
-  request->callback (request->disco, request, request->jid, request->node,
-                     query_node, err, request->user_data);
-  delete_request (request);
+  if (err != NULL)
+    priv->failed++;
+
+  if (disco_cache_wants (disco, fetch->type, fetch->jid))
+    disco_cache_insert (priv->cache, fetch->key, query_node, err,
+        err == NULL ? DISCO_CACHE_TTL : DISCO_CACHE_ERROR_TTL);
+
+  fetch_complete (fetch, query_node, err);
 
   if (err)
     g_error_free (err);
@@ -430,14 +1021,6 @@ request_reply_cb (GabbleConnection *conn, LmMessage *sent_msg,
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
 
-static void
-notify_delete_request (gpointer data, GObject *obj)
-{
-  GabbleDiscoRequest *request = (GabbleDiscoRequest *) data;
-  request->bound_object = NULL;
-  delete_request (request);
-}
-
 /**
  * gabble_disco_request:
  * @self: #GabbleDisco object to use for request
@@ -479,6 +1062,11 @@ gabble_disco_request (GabbleDisco *self, GabbleDiscoType type,
  *
  * Make a disco request on the given jid, which will fail unless a reply
  * is received within the given timeout interval.
+ *
+ * If the same question is already being asked of @jid, no new IQ is sent:
+ * the reply to the existing one is given to both callers, and this request
+ * times out along with the existing one, whatever @timeout is. At most
+ * DISCO_MAX_IN_FLIGHT IQs are outstanding at once; later ones are queued.
  */
 GabbleDiscoRequest *
 gabble_disco_request_with_timeout (GabbleDisco *self, GabbleDiscoType type,
@@ -489,8 +1077,8 @@ gabble_disco_request_with_timeout (GabbleDisco *self, GabbleDiscoType type,
 {
   GabbleDiscoPrivate *priv = self->priv;
   GabbleDiscoRequest *request;
-  LmMessage *msg;
-  LmMessageNode *lm_node;
+  DiscoFetch *fetch;
+  gchar *key;
 
   request = g_slice_new0 (GabbleDiscoRequest);
   request->disco = self;
@@ -509,32 +1097,68 @@ gabble_disco_request_with_timeout (GabbleDisco *self, GabbleDiscoType type,
            request, request->jid);
 
   priv->requests = g_list_prepend (priv->requests, request);
-  msg = lm_message_new_with_sub_type (jid, LM_MESSAGE_TYPE_IQ,
-                                           LM_MESSAGE_SUB_TYPE_GET);
-  lm_node = lm_message_node_add_child (
-      wocky_stanza_get_top_node (msg), "query", NULL);
+  priv->n_requests++;
 
-  lm_message_node_set_attribute (lm_node, "xmlns", disco_type_to_xmlns (type));
+  key = make_key (type, jid, node);
 
-  if (node)
+  if (disco_cache_wants (self, type, jid))
     {
-      lm_message_node_set_attribute (lm_node, "node", node);
+      DiscoCacheEntry *entry = disco_cache_lookup (priv->cache, key);
+
+      if (entry != NULL)
+        {
+          DEBUG ("answering %s from the cache", key);
+          priv->cached++;
+
+          request->cached = disco_cache_entry_copy (entry);
+
+          /* the caller doesn't expect to be called back before we return */
+          request->timer_id = g_idle_add (serve_cached_request, request);
+          g_free (key);
+          return request;
+        }
     }
 
-  if (! _gabble_connection_send_with_reply (priv->connection, msg,
-        request_reply_cb, G_OBJECT(self), request, error))
+  fetch = g_hash_table_lookup (priv->fetches, key);
+
+  if (fetch != NULL)
     {
-      delete_request (request);
-      lm_message_unref (msg);
-      return NULL;
+      DEBUG ("%s is already in progress, sharing its answer", key);
+      priv->coalesced++;
     }
   else
     {
-      request->timer_id =
-          g_timeout_add_seconds (timeout, timeout_request, request);
-      lm_message_unref (msg);
-      return request;
+      fetch = fetch_new (self, key, type, jid, node);
+      fetch->timer_id = g_timeout_add_seconds (timeout, fetch_timeout_cb,
+          fetch);
+
+      if (g_hash_table_size (priv->in_flight) < DISCO_MAX_IN_FLIGHT)
+        {
+          if (!fetch_send (fetch, error))
+            {
+              fetch_finish (fetch);
+              fetch_free (fetch);
+              delete_request (request);
+              g_free (key);
+              return NULL;
+            }
+        }
+      else
+        {
+          DEBUG ("%d requests in flight, queueing %s", DISCO_MAX_IN_FLIGHT,
+              key);
+          g_queue_push_tail (&priv->queued, fetch);
+          fetch->queued_link = priv->queued.tail;
+          priv->max_queued = MAX (priv->max_queued,
+              g_queue_get_length (&priv->queued));
+        }
     }
+
+  g_free (key);
+
+  g_queue_push_tail (&fetch->requests, request);
+  request->fetch = fetch;
+  return request;
 }
 
 void
@@ -552,6 +1176,41 @@ gabble_disco_cancel_request (GabbleDisco *disco, GabbleDiscoRequest *request)
   cancel_request (request);
 }
 
+/**
+ * gabble_disco_get_stats:
+ * @self: a #GabbleDisco
+ * @stats: (out caller-allocates): filled in with @self's counters
+ *
+ * Takes a snapshot of how many disco requests have been made, how many of
+ * them needed an IQ of their own, and how long the replies took.
+ */
+void
+gabble_disco_get_stats (GabbleDisco *self,
+    GabbleDiscoStats *stats)
+{
+  GabbleDiscoPrivate *priv;
+
+  g_return_if_fail (GABBLE_IS_DISCO (self));
+  g_return_if_fail (stats != NULL);
+
+  priv = self->priv;
+  memset (stats, 0, sizeof (*stats));
+
+  stats->requests = priv->n_requests;
+  stats->cached = priv->cached;
+  stats->coalesced = priv->coalesced;
+  stats->sent = priv->sent;
+  stats->queued = g_queue_get_length (&priv->queued);
+  stats->max_queued = priv->max_queued;
+  stats->in_flight = g_hash_table_size (priv->in_flight);
+  stats->completed = priv->completed;
+  stats->failed = priv->failed;
+  stats->timed_out = priv->timed_out;
+
+  gabble_samples_get_percentiles (&priv->rtts, &stats->rtt_p50,
+      &stats->rtt_p90, &stats->rtt_p99);
+}
+
 /* Disco pipeline */
 
 
@@ -911,9 +1570,16 @@ gabble_disco_conn_status_changed_cb (GabbleConnection *conn,
 
   if (status == TP_CONNECTION_STATUS_CONNECTED)
     {
+      TpBaseConnection *base = (TpBaseConnection *) conn;
+      TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+          TP_HANDLE_TYPE_CONTACT);
       char *server;
       gpointer pipeline;
 
+      if (priv->cache == NULL)
+        priv->cache = disco_cache_dup (
+            tp_handle_inspect (contact_repo, base->self_handle));
+
       g_object_get (priv->connection, "stream-server", &server, NULL);
 
       g_assert (server != NULL);
@@ -958,3 +1624,88 @@ gabble_disco_service_find (GabbleDisco *disco,
 
   return NULL;
 }
+
+/**
+ * gabble_disco_cache_lookup:
+ * @self: a #GabbleDisco
+ * @jid: the bare JID to look up
+ * @node: the node on @jid, or %NULL
+ * @query_result: (out) (transfer full): if the answer is known and
+ *  successful, set to a copy of the <query/> from it, to be freed with
+ *  lm_message_node_unref (); otherwise, set to %NULL
+ * @error: if the answer is known and was an error (or a timeout), set to
+ *  that error
+ *
+ * Synchronously checks whether we know the answer to a disco#info request,
+ * without sending anything.
+ *
+ * Returns: %TRUE if the answer is known, in which case exactly one of
+ *  @query_result and @error is set
+ */
+gboolean
+gabble_disco_cache_lookup (GabbleDisco *self,
+    const gchar *jid,
+    const gchar *node,
+    LmMessageNode **query_result,
+    GError **error)
+{
+  GabbleDiscoPrivate *priv;
+  DiscoCacheEntry *entry;
+  gchar *key;
+
+  g_return_val_if_fail (GABBLE_IS_DISCO (self), FALSE);
+  g_return_val_if_fail (jid != NULL, FALSE);
+  g_return_val_if_fail (query_result != NULL, FALSE);
+
+  priv = self->priv;
+  *query_result = NULL;
+
+  if (!disco_cache_wants (self, GABBLE_DISCO_TYPE_INFO, jid))
+    return FALSE;
+
+  key = make_key (GABBLE_DISCO_TYPE_INFO, jid, node);
+  entry = disco_cache_lookup (priv->cache, key);
+  g_free (key);
+
+  if (entry == NULL)
+    return FALSE;
+
+  priv->cached++;
+
+  if (entry->result != NULL)
+    *query_result = lm_message_node_ref (entry->result);
+  else
+    g_propagate_error (error, disco_cache_entry_dup_error (entry));
+
+  return TRUE;
+}
+
+/**
+ * gabble_disco_cache_invalidate:
+ * @self: a #GabbleDisco
+ * @jid: a bare JID
+ * @node: the node on @jid, or %NULL
+ *
+ * Forgets any disco#info answer we have for (@jid, @node), because it has
+ * (or might have) changed; the next request will go to the network.
+ */
+void
+gabble_disco_cache_invalidate (GabbleDisco *self,
+    const gchar *jid,
+    const gchar *node)
+{
+  GabbleDiscoPrivate *priv;
+  gchar *key;
+
+  g_return_if_fail (GABBLE_IS_DISCO (self));
+  g_return_if_fail (jid != NULL);
+
+  priv = self->priv;
+
+  if (priv->cache == NULL)
+    return;
+
+  key = make_key (GABBLE_DISCO_TYPE_INFO, jid, node);
+  disco_cache_remove (priv->cache, key);
+  g_free (key);
+}
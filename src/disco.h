@@ -99,6 +99,42 @@ GabbleDiscoRequest *gabble_disco_request_with_timeout (GabbleDisco *self,
 
 void gabble_disco_cancel_request (GabbleDisco *, GabbleDiscoRequest *);
 
+/**
+ * GabbleDiscoStats:
+ * @requests: number of requests made
+ * @cached: number of requests answered from the cache
+ * @coalesced: number of requests which were answered by an identical request
+ *  already in progress, rather than sending a new IQ
+ * @sent: number of IQs sent
+ * @queued: number of IQs waiting for other requests to finish before they
+ *  can be sent
+ * @max_queued: the largest @queued has been
+ * @in_flight: number of IQs sent and not yet answered
+ * @completed: number of replies received
+ * @failed: number of replies which were errors
+ * @timed_out: number of requests which timed out
+ * @rtt_p50: median round-trip time of recent requests, in milliseconds
+ * @rtt_p90: 90th percentile round-trip time, in milliseconds
+ * @rtt_p99: 99th percentile round-trip time, in milliseconds
+ */
+typedef struct {
+    guint requests;
+    guint cached;
+    guint coalesced;
+    guint sent;
+    guint queued;
+    guint max_queued;
+    guint in_flight;
+    guint completed;
+    guint failed;
+    guint timed_out;
+    guint rtt_p50;
+    guint rtt_p90;
+    guint rtt_p99;
+} GabbleDiscoStats;
+
+void gabble_disco_get_stats (GabbleDisco *self, GabbleDiscoStats *stats);
+
 /* Pipelines */
 
 typedef struct _GabbleDiscoItem GabbleDiscoItem;
@@ -134,6 +170,13 @@ gabble_disco_service_find (GabbleDisco *disco,
                            const char *type,
                            const char *feature);
 
+/* Cached answers to disco#info */
+
+gboolean gabble_disco_cache_lookup (GabbleDisco *self, const gchar *jid,
+    const gchar *node, LmMessageNode **query_result, GError **error);
+void gabble_disco_cache_invalidate (GabbleDisco *self, const gchar *jid,
+    const gchar *node);
+
 G_END_DECLS
 
 #endif
@@ -39,6 +39,7 @@
 
 #include <loudmouth/loudmouth.h>
 
+#include <gibber/gibber-fd-transport.h>
 #include <gibber/gibber-listener.h>
 #include <gibber/gibber-transport.h>
 #include <gibber/gibber-unix-transport.h>       /* just for the feature-test */
@@ -161,6 +162,9 @@ struct _GabbleFileTransferChannelPrivate {
   gchar *file_collection;
   gchar *uri;
   gboolean channel_opened;
+  /* TRUE if the bytestream moves the data to or from the local socket
+   * itself */
+  gboolean spliced;
 };
 
 
@@ -977,6 +981,17 @@ close_session_and_transport (GabbleFileTransferChannel *self)
 
   DEBUG ("Closing session and transport");
 
+  /* Stop the splice first: it calls back into us, and uses both the
+   * bytestream and the transport */
+  if (self->priv->spliced && self->priv->transport != NULL)
+    {
+      GibberTransport *transport = g_object_ref (self->priv->transport);
+
+      self->priv->spliced = FALSE;
+      gibber_transport_disconnect (transport);
+      g_object_unref (transport);
+    }
+
   if (self->priv->gtalk_file_collection != NULL)
     gtalk_file_collection_terminate (self->priv->gtalk_file_collection, self);
 
@@ -1132,6 +1147,67 @@ check_address_and_access_control (GabbleFileTransferChannel *self,
   return FALSE;
 }
 
+static void
+spliced_cb (GibberFdTransport *source,
+    gsize count,
+    gpointer user_data)
+{
+  GabbleFileTransferChannel *self = GABBLE_FILE_TRANSFER_CHANNEL (user_data);
+  TpBaseConnection *base_conn = (TpBaseConnection *) self->priv->connection;
+
+  transferred_chunk (self, (guint64) count);
+
+  /* The channel has been closed since the data was moved */
+  if (self->priv->bytestream == NULL || self->priv->transport == NULL)
+    return;
+
+  if (self->priv->state != TP_FILE_TRANSFER_STATE_OPEN ||
+      self->priv->transferred_bytes + self->priv->initial_offset <
+      self->priv->size)
+    return;
+
+  gabble_file_transfer_channel_set_state (
+      TP_SVC_CHANNEL_TYPE_FILE_TRANSFER (self),
+      TP_FILE_TRANSFER_STATE_COMPLETED,
+      TP_FILE_TRANSFER_STATE_CHANGE_REASON_NONE);
+
+  if (self->priv->initiator == base_conn->self_handle)
+    {
+      DEBUG ("All the file has been sent. Closing the bytestream");
+      gabble_bytestream_iface_close (self->priv->bytestream, NULL);
+    }
+  else
+    {
+      DEBUG ("Received all the file. Transfer is complete");
+      gibber_transport_disconnect (self->priv->transport);
+    }
+}
+
+/* Once both the bytestream and the local socket are ready, let the
+ * bytestream move the data between them directly if it can, as we don't
+ * need to look at it on the way. */
+static void
+try_splice (GabbleFileTransferChannel *self)
+{
+  TpBaseConnection *base_conn = (TpBaseConnection *) self->priv->connection;
+  gboolean incoming = (self->priv->initiator != base_conn->self_handle);
+
+  if (self->priv->spliced ||
+      self->priv->bytestream == NULL ||
+      self->priv->transport == NULL ||
+      self->priv->state != TP_FILE_TRANSFER_STATE_OPEN ||
+      gibber_transport_get_state (self->priv->transport) !=
+          GIBBER_TRANSPORT_CONNECTED)
+    return;
+
+  if (!gabble_bytestream_iface_splice (self->priv->bytestream,
+          self->priv->transport, incoming, spliced_cb, self))
+    return;
+
+  DEBUG ("splicing the bytestream and the local socket");
+  self->priv->spliced = TRUE;
+}
+
 static void
 channel_open (GabbleFileTransferChannel *self)
 {
@@ -1154,6 +1230,8 @@ channel_open (GabbleFileTransferChannel *self)
 
       if (self->priv->transport != NULL)
         gibber_transport_block_receiving (self->priv->transport, FALSE);
+
+      try_splice (self);
     }
   else
     {
@@ -1663,9 +1741,9 @@ data_received_cb (GabbleFileTransferChannel *self, const guint8 *data, guint len
       return;
     }
 
-  if (!gibber_transport_buffer_is_empty (self->priv->transport))
+  if (gibber_transport_buffer_is_full (self->priv->transport))
     {
-      /* We don't want to send more data while the buffer isn't empty */
+      /* We don't want to send more data until the buffer has drained */
       if (self->priv->bytestream != NULL)
         gabble_bytestream_iface_block_reading (self->priv->bytestream, TRUE);
       else if (self->priv->gtalk_file_collection != NULL)
@@ -2026,6 +2104,8 @@ file_transfer_send (GabbleFileTransferChannel *self)
 
   gibber_transport_set_handler (self->priv->transport, transport_handler,
       self);
+
+  try_splice (self);
 }
 
 static void
@@ -2037,6 +2117,8 @@ file_transfer_receive (GabbleFileTransferChannel *self)
   else if (self->priv->gtalk_file_collection != NULL)
     gtalk_file_collection_block_reading (self->priv->gtalk_file_collection,
         self, FALSE);
+
+  try_splice (self);
 }
 
 static void
@@ -2073,16 +2155,21 @@ static void
 transport_buffer_empty_cb (GibberTransport *transport,
                            GabbleFileTransferChannel *self)
 {
-  /* Buffer is empty so we can unblock the buffer if it was blocked */
+  if (self->priv->state > TP_FILE_TRANSFER_STATE_OPEN)
+    gibber_transport_disconnect (transport);
+}
+
+static void
+transport_buffer_drained_cb (GibberTransport *transport,
+                             GabbleFileTransferChannel *self)
+{
+  /* There is room in the buffer again, so unblock it if it was blocked */
   if (self->priv->bytestream != NULL)
     gabble_bytestream_iface_block_reading (self->priv->bytestream, FALSE);
 
   if (self->priv->gtalk_file_collection != NULL)
     gtalk_file_collection_block_reading (self->priv->gtalk_file_collection,
         self, FALSE);
-
-  if (self->priv->state > TP_FILE_TRANSFER_STATE_OPEN)
-    gibber_transport_disconnect (transport);
 }
 
 /*
@@ -2107,6 +2194,8 @@ new_connection_cb (GibberListener *listener,
     G_CALLBACK (transport_disconnected_cb), G_OBJECT (self));
   gabble_signal_connect_weak (transport, "buffer-empty",
     G_CALLBACK (transport_buffer_empty_cb), G_OBJECT (self));
+  gabble_signal_connect_weak (transport, "buffer-drained",
+    G_CALLBACK (transport_buffer_drained_cb), G_OBJECT (self));
 
   requested = (self->priv->initiator == base_conn->self_handle);
 
@@ -36,6 +36,7 @@
 
 #include "debug.h"
 #include "connection-manager.h"
+#include "local-addresses.h"
 #include "plugin-loader.h"
 
 static TpBaseConnectionManager *
@@ -178,6 +179,7 @@ gabble_main (int argc,
       construct_cm, argc, argv);
 
   g_object_unref (loader);
+  gabble_local_addresses_shutdown ();
 
 #ifdef ENABLE_DEBUG
   g_log_set_default_handler (g_log_default_handler, NULL);
@@ -37,6 +37,7 @@
 #include "extensions/extensions.h"
 
 #include "caps-channel-manager.h"
+#include "conn-presence.h"
 #include "connection.h"
 #include "debug.h"
 #include "disco.h"
@@ -240,6 +241,9 @@ im_factory_message_cb (LmMessageHandler *handler,
       return LM_HANDLER_RESULT_REMOVE_MESSAGE;
     }
 
+  /* the sender's presence changes came first */
+  conn_presence_flush_pending_updates (priv->conn);
+
   chan = g_hash_table_lookup (priv->channels, GUINT_TO_POINTER (handle));
 
   if (chan == NULL)
@@ -0,0 +1,40 @@
+/*
+ * local-addresses-internal.h - implementation details of local-addresses.c
+ *                              shared with the tests
+ * Copyright (C) 2011 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __LOCAL_ADDRESSES_INTERNAL_H__
+#define __LOCAL_ADDRESSES_INTERNAL_H__
+
+#include "local-addresses.h"
+
+/* Each address is one more connection attempt for the peer to race, so
+ * don't offer too many */
+#define MAX_ADDRESSES 8
+
+/* An address found on an interface which is up */
+typedef struct {
+  /* the interface's name, or NULL if we don't know it */
+  const gchar *interface;
+  /* in numeric form */
+  const gchar *address;
+} LocalAddress;
+
+GSList *local_addresses_select (const LocalAddress *found, guint n_found);
+
+#endif /* __LOCAL_ADDRESSES_INTERNAL_H__ */
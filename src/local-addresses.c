@@ -0,0 +1,625 @@
+/*
+ * local-addresses.c - The addresses of the local network interfaces
+ * Copyright (C) 2006 Youness Alaoui <kakaroto@kakaroto.homelinux.net>
+ * Copyright (C) 2007-2011 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* The addresses we can offer peers to connect to us directly, for instance
+ * as SOCKS5 streamhosts. Enumerating the network interfaces can take a while
+ * on machines with lots of them (containers, VPNs...), so the list is kept
+ * and only enumerated again when it may have changed: on Linux, when the
+ * kernel tells us over netlink that links or addresses changed, and
+ * elsewhere once it's CACHE_LIFE_TIME seconds old. */
+
+#include "config.h"
+#include "local-addresses.h"
+#include "local-addresses-internal.h"
+
+#include <gio/gio.h>
+#include <gibber/gibber-sockets.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* on Darwin, net/if.h requires sys/sockets.h, which is included by
+ * gibber-sockets.h; so this must come after that header */
+#ifdef HAVE_NET_IF_H
+# include <net/if.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#ifdef HAVE_IFADDRS_H
+ #include <ifaddrs.h>
+#endif
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+# include <fcntl.h>
+# include <linux/netlink.h>
+# include <linux/rtnetlink.h>
+#endif
+
+#define DEBUG_FLAG GABBLE_DEBUG_BYTESTREAM
+
+#include "debug.h"
+
+/* How long we use the list for when we can't be told about changes, in
+ * seconds */
+#define CACHE_LIFE_TIME 30
+
+/* owned gchar * */
+static GSList *addresses = NULL;
+static gboolean addresses_valid = FALSE;
+static glong addresses_stamp = 0;
+
+/* non-zero while the kernel tells us about changes */
+static guint netlink_watch_id = 0;
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+static gboolean tried_netlink = FALSE;
+#endif
+
+/* Bridges to containers and virtual machines, whose addresses are usually
+ * only reachable from this machine; they're offered last, if at all */
+static const gchar * const virtual_interface_prefixes[] = {
+    "docker", "veth", "virbr", "lxcbr", "vboxnet", "vmnet", "br-", NULL };
+
+static gboolean
+is_virtual_interface (const gchar *name)
+{
+  guint i;
+
+  if (name == NULL)
+    return FALSE;
+
+  for (i = 0; virtual_interface_prefixes[i] != NULL; i++)
+    {
+      if (g_str_has_prefix (name, virtual_interface_prefixes[i]))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+add_found (GArray *found,
+    GStringChunk *strings,
+    const gchar *interface,
+    const gchar *address)
+{
+  LocalAddress a;
+
+  DEBUG ("Interface:  %s", interface != NULL ? interface : "(unknown)");
+  DEBUG ("IP Address: %s", address);
+
+  if (interface != NULL)
+    a.interface = g_string_chunk_insert (strings, interface);
+  else
+    a.interface = NULL;
+
+  a.address = g_string_chunk_insert (strings, address);
+  g_array_append_val (found, a);
+}
+
+#ifdef G_OS_WIN32
+
+static void
+enumerate_addresses (GArray *found,
+    GStringChunk *strings)
+{
+  gint sockfd;
+  INTERFACE_INFO *iflist = NULL;
+  gsize size = 0;
+  int ret;
+  int error;
+  gsize bytes;
+  gsize num;
+  gsize i;
+  struct sockaddr_in *sa;
+
+  /* FIXME: add IPv6 addresses */
+  if ((sockfd = socket (AF_INET, SOCK_DGRAM, IPPROTO_IP)) == INVALID_SOCKET)
+    {
+      DEBUG ("Cannot open socket to retrieve interface list");
+      return;
+    }
+
+  /* Loop and get each interface the system has, one by one... */
+  do
+    {
+      size += sizeof (INTERFACE_INFO);
+      /* realloc buffer size until no overflow occurs  */
+      if (NULL == (iflist = realloc (iflist, size)))
+        {
+          DEBUG ("Out of memory while allocation interface configuration"
+              " structure");
+          closesocket (sockfd);
+          return;
+        }
+
+        ret = WSAIoctl (sockfd, SIO_GET_INTERFACE_LIST, NULL, 0, iflist,
+                        size, &bytes, NULL, NULL);
+        error = WSAGetLastError ();
+
+        if (ret == SOCKET_ERROR && error != WSAEFAULT)
+          {
+            DEBUG ("Cannot retrieve interface list");
+            closesocket (sockfd);
+            free (iflist);
+            return;
+          }
+    } while (ret == SOCKET_ERROR);
+
+  num = bytes / sizeof (INTERFACE_INFO);
+
+  /* Loop throught the interface list and get the IP address of each IF */
+  for (i = 0; i < num; i++)
+    {
+      /* no ip address from interface that is down */
+      if ((iflist[i].iiFlags & IFF_UP) == 0)
+        continue;
+
+      if ((iflist[i].iiFlags & IFF_LOOPBACK) == IFF_LOOPBACK)
+        {
+          DEBUG ("Ignoring loopback interface");
+          continue;
+        }
+
+      sa = (struct sockaddr_in *) &(iflist[i].iiAddress);
+      add_found (found, strings, NULL, inet_ntoa (sa->sin_addr));
+    }
+
+  closesocket (sockfd);
+  free (iflist);
+}
+
+#else
+
+/* enumerate_addresses original code from Farsight 2 (function
+ * fs_interfaces_get_local_ips in /gst-libs/gst/farsight/fs-interfaces.c).
+ *   Copyright (C) 2006 Youness Alaoui <kakaroto@kakaroto.homelinux.net>
+ *   Copyright (C) 2007 Collabora
+ */
+#ifdef HAVE_GETIFADDRS
+
+static void
+enumerate_addresses (GArray *found,
+    GStringChunk *strings)
+{
+  struct ifaddrs *ifa, *results;
+
+  if (getifaddrs (&results) < 0)
+    return;
+
+  /* Loop through the interface list and get the IP address of each IF */
+  for (ifa = results; ifa; ifa = ifa->ifa_next)
+    {
+      char straddr[INET6_ADDRSTRLEN];
+
+      /* no ip address from interface that is down */
+      if ((ifa->ifa_flags & IFF_UP) == 0)
+        continue;
+
+#ifdef IFF_RUNNING
+      /* ...or which has no carrier */
+      if ((ifa->ifa_flags & IFF_RUNNING) == 0)
+        continue;
+#endif
+
+      if (ifa->ifa_addr == NULL)
+        continue;
+
+      if ((ifa->ifa_flags & IFF_LOOPBACK) == IFF_LOOPBACK)
+        {
+          DEBUG ("Ignoring loopback interface");
+          continue;
+        }
+
+      if (ifa->ifa_addr->sa_family == AF_INET)
+        {
+          struct sockaddr_in *sa = (struct sockaddr_in *) ifa->ifa_addr;
+
+          inet_ntop (AF_INET, &sa->sin_addr, straddr, sizeof (straddr));
+        }
+      else if (ifa->ifa_addr->sa_family == AF_INET6)
+        {
+          struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *) ifa->ifa_addr;
+
+          inet_ntop (AF_INET6, &sa6->sin6_addr, straddr, sizeof (straddr));
+        }
+      else
+        {
+          continue;
+        }
+
+      add_found (found, strings, ifa->ifa_name, straddr);
+    }
+
+  freeifaddrs (results);
+}
+
+#else /* ! HAVE_GETIFADDRS */
+
+static void
+enumerate_addresses (GArray *found,
+    GStringChunk *strings)
+{
+  gint sockfd;
+  gint size = 0;
+  struct ifreq *ifr;
+  struct ifconf ifc;
+  struct sockaddr_in *sa;
+
+  /* FIXME: add IPv6 addresses */
+  if ((sockfd = socket (AF_INET, SOCK_DGRAM, IPPROTO_IP)) < 0)
+    {
+      DEBUG ("Cannot open socket to retreive interface list");
+      return;
+    }
+
+  ifc.ifc_len = 0;
+  ifc.ifc_req = NULL;
+
+  /* Loop and get each interface the system has, one by one... */
+  do
+    {
+      size += sizeof (struct ifreq);
+      /* realloc buffer size until no overflow occurs  */
+      if (NULL == (ifc.ifc_req = realloc (ifc.ifc_req, size)))
+        {
+          DEBUG ("Out of memory while allocation interface configuration"
+              " structure");
+          close (sockfd);
+          return;
+        }
+      ifc.ifc_len = size;
+
+      if (ioctl (sockfd, SIOCGIFCONF, &ifc))
+        {
+          DEBUG ("ioctl SIOCFIFCONF");
+          close (sockfd);
+          free (ifc.ifc_req);
+          return;
+        }
+    } while  (size <= ifc.ifc_len);
+
+  /* Loop throught the interface list and get the IP address of each IF */
+  for (ifr = ifc.ifc_req;
+      (gchar *) ifr < (gchar *) ifc.ifc_req + ifc.ifc_len;
+      ++ifr)
+    {
+
+      if (ioctl (sockfd, SIOCGIFFLAGS, ifr))
+        {
+          DEBUG ("Unable to get IP information for interface %s. Skipping...",
+              ifr->ifr_name);
+          continue;  /* failed to get flags, skip it */
+        }
+      sa = (struct sockaddr_in *) &ifr->ifr_addr;
+      if ((ifr->ifr_flags & IFF_LOOPBACK) == IFF_LOOPBACK)
+        {
+          DEBUG ("Ignoring loopback interface %s", ifr->ifr_name);
+        }
+      else
+        {
+          add_found (found, strings, ifr->ifr_name,
+              inet_ntoa (sa->sin_addr));
+        }
+    }
+
+  close (sockfd);
+  free (ifc.ifc_req);
+}
+
+#endif /* ! HAVE_GETIFADDRS */
+
+#endif /* ! G_OS_WIN32 */
+
+/* Indices into the classes in local_addresses_select () */
+enum {
+    FAMILY_IPV6 = 0,
+    FAMILY_IPV4 = 1,
+    N_FAMILIES
+};
+
+/**
+ * local_addresses_select:
+ * @found: addresses on the interfaces which are up
+ * @n_found: the number of elements of @found
+ *
+ * Drops the addresses peers can't use (link-local, loopback and anything
+ * which isn't an address) and duplicates, then picks at most MAX_ADDRESSES
+ * of the rest. Each family gets half the slots, plus any the other doesn't
+ * need, so lots of IPv6 addresses can't crowd out the IPv4 ones.
+ *
+ * Returns: the addresses to offer as a new list of new strings: those on real
+ *  interfaces first, and within those IPv6 first; each in the order found
+ */
+GSList *
+local_addresses_select (const LocalAddress *found,
+    guint n_found)
+{
+  /* the addresses kept so far; borrowed gchar * owned by classes */
+  GHashTable *seen = g_hash_table_new (g_str_hash, g_str_equal);
+  /* owned gchar *, indexed by family and then by whether the interface looks
+   * virtual */
+  GPtrArray *classes[N_FAMILIES][2];
+  guint quota[N_FAMILIES];
+  guint n_family[N_FAMILIES];
+  GSList *ret = NULL;
+  guint family, virtual, i;
+
+  for (family = 0; family < N_FAMILIES; family++)
+    for (virtual = 0; virtual < 2; virtual++)
+      classes[family][virtual] = g_ptr_array_new ();
+
+  for (i = 0; i < n_found; i++)
+    {
+      GInetAddress *addr = g_inet_address_new_from_string (found[i].address);
+      gchar *str;
+
+      if (addr == NULL)
+        {
+          DEBUG ("Ignoring unparseable address: %s", found[i].address);
+          continue;
+        }
+
+      if (g_inet_address_get_is_link_local (addr) ||
+          g_inet_address_get_is_loopback (addr) ||
+          g_inet_address_get_is_any (addr))
+        {
+          DEBUG ("Ignoring link-local or loopback address: %s",
+              found[i].address);
+          g_object_unref (addr);
+          continue;
+        }
+
+      if (g_inet_address_get_family (addr) == G_SOCKET_FAMILY_IPV4)
+        family = FAMILY_IPV4;
+      else
+        family = FAMILY_IPV6;
+
+      str = g_inet_address_to_string (addr);
+      g_object_unref (addr);
+
+      /* the same address can be on several interfaces */
+      if (g_hash_table_lookup (seen, str) != NULL)
+        {
+          g_free (str);
+          continue;
+        }
+
+      g_hash_table_insert (seen, str, str);
+      g_ptr_array_add (
+          classes[family][is_virtual_interface (found[i].interface)], str);
+    }
+
+  for (family = 0; family < N_FAMILIES; family++)
+    n_family[family] = classes[family][0]->len + classes[family][1]->len;
+
+  if (n_family[FAMILY_IPV4] >= MAX_ADDRESSES / 2)
+    quota[FAMILY_IPV6] = MAX_ADDRESSES / 2;
+  else
+    quota[FAMILY_IPV6] = MAX_ADDRESSES - n_family[FAMILY_IPV4];
+
+  quota[FAMILY_IPV6] = MIN (quota[FAMILY_IPV6], n_family[FAMILY_IPV6]);
+  quota[FAMILY_IPV4] = MAX_ADDRESSES - quota[FAMILY_IPV6];
+
+  /* real interfaces use up their family's quota before virtual ones */
+  for (virtual = 0; virtual < 2; virtual++)
+    {
+      for (family = 0; family < N_FAMILIES; family++)
+        {
+          GPtrArray *class = classes[family][virtual];
+
+          for (i = 0; i < class->len; i++)
+            {
+              if (quota[family] > 0)
+                {
+                  ret = g_slist_prepend (ret, g_ptr_array_index (class, i));
+                  quota[family]--;
+                }
+              else
+                {
+                  g_free (g_ptr_array_index (class, i));
+                }
+            }
+
+          g_ptr_array_free (class, TRUE);
+        }
+    }
+
+  g_hash_table_destroy (seen);
+  return g_slist_reverse (ret);
+}
+
+static void
+invalidate (void)
+{
+  g_slist_foreach (addresses, (GFunc) g_free, NULL);
+  g_slist_free (addresses);
+  addresses = NULL;
+  addresses_valid = FALSE;
+}
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+
+static gboolean
+netlink_cb (GIOChannel *source,
+    GIOCondition condition,
+    gpointer user_data)
+{
+  gint fd = g_io_channel_unix_get_fd (source);
+  gchar buf[4096];
+
+  /* We don't care what changed, just that something did. If the socket's
+   * buffer overflowed we lost some messages, which doesn't matter either. */
+  while (recv (fd, buf, sizeof (buf), 0) > 0)
+    ;
+
+  DEBUG ("network interfaces changed");
+  invalidate ();
+
+  if ((condition & (G_IO_ERR | G_IO_HUP)) != 0)
+    {
+      DEBUG ("netlink socket failed; we'll enumerate the interfaces again "
+          "every %d seconds", CACHE_LIFE_TIME);
+      netlink_watch_id = 0;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+watch_netlink (void)
+{
+  struct sockaddr_nl addr;
+  GIOChannel *channel;
+  gint fd = -1;
+
+#ifdef SOCK_CLOEXEC
+  fd = socket (AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+#endif
+
+  /* kernels older than 2.6.27 don't know about SOCK_CLOEXEC */
+  if (fd < 0)
+    {
+      fd = socket (AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+
+      if (fd >= 0)
+        fcntl (fd, F_SETFD, FD_CLOEXEC);
+    }
+
+  if (fd < 0)
+    {
+      DEBUG ("couldn't create netlink socket: %s", g_strerror (errno));
+      return;
+    }
+
+  memset (&addr, 0, sizeof (addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+
+  if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    {
+      DEBUG ("couldn't bind netlink socket: %s", g_strerror (errno));
+      close (fd);
+      return;
+    }
+
+  gibber_socket_set_nonblocking (fd);
+
+  channel = g_io_channel_unix_new (fd);
+  g_io_channel_set_close_on_unref (channel, TRUE);
+  g_io_channel_set_encoding (channel, NULL, NULL);
+  g_io_channel_set_buffered (channel, FALSE);
+
+  netlink_watch_id = g_io_add_watch (channel, G_IO_IN | G_IO_ERR | G_IO_HUP,
+      netlink_cb, NULL);
+
+  /* the watch keeps it alive, and closes the socket when it's removed */
+  g_io_channel_unref (channel);
+}
+
+#endif /* HAVE_LINUX_RTNETLINK_H */
+
+static void
+refresh (void)
+{
+  GArray *found = g_array_new (FALSE, FALSE, sizeof (LocalAddress));
+  GStringChunk *strings = g_string_chunk_new (256);
+  GTimeVal now;
+
+  invalidate ();
+
+  enumerate_addresses (found, strings);
+  addresses = local_addresses_select ((const LocalAddress *) found->data,
+      found->len);
+
+  g_array_free (found, TRUE);
+  g_string_chunk_free (strings);
+
+  g_get_current_time (&now);
+  addresses_stamp = now.tv_sec;
+  addresses_valid = TRUE;
+}
+
+/**
+ * gabble_local_addresses_get:
+ *
+ * Returns: the addresses of the local network interfaces we can offer to
+ *  peers, IPv6 first, as a new list of new strings which must be freed
+ */
+GSList *
+gabble_local_addresses_get (void)
+{
+  GSList *copy = NULL, *l;
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+  if (!tried_netlink)
+    {
+      /* start listening before we enumerate, so we don't miss anything */
+      tried_netlink = TRUE;
+      watch_netlink ();
+    }
+#endif
+
+  if (addresses_valid && netlink_watch_id == 0)
+    {
+      GTimeVal now;
+
+      g_get_current_time (&now);
+
+      if (now.tv_sec - addresses_stamp >= CACHE_LIFE_TIME)
+        addresses_valid = FALSE;
+    }
+
+  if (!addresses_valid)
+    refresh ();
+
+  for (l = addresses; l != NULL; l = g_slist_next (l))
+    copy = g_slist_prepend (copy, g_strdup (l->data));
+
+  return g_slist_reverse (copy);
+}
+
+/**
+ * gabble_local_addresses_shutdown:
+ *
+ * Stops listening for changes to the network interfaces and forgets their
+ * addresses; called when the connection manager exits.
+ */
+void
+gabble_local_addresses_shutdown (void)
+{
+#ifdef HAVE_LINUX_RTNETLINK_H
+  if (netlink_watch_id != 0)
+    {
+      g_source_remove (netlink_watch_id);
+      netlink_watch_id = 0;
+    }
+
+  tried_netlink = FALSE;
+#endif
+
+  invalidate ();
+}
@@ -0,0 +1,33 @@
+/*
+ * local-addresses.h - Header for the addresses of the local network
+ * interfaces
+ * Copyright (C) 2011 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GABBLE_LOCAL_ADDRESSES_H__
+#define __GABBLE_LOCAL_ADDRESSES_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+GSList *gabble_local_addresses_get (void);
+void gabble_local_addresses_shutdown (void);
+
+G_END_DECLS
+
+#endif /* __GABBLE_LOCAL_ADDRESSES_H__ */
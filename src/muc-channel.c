@@ -40,6 +40,7 @@
 #define DEBUG_FLAG GABBLE_DEBUG_MUC
 #include "connection.h"
 #include "conn-aliasing.h"
+#include "conn-presence.h"
 #include "debug.h"
 #include "disco.h"
 #include "error.h"
@@ -275,6 +276,16 @@ struct _GabbleMucChannelPrivate
   GPtrArray *initial_channels;
   GArray *initial_handles;
   char **initial_ids;
+
+  /* Other occupants we have added to the group: room member handle =>
+   * owner handle, or 0 if we don't know it. In a large room, most presences
+   * are status changes from people already here, which needn't touch the
+   * group at all. */
+  GHashTable *occupants;
+  /* Newcomers not yet added to the group, in the same form, each holding a
+   * ref on both handles; and the source which will add them */
+  GHashTable *pending_occupants;
+  guint pending_occupants_id;
 };
 
 typedef struct {
@@ -292,6 +303,8 @@ gabble_muc_channel_init (GabbleMucChannel *self)
   self->priv = priv;
 
   priv->requests_cancellable = g_cancellable_new ();
+  priv->occupants = g_hash_table_new (g_direct_hash, g_direct_equal);
+  priv->pending_occupants = g_hash_table_new (g_direct_hash, g_direct_equal);
 }
 
 static TpHandle create_room_identity (GabbleMucChannel *)
@@ -775,6 +788,7 @@ properties_disco_cb (GabbleDisco *disco,
   tp_intset_destroy (changed_props_flags);
 }
 
+/* Uses the cached disco#info for the room, if there is one */
 static void
 room_properties_update (GabbleMucChannel *chan)
 {
@@ -797,6 +811,25 @@ room_properties_update (GabbleMucChannel *chan)
     }
 }
 
+/* Forgets the room's cached disco#info, because it has (or might have)
+ * changed */
+static void
+room_properties_forget (GabbleMucChannel *chan)
+{
+  GabbleConnection *conn = GABBLE_CONNECTION (tp_base_channel_get_connection (
+      TP_BASE_CHANNEL (chan)));
+
+  gabble_disco_cache_invalidate (conn->disco, chan->priv->jid, NULL);
+}
+
+/* Asks the room for its current disco#info, ignoring any cached answer */
+static void
+room_properties_refresh (GabbleMucChannel *chan)
+{
+  room_properties_forget (chan);
+  room_properties_update (chan);
+}
+
 static TpHandle
 create_room_identity (GabbleMucChannel *chan)
 {
@@ -1249,6 +1282,7 @@ gabble_muc_channel_class_init (GabbleMucChannelClass *gabble_muc_channel_class)
 static void clear_join_timer (GabbleMucChannel *chan);
 static void clear_poll_timer (GabbleMucChannel *chan);
 static void clear_leave_timer (GabbleMucChannel *chan);
+static void clear_pending_occupants (GabbleMucChannel *chan);
 
 void
 gabble_muc_channel_dispose (GObject *object)
@@ -1266,6 +1300,7 @@ gabble_muc_channel_dispose (GObject *object)
   clear_join_timer (self);
   clear_poll_timer (self);
   clear_leave_timer (self);
+  clear_pending_occupants (self);
 
   tp_clear_object (&priv->wmuc);
   tp_clear_object (&priv->requests_cancellable);
@@ -1312,6 +1347,8 @@ gabble_muc_channel_finalize (GObject *object)
   g_free (priv->room_id);
   g_free (priv->server);
   g_value_array_free (priv->subject);
+  g_hash_table_destroy (priv->occupants);
+  g_hash_table_destroy (priv->pending_occupants);
 
   tp_properties_mixin_finalize (object);
   tp_group_mixin_finalize (object);
@@ -1356,6 +1393,117 @@ clear_leave_timer (GabbleMucChannel *chan)
     }
 }
 
+/* Drops the newcomers queued by queue_occupant () without adding them */
+static void
+clear_pending_occupants (GabbleMucChannel *chan)
+{
+  GabbleMucChannelPrivate *priv = chan->priv;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      tp_base_channel_get_connection (TP_BASE_CHANNEL (chan)),
+      TP_HANDLE_TYPE_CONTACT);
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if (priv->pending_occupants_id != 0)
+    {
+      g_source_remove (priv->pending_occupants_id);
+      priv->pending_occupants_id = 0;
+    }
+
+  g_hash_table_iter_init (&iter, priv->pending_occupants);
+
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      tp_handle_unref (contact_repo, GPOINTER_TO_UINT (key));
+
+      if (value != NULL)
+        tp_handle_unref (contact_repo, GPOINTER_TO_UINT (value));
+    }
+
+  g_hash_table_remove_all (priv->pending_occupants);
+}
+
+/* Adds the newcomers queued by queue_occupant () to the group, with one
+ * MembersChanged and one HandleOwnersChanged for all of them. This must be
+ * done before anything else changes the group, so that clients see changes
+ * in the order they happened. */
+static void
+flush_pending_occupants (GabbleMucChannel *chan)
+{
+  GabbleMucChannelPrivate *priv = chan->priv;
+  GHashTable *pending = priv->pending_occupants;
+  TpIntSet *handles;
+  GHashTableIter iter;
+  gpointer key;
+
+  if (priv->pending_occupants_id != 0)
+    {
+      g_source_remove (priv->pending_occupants_id);
+      priv->pending_occupants_id = 0;
+    }
+
+  if (g_hash_table_size (pending) == 0)
+    return;
+
+  handles = tp_intset_new ();
+  g_hash_table_iter_init (&iter, pending);
+
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    tp_intset_add (handles, GPOINTER_TO_UINT (key));
+
+  DEBUG ("adding %u new occupants", tp_intset_size (handles));
+
+  tp_group_mixin_change_members ((GObject *) chan, "", handles, NULL, NULL,
+      NULL, 0, 0);
+  tp_group_mixin_add_handle_owners ((GObject *) chan, pending);
+
+  tp_intset_destroy (handles);
+  clear_pending_occupants (chan);
+}
+
+static gboolean
+flush_pending_occupants_cb (gpointer data)
+{
+  GabbleMucChannel *chan = data;
+
+  chan->priv->pending_occupants_id = 0;
+  flush_pending_occupants (chan);
+  return FALSE;
+}
+
+/* Queues @handle to be added to the group with @owner, or 0 for no owner, so
+ * that a burst of people arriving is one change to the group */
+static void
+queue_occupant (GabbleMucChannel *chan,
+    TpHandleRepoIface *contact_repo,
+    TpHandle handle,
+    TpHandle owner)
+{
+  GabbleMucChannelPrivate *priv = chan->priv;
+  gpointer old_owner;
+
+  if (g_hash_table_lookup_extended (priv->pending_occupants,
+        GUINT_TO_POINTER (handle), NULL, &old_owner))
+    {
+      if (old_owner != NULL)
+        tp_handle_unref (contact_repo, GPOINTER_TO_UINT (old_owner));
+    }
+  else
+    {
+      tp_handle_ref (contact_repo, handle);
+    }
+
+  if (owner != 0)
+    tp_handle_ref (contact_repo, owner);
+
+  g_hash_table_insert (priv->pending_occupants, GUINT_TO_POINTER (handle),
+      GUINT_TO_POINTER (owner));
+
+  if (priv->pending_occupants_id == 0)
+    priv->pending_occupants_id = conn_presence_coalesce_add (
+        flush_pending_occupants_cb, chan);
+}
+
 static void
 change_password_flags (GabbleMucChannel *chan,
                        TpChannelPasswordFlags add,
@@ -1425,7 +1573,7 @@ timeout_poll (gpointer data)
 
   DEBUG ("polling for room properties");
 
-  room_properties_update (chan);
+  room_properties_refresh (chan);
 
   return TRUE;
 }
@@ -1505,6 +1653,8 @@ close_channel (GabbleMucChannel *chan, const gchar *reason,
   /* Ensure we stay alive even while telling everyone else to abandon us. */
   g_object_ref (chan);
 
+  flush_pending_occupants (chan);
+
   gabble_muc_channel_close_tube (chan);
   muc_call_channel_finish_requests (chan, NULL, &error);
   g_cancellable_cancel (priv->requests_cancellable);
@@ -1608,6 +1758,7 @@ handle_nick_conflict (GabbleMucChannel *chan,
   tp_intset_add (add_rp, self_handle);
   tp_intset_add (remove_rp, mixin->self_handle);
 
+  flush_pending_occupants (chan);
   tp_group_mixin_change_self_handle ((GObject *) chan, self_handle);
   tp_group_mixin_change_members ((GObject *) chan, NULL, NULL, remove_rp, NULL,
       add_rp, 0, TP_CHANNEL_GROUP_CHANGE_REASON_RENAMED);
@@ -2213,6 +2364,8 @@ handle_left (GObject *source,
       return;
     }
 
+  flush_pending_occupants (gmuc);
+
   handles = tp_intset_new ();
   tp_intset_add (handles, member);
 
@@ -2230,6 +2383,7 @@ handle_left (GObject *source,
     gabble_tubes_channel_presence_updated (priv->tube, member,
         wocky_stanza_get_top_node (stanza));
 
+  g_hash_table_remove (priv->occupants, GUINT_TO_POINTER (member));
   tp_group_mixin_change_members (data, why, NULL, handles, NULL, NULL,
       actor, reason);
 
@@ -2319,6 +2473,8 @@ handle_renamed (GObject *source,
   TpHandle userid = tp_handle_ensure (contact_repo, me2,
       GUINT_TO_POINTER (GABBLE_JID_ROOM_MEMBER), NULL);
 
+  flush_pending_occupants (gmuc);
+
   tp_intset_add (old_self, TP_GROUP_MIXIN (gmuc)->self_handle);
   tp_group_mixin_change_self_handle (data, myself);
   tp_group_mixin_add_handle_owner (data, myself, userid);
@@ -2363,14 +2519,14 @@ update_roster_presence (GabbleMucChannel *gmuc,
   g_hash_table_insert (omap,
       GUINT_TO_POINTER (handle),
       GUINT_TO_POINTER (owner));
+  g_hash_table_insert (gmuc->priv->occupants,
+      GUINT_TO_POINTER (handle),
+      GUINT_TO_POINTER (owner));
 
   tp_handle_unref (contact_repo, handle);
-  /* make a note of the fact that owner JIDs are visible to us    */
   /* notify whomever that an identifiable contact joined the MUC  */
   if (owner != 0)
     {
-      tp_group_mixin_change_flags (G_OBJECT (gmuc), 0,
-          TP_CHANNEL_GROUP_FLAG_HANDLE_OWNERS_NOT_AVAILABLE);
       g_signal_emit (gmuc, signals[CONTACT_JOIN], 0, owner);
       tp_handle_unref (contact_repo, owner);
     }
@@ -2408,6 +2564,14 @@ handle_join (WockyMuc *muc,
     update_roster_presence (gmuc, member, contact_repo,
       members, owners, omap);
 
+  DEBUG ("%d other occupants already in the room",
+      tp_handle_set_size (members));
+
+  /* make a note of the fact that owner JIDs are visible to us */
+  if (tp_handle_set_size (owners) > 0)
+    tp_group_mixin_change_flags (G_OBJECT (gmuc), 0,
+        TP_CHANNEL_GROUP_FLAG_HANDLE_OWNERS_NOT_AVAILABLE);
+
   g_hash_table_insert (omap,
       GUINT_TO_POINTER (myself),
       GUINT_TO_POINTER (base_conn->self_handle));
@@ -2480,7 +2644,7 @@ handle_presence (GObject *source,
   TpHandle owner = 0;
   TpHandle handle = tp_handle_ensure (contact_repo, who->from,
       GUINT_TO_POINTER (GABBLE_JID_ROOM_MEMBER), NULL);
-  TpHandleSet *handles = tp_handle_set_new (contact_repo);
+  gpointer known_owner;
 
   /* is the 'real' jid field of the presence set? If so, use it: */
   if (who->jid != NULL)
@@ -2488,26 +2652,32 @@ handle_presence (GObject *source,
       owner = tp_handle_ensure (contact_repo, who->jid,
           GUINT_TO_POINTER (GABBLE_JID_GLOBAL), NULL);
       if (owner == 0)
-        {
-          DEBUG ("Invalid owner handle '%s' ignored", who->jid);
-        }
-      else /* note that JIDs are known to us in this MUC */
-        {
-          tp_group_mixin_change_flags (G_OBJECT (data), 0,
-              TP_CHANNEL_GROUP_FLAG_HANDLE_OWNERS_NOT_AVAILABLE);
-        }
+        DEBUG ("Invalid owner handle '%s' ignored", who->jid);
     }
 
   gabble_presence_parse_presence_message (conn->presence_cache,
     handle, who->from, (LmMessage *) who->presence_stanza);
 
-  /* add the member in quesion */
-  tp_handle_set_add (handles, handle);
-  tp_group_mixin_change_members (data, "", tp_handle_set_peek (handles),
-      NULL, NULL, NULL, 0, 0);
-
-  /* record the owner (0 for no owner) */
-  tp_group_mixin_add_handle_owner (data, handle, owner);
+  /* Most presences are from people who are already in the room, just
+   * changing their status */
+  if (!g_hash_table_lookup_extended (priv->occupants,
+        GUINT_TO_POINTER (handle), NULL, &known_owner) ||
+      GPOINTER_TO_UINT (known_owner) != owner ||
+      (!tp_handle_set_is_member (gmuc->group.members, handle) &&
+       !g_hash_table_lookup_extended (priv->pending_occupants,
+         GUINT_TO_POINTER (handle), NULL, NULL)))
+    {
+      /* note that JIDs are known to us in this MUC */
+      if (owner != 0)
+        tp_group_mixin_change_flags (G_OBJECT (data), 0,
+            TP_CHANNEL_GROUP_FLAG_HANDLE_OWNERS_NOT_AVAILABLE);
+
+      /* add the member in question, recording the owner (0 for no owner),
+       * along with anyone else who arrives at about the same time */
+      queue_occupant (gmuc, contact_repo, handle, owner);
+      g_hash_table_insert (priv->occupants, GUINT_TO_POINTER (handle),
+          GUINT_TO_POINTER (owner));
+    }
 
   handle_tube_presence (gmuc, handle, stanza);
 
@@ -2529,12 +2699,35 @@ handle_presence (GObject *source,
   tp_handle_unref (contact_repo, handle);
   if (owner != 0)
     tp_handle_unref (contact_repo, owner);
-  tp_handle_set_destroy (handles);
 }
 
 /* ************************************************************************ */
 /* message signal handlers */
 
+/* Returns TRUE if @stanza is the room telling us that its configuration has
+ * changed (XEP-0045 status code 104) */
+static gboolean
+is_config_change (WockyStanza *stanza)
+{
+  LmMessageNode *x = lm_message_node_get_child_with_namespace (
+      wocky_stanza_get_top_node (stanza), "x", NS_MUC_USER);
+  NodeIter i;
+
+  if (x == NULL)
+    return FALSE;
+
+  for (i = node_iter (x); i; i = node_iter_next (i))
+    {
+      LmMessageNode *status = node_iter_data (i);
+
+      if (!tp_strdiff (status->name, "status") &&
+          !tp_strdiff (lm_message_node_get_attribute (status, "code"), "104"))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
 static void
 handle_message (GObject *source,
     WockyStanza *stanza,
@@ -2557,6 +2750,11 @@ handle_message (GObject *source,
   TpHandleType handle_type;
   TpHandle from;
 
+  /* a message from someone who has only just arrived shouldn't beat their
+   * arrival to the client */
+  flush_pending_occupants (gmuc);
+  conn_presence_flush_pending_updates (GABBLE_CONNECTION (conn));
+
   if (from_member)
     {
       handle_type = TP_HANDLE_TYPE_CONTACT;
@@ -2622,6 +2820,12 @@ handle_message (GObject *source,
     _gabble_muc_channel_handle_subject (gmuc, msg_type, handle_type, from,
         stamp, subject, stanza);
 
+  if (!from_member && is_config_change (stanza))
+    {
+      DEBUG ("room configuration changed");
+      room_properties_refresh (gmuc);
+    }
+
   tp_handle_unref (repo, from);
 }
 
@@ -2738,7 +2942,7 @@ _gabble_muc_channel_handle_subject (GabbleMucChannel *chan,
           priv->properties_ctx = NULL;
 
           /* Get the properties into a consistent state. */
-          room_properties_update (chan);
+          room_properties_refresh (chan);
         }
 
       return;
@@ -2746,6 +2950,9 @@ _gabble_muc_channel_handle_subject (GabbleMucChannel *chan,
 
   DEBUG ("updating new property value for subject");
 
+  /* The room's disco#info may include its subject */
+  room_properties_forget (chan);
+
   changed_values = tp_intset_sized_new (NUM_ROOM_PROPS);
   changed_flags = tp_intset_sized_new (NUM_ROOM_PROPS);
 
@@ -3217,6 +3424,7 @@ gabble_muc_channel_add_member (GObject *obj,
 
       tp_intset_add (set_remote_pending, handle);
 
+      flush_pending_occupants (self);
       tp_group_mixin_add_handle_owner (obj, mixin->self_handle,
           conn->self_handle);
       tp_group_mixin_change_members (obj, "", NULL, set_remove_members,
@@ -3702,6 +3910,9 @@ request_config_form_submit_reply_cb (GabbleConnection *conn,
     {
       guint i;
 
+      /* We've just changed what the room's disco#info says */
+      room_properties_forget (chan);
+
       for (i = 0; i < NUM_ROOM_PROPS; i++)
         {
           if (i != ROOM_PROP_SUBJECT)
@@ -3716,7 +3927,7 @@ request_config_form_submit_reply_cb (GabbleConnection *conn,
       returned = TRUE;
 
       /* Get the properties into a consistent state. */
-      room_properties_update (chan);
+      room_properties_refresh (chan);
     }
 
   if (returned)
@@ -29,9 +29,18 @@
 
 /* When five DIFFERENT guys report the same caps for a given bundle, it'll
  * be enough. But if only ONE guy use the verification string (XEP-0115 v1.5),
- * it'll be enough too.
+ * it'll be enough too. (This is the default for the caps-enough-trust
+ * property.)
  */
 #define CAPABILITY_BUNDLE_ENOUGH_TRUST 5
+
+/* Defaults for the other caps discovery properties: how many contacts we ask
+ * about a node at once, how long we give each of them, and how long we wait
+ * for the first one before asking another as well, in milliseconds */
+#define DEFAULT_MAX_NODE_DISCOS 3
+#define DEFAULT_CAPS_DISCO_TIMEOUT 20
+#define DEFAULT_HEDGE_DELAY 3000
+
 #define DEBUG_FLAG GABBLE_DEBUG_PRESENCE
 
 #include <dbus/dbus-glib.h>
@@ -69,6 +78,10 @@ G_DEFINE_TYPE (GabblePresenceCache, gabble_presence_cache, G_TYPE_OBJECT);
 enum
 {
   PROP_CONNECTION = 1,
+  PROP_ENOUGH_TRUST,
+  PROP_MAX_NODE_DISCOS,
+  PROP_CAPS_DISCO_TIMEOUT,
+  PROP_HEDGE_DELAY,
   LAST_PROPERTY
 };
 
@@ -100,9 +113,27 @@ struct _GabblePresenceCachePrivate
   TpHandleSet *presence_handles;
 
   GHashTable *capabilities;
+  /* gchar *node (borrowed from the value) => owned DiscoNode */
   GHashTable *disco_pending;
+  /* TpHandle => number of DiscoWaiters for that contact, across all nodes */
+  GHashTable *waiting_handles;
+  /* "handle/resource" => number of DiscoWaiters for that resource */
+  GHashTable *waiting_resources;
   guint caps_serial;
 
+  guint enough_trust;
+  guint max_node_discos;
+  guint caps_disco_timeout;
+  guint hedge_delay;
+
+  /* Counters, see GabblePresenceCacheCapsStats */
+  guint nodes_discovered;
+  guint nodes_failed;
+  guint discos_sent;
+  guint discos_hedged;
+  guint discos_failed;
+  GabbleSamples times_to_caps;
+
   guint unsure_id;
   /* handle => DecloakContext */
   GHashTable *decloak_requests;
@@ -124,6 +155,7 @@ struct _GabblePresenceCachePrivate
 };
 
 typedef struct _DiscoWaiter DiscoWaiter;
+typedef struct _DiscoNode DiscoNode;
 
 struct _DiscoWaiter
 {
@@ -134,8 +166,50 @@ struct _DiscoWaiter
   gboolean disco_requested;
   gchar *hash;
   gchar *ver;
+
+  /* "handle/resource", our key in DiscoNode.index and
+   * priv->waiting_resources */
+  gchar *key;
+  /* our link in DiscoNode.waiters */
+  GList *link;
+  /* the request we sent this contact, while it's in flight */
+  GabbleDiscoRequest *request;
+  /* how much trust a reply from this contact would give the node */
+  guint possible_trust;
+};
+
+/* The contacts advertising a node we haven't got trusted caps for yet */
+struct _DiscoNode
+{
+  GabblePresenceCache *cache;
+  gchar *node;
+
+  /* DiscoWaiter, most recently seen first */
+  GQueue waiters;
+  /* gchar *key (borrowed from the value) => DiscoWaiter in waiters */
+  GHashTable *index;
+
+  /* number of waiters whose disco request is in flight */
+  guint in_flight;
+  /* sum of waiters' possible_trust */
+  guint possible_trust;
+
+  /* when we first heard of this node, for the time-to-caps stats */
+  GTimeVal since;
+  /* asks another contact if nobody has replied in time */
+  guint hedge_id;
 };
 
+static gchar *
+disco_waiter_key (TpHandle handle,
+    const gchar *resource)
+{
+  if (resource == NULL)
+    return g_strdup_printf ("%u", handle);
+
+  return g_strdup_printf ("%u/%s", handle, resource);
+}
+
 /**
  * disco_waiter_new ()
  */
@@ -159,6 +233,7 @@ disco_waiter_new (TpHandleRepoIface *repo,
   waiter->hash = g_strdup (hash);
   waiter->ver = g_strdup (ver);
   waiter->serial = serial;
+  waiter->key = disco_waiter_key (handle, resource);
 
   DEBUG ("created waiter %p for handle %u with serial %u", waiter, handle,
       serial);
@@ -170,6 +245,7 @@ static void
 disco_waiter_free (DiscoWaiter *waiter)
 {
   g_assert (NULL != waiter);
+  g_assert (waiter->request == NULL);
 
   DEBUG ("freeing waiter %p for handle %u with serial %u", waiter,
       waiter->handle, waiter->serial);
@@ -179,46 +255,175 @@ disco_waiter_free (DiscoWaiter *waiter)
   g_free (waiter->resource);
   g_free (waiter->hash);
   g_free (waiter->ver);
+  g_free (waiter->key);
   g_slice_free (DiscoWaiter, waiter);
 }
 
+/* Keeps track of which contacts and resources we're waiting for caps for,
+ * so that gabble_presence_cache_caps_pending () and
+ * gabble_presence_cache_disco_in_progress () needn't look at every node */
 static void
-disco_waiter_list_free (GSList *list)
+count_waiter (GabblePresenceCachePrivate *priv,
+    DiscoWaiter *waiter,
+    gint delta)
 {
-  GSList *i;
+  gpointer handle = GUINT_TO_POINTER (waiter->handle);
+  gint count;
 
-  DEBUG ("list %p", list);
+  count = GPOINTER_TO_INT (g_hash_table_lookup (priv->waiting_handles,
+        handle)) + delta;
+  g_assert (count >= 0);
+
+  if (count == 0)
+    g_hash_table_remove (priv->waiting_handles, handle);
+  else
+    g_hash_table_insert (priv->waiting_handles, handle,
+        GINT_TO_POINTER (count));
 
-  for (i = list; NULL != i; i = i->next)
-    disco_waiter_free ((DiscoWaiter *) i->data);
+  count = GPOINTER_TO_INT (g_hash_table_lookup (priv->waiting_resources,
+        waiter->key)) + delta;
+  g_assert (count >= 0);
 
-  g_slist_free (list);
+  if (count == 0)
+    g_hash_table_remove (priv->waiting_resources, waiter->key);
+  else
+    g_hash_table_insert (priv->waiting_resources, g_strdup (waiter->key),
+        GINT_TO_POINTER (count));
 }
 
-static guint
-disco_waiter_list_get_request_count (GSList *list)
+static DiscoNode *
+disco_node_new (GabblePresenceCache *cache,
+    const gchar *node)
 {
-  guint c = 0;
-  GSList *i;
+  DiscoNode *dn = g_slice_new0 (DiscoNode);
 
-  for (i = list; i; i = i->next)
-    {
-      DiscoWaiter *waiter = (DiscoWaiter *) i->data;
+  dn->cache = cache;
+  dn->node = g_strdup (node);
+  g_queue_init (&dn->waiters);
+  dn->index = g_hash_table_new (g_str_hash, g_str_equal);
+  g_get_current_time (&dn->since);
 
-      if (waiter->disco_requested)
-        {
-          if (!tp_strdiff (waiter->hash, "sha-1"))
-            /* One waiter is enough if
-             * 1. the request has a verification string
-             * 2. the hash algorithm is supported
-             */
-            c += CAPABILITY_BUNDLE_ENOUGH_TRUST;
-          else
-            c++;
-        }
-    }
+  g_hash_table_insert (cache->priv->disco_pending, dn->node, dn);
+  return dn;
+}
+
+static DiscoWaiter *
+disco_node_find_waiter (DiscoNode *dn,
+    TpHandle handle,
+    const gchar *resource)
+{
+  gchar *key;
+  DiscoWaiter *waiter;
+
+  if (dn == NULL)
+    return NULL;
+
+  key = disco_waiter_key (handle, resource);
+  waiter = g_hash_table_lookup (dn->index, key);
+  g_free (key);
+  return waiter;
+}
+
+static void
+disco_node_add_waiter (DiscoNode *dn,
+    DiscoWaiter *waiter)
+{
+  GabblePresenceCachePrivate *priv = dn->cache->priv;
+
+  g_queue_push_head (&dn->waiters, waiter);
+  waiter->link = dn->waiters.head;
+  g_hash_table_insert (dn->index, waiter->key, waiter);
+
+  count_waiter (priv, waiter, 1);
+}
+
+/* Called when @waiter's request has been answered, or has failed */
+static void
+disco_node_request_done (DiscoNode *dn,
+    DiscoWaiter *waiter)
+{
+  if (waiter->request == NULL)
+    return;
+
+  waiter->request = NULL;
+  g_assert (dn->in_flight > 0);
+  dn->in_flight--;
+}
+
+/* Stops counting on @waiter to give us any trust in the node */
+static void
+disco_node_forget_trust (DiscoNode *dn,
+    DiscoWaiter *waiter)
+{
+  dn->possible_trust -= waiter->possible_trust;
+  waiter->possible_trust = 0;
+}
+
+/* Removes @waiter from @dn, cancelling its request if need be */
+static void
+disco_node_take_waiter (DiscoNode *dn,
+    DiscoWaiter *waiter)
+{
+  GabblePresenceCachePrivate *priv = dn->cache->priv;
+  GabbleDiscoRequest *request = waiter->request;
+
+  disco_node_request_done (dn, waiter);
+  disco_node_forget_trust (dn, waiter);
+
+  /* this calls _caps_disco_cb with a CANCELLED error, which it ignores */
+  if (request != NULL)
+    gabble_disco_cancel_request (priv->conn->disco, request);
+
+  g_queue_delete_link (&dn->waiters, waiter->link);
+  g_hash_table_remove (dn->index, waiter->key);
+
+  count_waiter (priv, waiter, -1);
+}
+
+static void
+disco_node_remove_waiter (DiscoNode *dn,
+    DiscoWaiter *waiter)
+{
+  disco_node_take_waiter (dn, waiter);
+  disco_waiter_free (waiter);
+}
+
+static void
+disco_node_free (gpointer data)
+{
+  DiscoNode *dn = data;
+
+  DEBUG ("node %s", dn->node);
+
+  if (dn->hedge_id != 0)
+    g_source_remove (dn->hedge_id);
+
+  while (!g_queue_is_empty (&dn->waiters))
+    disco_node_remove_waiter (dn, g_queue_peek_head (&dn->waiters));
 
-  return c;
+  g_hash_table_destroy (dn->index);
+  g_free (dn->node);
+  g_slice_free (DiscoNode, dn);
+}
+
+/* Removes @dn from the pending table and frees it */
+static void
+disco_node_finish (DiscoNode *dn)
+{
+  g_hash_table_remove (dn->cache->priv->disco_pending, dn->node);
+}
+
+static void
+record_time_to_caps (GabblePresenceCachePrivate *priv,
+    DiscoNode *dn)
+{
+  guint ms = gabble_time_val_elapsed_ms (&dn->since);
+
+  gabble_samples_add (&priv->times_to_caps, ms);
+  priv->nodes_discovered++;
+
+  DEBUG ("time to caps for %s: %ums (%u nodes discovered)", dn->node, ms,
+      priv->nodes_discovered);
 }
 
 static GabbleCapabilityInfo *
@@ -293,6 +498,12 @@ capability_info_recvd (GabblePresenceCache *cache,
 
   info->client_types = client_types;
 
+  /* Make @cap_set share its contents with the node's set, so that every
+   * contact advertising this node ends up pointing at the same data rather
+   * than at a copy of it */
+  gabble_capability_set_clear (cap_set);
+  gabble_capability_set_update (cap_set, info->cap_set);
+
   return info->trust;
 }
 
@@ -371,6 +582,39 @@ gabble_presence_cache_class_init (GabblePresenceCacheClass *klass)
                                    PROP_CONNECTION,
                                    param_spec);
 
+  param_spec = g_param_spec_uint ("caps-enough-trust", "Enough trust",
+      "How many different contacts must give the same answer about a caps "
+      "node without a hash before we believe it",
+      1, G_MAXUINT, CAPABILITY_BUNDLE_ENOUGH_TRUST,
+      G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_ENOUGH_TRUST,
+      param_spec);
+
+  param_spec = g_param_spec_uint ("caps-max-node-discos",
+      "Maximum discos per node",
+      "How many contacts may be asked about the same caps node at once",
+      1, G_MAXUINT, DEFAULT_MAX_NODE_DISCOS,
+      G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_MAX_NODE_DISCOS,
+      param_spec);
+
+  param_spec = g_param_spec_uint ("caps-disco-timeout", "Caps disco timeout",
+      "How long to wait for a contact to tell us what a caps node means, "
+      "in seconds",
+      1, G_MAXUINT, DEFAULT_CAPS_DISCO_TIMEOUT,
+      G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_CAPS_DISCO_TIMEOUT,
+      param_spec);
+
+  param_spec = g_param_spec_uint ("caps-hedge-delay", "Caps hedge delay",
+      "How long to wait for an answer about a caps node before asking "
+      "another contact as well, in milliseconds, or 0 to only do so when "
+      "the first request fails",
+      0, G_MAXUINT, DEFAULT_HEDGE_DELAY,
+      G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_HEDGE_DELAY,
+      param_spec);
+
   signals[PRESENCES_UPDATED] = g_signal_new (
     "presences-updated",
     G_TYPE_FROM_CLASS (klass),
@@ -458,7 +702,10 @@ gabble_presence_cache_init (GabblePresenceCache *cache)
   priv->capabilities = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
       (GDestroyNotify) capability_info_free);
   priv->disco_pending = g_hash_table_new_full (g_str_hash, g_str_equal,
-    g_free, (GDestroyNotify) disco_waiter_list_free);
+    NULL, disco_node_free);
+  priv->waiting_handles = g_hash_table_new (NULL, NULL);
+  priv->waiting_resources = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, NULL);
   priv->caps_serial = 1;
 
   priv->decloak_requests = g_hash_table_new_full (NULL, NULL, NULL,
@@ -557,6 +804,19 @@ gabble_presence_cache_dispose (GObject *object)
 
   priv->dispose_has_run = TRUE;
 
+  if (DEBUGGING)
+    {
+      GabblePresenceCacheCapsStats stats;
+
+      gabble_presence_cache_get_caps_stats (self, &stats);
+      DEBUG ("%u caps nodes discovered, %u given up on, %u still pending; "
+          "%u discos sent (%u hedged), %u failed; time to caps p50 %ums, "
+          "p90 %ums, p99 %ums", stats.nodes_discovered, stats.nodes_failed,
+          stats.nodes_pending, stats.discos_sent, stats.discos_hedged,
+          stats.discos_failed, stats.time_to_caps_p50,
+          stats.time_to_caps_p90, stats.time_to_caps_p99);
+    }
+
   if (priv->unsure_id != 0)
     {
       g_source_remove (priv->unsure_id);
@@ -574,6 +834,8 @@ gabble_presence_cache_dispose (GObject *object)
   tp_clear_pointer (&priv->presence, g_hash_table_destroy);
   tp_clear_pointer (&priv->capabilities, g_hash_table_destroy);
   tp_clear_pointer (&priv->disco_pending, g_hash_table_destroy);
+  tp_clear_pointer (&priv->waiting_handles, g_hash_table_destroy);
+  tp_clear_pointer (&priv->waiting_resources, g_hash_table_destroy);
   tp_clear_pointer (&priv->presence_handles, tp_handle_set_destroy);
   tp_clear_pointer (&priv->location, g_hash_table_destroy);
 
@@ -602,6 +864,18 @@ gabble_presence_cache_get_property (GObject    *object,
     case PROP_CONNECTION:
       g_value_set_object (value, priv->conn);
       break;
+    case PROP_ENOUGH_TRUST:
+      g_value_set_uint (value, priv->enough_trust);
+      break;
+    case PROP_MAX_NODE_DISCOS:
+      g_value_set_uint (value, priv->max_node_discos);
+      break;
+    case PROP_CAPS_DISCO_TIMEOUT:
+      g_value_set_uint (value, priv->caps_disco_timeout);
+      break;
+    case PROP_HEDGE_DELAY:
+      g_value_set_uint (value, priv->hedge_delay);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -631,6 +905,19 @@ gabble_presence_cache_set_property (GObject     *object,
       priv->decloak_handles = tp_handle_set_new (contact_repo);
       break;
 
+    case PROP_ENOUGH_TRUST:
+      priv->enough_trust = g_value_get_uint (value);
+      break;
+    case PROP_MAX_NODE_DISCOS:
+      priv->max_node_discos = g_value_get_uint (value);
+      break;
+    case PROP_CAPS_DISCO_TIMEOUT:
+      priv->caps_disco_timeout = g_value_get_uint (value);
+      break;
+    case PROP_HEDGE_DELAY:
+      priv->hedge_delay = g_value_get_uint (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -857,8 +1144,8 @@ self_avatar_resolve_conflict (GabblePresenceCache *cache)
   gabble_vcard_manager_invalidate_cache (priv->conn->vcard_manager,
       base_conn->self_handle);
   gabble_vcard_manager_request (priv->conn->vcard_manager,
-      base_conn->self_handle, 0, self_vcard_request_cb, cache,
-      NULL);
+      base_conn->self_handle, 0, GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL,
+      self_vcard_request_cb, cache, NULL);
 }
 
 static void
@@ -1026,83 +1313,172 @@ static void _caps_disco_cb (GabbleDisco *disco,
     GError *error,
     gpointer user_data);
 
+static gboolean disco_node_hedge_cb (gpointer data);
+
+/* Sends a disco request for @dn's node to @waiter */
 static void
-redisco (GabblePresenceCache *cache,
-    GabbleDisco *disco,
-    DiscoWaiter *waiter,
-    const gchar *node)
+disco_node_ask (DiscoNode *dn,
+    DiscoWaiter *waiter)
 {
+  GabblePresenceCache *cache = dn->cache;
+  GabblePresenceCachePrivate *priv = cache->priv;
   const gchar *waiter_jid;
   gchar *full_jid;
 
+  g_assert (!waiter->disco_requested);
+
   waiter_jid = tp_handle_inspect (waiter->repo, waiter->handle);
   if (waiter->resource != NULL)
     full_jid = g_strdup_printf ("%s/%s", waiter_jid, waiter->resource);
   else
     full_jid = g_strdup (waiter_jid);
 
-  gabble_disco_request (disco, GABBLE_DISCO_TYPE_INFO, full_jid,
-      node, _caps_disco_cb, cache, G_OBJECT (cache), NULL);
   waiter->disco_requested = TRUE;
+  waiter->request = gabble_disco_request_with_timeout (priv->conn->disco,
+      GABBLE_DISCO_TYPE_INFO, full_jid, dn->node, priv->caps_disco_timeout,
+      _caps_disco_cb, cache, G_OBJECT (cache), NULL);
+
+  if (waiter->request != NULL)
+    {
+      /* One waiter is enough if
+       * 1. the request has a verification string
+       * 2. the hash algorithm is supported
+       */
+      if (!tp_strdiff (waiter->hash, "sha-1"))
+        waiter->possible_trust = priv->enough_trust;
+      else
+        waiter->possible_trust = 1;
+
+      dn->possible_trust += waiter->possible_trust;
+      dn->in_flight++;
+      priv->discos_sent++;
+
+      DEBUG ("asked %s about %s (%u in flight)", full_jid, dn->node,
+          dn->in_flight);
+
+      if (dn->hedge_id == 0 && priv->hedge_delay > 0)
+        dn->hedge_id = g_timeout_add (priv->hedge_delay, disco_node_hedge_cb,
+            dn);
+    }
 
   g_free (full_jid);
 }
 
-static void
-disco_failed (GabblePresenceCache *cache,
-    GabbleDisco *disco,
-    const gchar *node,
-    GSList *waiters)
+/* Returns the most recently seen contact we haven't asked about @dn yet */
+static DiscoWaiter *
+disco_node_next_candidate (DiscoNode *dn)
 {
-  GabblePresenceCachePrivate *priv = cache->priv;
-  GSList *i;
-  DiscoWaiter *waiter = NULL;
-  gchar *full_jid = NULL;
+  GList *l;
 
-  for (i = waiters; NULL != i; i = i->next)
+  for (l = dn->waiters.head; l != NULL; l = l->next)
     {
-      waiter = (DiscoWaiter *) i->data;
+      DiscoWaiter *waiter = l->data;
 
       if (!waiter->disco_requested)
-        {
-          redisco (cache, disco, waiter, node);
-          break;
-        }
+        return waiter;
     }
 
-  if (NULL != i)
+  return NULL;
+}
+
+/* Asks more contacts about @dn's node, until the replies would give us
+ * enough trust in it, or as many requests as we allow are in flight */
+static void
+disco_node_ask_more (DiscoNode *dn,
+    guint trust)
+{
+  GabblePresenceCachePrivate *priv = dn->cache->priv;
+
+  while (trust + dn->possible_trust < priv->enough_trust &&
+      dn->in_flight < priv->max_node_discos)
     {
-      DEBUG ("sent a retry disco request to %s for URI %s", full_jid, node);
+      DiscoWaiter *waiter = disco_node_next_candidate (dn);
+
+      if (waiter == NULL)
+        break;
+
+      DEBUG ("only %u trust out of %u possible thus far, sending "
+          "disco for URI %s", trust + dn->possible_trust,
+          priv->enough_trust, dn->node);
+      disco_node_ask (dn, waiter);
     }
-  else
+}
+
+/* Nobody has answered us about this node quickly: rather than wait for them
+ * to time out, ask someone else too, and use whichever answer comes first */
+static gboolean
+disco_node_hedge_cb (gpointer data)
+{
+  DiscoNode *dn = data;
+  GabblePresenceCachePrivate *priv = dn->cache->priv;
+  DiscoWaiter *waiter;
+
+  if (dn->in_flight == 0 || dn->in_flight >= priv->max_node_discos)
     {
-      /* The contact sends us an error and we don't have any other
-       * contacts to send the discovery request on the same node. We
-       * cannot get the caps for this node. */
-      DEBUG ("failed to find a suitable candidate to retry disco "
-          "request for URI %s", node);
-      g_hash_table_remove (priv->disco_pending, node);
+      dn->hedge_id = 0;
+      return FALSE;
     }
 
-  g_free (full_jid);
+  waiter = disco_node_next_candidate (dn);
+
+  if (waiter == NULL)
+    {
+      dn->hedge_id = 0;
+      return FALSE;
+    }
+
+  DEBUG ("no reply about %s after %ums, asking another contact", dn->node,
+      priv->hedge_delay);
+  priv->discos_hedged++;
+
+  /* keep going (at most one new request per interval) while there's room */
+  disco_node_ask (dn, waiter);
+  return TRUE;
 }
 
-static DiscoWaiter *
-find_matching_waiter (GSList *waiters,
-    TpHandle godot,
-    const gchar *resource)
+static void
+disco_node_failed (DiscoNode *dn,
+    DiscoWaiter *waiter)
 {
-  GSList *i;
+  GabblePresenceCachePrivate *priv = dn->cache->priv;
+  GabbleCapabilityInfo *info;
+
+  priv->discos_failed++;
 
-  for (i = waiters; NULL != i; i = i->next)
+  if (waiter != NULL)
     {
-      DiscoWaiter *waiter = i->data;
+      disco_node_request_done (dn, waiter);
+      disco_node_forget_trust (dn, waiter);
+    }
 
-      if (waiter->handle == godot && !tp_strdiff (waiter->resource, resource))
-        return waiter;
+  info = capability_info_get (dn->cache, dn->node);
+  disco_node_ask_more (dn, info->trust);
+
+  /* If nobody else has been asked, ask the next contact anyway: the one who
+   * failed might have been wrong about what they advertise */
+  if (dn->in_flight == 0)
+    {
+      DiscoWaiter *next = disco_node_next_candidate (dn);
+
+      if (next != NULL)
+        disco_node_ask (dn, next);
     }
 
-  return NULL;
+  if (dn->in_flight > 0)
+    {
+      DEBUG ("%u disco requests for URI %s still in flight", dn->in_flight,
+          dn->node);
+    }
+  else
+    {
+      /* The contact sends us an error and we don't have any other
+       * contacts to send the discovery request on the same node. We
+       * cannot get the caps for this node. */
+      DEBUG ("failed to find a suitable candidate to retry disco "
+          "request for URI %s", dn->node);
+      priv->nodes_failed++;
+      disco_node_finish (dn);
+    }
 }
 
 static void
@@ -1234,6 +1610,29 @@ _signal_presences_updated (GabblePresenceCache *cache,
   g_array_free (handles, TRUE);
 }
 
+/* Returns the waiter for @jid on @dn, if any */
+static DiscoWaiter *
+disco_node_find_jid (DiscoNode *dn,
+    TpHandleRepoIface *contact_repo,
+    const gchar *jid)
+{
+  TpHandle handle;
+  gchar *resource;
+  DiscoWaiter *waiter;
+
+  if (dn == NULL)
+    return NULL;
+
+  handle = tp_handle_lookup (contact_repo, jid, NULL, NULL);
+
+  if (handle == 0 || !gabble_decode_jid (jid, NULL, NULL, &resource))
+    return NULL;
+
+  waiter = disco_node_find_waiter (dn, handle, resource);
+  g_free (resource);
+  return waiter;
+}
+
 static void
 _caps_disco_cb (GabbleDisco *disco,
                 GabbleDiscoRequest *request,
@@ -1243,7 +1642,7 @@ _caps_disco_cb (GabbleDisco *disco,
                 GError *error,
                 gpointer user_data)
 {
-  GSList *waiters, *i;
+  DiscoNode *dn;
   DiscoWaiter *waiter_self;
   GabblePresenceCache *cache;
   GabblePresenceCachePrivate *priv;
@@ -1253,9 +1652,6 @@ _caps_disco_cb (GabbleDisco *disco,
   TpHandle handle = 0;
   gboolean bad_hash = FALSE;
   TpBaseConnection *base_conn;
-  gchar *resource;
-  gboolean jid_is_valid;
-  gpointer key;
   guint client_types = 0;
 
   cache = GABBLE_PRESENCE_CACHE (user_data);
@@ -1270,37 +1666,45 @@ _caps_disco_cb (GabbleDisco *disco,
       return;
     }
 
-  waiters = g_hash_table_lookup (priv->disco_pending, node);
+  if (priv->disco_pending == NULL)
+    return;
+
+  dn = g_hash_table_lookup (priv->disco_pending, node);
+  waiter_self = disco_node_find_jid (dn, contact_repo, jid);
+
+  if (waiter_self != NULL && waiter_self->request != request)
+    waiter_self = NULL;
 
   if (NULL != error)
     {
-      DEBUG ("disco query failed: %s", error->message);
+      if (g_error_matches (error, GABBLE_DISCO_ERROR,
+            GABBLE_DISCO_ERROR_CANCELLED))
+        {
+          /* Either we cancelled it, because we don't need the answer any
+           * more, or the connection is going away */
+          if (waiter_self != NULL)
+            disco_node_request_done (dn, waiter_self);
 
-      disco_failed (cache, disco, node, waiters);
+          return;
+        }
 
-      return;
-    }
+      DEBUG ("disco query failed: %s", error->message);
 
-  handle = tp_handle_ensure (contact_repo, jid, NULL, NULL);
+      if (dn != NULL)
+        disco_node_failed (dn, waiter_self);
 
-  if (handle == 0)
-    {
-      DEBUG ("Ignoring presence from invalid JID %s", jid);
       return;
     }
 
-  /* If tp_handle_ensure () was happy with the jid, it's valid. */
-  jid_is_valid = gabble_decode_jid (jid, NULL, NULL, &resource);
-  g_assert (jid_is_valid);
-  waiter_self = find_matching_waiter (waiters, handle, resource);
-  g_free (resource);
-
   if (NULL == waiter_self)
     {
       DEBUG ("Ignoring non requested disco reply from %s", jid);
-      goto OUT;
+      return;
     }
 
+  disco_node_request_done (dn, waiter_self);
+  handle = waiter_self->handle;
+
   /* Now onto caps */
   cap_set = gabble_capability_set_new_from_stanza (query_result);
   client_types = client_types_from_message (handle, query_result,
@@ -1326,7 +1730,7 @@ _caps_disco_cb (GabbleDisco *disco,
       else if (g_str_equal (waiter_self->ver, computed_hash))
         {
           trust = capability_info_recvd (cache, node, handle, cap_set,
-              CAPABILITY_BUNDLE_ENOUGH_TRUST, client_types);
+              priv->enough_trust, client_types);
         }
       else
         {
@@ -1344,24 +1748,12 @@ _caps_disco_cb (GabbleDisco *disco,
       trust = capability_info_recvd (cache, node, handle, cap_set, 1, client_types);
     }
 
-  /* Remove the node from the hash table without freeing the key or list of
-   * waiters.
-   *
-   * In the 'enough trust' case, this needs to be done before emitting the
-   * signal, so that when recipients of the capabilities-discovered signal ask
-   * whether we're unsure about the handle, there is no pending disco request
-   * that would make us unsure.
-   *
-   * In the 'not enough trust' branch, we re-use 'key' when updating the table.
-   */
-  if (!g_hash_table_lookup_extended (priv->disco_pending, node, &key, NULL))
-    g_assert_not_reached ();
-  g_hash_table_steal (priv->disco_pending, node);
-
-  if (trust >= CAPABILITY_BUNDLE_ENOUGH_TRUST)
+  if (trust >= priv->enough_trust)
     {
       WockyNodeTree *query_node = wocky_node_tree_new_from_node (query_result);
       WockyCapsCache *caps_cache = wocky_caps_cache_dup_shared ();
+      GQueue waiters = G_QUEUE_INIT;
+      DiscoWaiter *waiter;
 
       if (DEBUGGING)
         {
@@ -1371,22 +1763,34 @@ _caps_disco_cb (GabbleDisco *disco,
           g_free (tmp);
         }
 
+      record_time_to_caps (priv, dn);
+
       /* Update external cache. */
       wocky_caps_cache_insert (caps_cache, node, query_node);
       g_object_unref (caps_cache);
       g_object_unref (query_node);
 
-      /* We trust this caps node. Serve all its waiters. */
-      for (i = waiters; NULL != i; i = i->next)
+      /* Take all the waiters off the node (cancelling any other requests
+       * about it), and forget it, before emitting any signals, so that when
+       * recipients of the capabilities-discovered signal ask whether we're
+       * unsure about the handle, there is no pending disco request that
+       * would make us unsure.
+       */
+      while ((waiter = g_queue_peek_head (&dn->waiters)) != NULL)
         {
-          DiscoWaiter *waiter = (DiscoWaiter *) i->data;
+          disco_node_take_waiter (dn, waiter);
+          g_queue_push_tail (&waiters, waiter);
+        }
 
+      disco_node_finish (dn);
+
+      /* We trust this caps node. Serve all its waiters. */
+      while ((waiter = g_queue_pop_head (&waiters)) != NULL)
+        {
           set_caps_for (waiter, cache, cap_set, client_types, handle, jid);
           emit_capabilities_discovered (cache, waiter->handle);
+          disco_waiter_free (waiter);
         }
-
-      g_free (key);
-      disco_waiter_list_free (waiters);
     }
   else
     {
@@ -1399,6 +1803,8 @@ _caps_disco_cb (GabbleDisco *disco,
        * FIXME I think we should respect the caps, even if the hash is wrong,
        *       for the jid that answered the query.
        */
+      disco_node_take_waiter (dn, waiter_self);
+
       if (!bad_hash)
         {
           if (DEBUGGING)
@@ -1411,34 +1817,30 @@ _caps_disco_cb (GabbleDisco *disco,
 
           set_caps_for (waiter_self, cache, cap_set, client_types, handle, jid);
         }
-
-      waiters = g_slist_remove (waiters, waiter_self);
-      g_hash_table_insert (priv->disco_pending, key, waiters);
+      else
+        {
+          priv->discos_failed++;
+        }
 
       emit_capabilities_discovered (cache, waiter_self->handle);
       disco_waiter_free (waiter_self);
 
-      /* Ensure that we have enough pending requests to get enough trust for
-       * this node.
-       */
-      for (i = waiters; i != NULL; i = i->next)
-        {
-          DiscoWaiter *waiter = (DiscoWaiter *) i->data;
+      /* Signal handlers could have changed the table */
+      dn = g_hash_table_lookup (priv->disco_pending, node);
 
-          if (trust + disco_waiter_list_get_request_count (waiters)
-              >= CAPABILITY_BUNDLE_ENOUGH_TRUST)
-            break;
+      if (dn != NULL)
+        {
+          /* Ensure that we have enough pending requests to get enough trust
+           * for this node.
+           */
+          disco_node_ask_more (dn, trust);
 
-          if (!waiter->disco_requested)
-            redisco (cache, disco, waiter, node);
+          if (dn->in_flight == 0 && disco_node_next_candidate (dn) == NULL)
+            disco_node_finish (dn);
         }
     }
 
   gabble_capability_set_free (cap_set);
-
-OUT:
-  if (handle)
-    tp_handle_unref (contact_repo, handle);
 }
 
 static void
@@ -1484,8 +1886,24 @@ _process_caps_uri (GabblePresenceCache *cache,
 
   g_object_unref (caps_cache);
 
+  if (cached_caps != NULL)
+    {
+      /* Intern the parsed set in the node's info, so the contacts sharing
+       * this node share one copy of their caps too */
+      if (info->cap_set == NULL)
+        {
+          info->cap_set = cached_caps;
+          cached_caps = gabble_capability_set_copy (info->cap_set);
+        }
+      else if (gabble_capability_set_equals (cached_caps, info->cap_set))
+        {
+          gabble_capability_set_clear (cached_caps);
+          gabble_capability_set_update (cached_caps, info->cap_set);
+        }
+    }
+
   if (cached_caps != NULL ||
-      info->trust >= CAPABILITY_BUNDLE_ENOUGH_TRUST ||
+      info->trust >= priv->enough_trust ||
       tp_intset_is_member (info->guys, handle))
     {
       GabblePresence *presence = gabble_presence_cache_get (cache, handle);
@@ -1526,21 +1944,14 @@ _process_caps_uri (GabblePresenceCache *cache,
     }
   else
     {
-      GSList *waiters;
+      DiscoNode *dn;
       DiscoWaiter *waiter;
-      guint possible_trust;
-      gboolean found;
-      gpointer key;
-      gpointer value = NULL;
 
       DEBUG ("not enough trust for URI %s", uri);
 
       /* Are we already waiting for responses for this URI? */
-      found = g_hash_table_lookup_extended (priv->disco_pending, uri, &key,
-          &value);
-      waiters = (GSList *) value;
-
-      waiter = find_matching_waiter (waiters, handle, resource);
+      dn = g_hash_table_lookup (priv->disco_pending, uri);
+      waiter = disco_node_find_waiter (dn, handle, resource);
 
       if (waiter != NULL)
         {
@@ -1553,37 +1964,19 @@ _process_caps_uri (GabblePresenceCache *cache,
           goto out;
         }
 
+      if (dn == NULL)
+        dn = disco_node_new (cache, uri);
+
       waiter = disco_waiter_new (contact_repo, handle, resource,
           hash, ver, serial);
-      waiters = g_slist_prepend (waiters, waiter);
-
-      /* If the URI was already in the hash table, steal it and re-use the same
-       * URI for the following insertion. Otherwise, make a copy of the URI for
-       * use as a key.
-       */
-      if (found)
-        g_hash_table_steal (priv->disco_pending, key);
-      else
-        key = g_strdup (uri);
-
-      g_hash_table_insert (priv->disco_pending, key, waiters);
+      disco_node_add_waiter (dn, waiter);
 
       /* When all the responses we're waiting for return, will we have enough
-       * trust?
+       * trust? If not, ask this contact too (unless we're already asking as
+       * many as we're willing to, in which case they'll be asked if one of
+       * the others doesn't come through).
        */
-      possible_trust = disco_waiter_list_get_request_count (waiters);
-
-      if (info->trust + possible_trust < CAPABILITY_BUNDLE_ENOUGH_TRUST)
-        {
-          /* DISCO */
-          DEBUG ("only %u trust out of %u possible thus far, sending "
-              "disco for URI %s", info->trust + possible_trust,
-              CAPABILITY_BUNDLE_ENOUGH_TRUST, uri);
-          gabble_disco_request (priv->conn->disco, GABBLE_DISCO_TYPE_INFO,
-              from, uri, _caps_disco_cb, cache, G_OBJECT (cache), NULL);
-          /* enough DISCO for you, buddy */
-          waiter->disco_requested = TRUE;
-        }
+      disco_node_ask_more (dn, info->trust);
     }
 
 out:
@@ -2089,7 +2482,7 @@ gabble_presence_cache_add_bundle_caps (GabblePresenceCache *cache,
   if (info->cap_set == NULL)
     info->cap_set = gabble_capability_set_new ();
 
-  info->trust = CAPABILITY_BUNDLE_ENOUGH_TRUST;
+  info->trust = cache->priv->enough_trust;
 
   if (namespace != NULL)
     gabble_capability_set_add (info->cap_set, namespace);
@@ -2132,7 +2525,7 @@ gabble_presence_cache_add_own_caps (
     info->identities = wocky_disco_identity_array_copy (identities);
 
   info->complete = TRUE;
-  info->trust = CAPABILITY_BUNDLE_ENOUGH_TRUST;
+  info->trust = cache->priv->enough_trust;
   tp_intset_add (info->guys, cache->priv->conn->parent.self_handle);
 
   /* FIXME: we should satisfy any waiters for this node now. fd.o bug #24619. */
@@ -2279,28 +2672,9 @@ gabble_presence_cache_caps_pending (GabblePresenceCache *cache,
                                     TpHandle handle)
 {
   GabblePresenceCachePrivate *priv = cache->priv;
-  GList *uris, *li;
-
-  uris = g_hash_table_get_values (priv->disco_pending);
-
-  for (li = uris; li != NULL; li = li->next)
-    {
-      GSList *waiters;
 
-      for (waiters = li->data; waiters != NULL; waiters = waiters->next)
-        {
-          DiscoWaiter *w = waiters->data;
-          if (w->handle == handle)
-            {
-              g_list_free (uris);
-              return TRUE;
-            }
-
-        }
-    }
-
-  g_list_free (uris);
-  return FALSE;
+  return g_hash_table_lookup (priv->waiting_handles,
+      GUINT_TO_POINTER (handle)) != NULL;
 }
 
 /* Return whether we're "unsure" about the capabilities of @handle.
@@ -2473,27 +2847,44 @@ gabble_presence_cache_disco_in_progress (GabblePresenceCache *cache,
     const gchar *resource)
 {
   GabblePresenceCachePrivate *priv = cache->priv;
-  GList *l, *waiter_list;
-  gboolean in_progress = FALSE;
+  gchar *key = disco_waiter_key (handle, resource);
+  gboolean in_progress;
 
-  waiter_list = g_hash_table_get_values (priv->disco_pending);
+  in_progress = g_hash_table_lookup (priv->waiting_resources, key) != NULL;
+  g_free (key);
+  return in_progress;
+}
 
-  for (l = waiter_list; !in_progress && l != NULL; l = l->next)
-    {
-      GList *j;
+/**
+ * gabble_presence_cache_get_caps_stats:
+ * @cache: a presence cache
+ * @stats: (out caller-allocates): filled in with @cache's counters
+ *
+ * Takes a snapshot of how caps discovery is doing: how many nodes we've
+ * learned, how many requests that took, and how long contacts waited.
+ */
+void
+gabble_presence_cache_get_caps_stats (GabblePresenceCache *cache,
+    GabblePresenceCacheCapsStats *stats)
+{
+  GabblePresenceCachePrivate *priv;
 
-      for (j = l->data; !in_progress && j != NULL; j = j->next)
-        {
-          DiscoWaiter *w = j->data;
+  g_return_if_fail (GABBLE_IS_PRESENCE_CACHE (cache));
+  g_return_if_fail (stats != NULL);
 
-          if (w != NULL &&
-              w->handle == handle &&
-              !tp_strdiff (w->resource, resource))
-            in_progress = TRUE;
-        }
-    }
+  priv = cache->priv;
+  memset (stats, 0, sizeof (*stats));
 
-  g_list_free (waiter_list);
+  stats->nodes_discovered = priv->nodes_discovered;
+  stats->nodes_failed = priv->nodes_failed;
+  stats->discos_sent = priv->discos_sent;
+  stats->discos_hedged = priv->discos_hedged;
+  stats->discos_failed = priv->discos_failed;
 
-  return in_progress;
+  if (priv->disco_pending != NULL)
+    stats->nodes_pending = g_hash_table_size (priv->disco_pending);
+
+  gabble_samples_get_percentiles (&priv->times_to_caps,
+      &stats->time_to_caps_p50, &stats->time_to_caps_p90,
+      &stats->time_to_caps_p99);
 }
@@ -140,6 +140,38 @@ GHashTable* gabble_presence_cache_get_location (GabblePresenceCache *cache,
 gboolean gabble_presence_cache_disco_in_progress (GabblePresenceCache *cache,
     TpHandle handle, const gchar *resource);
 
+/**
+ * GabblePresenceCacheCapsStats:
+ * @nodes_discovered: number of caps nodes we've come to trust by asking
+ *  contacts about them
+ * @nodes_failed: number of caps nodes we gave up on, because everyone we
+ *  asked failed to answer
+ * @nodes_pending: number of caps nodes we're currently asking about
+ * @discos_sent: number of disco requests sent to contacts about caps nodes
+ * @discos_hedged: how many of @discos_sent were sent because nobody had
+ *  answered in time
+ * @discos_failed: number of those requests which failed, or whose answer
+ *  didn't match its hash
+ * @time_to_caps_p50: median time between first seeing a node and trusting
+ *  it, for recently discovered nodes, in milliseconds
+ * @time_to_caps_p90: 90th percentile time to caps, in milliseconds
+ * @time_to_caps_p99: 99th percentile time to caps, in milliseconds
+ */
+typedef struct {
+    guint nodes_discovered;
+    guint nodes_failed;
+    guint nodes_pending;
+    guint discos_sent;
+    guint discos_hedged;
+    guint discos_failed;
+    guint time_to_caps_p50;
+    guint time_to_caps_p90;
+    guint time_to_caps_p99;
+} GabblePresenceCacheCapsStats;
+
+void gabble_presence_cache_get_caps_stats (GabblePresenceCache *cache,
+    GabblePresenceCacheCapsStats *stats);
+
 G_END_DECLS
 
 #endif /* __GABBLE_PRESENCE_CACHE_H__ */
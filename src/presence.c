@@ -58,8 +58,18 @@ struct _GabblePresencePrivate {
     /* The aggregated caps of all the contacts' resources. */
     GabbleCapabilitySet *cap_set;
 
+    /* GUINT_TO_POINTER (feature's GQuark) => GUINT_TO_POINTER (number of
+     * resources which have it), so that @cap_set can be kept up to date
+     * without going through every resource each time one changes */
+    GHashTable *cap_counts;
+
     gchar *no_resource_status_message;
-    GSList *resources;
+
+    /* Owned Resources, in the order we first saw them; and the same
+     * resources indexed by name (borrowed from the Resource) */
+    GPtrArray *resources;
+    GHashTable *resource_index;
+
     guint olpc_views;
 
     gchar *active_resource;
@@ -94,14 +104,13 @@ _resource_free (Resource *resource)
 static void
 gabble_presence_finalize (GObject *object)
 {
-  GSList *i;
   GabblePresence *presence = GABBLE_PRESENCE (object);
   GabblePresencePrivate *priv = presence->priv;
 
-  for (i = priv->resources; NULL != i; i = i->next)
-    _resource_free (i->data);
-
-  g_slist_free (priv->resources);
+  g_hash_table_destroy (priv->resource_index);
+  g_hash_table_destroy (priv->cap_counts);
+  g_ptr_array_foreach (priv->resources, (GFunc) _resource_free, NULL);
+  g_ptr_array_free (priv->resources, TRUE);
   gabble_capability_set_free (priv->cap_set);
 
   g_free (presence->nickname);
@@ -128,7 +137,9 @@ gabble_presence_init (GabblePresence *self)
 
   priv = self->priv;
   priv->cap_set = gabble_capability_set_new ();
-  priv->resources = NULL;
+  priv->resources = g_ptr_array_new ();
+  priv->resource_index = g_hash_table_new (g_str_hash, g_str_equal);
+  priv->cap_counts = g_hash_table_new (NULL, NULL);
 
   self->status = GABBLE_PRESENCE_UNKNOWN;
 }
@@ -175,6 +186,116 @@ resource_better_than (
     return (a->priority > b->priority);
 }
 
+typedef struct {
+    GabblePresence *presence;
+    Resource *resource;
+} CapsContext;
+
+static void
+count_resource_cap (gpointer data,
+    gpointer user_data)
+{
+  const gchar *ns = data;
+  CapsContext *ctx = user_data;
+  GabblePresencePrivate *priv = ctx->presence->priv;
+  gpointer key = GUINT_TO_POINTER (g_quark_from_string (ns));
+  guint count;
+
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (priv->cap_counts, key));
+
+  if (count == 0)
+    gabble_capability_set_add (priv->cap_set, ns);
+
+  g_hash_table_insert (priv->cap_counts, key, GUINT_TO_POINTER (count + 1));
+}
+
+static void
+add_resource_cap (gpointer data,
+    gpointer user_data)
+{
+  const gchar *ns = data;
+  CapsContext *ctx = user_data;
+
+  if (gabble_capability_set_has (ctx->resource->cap_set, ns))
+    return;
+
+  gabble_capability_set_add (ctx->resource->cap_set, ns);
+  count_resource_cap (data, user_data);
+}
+
+static void
+remove_resource_cap (gpointer data,
+    gpointer user_data)
+{
+  const gchar *ns = data;
+  CapsContext *ctx = user_data;
+  GabblePresencePrivate *priv = ctx->presence->priv;
+  gpointer key = GUINT_TO_POINTER (g_quark_try_string (ns));
+  guint count;
+
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (priv->cap_counts, key));
+  g_return_if_fail (count > 0);
+
+  if (count == 1)
+    {
+      gabble_capability_set_remove (priv->cap_set, ns);
+      g_hash_table_remove (priv->cap_counts, key);
+    }
+  else
+    {
+      g_hash_table_insert (priv->cap_counts, key,
+          GUINT_TO_POINTER (count - 1));
+    }
+}
+
+/* Adds @cap_set to @res's caps and to the aggregate */
+static void
+resource_add_caps (GabblePresence *presence,
+    Resource *res,
+    const GabbleCapabilitySet *cap_set)
+{
+  CapsContext ctx = { presence, res };
+
+  if (gabble_capability_set_size (res->cap_set) == 0)
+    {
+      /* This is nearly always the case: share the caller's set (typically
+       * the one every contact with the same caps node uses) */
+      gabble_capability_set_update (res->cap_set, cap_set);
+      gabble_capability_set_foreach_with_quirks (cap_set, count_resource_cap,
+          &ctx);
+      return;
+    }
+
+  gabble_capability_set_foreach_with_quirks (cap_set, add_resource_cap, &ctx);
+}
+
+/* Removes all of @res's caps, and those which no other resource has from the
+ * aggregate */
+static void
+resource_clear_caps (GabblePresence *presence,
+    Resource *res)
+{
+  CapsContext ctx = { presence, res };
+
+  gabble_capability_set_foreach_with_quirks (res->cap_set, remove_resource_cap,
+      &ctx);
+  gabble_capability_set_clear (res->cap_set);
+}
+
+/* Forgets any caps we had for the bare JID, which don't apply once we know
+ * about resources */
+static void
+forget_bare_jid_caps (GabblePresence *presence)
+{
+  GabblePresencePrivate *priv = presence->priv;
+
+  if (priv->resources->len == 0)
+    {
+      gabble_capability_set_clear (priv->cap_set);
+      g_hash_table_remove_all (priv->cap_counts);
+    }
+}
+
 gboolean
 gabble_presence_has_cap (GabblePresence *presence,
     const gchar *ns)
@@ -201,7 +322,7 @@ gabble_presence_peek_caps (GabblePresence *presence)
 gboolean
 gabble_presence_has_resources (GabblePresence *self)
 {
-  return (self->priv->resources != NULL);
+  return (self->priv->resources->len > 0);
 }
 
 /*
@@ -224,14 +345,14 @@ gabble_presence_pick_resource_by_caps (
     gconstpointer user_data)
 {
   GabblePresencePrivate *priv = presence->priv;
-  GSList *i;
+  guint i;
   Resource *chosen = NULL;
 
   g_return_val_if_fail (presence != NULL, NULL);
 
-  for (i = priv->resources; NULL != i; i = i->next)
+  for (i = 0; i < priv->resources->len; i++)
     {
-      Resource *res = (Resource *) i->data;
+      Resource *res = g_ptr_array_index (priv->resources, i);
 
       if (predicate != NULL && !predicate (res->cap_set, user_data))
         continue;
@@ -246,24 +367,33 @@ gabble_presence_pick_resource_by_caps (
     return NULL;
 }
 
+static Resource *
+_find_resource (GabblePresence *presence, const gchar *resource)
+{
+  /* you've been warned! */
+  g_return_val_if_fail (presence != NULL, NULL);
+  g_return_val_if_fail (resource != NULL, NULL);
+
+  return g_hash_table_lookup (presence->priv->resource_index, resource);
+}
+
 gboolean
 gabble_presence_resource_has_caps (GabblePresence *presence,
                                    const gchar *resource,
                                    GabbleCapabilitySetPredicate predicate,
                                    gconstpointer user_data)
 {
-  GabblePresencePrivate *priv = presence->priv;
-  GSList *i;
+  Resource *res;
 
-  for (i = priv->resources; NULL != i; i = i->next)
-    {
-      Resource *res = (Resource *) i->data;
+  if (resource == NULL)
+    return FALSE;
 
-      if (!tp_strdiff (res->name, resource))
-        return predicate (res->cap_set, user_data);
-    }
+  res = _find_resource (presence, resource);
 
-  return FALSE;
+  if (res == NULL)
+    return FALSE;
+
+  return predicate (res->cap_set, user_data);
 }
 
 void
@@ -273,9 +403,9 @@ gabble_presence_set_capabilities (GabblePresence *presence,
                                   guint serial)
 {
   GabblePresencePrivate *priv = presence->priv;
-  GSList *i;
+  Resource *res;
 
-  if (resource == NULL && priv->resources != NULL)
+  if (resource == NULL && priv->resources->len > 0)
     {
       /* This is consistent with the handling of presence: if we get presence
        * from a bare JID, we throw away all the resources, and if we get
@@ -287,86 +417,58 @@ gabble_presence_set_capabilities (GabblePresence *presence,
       return;
     }
 
-  gabble_capability_set_clear (priv->cap_set);
-
   if (resource == NULL)
     {
       DEBUG ("Setting capabilities for bare JID");
+      gabble_capability_set_clear (priv->cap_set);
       gabble_capability_set_update (priv->cap_set, cap_set);
       return;
     }
 
   DEBUG ("about to add caps to resource %s with serial %u", resource, serial);
 
-  for (i = priv->resources; NULL != i; i = i->next)
-    {
-      Resource *tmp = (Resource *) i->data;
-
-      /* This does not use _find_resource() because it also refreshes
-       * priv->cap_set as we go.
-       */
-      if (0 == strcmp (tmp->name, resource))
-        {
-          DEBUG ("found resource %s", resource);
-
-          if (serial > tmp->caps_serial)
-            {
-              DEBUG ("new serial %u, old %u, clearing caps", serial,
-                tmp->caps_serial);
-              tmp->caps_serial = serial;
-              gabble_capability_set_clear (tmp->cap_set);
-            }
-
-          if (serial >= tmp->caps_serial)
-            {
-              DEBUG ("updating caps for resource %s", resource);
-
-              gabble_capability_set_update (tmp->cap_set, cap_set);
-            }
-        }
+  res = _find_resource (presence, resource);
 
-      gabble_capability_set_update (priv->cap_set, tmp->cap_set);
+  if (res == NULL)
+    {
+      forget_bare_jid_caps (presence);
+      return;
     }
-}
 
-static Resource *
-_find_resource (GabblePresence *presence, const gchar *resource)
-{
-  GSList *i;
-
-  /* you've been warned! */
-  g_return_val_if_fail (presence != NULL, NULL);
-  g_return_val_if_fail (resource != NULL, NULL);
+  DEBUG ("found resource %s", resource);
 
-  for (i = presence->priv->resources; NULL != i; i = i->next)
+  if (serial > res->caps_serial)
     {
-      Resource *res = i->data;
-
-      if (!tp_strdiff (res->name, resource))
-        return res;
+      DEBUG ("new serial %u, old %u, clearing caps", serial,
+        res->caps_serial);
+      res->caps_serial = serial;
+      resource_clear_caps (presence, res);
     }
 
-  return NULL;
+  if (serial >= res->caps_serial)
+    {
+      DEBUG ("updating caps for resource %s", resource);
+      resource_add_caps (presence, res, cap_set);
+    }
 }
 
 static gboolean
 aggregate_resources (GabblePresence *presence)
 {
   GabblePresencePrivate *priv = presence->priv;
-  GSList *i;
+  guint i;
   Resource *best = NULL;
   guint old_client_types = presence->client_types;
 
+  forget_bare_jid_caps (presence);
+
   /* select the most preferable Resource and update presence->* based on our
    * choice */
-  gabble_capability_set_clear (priv->cap_set);
   presence->status = GABBLE_PRESENCE_OFFLINE;
 
-  for (i = priv->resources; NULL != i; i = i->next)
+  for (i = 0; i < priv->resources->len; i++)
     {
-      Resource *r = (Resource *) i->data;
-
-      gabble_capability_set_update (priv->cap_set, r->cap_set);
+      Resource *r = g_ptr_array_index (priv->resources, i);
 
       /* This doesn't use resource_better_than() because phone preferences take
        * priority above all others whereas this is only using the PC thing as a
@@ -424,7 +526,6 @@ gabble_presence_update (GabblePresence *presence,
   Resource *res;
   GabblePresenceId old_status;
   gchar *old_status_message;
-  GSList *i;
   gboolean ret = FALSE;
 
   /* save our current state */
@@ -434,13 +535,12 @@ gabble_presence_update (GabblePresence *presence,
   if (NULL == resource)
     {
       /* presence from a JID with no resource: free all resources and set
-       * presence directly */
-
-      for (i = priv->resources; i; i = i->next)
-        _resource_free (i->data);
-
-      g_slist_free (priv->resources);
-      priv->resources = NULL;
+       * presence directly. The caps they had are kept until we're told
+       * otherwise. */
+      g_hash_table_remove_all (priv->cap_counts);
+      g_hash_table_remove_all (priv->resource_index);
+      g_ptr_array_foreach (priv->resources, (GFunc) _resource_free, NULL);
+      g_ptr_array_set_size (priv->resources, 0);
 
       if (tp_strdiff (priv->no_resource_status_message, status_message))
         {
@@ -460,27 +560,22 @@ gabble_presence_update (GabblePresence *presence,
     {
       if (NULL != res)
         {
-          priv->resources = g_slist_remove (priv->resources, res);
+          g_hash_table_remove (priv->resource_index, res->name);
+          g_ptr_array_remove (priv->resources, res);
+          resource_clear_caps (presence, res);
           _resource_free (res);
           res = NULL;
-
-          /* recalculate aggregate capability mask */
-          gabble_capability_set_clear (priv->cap_set);
-
-          for (i = priv->resources; i; i = i->next)
-            {
-              Resource *r = (Resource *) i->data;
-
-              gabble_capability_set_update (priv->cap_set, r->cap_set);
-            }
         }
     }
   else
     {
       if (NULL == res)
         {
+          forget_bare_jid_caps (presence);
+
           res = _resource_new (g_strdup (resource));
-          priv->resources = g_slist_append (priv->resources, res);
+          g_ptr_array_add (priv->resources, res);
+          g_hash_table_insert (priv->resource_index, res->name, res);
         }
 
       res->status = status;
@@ -499,7 +594,6 @@ gabble_presence_update (GabblePresence *presence,
 
   /* select the most preferable Resource and update presence->* based on our
    * choice */
-  gabble_capability_set_clear (priv->cap_set);
   presence->status = GABBLE_PRESENCE_OFFLINE;
 
   /* use the status message from any offline Resource we're
@@ -605,9 +699,10 @@ gabble_presence_as_message (GabblePresence *presence,
   GabblePresencePrivate *priv = presence->priv;
   LmMessage *message;
   LmMessageSubType subtype;
-  Resource *res = priv->resources->data; /* pick first resource */
+  Resource *res;
 
-  g_assert (NULL != res);
+  g_assert (priv->resources->len > 0);
+  res = g_ptr_array_index (priv->resources, 0); /* pick first resource */
 
   if (presence->status == GABBLE_PRESENCE_OFFLINE)
     subtype = LM_MESSAGE_SUB_TYPE_UNAVAILABLE;
@@ -635,7 +730,7 @@ gabble_presence_as_message (GabblePresence *presence,
 gchar *
 gabble_presence_dump (GabblePresence *presence)
 {
-  GSList *i;
+  guint i;
   GString *ret = g_string_new ("");
   gchar *tmp;
   GabblePresencePrivate *priv = presence->priv;
@@ -665,9 +760,9 @@ gabble_presence_dump (GabblePresence *presence)
 
   g_string_append_printf (ret, "resources:\n");
 
-  for (i = priv->resources; i; i = i->next)
+  for (i = 0; i < priv->resources->len; i++)
     {
-      Resource *res = (Resource *) i->data;
+      Resource *res = g_ptr_array_index (priv->resources, i);
 
       g_string_append_printf (ret,
         "  %s\n"
@@ -685,7 +780,7 @@ gabble_presence_dump (GabblePresence *presence)
         }
     }
 
-  if (priv->resources == NULL)
+  if (priv->resources->len == 0)
     g_string_append_printf (ret, "  (none)\n");
 
   return g_string_free (ret, FALSE);
@@ -802,7 +897,7 @@ gabble_presence_update_client_types (GabblePresence *presence,
 {
   Resource *res;
 
-  if (resource == NULL && presence->priv->resources != NULL)
+  if (resource == NULL && presence->priv->resources->len > 0)
     {
       DEBUG ("Ignoring client types for NULL resource since we have "
           "presence for some resources");
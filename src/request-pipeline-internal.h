@@ -0,0 +1,61 @@
+/*
+ * request-pipeline-internal.h - implementation details of request-pipeline.c
+ *                               shared with the tests
+ *
+ * Copyright (C) 2007 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __REQUEST_PIPELINE_INTERNAL_H__
+#define __REQUEST_PIPELINE_INTERNAL_H__
+
+#include "request-pipeline.h"
+
+/* Number of requests in flight in fixed-window mode, and the initial window
+ * for each destination in adaptive mode. */
+#define REQUEST_PIPELINE_SIZE 10
+
+/* Bounds of the per-destination window in adaptive mode */
+#define REQUEST_PIPELINE_MIN_WINDOW 1
+#define REQUEST_PIPELINE_MAX_WINDOW 64
+
+/* Upper bound on the number of requests in flight across all destinations in
+ * adaptive mode, so that a roster spread over many servers can't flood our
+ * own server. */
+#define REQUEST_PIPELINE_MAX_IN_FLIGHT 128
+
+/* Extra requests an interactive request may have in flight beyond the
+ * window, so that it doesn't have to wait for a background request to
+ * complete before it can be sent */
+#define INTERACTIVE_HEADROOM 2
+
+/* Number of times a priority class with pending requests may be passed over
+ * in favour of a higher one before it's given the next slot anyway */
+#define STARVATION_LIMIT 8
+
+/* Same as GabbleConnectionMsgReplyFunc */
+typedef LmHandlerResult (*RequestPipelineReplyFunc) (GabbleConnection *conn,
+    LmMessage *sent, LmMessage *reply, GObject *object, gpointer user_data);
+
+/* Sends @msg and arranges for @reply_func to be called with @user_data when
+ * the reply arrives */
+typedef gboolean (*RequestPipelineSendFunc) (GabbleRequestPipeline *self,
+    LmMessage *msg, RequestPipelineReplyFunc reply_func, gpointer user_data,
+    GError **error);
+
+void request_pipeline_set_send_func (RequestPipelineSendFunc func);
+
+#endif /* __REQUEST_PIPELINE_INTERNAL_H__ */
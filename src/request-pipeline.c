@@ -20,6 +20,9 @@
 
 #include "config.h"
 #include "request-pipeline.h"
+#include "request-pipeline-internal.h"
+
+#include <string.h>
 
 #include <telepathy-glib/dbus.h>
 
@@ -27,28 +30,66 @@
 
 #include "connection.h"
 #include "debug.h"
+#include "error.h"
 #include "util.h"
 
 #define DEFAULT_REQUEST_TIMEOUT 180
-#define REQUEST_PIPELINE_SIZE 10
+
+#define N_PRIORITIES GABBLE_REQUEST_PIPELINE_N_PRIORITIES
 
 /* Properties */
 enum
 {
   PROP_CONNECTION = 1,
+  PROP_ADAPTIVE,
   LAST_PROPERTY
 };
 
 G_DEFINE_TYPE (GabbleRequestPipeline, gabble_request_pipeline, G_TYPE_OBJECT);
 
+/* Requests going to the same server. Within each priority class,
+ * destinations with pending requests (and, in adaptive mode, room in their
+ * window) are served round-robin, so that a burst of requests to one slow
+ * server doesn't hold up everybody else.
+ *
+ * Destinations are kept for the lifetime of the pipeline, so the window
+ * learnt for a server survives idle periods. */
+typedef struct
+{
+  /* owned; "" for requests without a 'to' attribute */
+  gchar *domain;
+
+  /* GabbleRequestPipelineItem, oldest first, indexed by priority */
+  GQueue items[N_PRIORITIES];
+  guint in_flight;
+
+  /* Our links in priv->active_queues, or NULL where we're not in it */
+  GList *active_link[N_PRIORITIES];
+
+  /* Adaptive mode only */
+  guint window;
+  guint acks_since_increase;
+  /* Smoothed and minimum observed round-trip time, in milliseconds; 0 if
+   * unknown */
+  guint srtt;
+  guint min_rtt;
+} PipelineQueue;
+
 struct _GabbleRequestPipelineItem
 {
   GabbleRequestPipeline *pipeline;
+  PipelineQueue *queue;
   LmMessage *message;
   guint timer_id;
   guint timeout;
+  GabbleRequestPipelinePriority priority;
   gboolean in_flight;
   gboolean zombie;
+  GTimeVal sent;
+
+  /* Our link in whichever of queue->items, priv->items_in_flight or
+   * priv->crypt_items we're currently in */
+  GList *link;
 
   GabbleRequestPipelineCb callback;
   gpointer user_data;
@@ -57,10 +98,27 @@ struct _GabbleRequestPipelineItem
 struct _GabbleRequestPipelinePrivate
 {
   GabbleConnection *connection;
-  GSList *pending_items;
-  GSList *items_in_flight;
+  gboolean adaptive;
+
+  /* gchar *domain (borrowed from the value) => owned PipelineQueue */
+  GHashTable *queues;
+  /* PipelineQueue which can send a request of each priority right now, in
+   * round-robin order */
+  GQueue active_queues[N_PRIORITIES];
+  /* Number of slots given to a higher priority class while this one had
+   * requests waiting */
+  guint skipped[N_PRIORITIES];
+  guint n_pending[N_PRIORITIES];
+
+  GQueue items_in_flight;
   /* Zombie storage (items which were cancelled while the IQ was in flight) */
-  GSList *crypt_items;
+  GQueue crypt_items;
+
+  /* Counters, see GabbleRequestPipelineStats */
+  guint completed;
+  guint throttled;
+  guint timed_out;
+  GabbleSamples rtts;
 
   gboolean dispose_has_run;
 };
@@ -76,12 +134,39 @@ gabble_request_pipeline_error_quark (void)
 
 #define GABBLE_REQUEST_PIPELINE_GET_PRIVATE(o) ((o)->priv)
 
+static void
+pipeline_queue_free (gpointer data)
+{
+  PipelineQueue *queue = data;
+  guint i;
+
+  for (i = 0; i < N_PRIORITIES; i++)
+    {
+      g_assert (g_queue_is_empty (&queue->items[i]));
+      g_assert (queue->active_link[i] == NULL);
+    }
+
+  g_free (queue->domain);
+  g_slice_free (PipelineQueue, queue);
+}
+
 static void
 gabble_request_pipeline_init (GabbleRequestPipeline *obj)
 {
   GabbleRequestPipelinePrivate *priv = G_TYPE_INSTANCE_GET_PRIVATE (obj,
       GABBLE_TYPE_REQUEST_PIPELINE, GabbleRequestPipelinePrivate);
+  guint i;
+
   obj->priv = priv;
+
+  priv->queues = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      pipeline_queue_free);
+
+  for (i = 0; i < N_PRIORITIES; i++)
+    g_queue_init (&priv->active_queues[i]);
+
+  g_queue_init (&priv->items_in_flight);
+  g_queue_init (&priv->crypt_items);
 }
 
 static void gabble_request_pipeline_set_property (GObject *object,
@@ -92,6 +177,35 @@ static void gabble_request_pipeline_dispose (GObject *object);
 static void gabble_request_pipeline_finalize (GObject *object);
 static void gabble_request_pipeline_go (GabbleRequestPipeline *pipeline);
 
+static gboolean
+real_send_with_reply (GabbleRequestPipeline *self,
+    LmMessage *msg,
+    RequestPipelineReplyFunc reply_func,
+    gpointer user_data,
+    GError **error)
+{
+  return _gabble_connection_send_with_reply (self->priv->connection, msg,
+      reply_func, G_OBJECT (self), user_data, error);
+}
+
+static RequestPipelineSendFunc send_with_reply = real_send_with_reply;
+
+/**
+ * request_pipeline_set_send_func:
+ * @func: the function to send requests with, or %NULL to send them on the
+ *  pipeline's connection
+ *
+ * Lets the tests send requests, and reply to them, without a connection.
+ */
+void
+request_pipeline_set_send_func (RequestPipelineSendFunc func)
+{
+  if (func == NULL)
+    send_with_reply = real_send_with_reply;
+  else
+    send_with_reply = func;
+}
+
 static void
 gabble_request_pipeline_class_init (GabbleRequestPipelineClass *cls)
 {
@@ -112,6 +226,12 @@ gabble_request_pipeline_class_init (GabbleRequestPipelineClass *cls)
       G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
   g_object_class_install_property (object_class, PROP_CONNECTION, param_spec);
 
+  param_spec = g_param_spec_boolean ("adaptive", "Adaptive window?",
+      "If TRUE, the number of requests in flight to each server is adjusted "
+      "according to round-trip times and 'wait' errors; if FALSE, a fixed "
+      "number of requests are in flight overall.", TRUE,
+      G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_ADAPTIVE, param_spec);
 }
 
 static void
@@ -128,6 +248,9 @@ gabble_request_pipeline_get_property (GObject *object,
     case PROP_CONNECTION:
       g_value_set_object (value, priv->connection);
       break;
+    case PROP_ADAPTIVE:
+      g_value_set_boolean (value, priv->adaptive);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -148,6 +271,9 @@ gabble_request_pipeline_set_property (GObject *object,
     case PROP_CONNECTION:
       priv->connection = g_value_get_object (value);
       break;
+    case PROP_ADAPTIVE:
+      priv->adaptive = g_value_get_boolean (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -167,6 +293,113 @@ gabble_request_pipeline_new (GabbleConnection *conn)
   return self;
 }
 
+static guint
+headroom (GabbleRequestPipelinePriority priority)
+{
+  if (priority == GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE)
+    return INTERACTIVE_HEADROOM;
+  else
+    return 0;
+}
+
+static guint
+max_in_flight (GabbleRequestPipelinePrivate *priv,
+    GabbleRequestPipelinePriority priority)
+{
+  if (priv->adaptive)
+    return REQUEST_PIPELINE_MAX_IN_FLIGHT + headroom (priority);
+  else
+    return REQUEST_PIPELINE_SIZE + headroom (priority);
+}
+
+static gboolean
+queue_has_room (GabbleRequestPipelinePrivate *priv,
+    PipelineQueue *queue,
+    GabbleRequestPipelinePriority priority)
+{
+  return !priv->adaptive ||
+      queue->in_flight < queue->window + headroom (priority);
+}
+
+/* Put @queue in, or take it out of, the round-robin lists of destinations
+ * which can send a request of each priority right now. */
+static void
+queue_update_active (GabbleRequestPipelinePrivate *priv,
+    PipelineQueue *queue)
+{
+  guint i;
+
+  for (i = 0; i < N_PRIORITIES; i++)
+    {
+      gboolean active = !g_queue_is_empty (&queue->items[i]) &&
+          queue_has_room (priv, queue, i);
+
+      if (active && queue->active_link[i] == NULL)
+        {
+          g_queue_push_tail (&priv->active_queues[i], queue);
+          queue->active_link[i] =
+              g_queue_peek_tail_link (&priv->active_queues[i]);
+        }
+      else if (!active && queue->active_link[i] != NULL)
+        {
+          g_queue_delete_link (&priv->active_queues[i],
+              queue->active_link[i]);
+          queue->active_link[i] = NULL;
+        }
+    }
+}
+
+static PipelineQueue *
+ensure_queue (GabbleRequestPipelinePrivate *priv,
+    LmMessage *msg)
+{
+  const gchar *to = lm_message_node_get_attribute (
+      wocky_stanza_get_top_node (msg), "to");
+  gchar *domain = NULL;
+  PipelineQueue *queue;
+  guint i;
+
+  if (to == NULL || !gabble_decode_jid (to, NULL, &domain, NULL))
+    domain = g_strdup ("");
+
+  queue = g_hash_table_lookup (priv->queues, domain);
+
+  if (queue == NULL)
+    {
+      queue = g_slice_new0 (PipelineQueue);
+      queue->domain = domain;
+
+      for (i = 0; i < N_PRIORITIES; i++)
+        g_queue_init (&queue->items[i]);
+
+      queue->window = REQUEST_PIPELINE_SIZE;
+      g_hash_table_insert (priv->queues, queue->domain, queue);
+    }
+  else
+    {
+      g_free (domain);
+    }
+
+  return queue;
+}
+
+/* Called when @item stops occupying a slot in its destination's window,
+ * either because it was answered or because it was turned into a zombie. */
+static void
+item_leave_flight (GabbleRequestPipelinePrivate *priv,
+    GabbleRequestPipelineItem *item)
+{
+  g_assert (item->in_flight);
+  g_assert (!item->zombie);
+
+  g_queue_delete_link (&priv->items_in_flight, item->link);
+  item->link = NULL;
+
+  g_assert (item->queue->in_flight > 0);
+  item->queue->in_flight--;
+  queue_update_active (priv, item->queue);
+}
+
 static void
 delete_item (GabbleRequestPipelineItem *item)
 {
@@ -179,15 +412,17 @@ delete_item (GabbleRequestPipelineItem *item)
 
   if (item->zombie)
     {
-      priv->crypt_items = g_slist_remove (priv->crypt_items, item);
+      g_queue_delete_link (&priv->crypt_items, item->link);
     }
   else if (item->in_flight)
     {
-      priv->items_in_flight = g_slist_remove (priv->items_in_flight, item);
+      item_leave_flight (priv, item);
     }
-  else
+  else if (item->link != NULL)
     {
-      priv->pending_items = g_slist_remove (priv->pending_items, item);
+      g_queue_delete_link (&item->queue->items[item->priority], item->link);
+      priv->n_pending[item->priority]--;
+      queue_update_active (priv, item->queue);
     }
 
   if (item->timer_id)
@@ -198,6 +433,24 @@ delete_item (GabbleRequestPipelineItem *item)
   g_slice_free (GabbleRequestPipelineItem, item);
 }
 
+/* Multiplicative decrease of @queue's window, in response to the server
+ * asking us to back off or not answering at all. */
+static void
+queue_throttle (GabbleRequestPipelinePrivate *priv,
+    PipelineQueue *queue)
+{
+  if (!priv->adaptive)
+    return;
+
+  queue->window = MAX (queue->window / 2, REQUEST_PIPELINE_MIN_WINDOW);
+  queue->acks_since_increase = 0;
+
+  DEBUG ("throttling requests to '%s': window is now %u", queue->domain,
+      queue->window);
+
+  queue_update_active (priv, queue);
+}
+
 static void
 gabble_request_pipeline_create_zombie (GabbleRequestPipeline *pipeline,
   GabbleRequestPipelineItem *item,
@@ -217,10 +470,11 @@ gabble_request_pipeline_create_zombie (GabbleRequestPipeline *pipeline,
 
   if (item->in_flight)
     {
-      item->zombie = TRUE;
+      item_leave_flight (priv, item);
 
-      priv->items_in_flight = g_slist_remove (priv->items_in_flight, item);
-      priv->crypt_items = g_slist_prepend (priv->crypt_items, item);
+      item->zombie = TRUE;
+      g_queue_push_head (&priv->crypt_items, item);
+      item->link = g_queue_peek_head_link (&priv->crypt_items);
 
       gabble_request_pipeline_go (pipeline);
     }
@@ -242,16 +496,14 @@ gabble_request_pipeline_item_cancel (GabbleRequestPipelineItem *item)
 
 static void
 gabble_request_pipeline_flush (GabbleRequestPipeline *self,
-    GSList **list)
+    GQueue *queue)
 {
   GabbleRequestPipelineItem *item;
   GError disconnected = { TP_ERRORS, TP_ERROR_DISCONNECTED,
       "Request failed because connection became disconnected" };
 
-  while (*list != NULL)
+  while ((item = g_queue_peek_head (queue)) != NULL)
     {
-      item = (*list)->data;
-
       if (!item->zombie)
         (item->callback) (self->priv->connection, NULL, item->user_data,
                             &disconnected);
@@ -266,16 +518,38 @@ gabble_request_pipeline_dispose (GObject *object)
   GabbleRequestPipeline *self = GABBLE_REQUEST_PIPELINE (object);
   GabbleRequestPipelinePrivate *priv =
       GABBLE_REQUEST_PIPELINE_GET_PRIVATE (self);
+  GHashTableIter iter;
+  gpointer value;
+  guint i;
 
   if (priv->dispose_has_run)
     return;
 
   priv->dispose_has_run = TRUE;
 
-  DEBUG ("disposing request-pipeline");
+  if (DEBUGGING)
+    {
+      GabbleRequestPipelineStats stats;
+
+      gabble_request_pipeline_get_stats (self, &stats);
+      DEBUG ("disposing request-pipeline: %u replies from %u servers, "
+          "%u throttled, %u timed out; RTT p50 %ums, p90 %ums, p99 %ums",
+          stats.completed, stats.destinations, stats.throttled,
+          stats.timed_out, stats.rtt_p50, stats.rtt_p90, stats.rtt_p99);
+    }
 
   gabble_request_pipeline_flush (self, &priv->items_in_flight);
-  gabble_request_pipeline_flush (self, &priv->pending_items);
+
+  g_hash_table_iter_init (&iter, priv->queues);
+
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      PipelineQueue *queue = value;
+
+      for (i = 0; i < N_PRIORITIES; i++)
+        gabble_request_pipeline_flush (self, &queue->items[i]);
+    }
+
   gabble_request_pipeline_flush (self, &priv->crypt_items);
 
   g_idle_remove_by_data (self);
@@ -287,9 +561,78 @@ gabble_request_pipeline_dispose (GObject *object)
 static void
 gabble_request_pipeline_finalize (GObject *object)
 {
+  GabbleRequestPipeline *self = GABBLE_REQUEST_PIPELINE (object);
+
+  g_hash_table_destroy (self->priv->queues);
+
   G_OBJECT_CLASS (gabble_request_pipeline_parent_class)->finalize (object);
 }
 
+static void
+record_rtt (GabbleRequestPipelinePrivate *priv,
+    PipelineQueue *queue,
+    guint rtt)
+{
+  gabble_samples_add (&priv->rtts, rtt);
+
+  if (queue->srtt == 0)
+    queue->srtt = MAX (rtt, 1);
+  else
+    queue->srtt = (7 * queue->srtt + rtt) / 8;
+
+  if (queue->min_rtt == 0 || rtt < queue->min_rtt)
+    queue->min_rtt = MAX (rtt, 1);
+}
+
+/* Additive increase of @queue's window: grow by one request per window's
+ * worth of successful replies, unless replies are getting noticeably slower
+ * than the best we've seen, which means requests are queueing up on the
+ * server. */
+static void
+queue_ack (GabbleRequestPipelinePrivate *priv,
+    PipelineQueue *queue)
+{
+  if (!priv->adaptive)
+    return;
+
+  if (queue->srtt > 2 * queue->min_rtt)
+    {
+      queue->acks_since_increase = 0;
+      return;
+    }
+
+  if (++queue->acks_since_increase >= queue->window &&
+      queue->window < REQUEST_PIPELINE_MAX_WINDOW)
+    {
+      queue->window++;
+      queue->acks_since_increase = 0;
+      queue_update_active (priv, queue);
+    }
+}
+
+/* Returns TRUE if @reply is the server telling us to slow down. */
+static gboolean
+reply_is_throttle (LmMessage *reply)
+{
+  LmMessageNode *error_node;
+  GabbleXmppErrorType type = XMPP_ERROR_TYPE_UNDEFINED;
+  GabbleXmppError error;
+
+  if (lm_message_get_sub_type (reply) != LM_MESSAGE_SUB_TYPE_ERROR)
+    return FALSE;
+
+  error_node = lm_message_node_get_child (wocky_stanza_get_top_node (reply),
+      "error");
+
+  if (error_node == NULL)
+    return FALSE;
+
+  error = gabble_xmpp_error_from_node (error_node, &type);
+
+  return (type == XMPP_ERROR_TYPE_WAIT ||
+      error == XMPP_ERROR_RESOURCE_CONSTRAINT);
+}
+
 static LmHandlerResult
 response_cb (GabbleConnection *conn,
              LmMessage *sent,
@@ -300,31 +643,43 @@ response_cb (GabbleConnection *conn,
   GabbleRequestPipelineItem *item = (GabbleRequestPipelineItem *) user_data;
   GabbleRequestPipeline *pipeline = item->pipeline;
   GabbleRequestPipelinePrivate *priv;
+  PipelineQueue *queue = item->queue;
+  GError *error = NULL;
 
   g_assert (GABBLE_IS_REQUEST_PIPELINE (pipeline));
   priv = GABBLE_REQUEST_PIPELINE_GET_PRIVATE (pipeline);
 
   DEBUG ("got reply for request %p", item);
 
-  if (NULL == g_slist_find (priv->items_in_flight, item))
-      return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
-
   g_assert (item->in_flight);
 
-  priv->items_in_flight = g_slist_remove (priv->items_in_flight, item);
-
-  if (!item->zombie)
+  if (item->zombie)
     {
-      GError *error = gabble_message_get_xmpp_error (reply);
+      DEBUG ("ignoring zombie connection reply");
+      delete_item (item);
+      return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
 
-      item->callback (priv->connection, reply, item->user_data, error);
-      g_clear_error (&error);
+  record_rtt (priv, queue, gabble_time_val_elapsed_ms (&item->sent));
+  priv->completed++;
+
+  if (reply_is_throttle (reply))
+    {
+      priv->throttled++;
+      queue_throttle (priv, queue);
     }
   else
     {
-      DEBUG ("ignoring zombie connection reply");
+      queue_ack (priv, queue);
     }
 
+  /* The item stays in flight until its callback has returned: if the
+   * callback cancels it, it's turned into a zombie, and delete_item () takes
+   * it out of whichever list it ended up in. */
+  error = gabble_message_get_xmpp_error (reply);
+  item->callback (priv->connection, reply, item->user_data, error);
+  g_clear_error (&error);
+
   delete_item (item);
 
   gabble_request_pipeline_go (pipeline);
@@ -336,63 +691,128 @@ static gboolean
 timeout_cb (gpointer data)
 {
   GabbleRequestPipelineItem *item = (GabbleRequestPipelineItem *) data;
+  GabbleRequestPipelinePrivate *priv = item->pipeline->priv;
   GError timed_out = { GABBLE_REQUEST_PIPELINE_ERROR,
       GABBLE_REQUEST_PIPELINE_ERROR_TIMEOUT,
       "Request timed out" };
 
+  item->timer_id = 0;
+  priv->timed_out++;
+  queue_throttle (priv, item->queue);
+
   gabble_request_pipeline_create_zombie (item->pipeline, item, &timed_out);
 
   return FALSE;
 }
 
 static void
-send_next_request (GabbleRequestPipeline *pipeline)
+send_next_request (GabbleRequestPipeline *pipeline,
+    PipelineQueue *queue,
+    GabbleRequestPipelinePriority priority)
 {
   GabbleRequestPipelinePrivate *priv =
       GABBLE_REQUEST_PIPELINE_GET_PRIVATE (pipeline);
   GabbleRequestPipelineItem *item;
   GError *error = NULL;
 
-  if (priv->pending_items == NULL)
-      return;
+  item = g_queue_pop_head (&queue->items[priority]);
 
-  item = priv->pending_items->data;
+  if (item == NULL)
+      return;
 
-  DEBUG ("processing request %p", item);
+  DEBUG ("processing request %p to '%s' with priority %u", item,
+      queue->domain, priority);
 
   g_assert (item->in_flight == FALSE);
 
-  priv->pending_items = g_slist_remove (priv->pending_items, item);
+  item->link = NULL;
+  priv->n_pending[priority]--;
 
-  if (!_gabble_connection_send_with_reply (priv->connection, item->message,
-      response_cb, G_OBJECT (pipeline), item, &error))
+  if (!send_with_reply (pipeline, item->message, response_cb, item, &error))
     {
       item->callback (priv->connection, NULL, item->user_data, error);
+      g_clear_error (&error);
       delete_item (item);
-      send_next_request (pipeline);
     }
   else
     {
-      priv->items_in_flight = g_slist_prepend (priv->items_in_flight, item);
+      g_queue_push_tail (&priv->items_in_flight, item);
+      item->link = g_queue_peek_tail_link (&priv->items_in_flight);
       item->in_flight = TRUE;
+      queue->in_flight++;
+      g_get_current_time (&item->sent);
       item->timer_id = g_timeout_add_seconds (item->timeout, timeout_cb, item);
     }
 }
 
+/* Returns the priority class which should get the next free slot, or -1 if
+ * nothing can be sent right now. Normally that's the highest priority with a
+ * request which can be sent, but a lower one which has been passed over
+ * STARVATION_LIMIT times gets its turn first. */
+static gint
+pick_priority (GabbleRequestPipelinePrivate *priv)
+{
+  guint in_flight = g_queue_get_length (&priv->items_in_flight);
+  gboolean eligible[N_PRIORITIES];
+  gint chosen = -1;
+  gint i;
+
+  for (i = 0; i < N_PRIORITIES; i++)
+    {
+      eligible[i] = !g_queue_is_empty (&priv->active_queues[i]) &&
+          in_flight < max_in_flight (priv, i);
+
+      if (!eligible[i])
+        continue;
+
+      if (chosen < 0)
+        chosen = i;
+      else if (priv->skipped[i] >= STARVATION_LIMIT)
+        {
+          chosen = i;
+          break;
+        }
+    }
+
+  if (chosen < 0)
+    return -1;
+
+  for (i = 0; i < N_PRIORITIES; i++)
+    {
+      if (i == chosen)
+        priv->skipped[i] = 0;
+      else if (eligible[i])
+        priv->skipped[i]++;
+    }
+
+  return chosen;
+}
+
 static void
 gabble_request_pipeline_go (GabbleRequestPipeline *pipeline)
 {
   GabbleRequestPipelinePrivate *priv =
       GABBLE_REQUEST_PIPELINE_GET_PRIVATE (pipeline);
+  gint priority;
 
-  DEBUG ("called; %d pending items, %d items in flight",
-    g_slist_length (priv->pending_items),
-    g_slist_length (priv->items_in_flight));
+  DEBUG ("called; %u/%u/%u pending items, %u items in flight",
+      priv->n_pending[GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE],
+      priv->n_pending[GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL],
+      priv->n_pending[GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND],
+      g_queue_get_length (&priv->items_in_flight));
 
-  while (priv->pending_items &&
-      (g_slist_length (priv->items_in_flight) < REQUEST_PIPELINE_SIZE))
+  while ((priority = pick_priority (priv)) >= 0)
     {
-      send_next_request (pipeline);
+      PipelineQueue *queue = g_queue_peek_head (
+          &priv->active_queues[priority]);
+
+      /* Rotate, so the next slot goes to the next destination */
+      g_queue_delete_link (&priv->active_queues[priority],
+          queue->active_link[priority]);
+      queue->active_link[priority] = NULL;
+
+      send_next_request (pipeline, queue, priority);
+      queue_update_active (priv, queue);
     }
 }
 
@@ -404,40 +824,156 @@ delayed_run_pipeline (gpointer user_data)
   return FALSE;
 }
 
+static void
+schedule_run (GabbleRequestPipeline *pipeline,
+    GabbleRequestPipelineItem *item)
+{
+  GabbleRequestPipelinePrivate *priv =
+      GABBLE_REQUEST_PIPELINE_GET_PRIVATE (pipeline);
+
+  /* If the pipeline isn't full, schedule a run. Run it delayed so that if
+   * there's an error, the callback will be called after this function returns.
+   */
+  if (item->queue->active_link[item->priority] != NULL &&
+      g_queue_get_length (&priv->items_in_flight) <
+          max_in_flight (priv, item->priority))
+    gabble_idle_add_weak (delayed_run_pipeline, G_OBJECT (pipeline));
+}
+
 GabbleRequestPipelineItem *
 gabble_request_pipeline_enqueue (GabbleRequestPipeline *pipeline,
                                  LmMessage *msg,
                                  guint timeout,
+                                 GabbleRequestPipelinePriority priority,
                                  GabbleRequestPipelineCb callback,
                                  gpointer user_data)
 {
   GabbleRequestPipelinePrivate *priv =
       GABBLE_REQUEST_PIPELINE_GET_PRIVATE (pipeline);
-  GabbleRequestPipelineItem *item = g_slice_new0 (GabbleRequestPipelineItem);
+  GabbleRequestPipelineItem *item;
 
   g_return_val_if_fail (callback != NULL, NULL);
+  g_return_val_if_fail (priority < N_PRIORITIES, NULL);
 
+  item = g_slice_new0 (GabbleRequestPipelineItem);
   item->pipeline = pipeline;
+  item->queue = ensure_queue (priv, msg);
   item->message = msg;
   if (timeout == 0)
       timeout = DEFAULT_REQUEST_TIMEOUT;
   item->timeout = timeout;
+  item->priority = priority;
   item->in_flight = FALSE;
   item->callback = callback;
   item->user_data = user_data;
 
   lm_message_ref (msg);
 
-  priv->pending_items = g_slist_append (priv->pending_items, item);
+  g_queue_push_tail (&item->queue->items[priority], item);
+  item->link = g_queue_peek_tail_link (&item->queue->items[priority]);
+  priv->n_pending[priority]++;
+  queue_update_active (priv, item->queue);
 
-  DEBUG ("enqueued new request as item %p", item);
-  DEBUG ("number of items in flight: %d", g_slist_length (priv->items_in_flight));
+  DEBUG ("enqueued new request to '%s' with priority %u as item %p",
+      item->queue->domain, priority, item);
+  DEBUG ("number of items in flight: %u",
+      g_queue_get_length (&priv->items_in_flight));
 
-  /* If the pipeline isn't full, schedule a run. Run it delayed so that if
-   * there's an error, the callback will be called after this function returns.
-   */
-  if (g_slist_length (priv->items_in_flight) < REQUEST_PIPELINE_SIZE)
-    gabble_idle_add_weak (delayed_run_pipeline, G_OBJECT (pipeline));
+  schedule_run (pipeline, item);
 
   return item;
 }
+
+/**
+ * gabble_request_pipeline_item_raise_priority:
+ * @item: a pipeline item
+ * @priority: the priority it is now needed at
+ *
+ * If @item hasn't been sent yet and @priority is higher than the priority it
+ * was enqueued with, moves it to the back of @priority's queue. Otherwise,
+ * does nothing.
+ */
+void
+gabble_request_pipeline_item_raise_priority (GabbleRequestPipelineItem *item,
+    GabbleRequestPipelinePriority priority)
+{
+  GabbleRequestPipelinePrivate *priv;
+  PipelineQueue *queue;
+
+  g_return_if_fail (item != NULL);
+  g_return_if_fail (priority < N_PRIORITIES);
+
+  if (item->in_flight || item->zombie || priority >= item->priority)
+    return;
+
+  priv = GABBLE_REQUEST_PIPELINE_GET_PRIVATE (item->pipeline);
+  queue = item->queue;
+
+  DEBUG ("raising priority of item %p from %u to %u", item, item->priority,
+      priority);
+
+  g_queue_delete_link (&queue->items[item->priority], item->link);
+  priv->n_pending[item->priority]--;
+
+  item->priority = priority;
+  g_queue_push_tail (&queue->items[priority], item);
+  item->link = g_queue_peek_tail_link (&queue->items[priority]);
+  priv->n_pending[priority]++;
+
+  queue_update_active (priv, queue);
+  schedule_run (item->pipeline, item);
+}
+
+/**
+ * gabble_request_pipeline_get_stats:
+ * @pipeline: a pipeline
+ * @stats: (out caller-allocates): filled in with the pipeline's counters
+ *
+ * Takes a snapshot of the pipeline's queue depth, windows and round-trip
+ * times, for debugging and tuning.
+ */
+void
+gabble_request_pipeline_get_stats (GabbleRequestPipeline *pipeline,
+    GabbleRequestPipelineStats *stats)
+{
+  GabbleRequestPipelinePrivate *priv;
+  GHashTableIter iter;
+  gpointer value;
+  guint i;
+
+  g_return_if_fail (GABBLE_IS_REQUEST_PIPELINE (pipeline));
+  g_return_if_fail (stats != NULL);
+
+  priv = GABBLE_REQUEST_PIPELINE_GET_PRIVATE (pipeline);
+  memset (stats, 0, sizeof (*stats));
+
+  for (i = 0; i < N_PRIORITIES; i++)
+    {
+      stats->pending_by_priority[i] = priv->n_pending[i];
+      stats->pending += priv->n_pending[i];
+    }
+
+  stats->in_flight = g_queue_get_length (&priv->items_in_flight);
+  stats->zombies = g_queue_get_length (&priv->crypt_items);
+  stats->destinations = g_hash_table_size (priv->queues);
+  stats->completed = priv->completed;
+  stats->throttled = priv->throttled;
+  stats->timed_out = priv->timed_out;
+
+  if (priv->adaptive)
+    {
+      g_hash_table_iter_init (&iter, priv->queues);
+
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        stats->window += ((PipelineQueue *) value)->window;
+
+      stats->window = MIN (stats->window, REQUEST_PIPELINE_MAX_IN_FLIGHT);
+    }
+  else
+    {
+      stats->window = REQUEST_PIPELINE_SIZE;
+    }
+
+  gabble_samples_get_percentiles (&priv->rtts, &stats->rtt_p50,
+      &stats->rtt_p90, &stats->rtt_p99);
+}
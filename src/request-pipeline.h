@@ -45,6 +45,26 @@ typedef enum
   GABBLE_REQUEST_PIPELINE_ERROR_TIMEOUT
 } GabbleRequestPipelineError;
 
+/**
+ * GabbleRequestPipelinePriority:
+ * @GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE: A user is waiting for the
+ *  reply, e.g. because they opened a contact's profile
+ * @GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL: A client asked for this and is
+ *  waiting for the reply, but not necessarily a user
+ * @GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND: Prefetching, e.g. fetching
+ *  aliases and avatars for the whole roster after connecting
+ *
+ * Requests with a higher priority are sent first; lower priorities are
+ * guaranteed to make progress eventually.
+ */
+typedef enum
+{
+  GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE,
+  GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL,
+  GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND,
+  GABBLE_REQUEST_PIPELINE_N_PRIORITIES
+} GabbleRequestPipelinePriority;
+
 GQuark gabble_request_pipeline_error_quark (void);
 #define GABBLE_REQUEST_PIPELINE_ERROR gabble_request_pipeline_error_quark ()
 
@@ -79,8 +99,45 @@ struct _GabbleRequestPipeline {
 GabbleRequestPipeline *gabble_request_pipeline_new (GabbleConnection *conn);
 GabbleRequestPipelineItem *gabble_request_pipeline_enqueue
     (GabbleRequestPipeline *pipeline, LmMessage *msg, guint timeout,
+     GabbleRequestPipelinePriority priority,
      GabbleRequestPipelineCb callback, gpointer user_data);
 void gabble_request_pipeline_item_cancel (GabbleRequestPipelineItem *req);
+void gabble_request_pipeline_item_raise_priority (
+    GabbleRequestPipelineItem *req, GabbleRequestPipelinePriority priority);
+
+/**
+ * GabbleRequestPipelineStats:
+ * @pending: number of requests waiting to be sent
+ * @pending_by_priority: number of requests waiting to be sent, indexed by
+ *  #GabbleRequestPipelinePriority
+ * @in_flight: number of requests sent and not yet answered
+ * @zombies: number of cancelled requests still awaiting a reply
+ * @window: number of requests which may currently be in flight
+ * @destinations: number of distinct servers requests have been sent to
+ * @completed: number of replies received
+ * @throttled: number of 'wait' or resource-constraint errors received
+ * @timed_out: number of requests which timed out
+ * @rtt_p50: median round-trip time of recent requests, in milliseconds
+ * @rtt_p90: 90th percentile round-trip time, in milliseconds
+ * @rtt_p99: 99th percentile round-trip time, in milliseconds
+ */
+typedef struct {
+    guint pending;
+    guint pending_by_priority[GABBLE_REQUEST_PIPELINE_N_PRIORITIES];
+    guint in_flight;
+    guint zombies;
+    guint window;
+    guint destinations;
+    guint completed;
+    guint throttled;
+    guint timed_out;
+    guint rtt_p50;
+    guint rtt_p90;
+    guint rtt_p99;
+} GabbleRequestPipelineStats;
+
+void gabble_request_pipeline_get_stats (GabbleRequestPipeline *pipeline,
+    GabbleRequestPipelineStats *stats);
 
 G_END_DECLS
 
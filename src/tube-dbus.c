@@ -46,6 +46,7 @@
 #include "bytestream-ibb.h"
 #include "bytestream-iface.h"
 #include "connection.h"
+#include "dbus-reassembler.h"
 #include "debug.h"
 #include "disco.h"
 #include "gabble-signals-marshal.h"
@@ -183,10 +184,8 @@ struct _GabbleTubeDBusPrivate
   /* mapping of D-Bus name -> contact handle */
   GHashTable *dbus_name_to_handle;
 
-  /* Message reassembly buffer (CONTACT tubes only) */
-  GString *reassembly_buffer;
-  /* Number of bytes that will be in the next message, 0 if unknown */
-  guint32 reassembly_bytes_needed;
+  /* Message reassembly (CONTACT tubes only) */
+  GabbleDBusReassembler *reassembler;
 
   gboolean closed;
 
@@ -594,8 +593,7 @@ gabble_tube_dbus_dispose (GObject *object)
   tp_clear_pointer (&priv->dbus_names, g_hash_table_destroy);
   tp_clear_pointer (&priv->dbus_name_to_handle, g_hash_table_destroy);
 
-  if (priv->reassembly_buffer)
-    g_string_free (priv->reassembly_buffer, TRUE);
+  tp_clear_pointer (&priv->reassembler, gabble_dbus_reassembler_free);
 
   tp_handle_unref (contact_repo, priv->initiator);
 
@@ -933,8 +931,7 @@ gabble_tube_dbus_constructor (GType type,
       priv->dbus_name_to_handle = NULL;
 
       /* For contact (IBB) tubes we need to be able to reassemble messages. */
-      priv->reassembly_buffer = g_string_new ("");
-      priv->reassembly_bytes_needed = 0;
+      priv->reassembler = gabble_dbus_reassembler_new ();
 
       g_assert (priv->muc == NULL);
 
@@ -1392,20 +1389,19 @@ unref:
   dbus_message_unref (msg);
 }
 
-static guint32
-collect_le32 (char *str)
-{
-  unsigned char *bytes = (unsigned char *) str;
-
-  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (bytes[3] << 24);
-}
+typedef struct {
+    GabbleTubeDBus *tube;
+    TpHandle sender;
+} ReassembledContext;
 
-static guint32
-collect_be32 (char *str)
+static void
+reassembled_message_cb (const gchar *data,
+    gsize len,
+    gpointer user_data)
 {
-  unsigned char *bytes = (unsigned char *) str;
+  ReassembledContext *ctx = user_data;
 
-  return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 24) | bytes[3];
+  message_received (ctx->tube, ctx->sender, data, len);
 }
 
 static void
@@ -1419,96 +1415,16 @@ data_received_cb (GabbleBytestreamIface *stream,
 
   if (priv->handle_type == TP_HANDLE_TYPE_CONTACT)
     {
-      GString *buf = priv->reassembly_buffer;
-
-      g_assert (buf != NULL);
-
-      g_string_append_len (buf, data->str, data->len);
-      DEBUG ("Received %" G_GSIZE_FORMAT " bytes, so we now have %"
-          G_GSIZE_FORMAT " bytes in reassembly buffer", data->len, buf->len);
-
-      /* Each D-Bus message has a 16-byte fixed header, in which
-       *
-       * * byte 0 is 'l' (ell) or 'B' for endianness
-       * * bytes 4-7 are body length "n" in bytes in that endianness
-       * * bytes 12-15 are length "m" of param array in bytes in that
-       *   endianness
-       *
-       * followed by m + n + ((8 - (m % 8)) % 8) bytes of other content.
-       */
-
-      while (buf->len >= 16)
-        {
-          guint32 body_length, params_length, m;
-
-          /* see if we have a whole message and have already calculated
-           * how many bytes it needs */
-
-          if (priv->reassembly_bytes_needed != 0)
-            {
-              if (buf->len >= priv->reassembly_bytes_needed)
-                {
-                  DEBUG ("Received complete D-Bus message of size %"
-                      G_GINT32_FORMAT, priv->reassembly_bytes_needed);
-                  message_received (tube, sender, buf->str,
-                      priv->reassembly_bytes_needed);
-                  g_string_erase (buf, 0, priv->reassembly_bytes_needed);
-                  priv->reassembly_bytes_needed = 0;
-                }
-              else
-                {
-                  /* we'll have to wait for more data */
-                  break;
-                }
-            }
-
-          if (buf->len < 16)
-            break;
-
-          /* work out how big the next message is going to be */
-
-          if (buf->str[0] == DBUS_BIG_ENDIAN)
-            {
-              body_length = collect_be32 (buf->str + 4);
-              m = collect_be32 (buf->str + 12);
-            }
-          else if (buf->str[0] == DBUS_LITTLE_ENDIAN)
-            {
-              body_length = collect_le32 (buf->str + 4);
-              m = collect_le32 (buf->str + 12);
-            }
-          else
-            {
-              DEBUG ("D-Bus message has unknown endianness byte 0x%x, "
-                  "closing tube", (unsigned int) buf->str[0]);
-              gabble_tube_dbus_close ((GabbleTubeIface *) tube, TRUE);
-              return;
-            }
+      ReassembledContext ctx = { tube, sender };
 
-          /* pad to 8-byte boundary */
-          params_length = m + ((8 - (m % 8)) % 8);
-          g_assert (params_length % 8 == 0);
-          g_assert (params_length >= m);
-          g_assert (params_length < m + 8);
-
-          priv->reassembly_bytes_needed = params_length + body_length + 16;
-
-          /* n.b.: this looks as if it could be simplified to just the third
-           * test, but that would be wrong if the addition had overflowed, so
-           * don't do that. The first and second tests are sufficient to
-           * ensure no overflow on 32-bit platforms */
-          if (body_length > DBUS_MAXIMUM_MESSAGE_LENGTH ||
-              params_length > DBUS_MAXIMUM_ARRAY_LENGTH ||
-              priv->reassembly_bytes_needed > DBUS_MAXIMUM_MESSAGE_LENGTH)
-            {
-              DEBUG ("D-Bus message is too large to be valid, closing tube");
-              gabble_tube_dbus_close ((GabbleTubeIface *) tube, TRUE);
-              return;
-            }
+      g_assert (priv->reassembler != NULL);
 
-          g_assert (priv->reassembly_bytes_needed != 0);
-          DEBUG ("We need %" G_GINT32_FORMAT " bytes for the next full "
-              "message", priv->reassembly_bytes_needed);
+      if (!gabble_dbus_reassembler_push (priv->reassembler, data->str,
+            data->len, reassembled_message_cb, &ctx))
+        {
+          DEBUG ("received data isn't a sequence of D-Bus messages, "
+              "closing tube");
+          gabble_tube_dbus_close ((GabbleTubeIface *) tube, TRUE);
         }
     }
   else
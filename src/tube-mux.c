@@ -0,0 +1,620 @@
+/*
+ * tube-mux.c - Multiplexing stream tube connections over one bytestream
+ *
+ * Copyright (C) 2011 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* When both ends of a 1-1 stream tube advertise NS_TUBES_MUX, the
+ * connections to the tube are carried as streams over a single bytestream
+ * rather than each negotiating its own. Everything sent over that
+ * bytestream is a frame:
+ *
+ *   byte  0    type: OPEN, DATA, CLOSE or WINDOW
+ *   byte  1    reserved, 0
+ *   bytes 2-3  stream ID, big-endian, never 0
+ *   bytes 4-7  payload length, big-endian, at most MAX_FRAME_PAYLOAD
+ *
+ * followed by the payload. OPEN and CLOSE have none. A WINDOW frame's
+ * payload is a big-endian 32-bit number of bytes the receiver of the frame
+ * may send on that stream in addition to what it was already allowed.
+ *
+ * Each end may initially send INITIAL_WINDOW bytes on a new stream. The
+ * receiving end gives credit back once it has passed the data on; if the
+ * application the data is for stops reading, the credit stops, so one slow
+ * connection can't make the others wait behind its data in the shared
+ * bytestream.
+ */
+
+#include "config.h"
+#include "tube-mux.h"
+
+#define DEBUG_FLAG GABBLE_DEBUG_TUBES
+
+#include "debug.h"
+#include "util.h"
+
+#define HEADER_LENGTH 8
+#define MAX_FRAME_PAYLOAD (64 * 1024)
+
+#define INITIAL_WINDOW (256 * 1024)
+/* Credit is given back in batches of at least this many bytes, so that the
+ * peer isn't sent a WINDOW frame for each DATA frame */
+#define CREDIT_THRESHOLD (INITIAL_WINDOW / 4)
+
+#define MAX_STREAMS 1024
+
+typedef enum {
+    FRAME_OPEN = 1,
+    FRAME_DATA = 2,
+    FRAME_CLOSE = 3,
+    FRAME_WINDOW = 4
+} FrameType;
+
+typedef struct {
+    /* How many more bytes we may send before the peer gives us more credit.
+     * This can go below 0, as gabble_tube_mux_send () never refuses data */
+    gint64 send_window;
+    /* Bytes received and passed on, but not yet credited back to the peer */
+    guint32 uncredited;
+    /* TRUE if stream_data asked us to stop giving the peer credit */
+    gboolean paused;
+    /* TRUE if gabble_tube_mux_send () told the caller to stop */
+    gboolean blocked;
+} MuxStream;
+
+struct _GabbleTubeMux
+{
+  const GabbleTubeMuxCallbacks *callbacks;
+  gpointer user_data;
+
+  /* GUINT_TO_POINTER (id) => owned MuxStream */
+  GHashTable *streams;
+  guint last_id;
+
+  /* The start of a frame which was split between reads */
+  GString *partial;
+  /* The frame being sent */
+  GString *out;
+  gboolean out_in_use;
+
+  /* > 0 while a callback may be running; the mux is only really freed once
+   * it's back to 0 */
+  guint busy;
+  gboolean freed;
+  gboolean broken;
+};
+
+static void
+mux_stream_free (gpointer p)
+{
+  g_slice_free (MuxStream, p);
+}
+
+GabbleTubeMux *
+gabble_tube_mux_new (const GabbleTubeMuxCallbacks *callbacks,
+    gpointer user_data)
+{
+  GabbleTubeMux *self;
+
+  g_return_val_if_fail (callbacks != NULL, NULL);
+
+  self = g_slice_new0 (GabbleTubeMux);
+  self->callbacks = callbacks;
+  self->user_data = user_data;
+  self->streams = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+      mux_stream_free);
+  self->partial = g_string_sized_new (HEADER_LENGTH);
+  self->out = g_string_sized_new (HEADER_LENGTH + 4);
+
+  return self;
+}
+
+static void
+destroy (GabbleTubeMux *self)
+{
+  g_hash_table_destroy (self->streams);
+  g_string_free (self->partial, TRUE);
+  g_string_free (self->out, TRUE);
+  g_slice_free (GabbleTubeMux, self);
+}
+
+/**
+ * gabble_tube_mux_free:
+ * @self: a mux
+ *
+ * Frees @self, without telling the peer anything; closing the bytestream is
+ * up to the caller. No more callbacks will be called.
+ */
+void
+gabble_tube_mux_free (GabbleTubeMux *self)
+{
+  if (self == NULL)
+    return;
+
+  g_return_if_fail (!self->freed);
+  self->freed = TRUE;
+
+  if (self->busy == 0)
+    destroy (self);
+}
+
+static void
+hold (GabbleTubeMux *self)
+{
+  self->busy++;
+}
+
+/* Returns FALSE if @self has been freed, in which case it must not be used
+ * again */
+static gboolean
+release (GabbleTubeMux *self)
+{
+  gboolean alive = !self->freed;
+
+  g_assert (self->busy > 0);
+  self->busy--;
+
+  if (self->busy == 0 && self->freed)
+    destroy (self);
+
+  return alive;
+}
+
+static guint
+collect_be16 (const gchar *str)
+{
+  const guchar *bytes = (const guchar *) str;
+
+  return (bytes[0] << 8) | bytes[1];
+}
+
+static void
+append_be32 (GString *str,
+    guint32 value)
+{
+  g_string_append_c (str, (value >> 24) & 0xff);
+  g_string_append_c (str, (value >> 16) & 0xff);
+  g_string_append_c (str, (value >> 8) & 0xff);
+  g_string_append_c (str, value & 0xff);
+}
+
+/* Must be called with @self held */
+static void
+send_frame (GabbleTubeMux *self,
+    FrameType type,
+    guint id,
+    const gchar *payload,
+    gsize len)
+{
+  GString *frame;
+
+  g_assert (self->busy > 0);
+  g_assert (len <= MAX_FRAME_PAYLOAD);
+
+  if (self->freed)
+    return;
+
+  /* if the send callback makes us send another frame, that one can't reuse
+   * the buffer the first one is still in */
+  if (self->out_in_use)
+    frame = g_string_sized_new (HEADER_LENGTH + len);
+  else
+    frame = self->out;
+
+  g_string_truncate (frame, 0);
+  g_string_append_c (frame, type);
+  g_string_append_c (frame, 0);
+  g_string_append_c (frame, (id >> 8) & 0xff);
+  g_string_append_c (frame, id & 0xff);
+  append_be32 (frame, len);
+  g_string_append_len (frame, payload, len);
+
+  if (frame == self->out)
+    {
+      self->out_in_use = TRUE;
+      self->callbacks->send (self, frame->str, frame->len, self->user_data);
+      self->out_in_use = FALSE;
+    }
+  else
+    {
+      self->callbacks->send (self, frame->str, frame->len, self->user_data);
+      g_string_free (frame, TRUE);
+    }
+}
+
+/* Must be called with @self held */
+static void
+send_credit (GabbleTubeMux *self,
+    guint id,
+    MuxStream *stream)
+{
+  gchar payload[4];
+  guint32 credit = stream->uncredited;
+
+  payload[0] = (credit >> 24) & 0xff;
+  payload[1] = (credit >> 16) & 0xff;
+  payload[2] = (credit >> 8) & 0xff;
+  payload[3] = credit & 0xff;
+
+  stream->uncredited = 0;
+  send_frame (self, FRAME_WINDOW, id, payload, sizeof (payload));
+}
+
+static MuxStream *
+add_stream (GabbleTubeMux *self,
+    guint id)
+{
+  MuxStream *stream = g_slice_new0 (MuxStream);
+
+  stream->send_window = INITIAL_WINDOW;
+  g_hash_table_insert (self->streams, GUINT_TO_POINTER (id), stream);
+  return stream;
+}
+
+/**
+ * gabble_tube_mux_open_stream:
+ * @self: a mux
+ *
+ * Returns: the ID of a new stream, or 0 if no more can be opened or @self
+ *  was freed while telling the peer
+ */
+guint
+gabble_tube_mux_open_stream (GabbleTubeMux *self)
+{
+  guint id = 0, i;
+
+  g_return_val_if_fail (self != NULL, 0);
+
+  if (g_hash_table_size (self->streams) >= MAX_STREAMS)
+    {
+      DEBUG ("%u streams are already open", MAX_STREAMS);
+      return 0;
+    }
+
+  for (i = 0; i < G_MAXUINT16; i++)
+    {
+      self->last_id = self->last_id % G_MAXUINT16 + 1;
+
+      if (g_hash_table_lookup (self->streams,
+            GUINT_TO_POINTER (self->last_id)) == NULL)
+        {
+          id = self->last_id;
+          break;
+        }
+    }
+
+  g_assert (id != 0);
+  add_stream (self, id);
+
+  hold (self);
+  send_frame (self, FRAME_OPEN, id, NULL, 0);
+
+  if (!release (self))
+    return 0;
+
+  return id;
+}
+
+/**
+ * gabble_tube_mux_send:
+ * @self: a mux
+ * @id: an open stream
+ * @data: data to send on it
+ * @len: the length of @data
+ *
+ * Sends all of @data.
+ *
+ * Returns: %FALSE if the caller should stop sending on @id until the
+ *  stream_writable callback is called for it
+ */
+gboolean
+gabble_tube_mux_send (GabbleTubeMux *self,
+    guint id,
+    const gchar *data,
+    gsize len)
+{
+  MuxStream *stream;
+  gboolean more;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+
+  stream = g_hash_table_lookup (self->streams, GUINT_TO_POINTER (id));
+  g_return_val_if_fail (stream != NULL, FALSE);
+
+  stream->send_window -= (gint64) len;
+  more = (stream->send_window > 0);
+
+  if (!more)
+    stream->blocked = TRUE;
+
+  hold (self);
+
+  while (len > 0 && !self->freed)
+    {
+      gsize chunk = MIN (len, MAX_FRAME_PAYLOAD);
+
+      send_frame (self, FRAME_DATA, id, data, chunk);
+      data += chunk;
+      len -= chunk;
+    }
+
+  release (self);
+  return more;
+}
+
+/**
+ * gabble_tube_mux_resume_stream:
+ * @self: a mux
+ * @id: a stream
+ *
+ * Lets the peer send more on @id again, after the stream_data callback
+ * returned %FALSE for it.
+ */
+void
+gabble_tube_mux_resume_stream (GabbleTubeMux *self,
+    guint id)
+{
+  MuxStream *stream;
+
+  g_return_if_fail (self != NULL);
+
+  stream = g_hash_table_lookup (self->streams, GUINT_TO_POINTER (id));
+
+  if (stream == NULL)
+    return;
+
+  stream->paused = FALSE;
+
+  if (stream->uncredited == 0)
+    return;
+
+  hold (self);
+  send_credit (self, id, stream);
+  release (self);
+}
+
+/**
+ * gabble_tube_mux_close_stream:
+ * @self: a mux
+ * @id: a stream
+ *
+ * Closes @id, if it's still open, and tells the peer.
+ */
+void
+gabble_tube_mux_close_stream (GabbleTubeMux *self,
+    guint id)
+{
+  g_return_if_fail (self != NULL);
+
+  if (!g_hash_table_remove (self->streams, GUINT_TO_POINTER (id)))
+    return;
+
+  hold (self);
+  send_frame (self, FRAME_CLOSE, id, NULL, 0);
+  release (self);
+}
+
+/* Must be called with @self held. Returns FALSE if the peer broke the
+ * protocol. */
+static gboolean
+handle_frame (GabbleTubeMux *self,
+    const gchar *frame,
+    guint32 payload_len)
+{
+  guint type = (guchar) frame[0];
+  guint id = collect_be16 (frame + 2);
+  const gchar *payload = frame + HEADER_LENGTH;
+  MuxStream *stream;
+
+  if (id == 0)
+    {
+      DEBUG ("frame for stream 0");
+      return FALSE;
+    }
+
+  stream = g_hash_table_lookup (self->streams, GUINT_TO_POINTER (id));
+
+  switch (type)
+    {
+      case FRAME_OPEN:
+        if (stream != NULL || payload_len != 0)
+          {
+            DEBUG ("invalid OPEN for stream %u", id);
+            return FALSE;
+          }
+
+        if (g_hash_table_size (self->streams) >= MAX_STREAMS)
+          {
+            DEBUG ("%u streams are already open; refusing %u", MAX_STREAMS,
+                id);
+            send_frame (self, FRAME_CLOSE, id, NULL, 0);
+            return TRUE;
+          }
+
+        add_stream (self, id);
+        self->callbacks->stream_opened (self, id, self->user_data);
+        return TRUE;
+
+      case FRAME_DATA:
+        /* if we don't know the stream, we've closed it and the peer
+         * hadn't noticed yet when it sent this */
+        if (stream == NULL || payload_len == 0)
+          return TRUE;
+
+        stream->uncredited += payload_len;
+
+        if (!self->callbacks->stream_data (self, id, payload, payload_len,
+              self->user_data))
+          {
+            stream = g_hash_table_lookup (self->streams,
+                GUINT_TO_POINTER (id));
+
+            if (stream != NULL)
+              stream->paused = TRUE;
+
+            return TRUE;
+          }
+
+        /* the callback might have closed it */
+        stream = g_hash_table_lookup (self->streams, GUINT_TO_POINTER (id));
+
+        if (stream != NULL && !stream->paused &&
+            stream->uncredited >= CREDIT_THRESHOLD)
+          send_credit (self, id, stream);
+
+        return TRUE;
+
+      case FRAME_CLOSE:
+        if (payload_len != 0)
+          {
+            DEBUG ("CLOSE for stream %u has a payload", id);
+            return FALSE;
+          }
+
+        if (stream == NULL)
+          return TRUE;
+
+        g_hash_table_remove (self->streams, GUINT_TO_POINTER (id));
+        self->callbacks->stream_closed (self, id, self->user_data);
+        return TRUE;
+
+      case FRAME_WINDOW:
+        if (payload_len != 4)
+          {
+            DEBUG ("WINDOW for stream %u has a %u-byte payload", id,
+                payload_len);
+            return FALSE;
+          }
+
+        if (stream == NULL)
+          return TRUE;
+
+        stream->send_window += gabble_collect_be32 (payload);
+
+        if (stream->blocked && stream->send_window > 0)
+          {
+            stream->blocked = FALSE;
+            self->callbacks->stream_writable (self, id, self->user_data);
+          }
+
+        return TRUE;
+
+      default:
+        DEBUG ("unknown frame type %u", type);
+        return FALSE;
+    }
+}
+
+/* Copies as much of [*data, end) into the buffer as it takes to make it
+ * @target bytes long. Returns TRUE if it now is. */
+static gboolean
+fill_partial (GabbleTubeMux *self,
+    gsize target,
+    const gchar **data,
+    const gchar *end)
+{
+  gsize available = end - *data;
+  gsize wanted = target - self->partial->len;
+  gsize take = MIN (wanted, available);
+
+  g_string_append_len (self->partial, *data, take);
+  *data += take;
+
+  return self->partial->len == target;
+}
+
+/**
+ * gabble_tube_mux_receive:
+ * @self: a mux
+ * @data: the next bytes received from the bytestream
+ * @len: the length of @data
+ *
+ * Calls the callbacks for each frame completed by @data.
+ *
+ * Returns: %FALSE if the peer has broken the protocol, in which case the
+ *  bytestream should be closed
+ */
+gboolean
+gabble_tube_mux_receive (GabbleTubeMux *self,
+    const gchar *data,
+    gsize len)
+{
+  const gchar *end = data + len;
+  guint32 payload_len;
+  gboolean ok = TRUE;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+
+  if (self->broken)
+    return FALSE;
+
+  hold (self);
+
+  /* First finish the frame left over from the last read, if any */
+  if (self->partial->len > 0)
+    {
+      if (self->partial->len < HEADER_LENGTH &&
+          !fill_partial (self, HEADER_LENGTH, &data, end))
+        goto out;
+
+      payload_len = gabble_collect_be32 (self->partial->str + 4);
+
+      if (payload_len > MAX_FRAME_PAYLOAD)
+        {
+          DEBUG ("%u-byte frame is too long", payload_len);
+          ok = FALSE;
+          goto out;
+        }
+
+      if (!fill_partial (self, HEADER_LENGTH + payload_len, &data, end))
+        goto out;
+
+      ok = handle_frame (self, self->partial->str, payload_len);
+      g_string_truncate (self->partial, 0);
+    }
+
+  /* Then handle the frames which are wholly inside this read where they
+   * are */
+  while (ok && !self->freed && (gsize) (end - data) >= HEADER_LENGTH)
+    {
+      payload_len = gabble_collect_be32 (data + 4);
+
+      if (payload_len > MAX_FRAME_PAYLOAD)
+        {
+          DEBUG ("%u-byte frame is too long", payload_len);
+          ok = FALSE;
+          break;
+        }
+
+      if ((gsize) (end - data) < HEADER_LENGTH + payload_len)
+        break;
+
+      ok = handle_frame (self, data, payload_len);
+      data += HEADER_LENGTH + payload_len;
+    }
+
+  /* And keep the start of the next one for later */
+  if (ok && !self->freed && data < end)
+    g_string_append_len (self->partial, data, end - data);
+
+out:
+  if (!ok)
+    self->broken = TRUE;
+
+  release (self);
+  return ok;
+}
@@ -0,0 +1,70 @@
+/*
+ * tube-mux.h - Header for multiplexing stream tube connections
+ *
+ * Copyright (C) 2011 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GABBLE_TUBE_MUX_H__
+#define __GABBLE_TUBE_MUX_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GabbleTubeMux GabbleTubeMux;
+
+/**
+ * GabbleTubeMuxCallbacks:
+ * @send: called with framed data to be written to the shared bytestream
+ * @stream_opened: called when the peer opens stream @id
+ * @stream_data: called with data the peer sent on stream @id. Returns %TRUE
+ *  if the data has been passed on and the peer may send more; if it returns
+ *  %FALSE, the peer isn't allowed to send more than its current window until
+ *  gabble_tube_mux_resume_stream () is called
+ * @stream_closed: called when the peer closes stream @id
+ * @stream_writable: called when the peer lets us send on stream @id again
+ *  after gabble_tube_mux_send () returned %FALSE
+ *
+ * The mux may be freed from within any of these.
+ */
+typedef struct {
+    void (*send) (GabbleTubeMux *mux, const gchar *data, gsize len,
+        gpointer user_data);
+    void (*stream_opened) (GabbleTubeMux *mux, guint id, gpointer user_data);
+    gboolean (*stream_data) (GabbleTubeMux *mux, guint id, const gchar *data,
+        gsize len, gpointer user_data);
+    void (*stream_closed) (GabbleTubeMux *mux, guint id, gpointer user_data);
+    void (*stream_writable) (GabbleTubeMux *mux, guint id,
+        gpointer user_data);
+} GabbleTubeMuxCallbacks;
+
+GabbleTubeMux *gabble_tube_mux_new (const GabbleTubeMuxCallbacks *callbacks,
+    gpointer user_data);
+void gabble_tube_mux_free (GabbleTubeMux *self);
+
+guint gabble_tube_mux_open_stream (GabbleTubeMux *self);
+gboolean gabble_tube_mux_send (GabbleTubeMux *self, guint id,
+    const gchar *data, gsize len);
+void gabble_tube_mux_resume_stream (GabbleTubeMux *self, guint id);
+void gabble_tube_mux_close_stream (GabbleTubeMux *self, guint id);
+
+gboolean gabble_tube_mux_receive (GabbleTubeMux *self, const gchar *data,
+    gsize len);
+
+G_END_DECLS
+
+#endif /* __GABBLE_TUBE_MUX_H__ */
@@ -63,6 +63,7 @@
 #include "presence-cache.h"
 #include "presence.h"
 #include "tube-iface.h"
+#include "tube-mux.h"
 #include "util.h"
 
 static void channel_iface_init (gpointer, gpointer);
@@ -111,6 +112,19 @@ typedef union
   struct sockaddr_in6 ipv6;
 } SockAddr;
 
+/* Per-connection budget for data from the peer waiting to be written to the
+ * local socket: once more than the high watermark is queued, we stop reading
+ * from the bytestream until the application has drained it to the low
+ * watermark. A peer which keeps sending regardless can't make us queue more
+ * than the hard limit; the connection is closed instead. */
+#define CONNECTION_HIGH_WATERMARK (256 * 1024)
+#define CONNECTION_LOW_WATERMARK (64 * 1024)
+#define CONNECTION_MAX_BUFFERED (4 * 1024 * 1024)
+
+/* How much a local connection may read in one go, while the application
+ * keeps writing, before other sources on the main loop get a turn */
+#define CONNECTION_READ_BUDGET (1024 * 1024)
+
 /* signals */
 enum
 {
@@ -201,6 +215,24 @@ struct _GabbleTubeStreamPrivate
   GibberListener *local_listener;
   GabbleMucChannel *muc;
 
+  /* Connections multiplexed over a single bytestream, for 1-1 tubes whose
+   * peer supports NS_TUBES_MUX; see tube-mux.c */
+  GabbleBytestreamIface *mux_bytestream;
+  GabbleTubeMux *mux;
+  /* GUINT_TO_POINTER (mux stream ID) -> owned (MuxConnection *) */
+  GHashTable *mux_connections;
+  /* (GibberTransport *) -> borrowed (MuxConnection *) */
+  GHashTable *transport_to_mux_connection;
+  /* Reffed local connections waiting for mux_bytestream to open */
+  GSList *mux_pending;
+  /* TRUE from when we ask for mux_bytestream until it opens */
+  gboolean mux_negotiating;
+  /* TRUE if the peer refused or broke a multiplexed bytestream, so that
+   * connections get a bytestream each from now on */
+  gboolean mux_refused;
+  /* TRUE while mux_bytestream can't take more data */
+  gboolean mux_write_blocked;
+
   gboolean closed;
 
   gboolean dispose_has_run;
@@ -214,10 +246,25 @@ typedef struct
   TpHandle contact;
 } transport_connected_data;
 
+typedef struct
+{
+  guint id;
+  GibberTransport *transport;
+  /* Data the peer sent before transport was connected */
+  GString *early_data;
+  /* TRUE if the peer's window is full, so we stopped reading transport */
+  gboolean window_closed;
+  /* TRUE if the peer closed the connection; transport is disconnected once
+   * it has written out what it has */
+  gboolean remote_closed;
+} MuxConnection;
+
 static void data_received_cb (GabbleBytestreamIface *ibb, TpHandle sender,
     GString *data, gpointer user_data);
 static void transport_connected_cb (GibberTransport *transport,
     transport_connected_data *data);
+static gboolean start_connection (GabbleTubeStream *self,
+    GibberTransport *transport, GError **error);
 
 #ifdef GIBBER_TYPE_UNIX_TRANSPORT
 static void
@@ -326,6 +373,20 @@ remove_transport (GabbleTubeStream *self,
   g_hash_table_remove (priv->transport_to_id, transport);
 }
 
+static void
+set_connection_budget (GibberTransport *transport)
+{
+  /* Other transports don't buffer much, if at all */
+  if (!GIBBER_IS_FD_TRANSPORT (transport))
+    return;
+
+  g_object_set (transport,
+      "high-watermark", CONNECTION_HIGH_WATERMARK,
+      "low-watermark", CONNECTION_LOW_WATERMARK,
+      "read-budget", CONNECTION_READ_BUDGET,
+      NULL);
+}
+
 static void
 transport_buffer_empty_cb (GibberTransport *transport,
                            GabbleTubeStream *self)
@@ -342,10 +403,28 @@ transport_buffer_empty_cb (GibberTransport *transport,
     {
       DEBUG ("buffer is now empty. Transport can be removed");
       remove_transport (self, bytestream, transport);
-      return;
     }
+}
+
+static void
+transport_buffer_drained_cb (GibberTransport *transport,
+                             GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  GabbleBytestreamIface *bytestream;
+  GabbleBytestreamState state;
+
+  bytestream = g_hash_table_lookup (priv->transport_to_bytestream, transport);
+  g_assert (bytestream != NULL);
+  g_object_get (bytestream, "state", &state, NULL);
+
+  /* A closed bytestream's transport is removed once it is empty */
+  if (state == GABBLE_BYTESTREAM_STATE_CLOSED)
+    return;
 
-  /* Buffer is empty so we can unblock the buffer if it was blocked */
+  /* There is room in the buffer again, so unblock it if it was blocked */
+  DEBUG ("%" G_GSIZE_FORMAT " bytes left for the local socket. Unblock the "
+      "bytestream", gibber_transport_get_buffered_bytes (transport));
   gabble_bytestream_iface_block_reading (bytestream, FALSE);
 }
 
@@ -360,6 +439,8 @@ add_transport (GabbleTubeStream *self,
       G_CALLBACK (transport_disconnected_cb), self);
   g_signal_connect (transport, "buffer-empty",
       G_CALLBACK (transport_buffer_empty_cb), self);
+  g_signal_connect (transport, "buffer-drained",
+      G_CALLBACK (transport_buffer_drained_cb), self);
 
   /* We can transfer transport's data; unblock it. */
   gibber_transport_block_receiving (transport, FALSE);
@@ -377,6 +458,8 @@ bytestream_write_blocked_cb (GabbleBytestreamIface *bytestream,
       bytestream);
   g_assert (transport != NULL);
 
+  DEBUG ("bytestream is %s. %s the local socket",
+      blocked ? "full" : "writable again", blocked ? "Block" : "Unblock");
   gibber_transport_block_receiving (transport, blocked);
 }
 
@@ -466,10 +549,14 @@ extra_bytestream_negotiate_cb (GabbleBytestreamIface *bytestream,
                 G_CALLBACK (extra_bytestream_state_changed_cb), self);
 }
 
+/* Asks the initiator for a bytestream, to carry either a single connection
+ * or, if @mux is TRUE, all of them */
 static gboolean
-start_stream_initiation (GabbleTubeStream *self,
-                         GibberTransport *transport,
-                         GError **error)
+send_stream_initiation (GabbleTubeStream *self,
+                        gboolean mux,
+                        GabbleBytestreamFactoryNegotiateReplyFunc func,
+                        gpointer user_data,
+                        GError **error)
 {
   GabbleTubeStreamPrivate *priv;
   LmMessageNode *node, *si_node;
@@ -503,7 +590,8 @@ start_stream_initiation (GabbleTubeStream *self,
         }
 
       resource = gabble_presence_pick_resource_by_caps (presence, 0,
-          gabble_capability_set_predicate_has, NS_TUBES);
+          gabble_capability_set_predicate_has,
+          mux ? NS_TUBES_MUX : NS_TUBES);
       if (resource == NULL)
         {
           DEBUG ("initiator doesn't have tubes capabilities");
@@ -545,10 +633,30 @@ start_stream_initiation (GabbleTubeStream *self,
       "tube", id_str,
       NULL);
 
+  if (mux)
+    lm_message_node_set_attribute (node, "mux", "true");
+
   result = gabble_bytestream_factory_negotiate_stream (
-      priv->conn->bytestream_factory, msg, stream_id,
-      extra_bytestream_negotiate_cb, g_object_ref (transport), G_OBJECT (self),
-      error);
+      priv->conn->bytestream_factory, msg, stream_id, func, user_data,
+      G_OBJECT (self), error);
+
+  lm_message_unref (msg);
+  g_free (stream_id);
+  g_free (full_jid);
+  g_free (id_str);
+
+  return result;
+}
+
+static gboolean
+start_stream_initiation (GabbleTubeStream *self,
+                         GibberTransport *transport,
+                         GError **error)
+{
+  gboolean result;
+
+  result = send_stream_initiation (self, FALSE, extra_bytestream_negotiate_cb,
+      g_object_ref (transport), error);
 
   /* FIXME: data and one ref on data->transport are leaked if the tube is
    * closed before we got the SI reply. */
@@ -558,11 +666,6 @@ start_stream_initiation (GabbleTubeStream *self,
       g_object_unref (transport);
     }
 
-  lm_message_unref (msg);
-  g_free (stream_id);
-  g_free (full_jid);
-  g_free (id_str);
-
   return result;
 }
 
@@ -629,7 +732,7 @@ credentials_received_cb (GibberUnixTransport *transport,
 
   DEBUG ("Connection properly authentificated");
 
-  if (!start_stream_initiation (self, GIBBER_TRANSPORT (transport), NULL))
+  if (!start_connection (self, GIBBER_TRANSPORT (transport), NULL))
     {
       DEBUG ("SI failed. Closing connection");
     }
@@ -639,7 +742,7 @@ credentials_received_cb (GibberUnixTransport *transport,
     }
 
 credentials_received_cb_out:
-  /* start_stream_initiation reffed the transport if everything went fine */
+  /* start_connection reffed the transport if everything went fine */
   g_object_unref (transport);
 }
 #endif
@@ -752,6 +855,7 @@ local_new_connection_cb (GibberListener *listener,
   /* Block the transport while there is no open bytestream to transfer
    * its data. */
   gibber_transport_block_receiving (transport, TRUE);
+  set_connection_budget (transport);
 
   if (!check_incoming_connection (self, transport))
     {
@@ -763,7 +867,7 @@ local_new_connection_cb (GibberListener *listener,
   /* Streams in stream tubes are established with stream initiation (XEP-0095).
    * We use SalutSiBytestreamManager.
    */
-  if (!start_stream_initiation (self, transport, NULL))
+  if (!start_connection (self, transport, NULL))
     {
       DEBUG ("closing new client connection");
     }
@@ -928,16 +1032,14 @@ transport_connected_cb (GibberTransport *transport,
   gabble_bytestream_iface_block_reading (bytestream, FALSE);
 }
 
+/* Connects to the socket of the tube we offered. The caller owns the
+ * returned transport, which doesn't receive data until it's unblocked. */
 static GibberTransport *
-new_connection_to_socket (GabbleTubeStream *self,
-                          GabbleBytestreamIface *bytestream,
-                          TpHandle contact)
+connect_to_socket (GabbleTubeStream *self)
 {
   GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
   GibberTransport *transport;
 
-  DEBUG ("Called.");
-
   g_assert (priv->initiator == priv->self_handle);
 
 #ifdef GIBBER_TYPE_UNIX_TRANSPORT
@@ -978,6 +1080,22 @@ new_connection_to_socket (GabbleTubeStream *self,
   /* Block the transport while there is no open bytestream to transfer
    * its data. */
   gibber_transport_block_receiving (transport, TRUE);
+  set_connection_budget (transport);
+
+  return transport;
+}
+
+static GibberTransport *
+new_connection_to_socket (GabbleTubeStream *self,
+                          GabbleBytestreamIface *bytestream,
+                          TpHandle contact)
+{
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  GibberTransport *transport;
+
+  DEBUG ("Called.");
+
+  transport = connect_to_socket (self);
 
   generate_connection_id (self, transport);
 
@@ -996,6 +1114,714 @@ new_connection_to_socket (GabbleTubeStream *self,
   return transport;
 }
 
+static void
+first_connection_received (GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+
+  if (priv->state != TP_TUBE_CHANNEL_STATE_REMOTE_PENDING)
+    return;
+
+  DEBUG ("Received first connection. Tube is now open");
+  priv->state = TP_TUBE_CHANNEL_STATE_OPEN;
+
+  tp_svc_channel_interface_tube_emit_tube_channel_state_changed (
+      self, TP_TUBE_CHANNEL_STATE_OPEN);
+
+  g_signal_emit (G_OBJECT (self), signals[OPENED], 0);
+}
+
+static void
+mux_connection_free (MuxConnection *connection)
+{
+  if (connection->early_data != NULL)
+    g_string_free (connection->early_data, TRUE);
+
+  g_object_unref (connection->transport);
+  g_slice_free (MuxConnection, connection);
+}
+
+/* Writes data from the peer to a connection's transport. Returns FALSE if the
+ * transport's buffer is full, so the peer should stop sending for now. */
+static gboolean
+mux_transport_send (GibberTransport *transport,
+                    const gchar *data,
+                    gsize len)
+{
+  GError *error = NULL;
+  gboolean ok;
+
+  /* A failed send disconnects the transport, which removes the connection
+   * and its ref on the transport; see data_received_cb () */
+  g_object_ref (transport);
+
+  if (!gibber_transport_send (transport, (const guint8 *) data, len, &error))
+    {
+      DEBUG ("sending failed: %s", error->message);
+      g_error_free (error);
+      g_object_unref (transport);
+      return FALSE;
+    }
+
+  ok = !gibber_transport_buffer_is_full (transport);
+  g_object_unref (transport);
+  return ok;
+}
+
+static void
+remove_mux_connection (GabbleTubeStream *self,
+                       MuxConnection *connection,
+                       const gchar *error,
+                       const gchar *debug_msg)
+{
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  GibberTransport *transport = g_object_ref (connection->transport);
+  guint id = connection->id;
+
+  DEBUG ("disconnect and remove multiplexed connection %u", id);
+
+  /* Forget the connection first, as closing the stream can close the
+   * bytestream and so all the other connections */
+  g_hash_table_remove (priv->transport_to_mux_connection, transport);
+  g_hash_table_remove (priv->mux_connections, GUINT_TO_POINTER (id));
+
+  g_signal_handlers_disconnect_matched (transport, G_SIGNAL_MATCH_DATA,
+      0, 0, NULL, NULL, self);
+  gibber_transport_disconnect (transport);
+  fire_connection_closed (self, transport, error, debug_msg);
+
+  if (priv->mux != NULL)
+    gabble_tube_mux_close_stream (priv->mux, id);
+
+  g_object_unref (transport);
+}
+
+static void
+mux_transport_handler (GibberTransport *transport,
+                       GibberBuffer *data,
+                       gpointer user_data)
+{
+  GabbleTubeStream *self = GABBLE_TUBE_STREAM (user_data);
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  MuxConnection *connection;
+
+  connection = g_hash_table_lookup (priv->transport_to_mux_connection,
+      transport);
+  if (connection == NULL || priv->mux == NULL)
+    {
+      DEBUG ("no open stream associated with this transport");
+      return;
+    }
+
+  if (gabble_tube_mux_send (priv->mux, connection->id,
+        (const gchar *) data->data, data->length))
+    return;
+
+  /* Sending can close the bytestream, taking the connection with it */
+  connection = g_hash_table_lookup (priv->transport_to_mux_connection,
+      transport);
+  if (connection == NULL)
+    return;
+
+  DEBUG ("peer's window for connection %u is full. Block the transport",
+      connection->id);
+  connection->window_closed = TRUE;
+  gibber_transport_block_receiving (transport, TRUE);
+}
+
+static void
+mux_transport_disconnected_cb (GibberTransport *transport,
+                               GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  MuxConnection *connection;
+
+  connection = g_hash_table_lookup (priv->transport_to_mux_connection,
+      transport);
+  if (connection == NULL)
+    return;
+
+  remove_mux_connection (self, connection, TP_ERROR_STR_CANCELLED,
+      "local socket has been disconnected");
+}
+
+static void
+mux_transport_buffer_empty_cb (GibberTransport *transport,
+                               GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  MuxConnection *connection;
+
+  connection = g_hash_table_lookup (priv->transport_to_mux_connection,
+      transport);
+  if (connection == NULL)
+    return;
+
+  if (connection->remote_closed)
+    remove_mux_connection (self, connection,
+        TP_ERROR_STR_CONNECTION_LOST, "remote end closed the connection");
+}
+
+static void
+mux_transport_buffer_drained_cb (GibberTransport *transport,
+                                 GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  MuxConnection *connection;
+
+  connection = g_hash_table_lookup (priv->transport_to_mux_connection,
+      transport);
+  if (connection == NULL || connection->remote_closed)
+    return;
+
+  /* There is room in the buffer again, so let the peer send more */
+  if (priv->mux != NULL)
+    gabble_tube_mux_resume_stream (priv->mux, connection->id);
+}
+
+/* Called on the initiator side once we have connected to the tube's socket
+ * for a stream the peer opened */
+static void
+mux_transport_connected_cb (GibberTransport *transport,
+                            GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  MuxConnection *connection;
+  GString *early_data;
+  gboolean more = TRUE;
+  guint id;
+
+  connection = g_hash_table_lookup (priv->transport_to_mux_connection,
+      transport);
+  if (connection == NULL)
+    return;
+
+  id = connection->id;
+  early_data = connection->early_data;
+  connection->early_data = NULL;
+
+  /* This disconnects the transport if it can't get the access control
+   * parameter, removing the connection */
+  fire_new_remote_connection (self, transport, priv->handle);
+
+  if (early_data != NULL)
+    {
+      if (g_hash_table_lookup (priv->transport_to_mux_connection,
+            transport) != NULL)
+        more = mux_transport_send (transport, early_data->str,
+            early_data->len);
+
+      g_string_free (early_data, TRUE);
+    }
+
+  connection = g_hash_table_lookup (priv->transport_to_mux_connection,
+      transport);
+  if (connection == NULL)
+    return;
+
+  if (connection->remote_closed)
+    {
+      if (gibber_transport_buffer_is_empty (transport))
+        remove_mux_connection (self, connection,
+            TP_ERROR_STR_CONNECTION_LOST, "remote end closed the connection");
+    }
+  else if (more && priv->mux != NULL)
+    {
+      gabble_tube_mux_resume_stream (priv->mux, id);
+    }
+}
+
+static void
+add_mux_connection (GabbleTubeStream *self,
+                    guint id,
+                    GibberTransport *transport)
+{
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  MuxConnection *connection = g_slice_new0 (MuxConnection);
+
+  connection->id = id;
+  connection->transport = g_object_ref (transport);
+
+  g_hash_table_insert (priv->mux_connections, GUINT_TO_POINTER (id),
+      connection);
+  g_hash_table_insert (priv->transport_to_mux_connection, transport,
+      connection);
+
+  gibber_transport_set_handler (transport, mux_transport_handler, self);
+
+  g_signal_connect (transport, "disconnected",
+      G_CALLBACK (mux_transport_disconnected_cb), self);
+  g_signal_connect (transport, "buffer-empty",
+      G_CALLBACK (mux_transport_buffer_empty_cb), self);
+  g_signal_connect (transport, "buffer-drained",
+      G_CALLBACK (mux_transport_buffer_drained_cb), self);
+
+  if (gibber_transport_get_state (transport) != GIBBER_TRANSPORT_CONNECTED)
+    g_signal_connect (transport, "connected",
+        G_CALLBACK (mux_transport_connected_cb), self);
+
+  gibber_transport_block_receiving (transport, priv->mux_write_blocked);
+}
+
+static void
+mux_send_cb (GabbleTubeMux *mux,
+             const gchar *data,
+             gsize len,
+             gpointer user_data)
+{
+  GabbleTubeStream *self = GABBLE_TUBE_STREAM (user_data);
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+
+  if (priv->mux_bytestream == NULL)
+    return;
+
+  gabble_bytestream_iface_send (priv->mux_bytestream, len, data);
+}
+
+static void
+mux_stream_opened_cb (GabbleTubeMux *mux,
+                      guint id,
+                      gpointer user_data)
+{
+  GabbleTubeStream *self = GABBLE_TUBE_STREAM (user_data);
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  GibberTransport *transport;
+
+  if (priv->initiator != priv->self_handle)
+    {
+      DEBUG ("I'm not the initiator of this tube, can't accept "
+          "a connection from the peer");
+      gabble_tube_mux_close_stream (mux, id);
+      return;
+    }
+
+  /* New stream, let's connect to the socket */
+  transport = connect_to_socket (self);
+
+  if (gibber_transport_get_state (transport) ==
+      GIBBER_TRANSPORT_DISCONNECTED)
+    {
+      DEBUG ("couldn't connect to the socket");
+      g_object_unref (transport);
+      gabble_tube_mux_close_stream (mux, id);
+      return;
+    }
+
+  DEBUG ("peer opened multiplexed connection %u", id);
+
+  generate_connection_id (self, transport);
+  add_mux_connection (self, id, transport);
+
+  g_signal_emit (G_OBJECT (self), signals[NEW_CONNECTION], 0, priv->handle);
+
+  /* Otherwise NewRemoteConnection is fired once the transport is connected,
+   * as in gabble_tube_stream_add_bytestream () */
+  if (gibber_transport_get_state (transport) == GIBBER_TRANSPORT_CONNECTED)
+    fire_new_remote_connection (self, transport, priv->handle);
+
+  g_object_unref (transport);
+}
+
+static gboolean
+mux_stream_data_cb (GabbleTubeMux *mux,
+                    guint id,
+                    const gchar *data,
+                    gsize len,
+                    gpointer user_data)
+{
+  GabbleTubeStream *self = GABBLE_TUBE_STREAM (user_data);
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  MuxConnection *connection;
+  gboolean more;
+  gsize buffered;
+
+  connection = g_hash_table_lookup (priv->mux_connections,
+      GUINT_TO_POINTER (id));
+  if (connection == NULL)
+    {
+      DEBUG ("data for unknown connection %u", id);
+      return TRUE;
+    }
+
+  if (gibber_transport_get_state (connection->transport) !=
+      GIBBER_TRANSPORT_CONNECTED)
+    {
+      /* Keep it until we have connected to the socket. The peer can't send
+       * more than its window until we resume the stream. */
+      if (connection->early_data == NULL)
+        connection->early_data = g_string_sized_new (len);
+
+      g_string_append_len (connection->early_data, data, len);
+      more = FALSE;
+      buffered = connection->early_data->len;
+    }
+  else
+    {
+      more = mux_transport_send (connection->transport, data, len);
+
+      /* A failed send removes the connection */
+      connection = g_hash_table_lookup (priv->mux_connections,
+          GUINT_TO_POINTER (id));
+      if (connection == NULL)
+        return TRUE;
+
+      buffered = gibber_transport_get_buffered_bytes (connection->transport);
+    }
+
+  if (buffered > CONNECTION_MAX_BUFFERED)
+    {
+      /* The peer sends a little past its window, but not this far */
+      DEBUG ("%" G_GSIZE_FORMAT " bytes queued for connection %u, over the "
+          "limit of %u. Close it", buffered, id, CONNECTION_MAX_BUFFERED);
+      remove_mux_connection (self, connection, TP_ERROR_STR_CONNECTION_LOST,
+          "remote end sent too much data for the local socket");
+      return TRUE;
+    }
+
+  if (!more)
+    DEBUG ("%" G_GSIZE_FORMAT " bytes queued for connection %u. Pause it",
+        buffered, id);
+
+  return more;
+}
+
+static void
+mux_stream_closed_cb (GabbleTubeMux *mux,
+                      guint id,
+                      gpointer user_data)
+{
+  GabbleTubeStream *self = GABBLE_TUBE_STREAM (user_data);
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  MuxConnection *connection;
+
+  connection = g_hash_table_lookup (priv->mux_connections,
+      GUINT_TO_POINTER (id));
+  if (connection == NULL)
+    return;
+
+  connection->remote_closed = TRUE;
+
+  if (gibber_transport_get_state (connection->transport) ==
+        GIBBER_TRANSPORT_CONNECTED &&
+      gibber_transport_buffer_is_empty (connection->transport))
+    {
+      remove_mux_connection (self, connection, TP_ERROR_STR_CONNECTION_LOST,
+          "remote end closed the connection");
+    }
+  else
+    {
+      DEBUG ("Wait buffer is empty before disconnect the transport");
+    }
+}
+
+static void
+mux_stream_writable_cb (GabbleTubeMux *mux,
+                        guint id,
+                        gpointer user_data)
+{
+  GabbleTubeStream *self = GABBLE_TUBE_STREAM (user_data);
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  MuxConnection *connection;
+
+  connection = g_hash_table_lookup (priv->mux_connections,
+      GUINT_TO_POINTER (id));
+  if (connection == NULL)
+    return;
+
+  connection->window_closed = FALSE;
+
+  if (!priv->mux_write_blocked)
+    gibber_transport_block_receiving (connection->transport, FALSE);
+}
+
+static const GabbleTubeMuxCallbacks mux_callbacks = {
+    mux_send_cb,
+    mux_stream_opened_cb,
+    mux_stream_data_cb,
+    mux_stream_closed_cb,
+    mux_stream_writable_cb
+};
+
+/* Returns FALSE if @transport has to get a bytestream of its own */
+static gboolean
+open_mux_connection (GabbleTubeStream *self,
+                     GibberTransport *transport)
+{
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  guint id;
+
+  id = gabble_tube_mux_open_stream (priv->mux);
+  if (id == 0)
+    return FALSE;
+
+  DEBUG ("opened multiplexed connection %u", id);
+  add_mux_connection (self, id, transport);
+  return TRUE;
+}
+
+/* Starts the connections which were waiting for the multiplexed bytestream,
+ * over it if it opened or with a bytestream each otherwise */
+static void
+start_pending_connections (GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  GSList *pending = priv->mux_pending, *l;
+
+  priv->mux_pending = NULL;
+
+  for (l = pending; l != NULL; l = g_slist_next (l))
+    {
+      GibberTransport *transport = l->data;
+
+      if (!start_connection (self, transport, NULL))
+        {
+          DEBUG ("closing client connection");
+          gibber_transport_disconnect (transport);
+          fire_connection_closed (self, transport,
+              TP_ERROR_STR_NETWORK_ERROR, "can't open a bytestream");
+        }
+
+      g_object_unref (transport);
+    }
+
+  g_slist_free (pending);
+}
+
+static void
+drop_pending_connections (GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  GSList *pending = priv->mux_pending, *l;
+
+  priv->mux_pending = NULL;
+
+  for (l = pending; l != NULL; l = g_slist_next (l))
+    {
+      GibberTransport *transport = l->data;
+
+      gibber_transport_disconnect (transport);
+      fire_connection_closed (self, transport, TP_ERROR_STR_CANCELLED,
+          "tube is closing");
+      g_object_unref (transport);
+    }
+
+  g_slist_free (pending);
+}
+
+/* Closes all the multiplexed connections, and the bytestream carrying them
+ * if @close_bytestream is TRUE */
+static void
+close_mux (GabbleTubeStream *self,
+           gboolean close_bytestream,
+           const gchar *error,
+           const gchar *debug_msg)
+{
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  GabbleBytestreamIface *bytestream = priv->mux_bytestream;
+  GHashTableIter iter;
+  gpointer value;
+
+  if (bytestream == NULL)
+    return;
+
+  DEBUG ("closing multiplexed bytestream");
+
+  priv->mux_bytestream = NULL;
+  g_signal_handlers_disconnect_matched (bytestream, G_SIGNAL_MATCH_DATA,
+      0, 0, NULL, NULL, self);
+
+  /* If it never opened, don't try again */
+  if (priv->mux == NULL)
+    priv->mux_refused = TRUE;
+
+  priv->mux_negotiating = FALSE;
+  priv->mux_write_blocked = FALSE;
+  tp_clear_pointer (&priv->mux, gabble_tube_mux_free);
+
+  g_hash_table_iter_init (&iter, priv->mux_connections);
+
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      remove_mux_connection (self, value, error, debug_msg);
+      g_hash_table_iter_init (&iter, priv->mux_connections);
+    }
+
+  if (close_bytestream)
+    gabble_bytestream_iface_close (bytestream, NULL);
+
+  g_object_unref (bytestream);
+
+  if (!priv->closed)
+    start_pending_connections (self);
+}
+
+static void
+mux_data_received_cb (GabbleBytestreamIface *bytestream,
+                      TpHandle sender,
+                      GString *data,
+                      gpointer user_data)
+{
+  GabbleTubeStream *self = GABBLE_TUBE_STREAM (user_data);
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+
+  if (priv->mux == NULL)
+    return;
+
+  /* The callbacks can close the tube */
+  g_object_ref (self);
+
+  if (!gabble_tube_mux_receive (priv->mux, data->str, data->len) &&
+      priv->mux != NULL)
+    {
+      DEBUG ("peer broke the multiplexing protocol");
+      priv->mux_refused = TRUE;
+      close_mux (self, TRUE, TP_ERROR_STR_CONNECTION_LOST,
+          "bytestream has been broken");
+    }
+
+  g_object_unref (self);
+}
+
+static void
+mux_write_blocked_cb (GabbleBytestreamIface *bytestream,
+                      gboolean blocked,
+                      GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  GHashTableIter iter;
+  gpointer value;
+
+  priv->mux_write_blocked = blocked;
+
+  g_hash_table_iter_init (&iter, priv->mux_connections);
+
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      MuxConnection *connection = value;
+
+      gibber_transport_block_receiving (connection->transport,
+          blocked || connection->window_closed);
+    }
+}
+
+static void
+mux_bytestream_state_changed_cb (GabbleBytestreamIface *bytestream,
+                                 GabbleBytestreamState state,
+                                 gpointer user_data)
+{
+  GabbleTubeStream *self = GABBLE_TUBE_STREAM (user_data);
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+
+  if (state == GABBLE_BYTESTREAM_STATE_OPEN)
+    {
+      DEBUG ("multiplexed bytestream open");
+
+      g_signal_connect (bytestream, "data-received",
+          G_CALLBACK (mux_data_received_cb), self);
+      g_signal_connect (bytestream, "write-blocked",
+          G_CALLBACK (mux_write_blocked_cb), self);
+
+      priv->mux = gabble_tube_mux_new (&mux_callbacks, self);
+      priv->mux_negotiating = FALSE;
+
+      start_pending_connections (self);
+    }
+  else if (state == GABBLE_BYTESTREAM_STATE_CLOSED)
+    {
+      DEBUG ("multiplexed bytestream closed");
+
+      close_mux (self, FALSE, TP_ERROR_STR_CONNECTION_LOST,
+          "bytestream has been broken");
+    }
+}
+
+static void
+mux_bytestream_negotiate_cb (GabbleBytestreamIface *bytestream,
+                             const gchar *stream_id,
+                             LmMessage *msg,
+                             GObject *object,
+                             gpointer user_data)
+{
+  GabbleTubeStream *self = GABBLE_TUBE_STREAM (object);
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+
+  if (bytestream == NULL || priv->closed)
+    {
+      DEBUG ("initiator refused multiplexed bytestream; connections will "
+          "get a bytestream each");
+
+      if (bytestream != NULL)
+        gabble_bytestream_iface_close (bytestream, NULL);
+
+      priv->mux_negotiating = FALSE;
+      priv->mux_refused = TRUE;
+
+      if (!priv->closed)
+        start_pending_connections (self);
+
+      return;
+    }
+
+  DEBUG ("multiplexed bytestream accepted");
+
+  priv->mux_bytestream = g_object_ref (bytestream);
+
+  g_signal_connect (bytestream, "state-changed",
+      G_CALLBACK (mux_bytestream_state_changed_cb), self);
+}
+
+static gboolean
+peer_supports_mux (GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+  GabblePresence *presence;
+
+  if (priv->handle_type != TP_HANDLE_TYPE_CONTACT || priv->mux_refused)
+    return FALSE;
+
+  presence = gabble_presence_cache_get (priv->conn->presence_cache,
+      priv->initiator);
+
+  return presence != NULL &&
+      gabble_presence_pick_resource_by_caps (presence, 0,
+          gabble_capability_set_predicate_has, NS_TUBES_MUX) != NULL;
+}
+
+/* Carries a new connection from a local application to the initiator, over
+ * the multiplexed bytestream if the initiator supports it or over a
+ * bytestream of its own otherwise. Takes a ref on @transport if it
+ * succeeds. */
+static gboolean
+start_connection (GabbleTubeStream *self,
+                  GibberTransport *transport,
+                  GError **error)
+{
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+
+  if (priv->mux != NULL)
+    {
+      if (open_mux_connection (self, transport))
+        return TRUE;
+    }
+  else if (!priv->mux_negotiating && peer_supports_mux (self))
+    {
+      if (send_stream_initiation (self, TRUE, mux_bytestream_negotiate_cb,
+            NULL, NULL))
+        priv->mux_negotiating = TRUE;
+      else
+        priv->mux_refused = TRUE;
+    }
+
+  if (priv->mux_negotiating)
+    {
+      priv->mux_pending = g_slist_append (priv->mux_pending,
+          g_object_ref (transport));
+      return TRUE;
+    }
+
+  return start_stream_initiation (self, transport, error);
+}
+
 static gboolean
 tube_stream_open (GabbleTubeStream *self,
                   GError **error)
@@ -1135,6 +1961,11 @@ gabble_tube_stream_init (GabbleTubeStream *self)
       g_direct_equal, NULL, NULL);
   priv->last_connection_id = 0;
 
+  priv->mux_connections = g_hash_table_new_full (g_direct_hash,
+      g_direct_equal, NULL, (GDestroyNotify) mux_connection_free);
+  priv->transport_to_mux_connection = g_hash_table_new (g_direct_hash,
+      g_direct_equal);
+
   priv->address_type = TP_SOCKET_ADDRESS_TYPE_UNIX;
   priv->address = NULL;
   priv->access_control = TP_SOCKET_ACCESS_CONTROL_LOCALHOST;
@@ -1212,6 +2043,9 @@ gabble_tube_stream_dispose (GObject *object)
   tp_clear_pointer (&priv->transport_to_bytestream, g_hash_table_destroy);
   tp_clear_pointer (&priv->bytestream_to_transport, g_hash_table_destroy);
   tp_clear_pointer (&priv->transport_to_id, g_hash_table_destroy);
+  tp_clear_pointer (&priv->transport_to_mux_connection,
+      g_hash_table_destroy);
+  tp_clear_pointer (&priv->mux_connections, g_hash_table_destroy);
 
   tp_handle_unref (contact_repo, priv->initiator);
 
@@ -1762,6 +2596,7 @@ data_received_cb (GabbleBytestreamIface *bytestream,
   GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (tube);
   GibberTransport *transport;
   GError *error = NULL;
+  gsize buffered;
 
   transport = g_hash_table_lookup (priv->bytestream_to_transport, bytestream);
   g_assert (transport != NULL);
@@ -1782,12 +2617,31 @@ data_received_cb (GabbleBytestreamIface *bytestream,
     return;
   }
 
-  if (!gibber_transport_buffer_is_empty (transport))
+  buffered = gibber_transport_get_buffered_bytes (transport);
+
+  if (buffered > CONNECTION_MAX_BUFFERED)
     {
-      /* We don't want to send more data while the buffer isn't empty */
-      DEBUG ("tube buffer isn't empty. Block the bytestream");
+      /* The peer has ignored our blocking the bytestream for too long.
+       * Disconnecting the transport drops what it has queued. */
+      DEBUG ("%" G_GSIZE_FORMAT " bytes queued for the local socket, over "
+          "the limit of %u. Close the connection", buffered,
+          CONNECTION_MAX_BUFFERED);
+
+      g_object_ref (bytestream);
+      fire_connection_closed (tube, transport, TP_ERROR_STR_CONNECTION_LOST,
+          "remote end sent too much data for the local socket");
+      remove_transport (tube, bytestream, transport);
+      gabble_bytestream_iface_close (bytestream, NULL);
+      g_object_unref (bytestream);
+    }
+  else if (gibber_transport_buffer_is_full (transport))
+    {
+      /* We don't want to send more data until the buffer has drained */
+      DEBUG ("%" G_GSIZE_FORMAT " bytes queued for the local socket. Block "
+          "the bytestream", buffered);
       gabble_bytestream_iface_block_reading (bytestream, TRUE);
     }
+
   g_object_unref (transport);
 }
 
@@ -1891,6 +2745,9 @@ gabble_tube_stream_close (GabbleTubeIface *tube, gboolean closed_remotely)
   g_hash_table_foreach_remove (priv->bytestream_to_transport,
       close_each_extra_bytestream, self);
 
+  drop_pending_connections (self);
+  close_mux (self, TRUE, TP_ERROR_STR_CANCELLED, "tube is closing");
+
   if (!closed_remotely && priv->handle_type == TP_HANDLE_TYPE_CONTACT)
     {
       LmMessage *msg;
@@ -1972,16 +2829,7 @@ gabble_tube_stream_add_bytestream (GabbleTubeIface *tube,
   transport = new_connection_to_socket (self, bytestream, contact);
   if (transport != NULL)
     {
-      if (priv->state == TP_TUBE_CHANNEL_STATE_REMOTE_PENDING)
-        {
-          DEBUG ("Received first connection. Tube is now open");
-          priv->state = TP_TUBE_CHANNEL_STATE_OPEN;
-
-          tp_svc_channel_interface_tube_emit_tube_channel_state_changed (
-              self, TP_TUBE_CHANNEL_STATE_OPEN);
-
-          g_signal_emit (G_OBJECT (self), signals[OPENED], 0);
-        }
+      first_connection_received (self);
 
       DEBUG ("accept the extra bytestream");
 
@@ -2014,6 +2862,48 @@ gabble_tube_stream_add_bytestream (GabbleTubeIface *tube,
     }
 }
 
+/**
+ * gabble_tube_stream_add_mux_bytestream
+ *
+ * Accepts a bytestream the peer offered to carry all its connections to a
+ * 1-1 tube we offered; see tube-mux.c.
+ */
+void
+gabble_tube_stream_add_mux_bytestream (GabbleTubeStream *self,
+                                       GabbleBytestreamIface *bytestream)
+{
+  GabbleTubeStreamPrivate *priv = GABBLE_TUBE_STREAM_GET_PRIVATE (self);
+
+  if (priv->initiator != priv->self_handle ||
+      priv->handle_type != TP_HANDLE_TYPE_CONTACT)
+    {
+      DEBUG ("I'm not the initiator of this 1-1 tube, can't accept "
+          "a multiplexed bytestream");
+
+      gabble_bytestream_iface_close (bytestream, NULL);
+      return;
+    }
+
+  if (priv->mux_bytestream != NULL)
+    {
+      DEBUG ("we already have a multiplexed bytestream");
+
+      gabble_bytestream_iface_close (bytestream, NULL);
+      return;
+    }
+
+  first_connection_received (self);
+
+  DEBUG ("accept the multiplexed bytestream");
+
+  priv->mux_bytestream = g_object_ref (bytestream);
+
+  g_signal_connect (bytestream, "state-changed",
+      G_CALLBACK (mux_bytestream_state_changed_cb), self);
+
+  gabble_bytestream_iface_accept (bytestream, augment_si_accept_iq, self);
+}
+
 #ifdef GIBBER_TYPE_UNIX_TRANSPORT
 static gboolean
 check_unix_params (TpSocketAddressType address_type,
@@ -1312,6 +1312,17 @@ gabble_tubes_channel_bytestream_offered (GabbleTubesChannel *self,
 
   DEBUG ("received new bytestream request for existing tube: %u", tube_id);
 
+  if (priv->handle_type == TP_HANDLE_TYPE_CONTACT &&
+      GABBLE_IS_TUBE_STREAM (tube) &&
+      !tp_strdiff (lm_message_node_get_attribute (stream_node, "mux"),
+        "true"))
+    {
+      /* One bytestream for all the peer's connections to this tube */
+      gabble_tube_stream_add_mux_bytestream (GABBLE_TUBE_STREAM (tube),
+          bytestream);
+      return;
+    }
+
   gabble_tube_iface_add_bytestream (tube, bytestream);
 }
 
@@ -1490,3 +1490,98 @@ gabble_simple_async_countdown_dec (GSimpleAsyncResult *simple)
       g_object_unref (simple);
     }
 }
+
+/**
+ * gabble_collect_be32:
+ * @str: at least 4 bytes
+ *
+ * Returns: the big-endian 32-bit integer at the start of @str, which need
+ *  not be aligned
+ */
+guint32
+gabble_collect_be32 (const gchar *str)
+{
+  const guchar *bytes = (const guchar *) str;
+
+  return ((guint32) bytes[0] << 24) | ((guint32) bytes[1] << 16) |
+      ((guint32) bytes[2] << 8) | (guint32) bytes[3];
+}
+
+/**
+ * gabble_time_val_elapsed_ms:
+ * @since: a time from g_get_current_time ()
+ *
+ * Returns: the number of milliseconds since @since, or 0 if the wall clock
+ *  has gone backwards since then
+ */
+guint
+gabble_time_val_elapsed_ms (const GTimeVal *since)
+{
+  GTimeVal now;
+  glong ms;
+
+  g_get_current_time (&now);
+  ms = (now.tv_sec - since->tv_sec) * 1000 +
+      (now.tv_usec - since->tv_usec) / 1000;
+
+  return (guint) MAX (ms, 0);
+}
+
+/**
+ * gabble_samples_add:
+ * @samples: a #GabbleSamples, initially zero-filled
+ * @value: a new measurement
+ *
+ * Remembers @value, forgetting the oldest sample if @samples is full.
+ */
+void
+gabble_samples_add (GabbleSamples *samples,
+    guint value)
+{
+  samples->values[samples->next] = value;
+  samples->next = (samples->next + 1) % GABBLE_SAMPLES_SIZE;
+  samples->n_values = MIN (samples->n_values + 1, GABBLE_SAMPLES_SIZE);
+}
+
+static int
+compare_guint (gconstpointer a,
+    gconstpointer b)
+{
+  guint x = *(const guint *) a;
+  guint y = *(const guint *) b;
+
+  return (x > y) - (x < y);
+}
+
+/**
+ * gabble_samples_get_percentiles:
+ * @samples: a #GabbleSamples
+ * @p50: (out): the median of @samples
+ * @p90: (out): the 90th percentile of @samples
+ * @p99: (out): the 99th percentile of @samples
+ *
+ * Sets the percentiles of the samples remembered by @samples, or sets them
+ * all to 0 if there aren't any.
+ */
+void
+gabble_samples_get_percentiles (const GabbleSamples *samples,
+    guint *p50,
+    guint *p90,
+    guint *p99)
+{
+  guint sorted[GABBLE_SAMPLES_SIZE];
+  guint n = samples->n_values;
+
+  if (n == 0)
+    {
+      *p50 = *p90 = *p99 = 0;
+      return;
+    }
+
+  memcpy (sorted, samples->values, n * sizeof (guint));
+  qsort (sorted, n, sizeof (guint), compare_guint);
+
+  *p50 = sorted[(n - 1) * 50 / 100];
+  *p90 = sorted[(n - 1) * 90 / 100];
+  *p99 = sorted[(n - 1) * 99 / 100];
+}
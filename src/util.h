@@ -141,4 +141,23 @@ GSimpleAsyncResult *gabble_simple_async_countdown_new (gpointer self,
 void gabble_simple_async_countdown_inc (GSimpleAsyncResult *simple);
 void gabble_simple_async_countdown_dec (GSimpleAsyncResult *simple);
 
+guint32 gabble_collect_be32 (const gchar *str);
+
+guint gabble_time_val_elapsed_ms (const GTimeVal *since);
+
+/* How many of the most recent samples a GabbleSamples remembers */
+#define GABBLE_SAMPLES_SIZE 256
+
+/* The most recent measurements of something, such as round-trip times, for
+ * debugging statistics */
+typedef struct {
+    guint values[GABBLE_SAMPLES_SIZE];
+    guint n_values;
+    guint next;
+} GabbleSamples;
+
+void gabble_samples_add (GabbleSamples *samples, guint value);
+void gabble_samples_get_percentiles (const GabbleSamples *samples,
+    guint *p50, guint *p90, guint *p99);
+
 #endif /* __GABBLE_UTIL_H__ */
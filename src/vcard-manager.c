@@ -35,8 +35,11 @@
 #include "connection.h"
 #include "debug.h"
 #include "namespaces.h"
+#include "presence.h"
+#include "presence-cache.h"
 #include "request-pipeline.h"
 #include "util.h"
+#include "vcard-store.h"
 
 static guint default_request_timeout = 180;
 #define VCARD_CACHE_ENTRY_TTL 60
@@ -46,6 +49,19 @@ static guint default_request_timeout = 180;
  * the same recipient */
 static guint request_wait_delay = 5 * 60;
 
+/* Requests for vCards are not sent as soon as they're made: they are collected
+ * for up to VCARD_BATCH_DELAY milliseconds, so that a burst of requests from
+ * the Avatars, Aliasing and ContactInfo interfaces (for instance, when a
+ * client has just fetched the roster) costs one <iq/> per contact, then handed
+ * to the request pipeline most urgent first, at most VCARD_BATCH_SIZE per
+ * VCARD_BATCH_DELAY. */
+#define VCARD_BATCH_DELAY 50
+#define VCARD_BATCH_SIZE 32
+
+/* Alias changes found in a batch are reported together when the whole batch
+ * has been answered, or after this many milliseconds if that takes longer */
+#define VCARD_BATCH_REPORT_DELAY 1000
+
 static const gchar *NO_ALIAS = "none";
 
 typedef struct {
@@ -101,6 +117,7 @@ struct _GabbleVCardManagerEditInfo {
 enum
 {
     NICKNAME_UPDATE,
+    NICKNAMES_UPDATE,
     VCARD_UPDATE,
     GOT_SELF_INITIAL_AVATAR,
     LAST_SIGNAL
@@ -155,14 +172,28 @@ struct _GabbleVCardManagerPrivate
    * got confirmation yet. We don't want to store it in cache (visible
    * to others) before we're sure the server accepts it. */
   LmMessageNode *patched_vcard;
+
+  /* Contacts' vCards from previous connections, or NULL if the persistent
+   * store is disabled. Opened the first time we need it, because we don't
+   * know our own JID (which it's keyed by) when we're constructed. */
+  GabbleVCardStore *store;
+  gboolean store_opened;
+
+  /* Cache entries whose <iq/> hasn't been given to the request pipeline yet,
+   * one queue per GabbleRequestPipelinePriority; borrowed from @cache */
+  GQueue unsent[GABBLE_REQUEST_PIPELINE_N_PRIORITIES];
+
+  /* Source which will next move entries from @unsent to the pipeline, or 0 */
+  guint flush_id;
+  gboolean flush_is_idle;
 };
 
 struct _GabbleVCardManagerRequest
 {
   GabbleVCardManager *manager;
   GabbleVCardCacheEntry *entry;
-  guint timer_id;
   guint timeout;
+  GabbleRequestPipelinePriority priority;
 
   GabbleVCardManagerCb callback;
   gpointer user_data;
@@ -181,11 +212,28 @@ struct _GabbleVCardManagerEditRequest
   gboolean set_in_pipeline;
 };
 
+/* A set of <iq/>s handed to the pipeline together. */
+typedef struct
+{
+  GabbleVCardManager *manager;
+
+  /* Number of entries in the batch whose <iq/> hasn't been answered yet */
+  guint outstanding;
+
+  /* Contacts whose alias changed, which we haven't reported yet */
+  TpHandleSet *changed;
+
+  /* Timer which runs out when we stop waiting for the rest of the batch
+   * before reporting @changed */
+  guint report_id;
+} VCardBatch;
+
 /* An entry in the vCard cache. These exist only as long as:
  *
  * 1) the cached message which has not yet expired; and/or
- * 2) a network request is in the pipeline; and/or
- * 3) there are requests pending.
+ * 2) a network request is queued or in the pipeline; and/or
+ * 3) the persistent store is being checked; and/or
+ * 4) there are requests pending.
  */
 struct _GabbleVCardCacheEntry
 {
@@ -195,9 +243,28 @@ struct _GabbleVCardCacheEntry
   /* Referenced handle */
   TpHandle handle;
 
+  /* Our link in priv->unsent[priority] if we're waiting to send an
+   * <iq type="get">, or NULL */
+  GList *unsent_link;
+
+  /* The most urgent priority and shortest timeout of the pending requests,
+   * as of when the <iq/> was queued or the store lookup started */
+  GabbleRequestPipelinePriority priority;
+  guint timeout;
+
   /* Pipeline item for our <iq type="get"> if one is in progress */
   GabbleRequestPipelineItem *pipeline_item;
 
+  /* TRUE while we're looking for a stored vCard, before asking the server;
+   * @store_checked is set once we've looked */
+  gboolean store_lookup;
+  gboolean store_checked;
+
+  /* The batch @pipeline_item was sent in, and the timer after which we give
+   * up on it */
+  VCardBatch *batch;
+  guint timer_id;
+
   /* List of (GabbleVCardManagerRequest *) borrowed from priv->requests */
   GSList *pending_requests;
 
@@ -236,8 +303,8 @@ static void cache_entry_free (void *data);
 static gint cache_entry_compare (gconstpointer a, gconstpointer b);
 static void manager_patch_vcard (
     GabbleVCardManager *self, LmMessageNode *vcard_node);
-static void request_send (GabbleVCardManagerRequest *request,
-    guint timeout);
+static void request_send (GabbleVCardManagerRequest *request);
+static GabbleVCardStore *manager_get_store (GabbleVCardManager *self);
 
 static void
 gabble_vcard_manager_init (GabbleVCardManager *obj)
@@ -245,6 +312,8 @@ gabble_vcard_manager_init (GabbleVCardManager *obj)
   GabbleVCardManagerPrivate *priv =
      G_TYPE_INSTANCE_GET_PRIVATE (obj, GABBLE_TYPE_VCARD_MANAGER,
          GabbleVCardManagerPrivate);
+  guint i;
+
   obj->priv = priv;
 
   priv->cache = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
@@ -255,6 +324,9 @@ gabble_vcard_manager_init (GabbleVCardManager *obj)
 
   priv->have_self_avatar = FALSE;
   priv->edits = NULL;
+
+  for (i = 0; i < GABBLE_REQUEST_PIPELINE_N_PRIORITIES; i++)
+    g_queue_init (&priv->unsent[i]);
 }
 
 static void gabble_vcard_manager_set_property (GObject *object,
@@ -298,6 +370,13 @@ gabble_vcard_manager_class_init (GabbleVCardManagerClass *cls)
         0, NULL, NULL, g_cclosure_marshal_VOID__UINT,
         G_TYPE_NONE, 1, G_TYPE_UINT);
 
+  /* Emitted instead of nickname-update for contacts whose vCards were
+   * fetched in the same batch; the argument is a GArray of TpHandle */
+  signals[NICKNAMES_UPDATE] = g_signal_new ("nicknames-update",
+        G_TYPE_FROM_CLASS (cls), G_SIGNAL_RUN_LAST,
+        0, NULL, NULL, g_cclosure_marshal_VOID__POINTER,
+        G_TYPE_NONE, 1, G_TYPE_POINTER);
+
   signals[VCARD_UPDATE] = g_signal_new ("vcard-update",
         G_TYPE_FROM_CLASS (cls), G_SIGNAL_RUN_LAST,
         0, NULL, NULL, g_cclosure_marshal_VOID__UINT,
@@ -377,6 +456,19 @@ cache_entry_free (gpointer data)
       cancel_request (entry->pending_requests->data);
     }
 
+  if (entry->unsent_link != NULL)
+    {
+      g_queue_delete_link (&priv->unsent[entry->priority],
+          entry->unsent_link);
+      entry->unsent_link = NULL;
+    }
+
+  if (entry->suspended_timer_id != 0)
+    {
+      g_source_remove (entry->suspended_timer_id);
+      entry->suspended_timer_id = 0;
+    }
+
   if (entry->pipeline_item)
     {
       gabble_request_pipeline_item_cancel (entry->pipeline_item);
@@ -449,6 +541,11 @@ cache_entry_attempt_to_free (GabbleVCardCacheEntry *entry)
   GabbleVCardManagerPrivate *priv = entry->manager->priv;
   TpBaseConnection *base = (TpBaseConnection *) priv->connection;
 
+  /* Everything is freed at once in dispose, and we mustn't modify @cache
+   * while it iterates over it */
+  if (priv->dispose_has_run)
+    return;
+
   if (entry->vcard_node != NULL)
     {
       DEBUG ("Not freeing vCard cache entry %p: it has a cached vCard %p",
@@ -463,6 +560,13 @@ cache_entry_attempt_to_free (GabbleVCardCacheEntry *entry)
       return;
     }
 
+  if (entry->store_lookup)
+    {
+      DEBUG ("Not freeing vCard cache entry %p: it's being looked up in the "
+          "store", entry);
+      return;
+    }
+
   if (entry->pending_requests != NULL)
     {
       DEBUG ("Not freeing vCard cache entry %p: it has pending requests",
@@ -470,9 +574,12 @@ cache_entry_attempt_to_free (GabbleVCardCacheEntry *entry)
       return;
     }
 
-  /* If there is a suspended request, it must be in entry-> pending_requests
-   */
-  g_assert (entry->suspended_timer_id == 0);
+  if (entry->suspended_timer_id != 0)
+    {
+      DEBUG ("Not freeing vCard cache entry %p: its <iq> is suspended",
+          entry);
+      return;
+    }
 
   if (entry->handle == base->self_handle)
     {
@@ -508,6 +615,25 @@ gabble_vcard_manager_invalidate_cache (GabbleVCardManager *manager,
   cache_entry_attempt_to_free (entry);
 }
 
+/* Like gabble_vcard_manager_invalidate_cache (), but also forgets the vCard
+ * stored from previous connections, so the next request goes to the server. */
+void
+gabble_vcard_manager_invalidate_stored (GabbleVCardManager *manager,
+    TpHandle handle)
+{
+  GabbleVCardManagerPrivate *priv = manager->priv;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) priv->connection, TP_HANDLE_TYPE_CONTACT);
+  GabbleVCardStore *store = manager_get_store (manager);
+
+  g_return_if_fail (tp_handle_is_valid (contact_repo, handle, NULL));
+
+  if (store != NULL)
+    gabble_vcard_store_remove (store, tp_handle_inspect (contact_repo, handle));
+
+  gabble_vcard_manager_invalidate_cache (manager, handle);
+}
+
 static void complete_one_request (GabbleVCardManagerRequest *request,
     LmMessageNode *vcard_node, GError *error);
 
@@ -554,6 +680,13 @@ disconnect_entry_foreach (gpointer handle, gpointer value, gpointer unused)
       entry->suspended_timer_id = 0;
     }
 
+  if (entry->unsent_link != NULL)
+    {
+      g_queue_delete_link (&entry->manager->priv->unsent[entry->priority],
+          entry->unsent_link);
+      entry->unsent_link = NULL;
+    }
+
   cache_entry_complete_requests (entry, &err);
 
   if (entry->pipeline_item)
@@ -587,6 +720,12 @@ gabble_vcard_manager_dispose (GObject *object)
   if (priv->cache_timer)
       g_source_remove (priv->cache_timer);
 
+  if (priv->flush_id != 0)
+    {
+      g_source_remove (priv->flush_id);
+      priv->flush_id = 0;
+    }
+
   g_hash_table_foreach (priv->cache, disconnect_entry_foreach, NULL);
 
   tp_heap_destroy (priv->timed_cache);
@@ -597,6 +736,8 @@ gabble_vcard_manager_dispose (GObject *object)
 
   cancel_all_edit_requests (self);
 
+  tp_clear_pointer (&priv->store, gabble_vcard_store_free);
+
   if (G_OBJECT_CLASS (gabble_vcard_manager_parent_class)->dispose)
     G_OBJECT_CLASS (gabble_vcard_manager_parent_class)->dispose (object);
 }
@@ -715,7 +856,8 @@ status_changed_cb (GObject *object,
 
       /* FIXME: we happen to know that synchronous errors can't happen */
       gabble_vcard_manager_request (self, base->self_handle, 0,
-          initial_request_cb, NULL, (GObject *) self);
+          GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL, initial_request_cb, NULL,
+          (GObject *) self);
     }
 }
 
@@ -769,28 +911,22 @@ delete_request (GabbleVCardManagerRequest *request)
           request);
     }
 
-  if (0 != request->timer_id)
-    {
-      g_source_remove (request->timer_id);
-    }
-
   g_slice_free (GabbleVCardManagerRequest, request);
 }
 
 static gboolean
 timeout_request (gpointer data)
 {
-  GabbleVCardManagerRequest *request = (GabbleVCardManagerRequest *) data;
+  GabbleVCardCacheEntry *entry = data;
 
   g_return_val_if_fail (data != NULL, FALSE);
-  DEBUG ("Request %p timed out, notifying callback %p",
-         request, request->callback);
+  DEBUG ("<iq> for cache entry %p timed out, notifying its requests", entry);
 
-  request->timer_id = 0;
+  entry->timer_id = 0;
 
   /* The pipeline machinery will call our callback with the error "canceled"
    */
-  gabble_request_pipeline_item_cancel (request->entry->pipeline_item);
+  gabble_request_pipeline_item_cancel (entry->pipeline_item);
 
   return FALSE;
 }
@@ -825,11 +961,14 @@ extract_nickname (LmMessageNode *vcard_node)
   return g_strdup (nick);
 }
 
+/* If @batch is not NULL, an alias change is saved to be reported with the
+ * rest of the batch rather than signalled straight away. */
 static void
 observe_vcard (GabbleConnection *conn,
                GabbleVCardManager *manager,
                TpHandle handle,
-               LmMessageNode *vcard_node)
+               LmMessageNode *vcard_node,
+               VCardBatch *batch)
 {
   TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
       (TpBaseConnection *) conn, TP_HANDLE_TYPE_CONTACT);
@@ -884,8 +1023,156 @@ observe_vcard (GabbleConnection *conn,
           gabble_vcard_manager_cache_quark (), (gchar *) NO_ALIAS, NULL);
     }
 
-  if ((old_alias != NULL) || (alias != NULL))
-      g_signal_emit (G_OBJECT (manager), signals[NICKNAME_UPDATE], 0, handle);
+  if ((old_alias == NULL) && (alias == NULL))
+    return;
+
+  if (batch != NULL)
+    tp_handle_set_add (batch->changed, handle);
+  else
+    g_signal_emit (G_OBJECT (manager), signals[NICKNAME_UPDATE], 0, handle);
+}
+
+/* Takes ownership of @vcard_node */
+static void
+cache_entry_set_vcard (GabbleVCardManager *self,
+    GabbleVCardCacheEntry *entry,
+    LmMessageNode *vcard_node)
+{
+  GabbleVCardManagerPrivate *priv = self->priv;
+
+  if (entry->vcard_node != NULL)
+    {
+      tp_heap_remove (priv->timed_cache, entry);
+      lm_message_node_unref (entry->vcard_node);
+    }
+
+  entry->vcard_node = vcard_node;
+
+  entry->expires = time (NULL) + VCARD_CACHE_ENTRY_TTL;
+  tp_heap_add (priv->timed_cache, entry);
+  if (priv->cache_timer == 0)
+    {
+      GabbleVCardCacheEntry *first =
+          tp_heap_peek_first (priv->timed_cache);
+
+      priv->cache_timer = g_timeout_add_seconds (
+          first->expires - time (NULL), cache_entry_timeout, self);
+    }
+}
+
+static GabbleVCardStore *
+manager_get_store (GabbleVCardManager *self)
+{
+  GabbleVCardManagerPrivate *priv = self->priv;
+  TpBaseConnection *base = (TpBaseConnection *) priv->connection;
+
+  if (!priv->store_opened && base->self_handle != 0)
+    {
+      TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+          TP_HANDLE_TYPE_CONTACT);
+
+      priv->store = gabble_vcard_store_new (
+          tp_handle_inspect (contact_repo, base->self_handle));
+      priv->store_opened = TRUE;
+    }
+
+  return priv->store;
+}
+
+/* Save a contact's vCard, which we've just received, for next time */
+static void
+store_vcard (GabbleVCardManager *self,
+    TpHandle handle,
+    LmMessageNode *vcard_node)
+{
+  TpBaseConnection *base = (TpBaseConnection *) self->priv->connection;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+      TP_HANDLE_TYPE_CONTACT);
+  GabbleVCardStore *store;
+  gchar *sha1;
+
+  /* Our own vCard can be edited, so we always fetch it afresh */
+  if (handle == base->self_handle)
+    return;
+
+  store = manager_get_store (self);
+
+  if (store == NULL)
+    return;
+
+  sha1 = vcard_get_avatar_sha1 (vcard_node);
+  gabble_vcard_store_insert (store, tp_handle_inspect (contact_repo, handle),
+      vcard_node, sha1);
+  g_free (sha1);
+}
+
+static void cache_entry_queue (GabbleVCardCacheEntry *entry,
+    GabbleRequestPipelinePriority priority);
+
+static void
+store_lookup_cb (GabbleVCardStore *store,
+    LmMessageNode *vcard_node,
+    gpointer user_data)
+{
+  GabbleVCardCacheEntry *entry = user_data;
+  GabbleVCardManager *self = entry->manager;
+
+  entry->store_lookup = FALSE;
+
+  if (vcard_node != NULL)
+    {
+      DEBUG ("found stored vCard for handle %u", entry->handle);
+      cache_entry_set_vcard (self, entry, lm_message_node_ref (vcard_node));
+      observe_vcard (self->priv->connection, self, entry->handle,
+          entry->vcard_node, NULL);
+      cache_entry_complete_requests (entry, NULL);
+    }
+  else if (entry->pending_requests != NULL)
+    {
+      DEBUG ("no usable stored vCard for handle %u, queueing the <iq>",
+          entry->handle);
+      cache_entry_queue (entry, entry->priority);
+    }
+
+  cache_entry_attempt_to_free (entry);
+}
+
+/* If we haven't done so yet, starts looking for a vCard stored for @entry's
+ * contact on a previous connection, and returns TRUE; the <iq> is only queued
+ * if there isn't one. */
+static gboolean
+cache_entry_lookup_stored (GabbleVCardCacheEntry *entry)
+{
+  GabbleVCardManager *self = entry->manager;
+  GabbleVCardManagerPrivate *priv = self->priv;
+  TpBaseConnection *base = (TpBaseConnection *) priv->connection;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+      TP_HANDLE_TYPE_CONTACT);
+  GabbleVCardStore *store;
+  GabblePresence *presence;
+
+  if (entry->store_checked)
+    return FALSE;
+
+  entry->store_checked = TRUE;
+
+  if (entry->handle == base->self_handle ||
+      base->status != TP_CONNECTION_STATUS_CONNECTED)
+    return FALSE;
+
+  store = manager_get_store (self);
+
+  if (store == NULL)
+    return FALSE;
+
+  presence = gabble_presence_cache_get (priv->connection->presence_cache,
+      entry->handle);
+  entry->store_lookup = TRUE;
+  gabble_vcard_store_lookup (store,
+      tp_handle_inspect (contact_repo, entry->handle),
+      presence != NULL ? presence->avatar_sha1 : NULL,
+      store_lookup_cb, entry);
+  return TRUE;
 }
 
 /* Called when a pre-set get request failed, or when a set request succeeded
@@ -927,7 +1214,8 @@ replace_reply_cb (GabbleConnection *conn,
       priv->patched_vcard = NULL;
 
       /* observe it so we pick up alias updates */
-      observe_vcard (conn, self, base->self_handle, entry->vcard_node);
+      observe_vcard (conn, self, base->self_handle, entry->vcard_node,
+          NULL);
 
       node = entry->vcard_node;
     }
@@ -1286,7 +1574,7 @@ manager_patch_vcard (GabbleVCardManager *self,
 
   priv->edit_pipeline_item = gabble_request_pipeline_enqueue (
       priv->connection->req_pipeline, msg, default_request_timeout,
-      replace_reply_cb, self);
+      GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE, replace_reply_cb, self);
 
   lm_message_unref (msg);
 
@@ -1309,15 +1597,110 @@ out:
 static gboolean
 suspended_request_timeout_cb (gpointer data)
 {
-  GabbleVCardManagerRequest *request = data;
+  GabbleVCardCacheEntry *entry = data;
+  GabbleRequestPipelinePriority priority =
+      GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND;
+  GSList *l;
+
+  entry->suspended_timer_id = 0;
+
+  if (entry->pending_requests == NULL)
+    {
+      cache_entry_attempt_to_free (entry);
+      return FALSE;
+    }
+
+  /* Send the <iq> again, as urgently as the requests made meanwhile need it */
+  entry->timeout = G_MAXUINT;
+
+  for (l = entry->pending_requests; l != NULL; l = l->next)
+    {
+      GabbleVCardManagerRequest *request = l->data;
+
+      priority = MIN (priority, request->priority);
+      entry->timeout = MIN (entry->timeout, request->timeout);
+    }
 
-  /* Send the request again */
-  request->entry->suspended_timer_id = 0;
-  request_send (request, request->timeout);
+  cache_entry_queue (entry, priority);
 
   return FALSE;
 }
 
+static VCardBatch *
+vcard_batch_new (GabbleVCardManager *self)
+{
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) self->priv->connection, TP_HANDLE_TYPE_CONTACT);
+  VCardBatch *batch = g_slice_new0 (VCardBatch);
+
+  batch->manager = self;
+  batch->changed = tp_handle_set_new (contact_repo);
+  return batch;
+}
+
+static void
+vcard_batch_report (VCardBatch *batch)
+{
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) batch->manager->priv->connection,
+      TP_HANDLE_TYPE_CONTACT);
+  GArray *handles;
+
+  if (batch->report_id != 0)
+    {
+      g_source_remove (batch->report_id);
+      batch->report_id = 0;
+    }
+
+  if (tp_handle_set_size (batch->changed) == 0 ||
+      batch->manager->priv->dispose_has_run)
+    return;
+
+  handles = tp_handle_set_to_array (batch->changed);
+  DEBUG ("reporting %u alias changes", handles->len);
+
+  /* the handles are kept alive by @changed until it's destroyed */
+  g_signal_emit (batch->manager, signals[NICKNAMES_UPDATE], 0, handles);
+  g_array_free (handles, TRUE);
+
+  tp_handle_set_destroy (batch->changed);
+  batch->changed = tp_handle_set_new (contact_repo);
+}
+
+static gboolean
+vcard_batch_report_cb (gpointer data)
+{
+  VCardBatch *batch = data;
+
+  batch->report_id = 0;
+  vcard_batch_report (batch);
+  return FALSE;
+}
+
+/* Called when the <iq> of one entry in @batch has been answered, failed or
+ * been cancelled; @batch may be NULL. */
+static void
+vcard_batch_entry_done (VCardBatch *batch)
+{
+  if (batch == NULL)
+    return;
+
+  g_assert (batch->outstanding > 0);
+  batch->outstanding--;
+
+  if (batch->outstanding == 0)
+    {
+      vcard_batch_report (batch);
+      tp_handle_set_destroy (batch->changed);
+      g_slice_free (VCardBatch, batch);
+    }
+  else if (batch->report_id == 0 && tp_handle_set_size (batch->changed) > 0)
+    {
+      batch->report_id = g_timeout_add (VCARD_BATCH_REPORT_DELAY,
+          vcard_batch_report_cb, batch);
+    }
+}
+
 static gboolean
 is_item_not_found (const GError *error)
 {
@@ -1332,14 +1715,14 @@ pipeline_reply_cb (GabbleConnection *conn,
                    gpointer user_data,
                    GError *error)
 {
-  GabbleVCardManagerRequest *request = user_data;
-  GabbleVCardCacheEntry *entry = request->entry;
+  GabbleVCardCacheEntry *entry = user_data;
   GabbleVCardManager *self = GABBLE_VCARD_MANAGER (entry->manager);
   GabbleVCardManagerPrivate *priv = self->priv;
   TpBaseConnection *base = (TpBaseConnection *) conn;
   TpHandleRepoIface *contact_repo =
       tp_base_connection_get_handles (base, TP_HANDLE_TYPE_CONTACT);
   LmMessageNode *vcard_node = NULL;
+  VCardBatch *batch = entry->batch;
 
   DEBUG("called for entry %p", entry);
 
@@ -1349,6 +1732,13 @@ pipeline_reply_cb (GabbleConnection *conn,
   g_assert (entry->suspended_timer_id == 0);
 
   entry->pipeline_item = NULL;
+  entry->batch = NULL;
+
+  if (entry->timer_id != 0)
+    {
+      g_source_remove (entry->timer_id);
+      entry->timer_id = 0;
+    }
 
   /* XEP-0054 says that the server MUST return <item-not-found/> if you have no
    * vCard set, so we should treat that case identically to the server
@@ -1378,12 +1768,10 @@ pipeline_reply_cb (GabbleConnection *conn,
               "trying againg in %u seconds", entry->handle,
               gabble_xmpp_error_string (xmpp_error), request_wait_delay);
 
-          g_source_remove (request->timer_id);
-          request->timer_id = 0;
-
           entry->suspended_timer_id = g_timeout_add_seconds (
-              request_wait_delay, suspended_request_timeout_cb, request);
+              request_wait_delay, suspended_request_timeout_cb, entry);
 
+          vcard_batch_entry_done (batch);
           return;
         }
 
@@ -1403,6 +1791,7 @@ pipeline_reply_cb (GabbleConnection *conn,
 
       /* Complete pending GET requests */
       cache_entry_complete_requests (entry, error);
+      vcard_batch_entry_done (batch);
       return;
     }
 
@@ -1424,18 +1813,8 @@ pipeline_reply_cb (GabbleConnection *conn,
     }
 
   /* Put the message in the cache */
-  entry->vcard_node = lm_message_node_ref (vcard_node);
-
-  entry->expires = time (NULL) + VCARD_CACHE_ENTRY_TTL;
-  tp_heap_add (priv->timed_cache, entry);
-  if (priv->cache_timer == 0)
-    {
-      GabbleVCardCacheEntry *first =
-          tp_heap_peek_first (priv->timed_cache);
-
-      priv->cache_timer = g_timeout_add_seconds (
-          first->expires - time (NULL), cache_entry_timeout, self);
-    }
+  cache_entry_set_vcard (self, entry, lm_message_node_ref (vcard_node));
+  store_vcard (self, entry->handle, vcard_node);
 
   /* We have freshly updated cache for our vCard, edit it if
    * there are any pending edits and no outstanding set request.
@@ -1446,10 +1825,11 @@ pipeline_reply_cb (GabbleConnection *conn,
     }
 
   /* Observe the vCard as it goes past */
-  observe_vcard (priv->connection, self, entry->handle, vcard_node);
+  observe_vcard (priv->connection, self, entry->handle, vcard_node, batch);
 
   /* Complete all pending requests successfully */
   cache_entry_complete_requests (entry, NULL);
+  vcard_batch_entry_done (batch);
 }
 
 static void
@@ -1461,57 +1841,187 @@ notify_delete_request (gpointer data, GObject *obj)
   delete_request (request);
 }
 
+/* Hands @entry's <iq> to the request pipeline as part of @batch */
 static void
-request_send (GabbleVCardManagerRequest *request, guint timeout)
+cache_entry_send (GabbleVCardCacheEntry *entry,
+    VCardBatch *batch)
 {
-  GabbleVCardCacheEntry *entry = request->entry;
   GabbleConnection *conn = entry->manager->priv->connection;
   TpBaseConnection *base = (TpBaseConnection *) conn;
   TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
       TP_HANDLE_TYPE_CONTACT);
+  const char *jid;
+  LmMessage *msg;
 
-  g_assert (request->timer_id == 0);
+  g_assert (entry->pipeline_item == NULL);
+  g_assert (entry->timer_id == 0);
 
-  if (entry->pipeline_item)
+  if (entry->handle == base->self_handle)
     {
-      DEBUG ("adding to cache entry %p with <iq> already pending", entry);
+      DEBUG ("Cache entry %p is my own, not setting @to", entry);
+      jid = NULL;
     }
-  else if (entry->suspended_timer_id != 0)
+  else
     {
-      DEBUG ("adding to cache entry %p with <iq> suspended", entry);
+      jid = tp_handle_inspect (contact_repo, entry->handle);
+      DEBUG ("Cache entry %p is not mine, @to = %s", entry, jid);
     }
-  else
+
+  msg = lm_message_build_with_sub_type (jid,
+      LM_MESSAGE_TYPE_IQ, LM_MESSAGE_SUB_TYPE_GET,
+      '(', "vCard", "",
+          '@', "xmlns", NS_VCARD_TEMP,
+      ')',
+      NULL);
+
+  entry->batch = batch;
+  batch->outstanding++;
+
+  entry->timer_id = g_timeout_add_seconds (entry->timeout, timeout_request,
+      entry);
+  entry->pipeline_item = gabble_request_pipeline_enqueue (
+      conn->req_pipeline, msg, entry->timeout, entry->priority,
+      pipeline_reply_cb, entry);
+
+  lm_message_unref (msg);
+}
+
+static gboolean flush_unsent_cb (gpointer data);
+
+static void
+schedule_flush (GabbleVCardManager *self,
+    gboolean urgent)
+{
+  GabbleVCardManagerPrivate *priv = self->priv;
+  guint i;
+
+  for (i = 0; i < GABBLE_REQUEST_PIPELINE_N_PRIORITIES; i++)
     {
-      const char *jid;
-      LmMessage *msg;
+      if (!g_queue_is_empty (&priv->unsent[i]))
+        break;
+    }
 
-      request->timer_id =
-          g_timeout_add_seconds (request->timeout, timeout_request, request);
+  if (i == GABBLE_REQUEST_PIPELINE_N_PRIORITIES)
+    return;
 
-      if (entry->handle == base->self_handle)
-        {
-          DEBUG ("Cache entry %p is my own, not setting @to", entry);
-          jid = NULL;
-        }
-      else
+  if (priv->flush_id != 0)
+    {
+      if (!urgent || priv->flush_is_idle)
+        return;
+
+      g_source_remove (priv->flush_id);
+    }
+
+  priv->flush_is_idle = urgent;
+
+  if (urgent)
+    priv->flush_id = g_idle_add (flush_unsent_cb, self);
+  else
+    priv->flush_id = g_timeout_add (VCARD_BATCH_DELAY, flush_unsent_cb, self);
+}
+
+static gboolean
+flush_unsent_cb (gpointer data)
+{
+  GabbleVCardManager *self = data;
+  GabbleVCardManagerPrivate *priv = self->priv;
+  TpBaseConnection *base = (TpBaseConnection *) priv->connection;
+  VCardBatch *batch = NULL;
+  guint i;
+
+  priv->flush_id = 0;
+
+  /* if we've been disconnected, dispose will fail whatever is left */
+  if (base->status != TP_CONNECTION_STATUS_CONNECTED)
+    return FALSE;
+
+  for (i = 0; i < GABBLE_REQUEST_PIPELINE_N_PRIORITIES; i++)
+    {
+      GabbleVCardCacheEntry *entry;
+
+      while ((batch == NULL || batch->outstanding < VCARD_BATCH_SIZE) &&
+          (entry = g_queue_pop_head (&priv->unsent[i])) != NULL)
         {
-          jid = tp_handle_inspect (contact_repo, entry->handle);
-          DEBUG ("Cache entry %p is not mine, @to = %s", entry, jid);
+          entry->unsent_link = NULL;
+
+          if (batch == NULL)
+            batch = vcard_batch_new (self);
+
+          cache_entry_send (entry, batch);
         }
+    }
 
-      msg = lm_message_build_with_sub_type (jid,
-          LM_MESSAGE_TYPE_IQ, LM_MESSAGE_SUB_TYPE_GET,
-          '(', "vCard", "",
-              '@', "xmlns", NS_VCARD_TEMP,
-          ')',
-          NULL);
+  if (batch != NULL)
+    DEBUG ("sent a batch of %u vCard requests", batch->outstanding);
 
-      entry->pipeline_item = gabble_request_pipeline_enqueue (
-          conn->req_pipeline, msg, timeout, pipeline_reply_cb, request);
+  /* Anything left over waits for the next batch, however urgent it is, so
+   * we don't flood the pipeline */
+  schedule_flush (self, FALSE);
 
-      lm_message_unref (msg);
+  return FALSE;
+}
+
+/* Queues an <iq> for @entry, or makes its queued <iq> more urgent */
+static void
+cache_entry_queue (GabbleVCardCacheEntry *entry,
+    GabbleRequestPipelinePriority priority)
+{
+  GabbleVCardManagerPrivate *priv = entry->manager->priv;
+
+  if (entry->unsent_link != NULL)
+    {
+      if (priority >= entry->priority)
+        return;
+
+      g_queue_delete_link (&priv->unsent[entry->priority],
+          entry->unsent_link);
+    }
+
+  entry->priority = priority;
+  g_queue_push_tail (&priv->unsent[priority], entry);
+  entry->unsent_link = g_queue_peek_tail_link (&priv->unsent[priority]);
+
+  schedule_flush (entry->manager,
+      priority == GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE);
+}
+
+static void
+request_send (GabbleVCardManagerRequest *request)
+{
+  GabbleVCardCacheEntry *entry = request->entry;
+
+  if (entry->pipeline_item)
+    {
+      DEBUG ("adding to cache entry %p with <iq> already pending", entry);
+      gabble_request_pipeline_item_raise_priority (entry->pipeline_item,
+          request->priority);
+    }
+  else if (entry->suspended_timer_id != 0)
+    {
+      DEBUG ("adding to cache entry %p with <iq> suspended", entry);
+    }
+  else if (entry->store_lookup)
+    {
+      DEBUG ("adding to cache entry %p being looked up in the store", entry);
+
+      entry->priority = MIN (entry->priority, request->priority);
+      entry->timeout = MIN (entry->timeout, request->timeout);
+    }
+  else if (entry->unsent_link == NULL && cache_entry_lookup_stored (entry))
+    {
+      DEBUG ("adding request to cache entry %p and checking the store",
+          entry);
+
+      entry->priority = request->priority;
+      entry->timeout = request->timeout;
+    }
+  else
+    {
+      if (entry->unsent_link == NULL || request->timeout < entry->timeout)
+        entry->timeout = request->timeout;
 
       DEBUG ("adding request to cache entry %p and queueing the <iq>", entry);
+      cache_entry_queue (entry, request->priority);
     }
 }
 
@@ -1530,12 +2040,16 @@ request_send (GabbleVCardManagerRequest *request, guint timeout)
  * FIXME: the timeout is not always obeyed when there is already a request
  *        on the same handle. It should perhaps be removed.
  *
+ * @priority says how urgently the vCard is needed; if a request for the same
+ * handle is already queued with a lower priority, it is promoted.
+ *
  * The connection must be connected.
  */
 GabbleVCardManagerRequest *
 gabble_vcard_manager_request (GabbleVCardManager *self,
                               TpHandle handle,
                               guint timeout,
+                              GabbleRequestPipelinePriority priority,
                               GabbleVCardManagerCb callback,
                               gpointer user_data,
                               GObject *object)
@@ -1558,6 +2072,7 @@ gabble_vcard_manager_request (GabbleVCardManager *self,
   request = g_slice_new0 (GabbleVCardManagerRequest);
   DEBUG ("Created request %p to retrieve <%u>'s vCard", request, handle);
   request->timeout = timeout;
+  request->priority = priority;
   request->manager = self;
   request->entry = entry;
   request->callback = callback;
@@ -1570,7 +2085,7 @@ gabble_vcard_manager_request (GabbleVCardManager *self,
   request->entry->pending_requests = g_slist_prepend
       (request->entry->pending_requests, request);
 
-  request_send (request, timeout);
+  request_send (request);
   return request;
 }
 
@@ -1607,8 +2122,8 @@ gabble_vcard_manager_edit (GabbleVCardManager *self,
     {
       DEBUG ("we don't, create one");
       /* create dummy GET request if neccessary */
-      gabble_vcard_manager_request (self, base->self_handle, 0, NULL,
-          NULL, NULL);
+      gabble_vcard_manager_request (self, base->self_handle, 0,
+          GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE, NULL, NULL, NULL);
     }
 
   priv->edits = g_list_concat (priv->edits, edits);
@@ -25,6 +25,7 @@
 #include <glib-object.h>
 #include <loudmouth/loudmouth.h>
 
+#include "request-pipeline.h"
 #include "types.h"
 
 G_BEGIN_DECLS
@@ -101,6 +102,7 @@ GQuark gabble_vcard_manager_cache_quark (void);
 GabbleVCardManagerRequest *gabble_vcard_manager_request (GabbleVCardManager *,
                                                        TpHandle,
                                                        guint timeout,
+                                                       GabbleRequestPipelinePriority priority,
                                                        GabbleVCardManagerCb,
                                                        gpointer user_data,
                                                        GObject *object);
@@ -117,6 +119,7 @@ gboolean gabble_vcard_manager_get_cached (GabbleVCardManager *,
                                           TpHandle,
                                           LmMessageNode **);
 void gabble_vcard_manager_invalidate_cache (GabbleVCardManager *, TpHandle);
+void gabble_vcard_manager_invalidate_stored (GabbleVCardManager *, TpHandle);
 
 typedef void (*GabbleVCardManagerEditCb)(GabbleVCardManager *self,
                                          GabbleVCardManagerEditRequest *request,
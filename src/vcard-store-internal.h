@@ -0,0 +1,33 @@
+/*
+ * vcard-store-internal.h - implementation details of vcard-store.c shared
+ *                          with the tests
+ *
+ * Copyright (C) 2011 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __VCARD_STORE_INTERNAL_H__
+#define __VCARD_STORE_INTERNAL_H__
+
+#include <gio/gio.h>
+
+#include "vcard-store.h"
+
+void vcard_store_write_file (GFile *directory, const gchar *name,
+    GString *contents);
+guint vcard_store_writes_in_flight (void);
+
+#endif /* __VCARD_STORE_INTERNAL_H__ */
@@ -0,0 +1,879 @@
+/*
+ * vcard-store.c - Persistent vCard store
+ *
+ * Copyright (C) 2011 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Contacts' vCards are kept on disk between connections, one file per
+ * contact, so that we don't have to download every avatar again each time we
+ * connect. An index file records, for each stored vCard, the SHA-1 of its
+ * avatar and when it was stored; a stored vCard is only used if that matches
+ * the hash the contact currently advertises in their presence, or, if they
+ * haven't advertised one, if it was stored recently.
+ *
+ * Nothing here blocks the main loop on the disk, apart from creating the
+ * directory when the store is opened. The index is read once, when the store
+ * is opened; lookups made before it has been read wait for it. vCards are
+ * read when they're looked up. Changes are written back in batches, every
+ * WRITE_DELAY seconds and when the store is freed; writes still in progress
+ * then are allowed to finish. Each file has at most one write in progress, so
+ * that an older write can't finish after a newer one; if it changes again
+ * meanwhile, only its latest contents are written next.
+ *
+ * The store lives in $XDG_CACHE_HOME/telepathy/gabble/vcards/, with a
+ * subdirectory per account. It can be moved by setting GABBLE_VCARD_CACHE to
+ * a directory, or disabled by setting it to ":memory:".
+ */
+
+#include "config.h"
+#include "vcard-store.h"
+#include "vcard-store-internal.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <gio/gio.h>
+#include <telepathy-glib/util.h>
+#include <wocky/wocky-node-tree.h>
+#include <wocky/wocky-xmpp-reader.h>
+#include <wocky/wocky-xmpp-writer.h>
+
+#define DEBUG_FLAG GABBLE_DEBUG_VCARD
+
+#include "debug.h"
+#include "util.h"
+
+#define STORE_VERSION 2
+#define INDEX_FILE "index"
+#define INDEX_GROUP "gabble-vcard-store"
+
+/* How long a stored vCard is used for if the contact hasn't told us the hash
+ * of their current avatar, in seconds */
+#define UNVERIFIED_MAX_AGE (24 * 60 * 60)
+
+/* vCards bigger than this (which can only be because of a huge PHOTO) are
+ * not stored */
+#define MAX_VCARD_SIZE (512 * 1024)
+
+/* How long changes are held back so that they're written together, in
+ * seconds */
+#define WRITE_DELAY 5
+
+typedef struct {
+    /* the hash of the avatar in the stored vCard, "" for none */
+    gchar *avatar_sha1;
+    /* when it was stored, in seconds since the epoch */
+    gint64 stored;
+} IndexEntry;
+
+typedef struct {
+    GabbleVCardStore *store;
+    gchar *jid;
+    gchar *avatar_sha1;
+    GabbleVCardStoreLookupCb callback;
+    gpointer user_data;
+    /* the vCard to report, if we already know the answer */
+    LmMessageNode *vcard;
+} Lookup;
+
+struct _GabbleVCardStore
+{
+  GFile *directory;
+  WockyXmppWriter *writer;
+
+  /* owned file name (the SHA-1 of the JID) -> owned IndexEntry */
+  GHashTable *index;
+  gboolean index_loaded;
+  gboolean index_dirty;
+
+  /* owned file name -> owned GString with the vCard to write, or NULL if
+   * the file should be emptied */
+  GHashTable *unwritten;
+  guint write_id;
+
+  /* Lookups waiting for the index to be read, and lookups whose answer is
+   * waiting to be delivered from @deliver_id */
+  GQueue waiting;
+  GQueue ready;
+  guint deliver_id;
+
+  /* cancelled when the store is freed, to abandon reads in progress */
+  GCancellable *cancellable;
+};
+
+static void
+index_entry_free (gpointer p)
+{
+  IndexEntry *entry = p;
+
+  g_free (entry->avatar_sha1);
+  g_slice_free (IndexEntry, entry);
+}
+
+static void
+string_free (gpointer p)
+{
+  if (p != NULL)
+    g_string_free (p, TRUE);
+}
+
+static void
+lookup_free (Lookup *lookup)
+{
+  tp_clear_pointer (&lookup->vcard, lm_message_node_unref);
+  g_free (lookup->jid);
+  g_free (lookup->avatar_sha1);
+  g_slice_free (Lookup, lookup);
+}
+
+static gchar *
+get_base_directory (void)
+{
+  const gchar *path = g_getenv ("GABBLE_VCARD_CACHE");
+
+  if (path == NULL)
+    return g_build_filename (g_get_user_cache_dir (), "telepathy", "gabble",
+        "vcards", NULL);
+
+  if (path[0] == '\0' || !tp_strdiff (path, ":memory:"))
+    return NULL;
+
+  return g_strdup (path);
+}
+
+static gchar *
+get_name (const gchar *jid)
+{
+  return sha1_hex (jid, strlen (jid));
+}
+
+static void
+parse_index (GabbleVCardStore *store,
+    const gchar *contents,
+    gsize length)
+{
+  GKeyFile *file = g_key_file_new ();
+  GError *error = NULL;
+  gchar **groups;
+  guint i;
+
+  if (!g_key_file_load_from_data (file, contents, length, G_KEY_FILE_NONE,
+        &error))
+    {
+      DEBUG ("couldn't parse the index, starting afresh: %s", error->message);
+      g_clear_error (&error);
+      goto out;
+    }
+
+  if (g_key_file_get_integer (file, INDEX_GROUP, "version", NULL) !=
+      STORE_VERSION)
+    {
+      DEBUG ("index is from another version, starting afresh");
+      goto out;
+    }
+
+  groups = g_key_file_get_groups (file, NULL);
+
+  for (i = 0; groups[i] != NULL; i++)
+    {
+      IndexEntry *entry;
+      gchar *stored;
+
+      if (!tp_strdiff (groups[i], INDEX_GROUP) ||
+          /* our own changes since the store was opened win */
+          g_hash_table_lookup (store->index, groups[i]) != NULL ||
+          g_hash_table_lookup_extended (store->unwritten, groups[i], NULL,
+              NULL))
+        continue;
+
+      entry = g_slice_new0 (IndexEntry);
+      entry->avatar_sha1 = g_key_file_get_string (file, groups[i],
+          "avatar-sha1", NULL);
+
+      /* g_key_file_get_int64 () needs GLib 2.26 */
+      stored = g_key_file_get_value (file, groups[i], "stored", NULL);
+      if (stored != NULL)
+        entry->stored = g_ascii_strtoll (stored, NULL, 10);
+      g_free (stored);
+
+      if (entry->avatar_sha1 == NULL)
+        {
+          index_entry_free (entry);
+          continue;
+        }
+
+      g_hash_table_insert (store->index, g_strdup (groups[i]), entry);
+    }
+
+  g_strfreev (groups);
+
+  DEBUG ("%u stored vCards", g_hash_table_size (store->index));
+
+out:
+  g_key_file_free (file);
+}
+
+static void lookup_start (Lookup *lookup);
+static GString *get_writing (GFile *directory, const gchar *name);
+
+static void
+index_loaded_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  GabbleVCardStore *store = user_data;
+  gchar *contents = NULL;
+  gsize length;
+  GError *error = NULL;
+  Lookup *lookup;
+
+  if (!g_file_load_contents_finish (G_FILE (source), result, &contents,
+        &length, NULL, &error))
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          /* the store has been freed */
+          g_error_free (error);
+          return;
+        }
+
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        DEBUG ("couldn't read the index: %s", error->message);
+
+      g_clear_error (&error);
+    }
+  else
+    {
+      parse_index (store, contents, length);
+      g_free (contents);
+    }
+
+  store->index_loaded = TRUE;
+
+  while ((lookup = g_queue_pop_head (&store->waiting)) != NULL)
+    lookup_start (lookup);
+}
+
+/**
+ * gabble_vcard_store_new:
+ * @account: the bare JID of the local user
+ *
+ * Returns: a new store for vCards seen by @account, or %NULL if the
+ *  persistent store is disabled or can't be used
+ */
+GabbleVCardStore *
+gabble_vcard_store_new (const gchar *account)
+{
+  GabbleVCardStore *store;
+  gchar *base, *account_hash, *path;
+  GFile *index_file;
+  GString *writing;
+
+  g_return_val_if_fail (account != NULL, NULL);
+
+  base = get_base_directory ();
+
+  if (base == NULL)
+    {
+      DEBUG ("persistent vCard store disabled");
+      return NULL;
+    }
+
+  account_hash = sha1_hex (account, strlen (account));
+  path = g_build_filename (base, account_hash, NULL);
+  g_free (account_hash);
+  g_free (base);
+
+  /* GLib doesn't have an asynchronous version of this before 2.38; it's
+   * only done once per connection, and usually finds the directory already
+   * exists */
+  if (g_mkdir_with_parents (path, 0700) != 0)
+    {
+      DEBUG ("couldn't create %s, not storing vCards: %s", path,
+          g_strerror (errno));
+      g_free (path);
+      return NULL;
+    }
+
+  store = g_slice_new0 (GabbleVCardStore);
+  store->directory = g_file_new_for_path (path);
+  store->writer = wocky_xmpp_writer_new_no_stream ();
+  store->index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      index_entry_free);
+  store->unwritten = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      string_free);
+  g_queue_init (&store->waiting);
+  g_queue_init (&store->ready);
+  store->cancellable = g_cancellable_new ();
+
+  writing = get_writing (store->directory, INDEX_FILE);
+
+  if (writing != NULL)
+    {
+      /* a store we've just freed is still writing it, so what's on disk is
+       * out of date */
+      parse_index (store, writing->str, writing->len);
+      store->index_loaded = TRUE;
+    }
+  else
+    {
+      index_file = g_file_get_child (store->directory, INDEX_FILE);
+      g_file_load_contents_async (index_file, store->cancellable,
+          index_loaded_cb, store);
+      g_object_unref (index_file);
+    }
+
+  DEBUG ("storing vCards in %s", path);
+  g_free (path);
+  return store;
+}
+
+/* Owns the data being written to a file, which must stay alive until the
+ * write has finished; writes don't need the store, so they can outlive it */
+typedef struct {
+    GFile *file;
+    /* owned, and the key in writes_in_flight */
+    gchar *path;
+    GString *contents;
+    /* what to write once this write has finished, or NULL */
+    GString *pending;
+} Write;
+
+/* owned Write, keyed by its path; NULL until something is written */
+static GHashTable *writes_in_flight = NULL;
+
+static void
+write_free (gpointer p)
+{
+  Write *write = p;
+
+  g_object_unref (write->file);
+  g_free (write->path);
+  string_free (write->contents);
+  string_free (write->pending);
+  g_slice_free (Write, write);
+}
+
+static void write_done_cb (GObject *source, GAsyncResult *result,
+    gpointer user_data);
+
+static void
+write_start (Write *write)
+{
+  g_file_replace_contents_async (write->file, write->contents->str,
+      write->contents->len, NULL, FALSE, G_FILE_CREATE_PRIVATE, NULL,
+      write_done_cb, write);
+}
+
+static void
+write_done_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  Write *write = user_data;
+  GError *error = NULL;
+
+  if (!g_file_replace_contents_finish (G_FILE (source), result, NULL,
+        &error))
+    {
+      DEBUG ("couldn't write %s: %s", write->path, error->message);
+      g_clear_error (&error);
+    }
+
+  g_string_free (write->contents, TRUE);
+  write->contents = write->pending;
+  write->pending = NULL;
+
+  if (write->contents != NULL)
+    write_start (write);
+  else
+    g_hash_table_remove (writes_in_flight, write->path);
+}
+
+/**
+ * vcard_store_write_file:
+ * @directory: where to write
+ * @name: the name of the file in @directory
+ * @contents: what to write, which is freed when it has been written
+ *
+ * Starts replacing the contents of @name with @contents, or, if @name is
+ * already being written, arranges to do so once it has been, instead of any
+ * contents previously waiting for that.
+ */
+void
+vcard_store_write_file (GFile *directory,
+    const gchar *name,
+    GString *contents)
+{
+  GFile *file = g_file_get_child (directory, name);
+  gchar *path = g_file_get_path (file);
+  Write *write;
+
+  if (writes_in_flight == NULL)
+    writes_in_flight = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+        write_free);
+
+  write = g_hash_table_lookup (writes_in_flight, path);
+
+  if (write != NULL)
+    {
+      DEBUG ("%s is still being written; will write it again afterwards",
+          path);
+      string_free (write->pending);
+      write->pending = contents;
+      g_object_unref (file);
+      g_free (path);
+      return;
+    }
+
+  write = g_slice_new0 (Write);
+  write->file = file;
+  write->path = path;
+  write->contents = contents;
+  g_hash_table_insert (writes_in_flight, write->path, write);
+  write_start (write);
+}
+
+/**
+ * vcard_store_writes_in_flight:
+ *
+ * Returns: how many files are being written
+ */
+guint
+vcard_store_writes_in_flight (void)
+{
+  if (writes_in_flight == NULL)
+    return 0;
+
+  return g_hash_table_size (writes_in_flight);
+}
+
+/* Returns: a borrowed reference to the contents most recently given to
+ *  vcard_store_write_file () for @name if they haven't all been written yet,
+ *  or %NULL */
+static GString *
+get_writing (GFile *directory,
+    const gchar *name)
+{
+  GFile *file;
+  gchar *path;
+  Write *write;
+
+  if (writes_in_flight == NULL)
+    return NULL;
+
+  file = g_file_get_child (directory, name);
+  path = g_file_get_path (file);
+  write = g_hash_table_lookup (writes_in_flight, path);
+  g_object_unref (file);
+  g_free (path);
+
+  if (write == NULL)
+    return NULL;
+
+  return write->pending != NULL ? write->pending : write->contents;
+}
+
+static GString *
+serialize_index (GabbleVCardStore *store)
+{
+  GKeyFile *file = g_key_file_new ();
+  GHashTableIter iter;
+  gpointer key, value;
+  gchar *data;
+  gsize length;
+  GString *contents;
+
+  g_key_file_set_integer (file, INDEX_GROUP, "version", STORE_VERSION);
+
+  g_hash_table_iter_init (&iter, store->index);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      IndexEntry *entry = value;
+      gchar *stored = g_strdup_printf ("%" G_GINT64_FORMAT, entry->stored);
+
+      g_key_file_set_string (file, key, "avatar-sha1", entry->avatar_sha1);
+      g_key_file_set_value (file, key, "stored", stored);
+      g_free (stored);
+    }
+
+  data = g_key_file_to_data (file, &length, NULL);
+  contents = g_string_new_len (data, length);
+  g_free (data);
+  g_key_file_free (file);
+  return contents;
+}
+
+/* Starts writing everything which has changed */
+static void
+write_changes (GabbleVCardStore *store)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if (store->write_id != 0)
+    {
+      g_source_remove (store->write_id);
+      store->write_id = 0;
+    }
+
+  /* Until we've read the index, we don't know what else it should contain;
+   * we'll be called again once we have */
+  if (!store->index_loaded)
+    return;
+
+  DEBUG ("writing %u changed vCards",
+      g_hash_table_size (store->unwritten));
+
+  g_hash_table_iter_init (&iter, store->unwritten);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      /* emptying the file of a vCard we've forgotten */
+      if (value == NULL)
+        value = g_string_new ("");
+
+      vcard_store_write_file (store->directory, key, value);
+      g_hash_table_iter_steal (&iter);
+      g_free (key);
+    }
+
+  if (store->index_dirty)
+    {
+      vcard_store_write_file (store->directory, INDEX_FILE,
+          serialize_index (store));
+      store->index_dirty = FALSE;
+    }
+}
+
+static gboolean
+write_changes_cb (gpointer data)
+{
+  GabbleVCardStore *store = data;
+
+  store->write_id = 0;
+  write_changes (store);
+  return FALSE;
+}
+
+static void
+schedule_write (GabbleVCardStore *store)
+{
+  store->index_dirty = TRUE;
+
+  if (store->write_id == 0)
+    store->write_id = g_timeout_add_seconds (WRITE_DELAY, write_changes_cb,
+        store);
+}
+
+void
+gabble_vcard_store_free (GabbleVCardStore *store)
+{
+  Lookup *lookup;
+
+  if (store == NULL)
+    return;
+
+  if (store->index_loaded)
+    write_changes (store);
+  else if (store->write_id != 0)
+    /* we can't write the index without losing the entries we haven't read,
+     * so these changes are lost */
+    g_source_remove (store->write_id);
+
+  g_cancellable_cancel (store->cancellable);
+  g_object_unref (store->cancellable);
+
+  while ((lookup = g_queue_pop_head (&store->waiting)) != NULL)
+    lookup_free (lookup);
+
+  while ((lookup = g_queue_pop_head (&store->ready)) != NULL)
+    lookup_free (lookup);
+
+  if (store->deliver_id != 0)
+    g_source_remove (store->deliver_id);
+
+  g_hash_table_destroy (store->index);
+  g_hash_table_destroy (store->unwritten);
+  g_object_unref (store->writer);
+  g_object_unref (store->directory);
+  g_slice_free (GabbleVCardStore, store);
+}
+
+static LmMessageNode *
+parse_vcard (const gchar *jid,
+    const gchar *contents,
+    gsize length)
+{
+  WockyXmppReader *reader = wocky_xmpp_reader_new_no_stream ();
+  WockyStanza *stanza;
+  LmMessageNode *vcard = NULL;
+
+  wocky_xmpp_reader_push (reader, (const guint8 *) contents, length);
+  stanza = wocky_xmpp_reader_pop_stanza (reader);
+
+  if (stanza == NULL)
+    {
+      DEBUG ("couldn't parse stored vCard for %s", jid);
+    }
+  else
+    {
+      DEBUG ("using stored vCard for %s", jid);
+      vcard = lm_message_node_ref (wocky_stanza_get_top_node (stanza));
+      g_object_unref (stanza);
+    }
+
+  g_object_unref (reader);
+  return vcard;
+}
+
+static void
+lookup_deliver (Lookup *lookup)
+{
+  lookup->callback (lookup->store, lookup->vcard, lookup->user_data);
+  lookup_free (lookup);
+}
+
+static gboolean
+deliver_ready_cb (gpointer data)
+{
+  GabbleVCardStore *store = data;
+  Lookup *lookup;
+
+  store->deliver_id = 0;
+
+  /* callbacks may start new lookups, which wait for the next idle */
+  while ((lookup = g_queue_pop_head (&store->ready)) != NULL)
+    lookup_deliver (lookup);
+
+  return FALSE;
+}
+
+/* Reports @lookup's result, which we already know, from an idle, so that
+ * lookups never complete before gabble_vcard_store_lookup () returns */
+static void
+lookup_ready (Lookup *lookup)
+{
+  GabbleVCardStore *store = lookup->store;
+
+  g_queue_push_tail (&store->ready, lookup);
+
+  if (store->deliver_id == 0)
+    store->deliver_id = g_idle_add (deliver_ready_cb, store);
+}
+
+static void
+vcard_loaded_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  Lookup *lookup = user_data;
+  gchar *contents = NULL;
+  gsize length;
+  GError *error = NULL;
+
+  if (!g_file_load_contents_finish (G_FILE (source), result, &contents,
+        &length, NULL, &error))
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          /* the store has been freed */
+          g_error_free (error);
+          lookup_free (lookup);
+          return;
+        }
+
+      DEBUG ("couldn't read stored vCard for %s: %s", lookup->jid,
+          error->message);
+      g_clear_error (&error);
+    }
+  else
+    {
+      lookup->vcard = parse_vcard (lookup->jid, contents, length);
+      g_free (contents);
+    }
+
+  lookup_deliver (lookup);
+}
+
+static void
+lookup_start (Lookup *lookup)
+{
+  GabbleVCardStore *store = lookup->store;
+  gchar *name = get_name (lookup->jid);
+  IndexEntry *entry = g_hash_table_lookup (store->index, name);
+  GString *unwritten;
+  GFile *file;
+
+  if (entry == NULL)
+    goto not_found;
+
+  if (lookup->avatar_sha1 != NULL)
+    {
+      if (tp_strdiff (lookup->avatar_sha1, entry->avatar_sha1))
+        {
+          DEBUG ("stored vCard for %s has avatar '%s', but they advertise "
+              "'%s'", lookup->jid, entry->avatar_sha1, lookup->avatar_sha1);
+          goto not_found;
+        }
+    }
+  else if (time (NULL) - entry->stored >= UNVERIFIED_MAX_AGE)
+    {
+      DEBUG ("stored vCard for %s is too old to use without an avatar hash",
+          lookup->jid);
+      goto not_found;
+    }
+
+  unwritten = g_hash_table_lookup (store->unwritten, name);
+
+  if (unwritten == NULL)
+    unwritten = get_writing (store->directory, name);
+
+  if (unwritten != NULL)
+    {
+      /* we haven't written it yet, or haven't finished doing so */
+      lookup->vcard = parse_vcard (lookup->jid, unwritten->str,
+          unwritten->len);
+      goto not_found;
+    }
+
+  file = g_file_get_child (store->directory, name);
+  g_file_load_contents_async (file, store->cancellable, vcard_loaded_cb,
+      lookup);
+  g_object_unref (file);
+  g_free (name);
+  return;
+
+not_found:
+  lookup_ready (lookup);
+  g_free (name);
+}
+
+/**
+ * gabble_vcard_store_lookup:
+ * @store: a store
+ * @jid: a contact's bare JID
+ * @avatar_sha1: the hash of the avatar @jid currently advertises, "" if they
+ *  advertise having no avatar, or %NULL if we don't know
+ * @callback: called with a borrowed reference to the stored vCard for @jid,
+ *  or with %NULL if there is none or it's out of date
+ * @user_data: passed to @callback
+ *
+ * Looks for a stored vCard for @jid. @callback is always called from the
+ * main loop, never before this function returns; if @store is freed first,
+ * it is not called at all.
+ */
+void
+gabble_vcard_store_lookup (GabbleVCardStore *store,
+    const gchar *jid,
+    const gchar *avatar_sha1,
+    GabbleVCardStoreLookupCb callback,
+    gpointer user_data)
+{
+  Lookup *lookup;
+
+  g_return_if_fail (store != NULL);
+  g_return_if_fail (jid != NULL);
+  g_return_if_fail (callback != NULL);
+
+  lookup = g_slice_new0 (Lookup);
+  lookup->store = store;
+  lookup->jid = g_strdup (jid);
+  lookup->avatar_sha1 = g_strdup (avatar_sha1);
+  lookup->callback = callback;
+  lookup->user_data = user_data;
+
+  if (store->index_loaded)
+    lookup_start (lookup);
+  else
+    g_queue_push_tail (&store->waiting, lookup);
+}
+
+/**
+ * gabble_vcard_store_insert:
+ * @store: a store
+ * @jid: a contact's bare JID
+ * @vcard: their vCard
+ * @avatar_sha1: the hash of the avatar in @vcard, as returned by
+ *  vcard_get_avatar_sha1 ()
+ *
+ * Stores @vcard, replacing any vCard previously stored for @jid. It's
+ * written to disk with the next batch of changes.
+ */
+void
+gabble_vcard_store_insert (GabbleVCardStore *store,
+    const gchar *jid,
+    LmMessageNode *vcard,
+    const gchar *avatar_sha1)
+{
+  WockyNodeTree *tree;
+  const guint8 *data;
+  gsize length;
+  IndexEntry *entry;
+
+  g_return_if_fail (store != NULL);
+  g_return_if_fail (jid != NULL);
+  g_return_if_fail (vcard != NULL);
+  g_return_if_fail (avatar_sha1 != NULL);
+
+  tree = wocky_node_tree_new_from_node (vcard);
+  wocky_xmpp_writer_write_node_tree (store->writer, tree, &data, &length);
+
+  if (length > MAX_VCARD_SIZE)
+    {
+      DEBUG ("vCard for %s is %" G_GSIZE_FORMAT " bytes long, not storing it",
+          jid, length);
+      g_object_unref (tree);
+      gabble_vcard_store_remove (store, jid);
+      return;
+    }
+
+  entry = g_slice_new0 (IndexEntry);
+  entry->avatar_sha1 = g_strdup (avatar_sha1);
+  entry->stored = time (NULL);
+  g_hash_table_insert (store->index, get_name (jid), entry);
+
+  g_hash_table_insert (store->unwritten, get_name (jid),
+      g_string_new_len ((const gchar *) data, length));
+  g_object_unref (tree);
+
+  schedule_write (store);
+}
+
+/**
+ * gabble_vcard_store_remove:
+ * @store: a store
+ * @jid: a contact's bare JID
+ *
+ * Forgets any vCard stored for @jid.
+ */
+void
+gabble_vcard_store_remove (GabbleVCardStore *store,
+    const gchar *jid)
+{
+  gchar *name;
+
+  g_return_if_fail (store != NULL);
+  g_return_if_fail (jid != NULL);
+
+  name = get_name (jid);
+  g_hash_table_remove (store->index, name);
+  /* takes ownership of name */
+  g_hash_table_insert (store->unwritten, name, NULL);
+
+  schedule_write (store);
+}
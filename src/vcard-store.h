@@ -0,0 +1,46 @@
+/*
+ * vcard-store.h - Header for the persistent vCard store
+ *
+ * Copyright (C) 2011 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GABBLE_VCARD_STORE_H__
+#define __GABBLE_VCARD_STORE_H__
+
+#include <glib.h>
+#include <loudmouth/loudmouth.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GabbleVCardStore GabbleVCardStore;
+
+typedef void (*GabbleVCardStoreLookupCb) (GabbleVCardStore *store,
+    LmMessageNode *vcard, gpointer user_data);
+
+GabbleVCardStore *gabble_vcard_store_new (const gchar *account);
+void gabble_vcard_store_free (GabbleVCardStore *store);
+
+void gabble_vcard_store_lookup (GabbleVCardStore *store, const gchar *jid,
+    const gchar *avatar_sha1, GabbleVCardStoreLookupCb callback,
+    gpointer user_data);
+void gabble_vcard_store_insert (GabbleVCardStore *store, const gchar *jid,
+    LmMessageNode *vcard, const gchar *avatar_sha1);
+void gabble_vcard_store_remove (GabbleVCardStore *store, const gchar *jid);
+
+G_END_DECLS
+
+#endif /* __GABBLE_VCARD_STORE_H__ */
@@ -1,12 +1,16 @@
 
 #include "config.h"
 
-#include <stdio.h>
 #include <string.h>
 
 #include <glib-object.h>
 
 #include "src/base64.h"
+#include "src/base64-internal.h"
+
+/* Checks base64 against known vectors, then checks each implementation
+ * available here against the scalar one. Run with -m perf to also time each
+ * implementation. */
 
 struct test {
   gchar *str;
@@ -41,15 +45,113 @@ struct test tests[] = {
   { NULL, 0, NULL }
 };
 
-int
-main (void)
+static const struct {
+  Base64Implementation impl;
+  const gchar *name;
+} implementations[] = {
+  { BASE64_IMPLEMENTATION_SCALAR, "scalar" },
+  { BASE64_IMPLEMENTATION_SSSE3, "SSSE3" },
+  { BASE64_IMPLEMENTATION_AVX2, "AVX2" },
+};
+
+/* Checks the current implementation against the scalar one on random data of
+ * every length up to a few vector blocks, in one go and in random pieces */
+static void
+test_round_trips (GRand *rand)
+{
+  Base64Implementation impl = base64_get_implementation ();
+  guint max = 1024;
+  guchar *data = g_malloc (max);
+  gchar *encoded = g_malloc (BASE64_ENCODED_LEN (max) + 1);
+  gchar *expected = g_malloc (BASE64_ENCODED_LEN (max) + 1);
+  gchar *decoded = g_malloc (BASE64_DECODED_MAX_LEN (
+      BASE64_ENCODED_LEN (max)));
+  guint len, i;
+
+  for (i = 0; i < max; i++)
+    data[i] = g_rand_int_range (rand, 0, 256);
+
+  for (len = 0; len <= max; len++)
+    {
+      Base64Encoder encoder;
+      Base64Decoder decoder;
+      gsize encoded_len, done, step, written, total;
+      gboolean ok;
+      GString *str;
+      gchar *split;
+
+      base64_set_implementation (BASE64_IMPLEMENTATION_SCALAR);
+      base64_encode_into (len, (const gchar *) data, expected);
+      base64_set_implementation (impl);
+
+      encoded_len = base64_encode_into (len, (const gchar *) data, encoded);
+      g_assert (0 == strcmp (encoded, expected));
+
+      base64_encoder_init (&encoder);
+      written = 0;
+
+      for (done = 0; done < len; done += step)
+        {
+          step = g_rand_int_range (rand, 1, 64);
+          step = MIN (step, len - done);
+          written += base64_encoder_step (&encoder,
+              (const gchar *) data + done, step, encoded + written);
+        }
+
+      written += base64_encoder_finish (&encoder, encoded + written);
+      g_assert (written == encoded_len);
+      g_assert (0 == memcmp (encoded, expected, written));
+
+      base64_decoder_init (&decoder);
+      total = 0;
+
+      for (done = 0; done < encoded_len; done += step)
+        {
+          step = g_rand_int_range (rand, 1, 96);
+          step = MIN (step, encoded_len - done);
+          ok = base64_decoder_step (&decoder, expected + done, step,
+              decoded + total, &written);
+          g_assert (ok);
+          total += written;
+        }
+
+      ok = base64_decoder_finish (&decoder);
+      g_assert (ok);
+      g_assert (total == len);
+      g_assert (0 == memcmp (decoded, data, len));
+
+      /* line breaks make the vector code hand over to the scalar code */
+      split = base64_encode (len, (const gchar *) data, TRUE);
+      str = base64_decode (split);
+      g_assert (str != NULL);
+      g_assert (str->len == len);
+      g_assert (0 == memcmp (str->str, data, len));
+      g_string_free (str, TRUE);
+
+      /* and a bad character anywhere must be noticed */
+      if (encoded_len > 0)
+        {
+          split[g_rand_int_range (rand, 0, strlen (split))] = '*';
+          str = base64_decode (split);
+          g_assert (str == NULL);
+        }
+
+      g_free (split);
+    }
+
+  g_free (data);
+  g_free (encoded);
+  g_free (expected);
+  g_free (decoded);
+}
+
+static void
+test_vectors (void)
 {
   gchar *s;
   GString *tmp1, *tmp2;
   struct test *t;
 
-  g_type_init ();
-
   for (t = tests; t->str != NULL; t++)
     {
       if (t->len == 0)
@@ -59,6 +161,20 @@ main (void)
       g_free (s);
     }
 
+  /* encoding into a caller-supplied buffer never splits lines */
+  for (t = tests; t->str != NULL; t++)
+    {
+      gchar buf[128];
+      gchar *unsplit = base64_encode (t->len, t->str, FALSE);
+      gsize len = base64_encode_into (t->len, t->str, buf);
+
+      g_assert (len == BASE64_ENCODED_LEN (t->len));
+      g_assert (len == strlen (unsplit));
+      g_assert (0 == strcmp (buf, unsplit));
+      g_assert (strchr (buf, '\n') == NULL);
+      g_free (unsplit);
+    }
+
   /* test string with valid characters but invalid length */
   tmp1 = base64_decode ("AAA");
   g_assert (tmp1 == NULL);
@@ -100,7 +216,98 @@ main (void)
       g_string_free (tmp1, TRUE);
       g_string_free (tmp2, TRUE);
     }
+}
+
+static void
+test_implementations (void)
+{
+  GRand *rand = g_rand_new_with_seed (42);
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (implementations); i++)
+    {
+      if (base64_set_implementation (implementations[i].impl))
+        test_round_trips (rand);
+    }
+
+  g_rand_free (rand);
+  base64_set_implementation (BASE64_IMPLEMENTATION_AUTO);
+}
+
+/*
+ * throughput:
+ *
+ * Times encoding and decoding a few MiB with each implementation the CPU
+ * supports. Only run with -m perf.
+ */
+static void
+test_throughput (void)
+{
+  gsize len = 4 * 1024 * 1024;
+  guint rounds = 64, i, round;
+  gchar *data;
+  gchar *encoded;
+
+  if (!g_test_perf ())
+    return;
+
+  data = g_malloc (len);
+  encoded = g_malloc (BASE64_ENCODED_LEN (len) + 1);
+  memset (data, 'x', len);
+
+  for (i = 0; i < G_N_ELEMENTS (implementations); i++)
+    {
+      gsize encoded_len = 0;
+      gdouble rate;
+
+      if (!base64_set_implementation (implementations[i].impl))
+        continue;
+
+      g_test_timer_start ();
+
+      for (round = 0; round < rounds; round++)
+        encoded_len = base64_encode_into (len, data, encoded);
+
+      rate = rounds * (len / 1048576.) / g_test_timer_elapsed ();
+      g_test_maximized_result (rate, "%s: encode %.1f MiB/s",
+          implementations[i].name, rate);
+
+      g_test_timer_start ();
+
+      for (round = 0; round < rounds; round++)
+        {
+          Base64Decoder decoder;
+          gsize written;
+          gboolean ok;
+
+          base64_decoder_init (&decoder);
+          ok = base64_decoder_step (&decoder, encoded, encoded_len, data,
+              &written);
+          g_assert (ok);
+          g_assert (written == len);
+        }
+
+      rate = rounds * (len / 1048576.) / g_test_timer_elapsed ();
+      g_test_maximized_result (rate, "%s: decode %.1f MiB/s",
+          implementations[i].name, rate);
+    }
+
+  base64_set_implementation (BASE64_IMPLEMENTATION_AUTO);
+  g_free (data);
+  g_free (encoded);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_type_init ();
+
+  g_test_init (&argc, &argv, NULL);
+  g_test_add_func ("/base64/vectors", test_vectors);
+  g_test_add_func ("/base64/implementations", test_implementations);
+  g_test_add_func ("/base64/throughput", test_throughput);
 
-  return 0;
+  return g_test_run ();
 }
 
@@ -0,0 +1,286 @@
+
+#include "config.h"
+
+#include <glib-object.h>
+
+#include "src/capabilities.h"
+#include "src/capabilities-internal.h"
+#include "src/namespaces.h"
+
+/* Checks GabbleCapabilitySet, whichever way each of its features is stored:
+ * as a bit of its own, or by name once KNOWN_FEATURES_MAX of them have been
+ * seen. */
+
+#define FOO "http://example.com/foo"
+#define BAR "http://example.com/bar"
+
+static void
+count_cb (gpointer data,
+    gpointer user_data)
+{
+  guint *count = user_data;
+
+  (*count)++;
+}
+
+static guint
+count_features (const GabbleCapabilitySet *caps)
+{
+  guint count = 0;
+
+  gabble_capability_set_foreach (caps, count_cb, &count);
+  return count;
+}
+
+static void
+test_add_remove (void)
+{
+  GabbleCapabilitySet *caps = gabble_capability_set_new ();
+
+  g_assert_cmpint (gabble_capability_set_size (caps), ==, 0);
+  g_assert (!gabble_capability_set_has (caps, NS_GOOGLE_FEAT_VOICE));
+  g_assert (!gabble_capability_set_has (caps, FOO));
+
+  gabble_capability_set_add (caps, NS_GOOGLE_FEAT_VOICE);
+  gabble_capability_set_add (caps, FOO);
+  gabble_capability_set_add (caps, FOO);
+  g_assert_cmpint (gabble_capability_set_size (caps), ==, 2);
+  g_assert (gabble_capability_set_has (caps, NS_GOOGLE_FEAT_VOICE));
+  g_assert (gabble_capability_set_has (caps, FOO));
+  g_assert (!gabble_capability_set_has (caps, BAR));
+
+  /* quirks count towards the size, but aren't features */
+  gabble_capability_set_add (caps, QUIRK_OMITS_CONTENT_CREATORS);
+  g_assert_cmpint (gabble_capability_set_size (caps), ==, 3);
+  g_assert_cmpuint (count_features (caps), ==, 2);
+
+  g_assert (gabble_capability_set_remove (caps, NS_GOOGLE_FEAT_VOICE));
+  g_assert (!gabble_capability_set_remove (caps, NS_GOOGLE_FEAT_VOICE));
+  g_assert (!gabble_capability_set_remove (caps, BAR));
+  g_assert (!gabble_capability_set_has (caps, NS_GOOGLE_FEAT_VOICE));
+  g_assert (gabble_capability_set_has (caps, FOO));
+  g_assert_cmpint (gabble_capability_set_size (caps), ==, 2);
+
+  gabble_capability_set_clear (caps);
+  g_assert_cmpint (gabble_capability_set_size (caps), ==, 0);
+  g_assert (!gabble_capability_set_has (caps, FOO));
+
+  gabble_capability_set_free (caps);
+}
+
+static void
+test_equals (void)
+{
+  GabbleCapabilitySet *a = gabble_capability_set_new ();
+  GabbleCapabilitySet *b = gabble_capability_set_new ();
+
+  g_assert (gabble_capability_set_equals (a, b));
+
+  gabble_capability_set_add (a, NS_GOOGLE_FEAT_VOICE);
+  gabble_capability_set_add (a, FOO);
+  g_assert (!gabble_capability_set_equals (a, b));
+  g_assert (gabble_capability_set_at_least (a, b));
+  g_assert (!gabble_capability_set_at_least (b, a));
+
+  /* the order they're added in doesn't matter */
+  gabble_capability_set_add (b, FOO);
+  g_assert (!gabble_capability_set_equals (a, b));
+  gabble_capability_set_add (b, NS_GOOGLE_FEAT_VOICE);
+  g_assert (gabble_capability_set_equals (a, b));
+  g_assert (gabble_capability_set_equals (b, a));
+
+  /* nor does having had other features which have since been removed */
+  gabble_capability_set_add (b, BAR);
+  g_assert (!gabble_capability_set_equals (a, b));
+  gabble_capability_set_remove (b, BAR);
+  g_assert (gabble_capability_set_equals (a, b));
+
+  gabble_capability_set_remove (b, FOO);
+  gabble_capability_set_add (b, BAR);
+  g_assert (!gabble_capability_set_equals (a, b));
+  g_assert (gabble_capability_set_has_one (a, b));
+  g_assert (!gabble_capability_set_at_least (a, b));
+
+  gabble_capability_set_free (a);
+  gabble_capability_set_free (b);
+}
+
+#define N_UNKNOWN (KNOWN_FEATURES_MAX + 16)
+
+static gchar *
+unknown_feature (guint i)
+{
+  return g_strdup_printf ("http://example.com/unknown/%u", i);
+}
+
+static void
+test_unknown (void)
+{
+  GabbleCapabilitySet *forwards = gabble_capability_set_new ();
+  GabbleCapabilitySet *backwards = gabble_capability_set_new ();
+  GabbleCapabilitySet *some;
+  guint i;
+
+  /* more features than can have bits of their own, so the last ones
+   * are stored by name */
+  for (i = 0; i < N_UNKNOWN; i++)
+    {
+      gchar *feature = unknown_feature (i);
+
+      gabble_capability_set_add (forwards, feature);
+      g_free (feature);
+    }
+
+  g_assert_cmpint (gabble_capability_set_size (forwards), ==, N_UNKNOWN);
+  g_assert_cmpuint (count_features (forwards), ==, N_UNKNOWN);
+
+  for (i = N_UNKNOWN; i > 0; i--)
+    {
+      gchar *feature = unknown_feature (i - 1);
+
+      g_assert (gabble_capability_set_has (forwards, feature));
+      gabble_capability_set_add (backwards, feature);
+      g_free (feature);
+    }
+
+  g_assert (gabble_capability_set_equals (forwards, backwards));
+
+  /* our own features still have bits, and mix with the others */
+  gabble_capability_set_add (forwards, NS_GOOGLE_FEAT_VOICE);
+  g_assert (!gabble_capability_set_equals (forwards, backwards));
+  g_assert (gabble_capability_set_at_least (forwards, backwards));
+  g_assert_cmpint (gabble_capability_set_size (forwards), ==, N_UNKNOWN + 1);
+
+  /* features which were first seen after the bits ran out */
+  some = gabble_capability_set_new ();
+
+  for (i = N_UNKNOWN - 4; i < N_UNKNOWN; i++)
+    {
+      gchar *feature = unknown_feature (i);
+
+      gabble_capability_set_add (some, feature);
+      g_free (feature);
+    }
+
+  g_assert (gabble_capability_set_at_least (backwards, some));
+  g_assert (gabble_capability_set_has_one (backwards, some));
+
+  gabble_capability_set_exclude (backwards, some);
+  g_assert_cmpint (gabble_capability_set_size (backwards), ==, N_UNKNOWN - 4);
+  g_assert (!gabble_capability_set_has_one (backwards, some));
+
+  gabble_capability_set_intersect (forwards, some);
+  g_assert (gabble_capability_set_equals (forwards, some));
+
+  gabble_capability_set_update (forwards, backwards);
+  g_assert_cmpint (gabble_capability_set_size (forwards), ==, N_UNKNOWN);
+
+  gabble_capability_set_free (some);
+  gabble_capability_set_free (forwards);
+  gabble_capability_set_free (backwards);
+}
+
+/* Sets which are copies of each other share their contents until one of them
+ * is modified */
+static void
+test_copy_on_write (void)
+{
+  GabbleCapabilitySet *a = gabble_capability_set_new ();
+  GabbleCapabilitySet *b, *c, *d;
+  gchar *by_name = unknown_feature (N_UNKNOWN);
+  gchar *other_by_name = unknown_feature (N_UNKNOWN + 1);
+
+  /* /capabilities/unknown has used up all the bits, so these are stored by
+   * name */
+  gabble_capability_set_add (a, NS_GOOGLE_FEAT_VOICE);
+  gabble_capability_set_add (a, FOO);
+  gabble_capability_set_add (a, by_name);
+
+  b = gabble_capability_set_copy (a);
+  g_assert (gabble_capability_set_equals (a, b));
+
+  gabble_capability_set_add (b, BAR);
+  gabble_capability_set_add (b, other_by_name);
+  gabble_capability_set_remove (b, FOO);
+  gabble_capability_set_remove (b, by_name);
+  g_assert (gabble_capability_set_has (b, BAR));
+  g_assert (gabble_capability_set_has (b, other_by_name));
+  g_assert (!gabble_capability_set_has (b, FOO));
+  g_assert (!gabble_capability_set_has (b, by_name));
+
+  /* a hasn't changed */
+  g_assert_cmpint (gabble_capability_set_size (a), ==, 3);
+  g_assert (gabble_capability_set_has (a, FOO));
+  g_assert (gabble_capability_set_has (a, by_name));
+  g_assert (!gabble_capability_set_has (a, BAR));
+  g_assert (!gabble_capability_set_has (a, other_by_name));
+
+  /* nor does it when its copies are cleared, or have other sets excluded
+   * from, intersected with or added to them */
+  c = gabble_capability_set_copy (a);
+  gabble_capability_set_clear (c);
+  g_assert_cmpint (gabble_capability_set_size (c), ==, 0);
+  g_assert_cmpint (gabble_capability_set_size (a), ==, 3);
+
+  gabble_capability_set_free (c);
+  c = gabble_capability_set_copy (a);
+  gabble_capability_set_exclude (c, b);
+  g_assert_cmpint (gabble_capability_set_size (c), ==, 2);
+  g_assert_cmpint (gabble_capability_set_size (a), ==, 3);
+
+  gabble_capability_set_free (c);
+  c = gabble_capability_set_copy (a);
+  gabble_capability_set_intersect (c, b);
+  g_assert_cmpint (gabble_capability_set_size (c), ==, 1);
+  g_assert_cmpint (gabble_capability_set_size (a), ==, 3);
+
+  gabble_capability_set_free (c);
+  c = gabble_capability_set_copy (a);
+  gabble_capability_set_update (c, b);
+  g_assert_cmpint (gabble_capability_set_size (c), ==, 5);
+  g_assert_cmpint (gabble_capability_set_size (a), ==, 3);
+  g_assert (!gabble_capability_set_has (a, other_by_name));
+
+  /* updating an empty set shares the other set's contents, so neither
+   * set sees the other being modified afterwards */
+  d = gabble_capability_set_new ();
+  gabble_capability_set_update (d, a);
+  g_assert (gabble_capability_set_equals (a, d));
+  gabble_capability_set_add (a, BAR);
+  g_assert (!gabble_capability_set_has (d, BAR));
+  gabble_capability_set_remove (d, by_name);
+  g_assert (gabble_capability_set_has (a, by_name));
+
+  /* copies outlive the set they were copied from */
+  gabble_capability_set_free (a);
+  g_assert_cmpint (gabble_capability_set_size (c), ==, 5);
+  g_assert (gabble_capability_set_has (c, by_name));
+  g_assert_cmpint (gabble_capability_set_size (d), ==, 2);
+
+  gabble_capability_set_free (b);
+  gabble_capability_set_free (c);
+  gabble_capability_set_free (d);
+  g_free (other_by_name);
+  g_free (by_name);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  int ret;
+
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+  gabble_capabilities_init (NULL);
+
+  g_test_add_func ("/capabilities/add-remove", test_add_remove);
+  g_test_add_func ("/capabilities/equals", test_equals);
+  g_test_add_func ("/capabilities/unknown", test_unknown);
+  g_test_add_func ("/capabilities/copy-on-write", test_copy_on_write);
+
+  ret = g_test_run ();
+
+  gabble_capabilities_finalize (NULL);
+  return ret;
+}
@@ -0,0 +1,274 @@
+#include "config.h"
+
+#include <string.h>
+
+#include <dbus/dbus.h>
+#include <glib.h>
+
+#include "src/dbus-reassembler.h"
+
+/* Feeds streams of D-Bus messages to the reassembler in pieces of random
+ * sizes and checks that exactly the same messages come out. Run with -m perf
+ * to also measure how many small messages a second it gets through,
+ * demarshalling each one as tubes do. */
+
+typedef struct {
+    GPtrArray *expected;
+    guint next;
+} Checker;
+
+static GString *
+marshal_signal (guint i,
+    guint payload_length)
+{
+  DBusMessage *msg = dbus_message_new_signal ("/org/freedesktop/Telepathy",
+      "org.freedesktop.Telepathy.Test", "Ping");
+  gchar *payload = g_strnfill (payload_length, 'a' + i % 26);
+  dbus_uint32_t serial = i;
+  char *marshalled;
+  int len;
+  GString *ret;
+
+  g_assert (msg != NULL);
+  dbus_message_set_serial (msg, i + 1);
+  dbus_message_append_args (msg,
+      DBUS_TYPE_UINT32, &serial,
+      DBUS_TYPE_STRING, &payload,
+      DBUS_TYPE_INVALID);
+
+  if (!dbus_message_marshal (msg, &marshalled, &len))
+    g_assert_not_reached ();
+
+  ret = g_string_new_len (marshalled, len);
+
+  dbus_free (marshalled);
+  dbus_message_unref (msg);
+  g_free (payload);
+  return ret;
+}
+
+/* A message which libdbus wouldn't demarshal, but which is framed correctly,
+ * in the other endianness from the ones libdbus produces here */
+static GString *
+fake_big_endian (guint32 params,
+    guint32 body)
+{
+  guint32 padded = params + ((8 - (params % 8)) % 8);
+  GString *ret = g_string_new ("");
+  guint32 i;
+
+  g_string_append_c (ret, DBUS_BIG_ENDIAN);
+  g_string_append_len (ret, "\1\0\1", 3);
+  g_string_append_c (ret, body >> 24);
+  g_string_append_c (ret, (body >> 16) & 0xff);
+  g_string_append_c (ret, (body >> 8) & 0xff);
+  g_string_append_c (ret, body & 0xff);
+  g_string_append_len (ret, "\0\0\0\1", 4);
+  g_string_append_c (ret, params >> 24);
+  g_string_append_c (ret, (params >> 16) & 0xff);
+  g_string_append_c (ret, (params >> 8) & 0xff);
+  g_string_append_c (ret, params & 0xff);
+
+  for (i = 0; i < padded + body; i++)
+    g_string_append_c (ret, i & 0xff);
+
+  return ret;
+}
+
+static void
+check_message_cb (const gchar *data,
+    gsize len,
+    gpointer user_data)
+{
+  Checker *checker = user_data;
+  GString *expected;
+
+  g_assert (checker->next < checker->expected->len);
+  expected = g_ptr_array_index (checker->expected, checker->next);
+  g_assert (len == expected->len);
+  g_assert (0 == memcmp (data, expected->str, len));
+  checker->next++;
+}
+
+static void
+free_string (gpointer p)
+{
+  g_string_free (p, TRUE);
+}
+
+static void
+test_split_streams (void)
+{
+  GRand *rand = g_rand_new_with_seed (42);
+  GPtrArray *messages = g_ptr_array_new ();
+  GString *stream = g_string_new ("");
+  guint i, round;
+
+  for (i = 0; i < 200; i++)
+    {
+      GString *msg;
+
+      if (i % 17 == 0)
+        msg = fake_big_endian (g_rand_int_range (rand, 0, 40),
+            g_rand_int_range (rand, 0, 300));
+      else
+        msg = marshal_signal (i, g_rand_int_range (rand, 0, i * 10 + 1));
+
+      g_ptr_array_add (messages, msg);
+      g_string_append_len (stream, msg->str, msg->len);
+    }
+
+  /* pieces of up to 1, 2, 16... bytes, and up to the whole stream */
+  for (round = 0; round < 24; round++)
+    {
+      GabbleDBusReassembler *reassembler = gabble_dbus_reassembler_new ();
+      Checker checker = { messages, 0 };
+      gsize max = round < 20 ? (gsize) 1 << (round / 2) : stream->len;
+      gsize done, step;
+
+      for (done = 0; done < stream->len; done += step)
+        {
+          step = g_rand_int_range (rand, 1, max + 1);
+          step = MIN (step, stream->len - done);
+
+          if (!gabble_dbus_reassembler_push (reassembler, stream->str + done,
+                step, check_message_cb, &checker))
+            g_assert_not_reached ();
+        }
+
+      g_assert (checker.next == messages->len);
+      gabble_dbus_reassembler_free (reassembler);
+    }
+
+  g_ptr_array_foreach (messages, (GFunc) free_string, NULL);
+  g_ptr_array_free (messages, TRUE);
+  g_string_free (stream, TRUE);
+  g_rand_free (rand);
+}
+
+static void
+unexpected_message_cb (const gchar *data,
+    gsize len,
+    gpointer user_data)
+{
+  g_assert_not_reached ();
+}
+
+static void
+test_invalid (void)
+{
+  GabbleDBusReassembler *reassembler;
+  GString *msg;
+  gboolean ok;
+
+  /* not an endianness byte */
+  reassembler = gabble_dbus_reassembler_new ();
+  ok = gabble_dbus_reassembler_push (reassembler,
+      "x\1\0\1\0\0\0\0\0\0\0\1\0\0\0\0", 16, unexpected_message_cb, NULL);
+  g_assert (!ok);
+  gabble_dbus_reassembler_free (reassembler);
+
+  /* the same, split in the middle of the header */
+  reassembler = gabble_dbus_reassembler_new ();
+  ok = gabble_dbus_reassembler_push (reassembler, "x\1\0\1\0\0\0\0", 8,
+      unexpected_message_cb, NULL);
+  g_assert (ok);
+  ok = gabble_dbus_reassembler_push (reassembler, "\0\0\0\1\0\0\0\0", 8,
+      unexpected_message_cb, NULL);
+  g_assert (!ok);
+  gabble_dbus_reassembler_free (reassembler);
+
+  /* a body far too long to be valid */
+  msg = fake_big_endian (0, 0);
+  msg->str[4] = 0x7f;
+  reassembler = gabble_dbus_reassembler_new ();
+  ok = gabble_dbus_reassembler_push (reassembler, msg->str, msg->len,
+      unexpected_message_cb, NULL);
+  g_assert (!ok);
+  gabble_dbus_reassembler_free (reassembler);
+  g_string_free (msg, TRUE);
+
+  /* a header field array far too long to be valid */
+  msg = fake_big_endian (0, 0);
+  msg->str[12] = 0x7f;
+  reassembler = gabble_dbus_reassembler_new ();
+  ok = gabble_dbus_reassembler_push (reassembler, msg->str, msg->len,
+      unexpected_message_cb, NULL);
+  g_assert (!ok);
+  gabble_dbus_reassembler_free (reassembler);
+  g_string_free (msg, TRUE);
+}
+
+static void
+demarshal_cb (const gchar *data,
+    gsize len,
+    gpointer user_data)
+{
+  guint *count = user_data;
+  DBusMessage *msg = dbus_message_demarshal (data, len, NULL);
+
+  g_assert (msg != NULL);
+  dbus_message_unref (msg);
+  (*count)++;
+}
+
+/*
+ * throughput:
+ *
+ * Pushes 100000 small messages through in 4 KiB pieces, as a 1-1 tube
+ * receives them, and reports how many a second got through. Only run with
+ * -m perf.
+ */
+static void
+test_throughput (void)
+{
+  guint n_messages = 100000, count = 0, i;
+  GabbleDBusReassembler *reassembler;
+  GString *stream;
+  gsize done, step;
+  gdouble rate;
+
+  if (!g_test_perf ())
+    return;
+
+  reassembler = gabble_dbus_reassembler_new ();
+  stream = g_string_new ("");
+
+  for (i = 0; i < n_messages; i++)
+    {
+      GString *msg = marshal_signal (i, i % 32);
+
+      g_string_append_len (stream, msg->str, msg->len);
+      g_string_free (msg, TRUE);
+    }
+
+  g_test_timer_start ();
+
+  for (done = 0; done < stream->len; done += step)
+    {
+      step = MIN (4096, stream->len - done);
+
+      if (!gabble_dbus_reassembler_push (reassembler, stream->str + done,
+            step, demarshal_cb, &count))
+        g_assert_not_reached ();
+    }
+
+  rate = n_messages / g_test_timer_elapsed ();
+  g_assert (count == n_messages);
+  g_test_maximized_result (rate, "%.0f messages/s", rate);
+
+  g_string_free (stream, TRUE);
+  gabble_dbus_reassembler_free (reassembler);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+  g_test_add_func ("/dbus-reassembler/split-streams", test_split_streams);
+  g_test_add_func ("/dbus-reassembler/invalid", test_invalid);
+  g_test_add_func ("/dbus-reassembler/throughput", test_throughput);
+
+  return g_test_run ();
+}
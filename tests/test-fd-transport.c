@@ -0,0 +1,439 @@
+#include "config.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <glib-object.h>
+
+#include <gibber/gibber-fd-transport.h>
+
+/* Pushes data through a GibberFdTransport to a peer on the other end of a
+ * socketpair and back, and from one transport to another, checking that it
+ * arrives intact, that buffer-drained drives the writer, that buffer-empty
+ * means empty and the buffer is accounted for, that the read budget stops
+ * when receiving is blocked and that splicing gets everything across.
+ * Run with -m perf to also measure throughput. */
+
+typedef struct {
+  GMainLoop *loop;
+  GibberTransport *transport;
+  int peer;
+  gsize total;
+  gsize sent;
+  gsize received;
+  guint buffer_drained;
+  guint buffer_empty;
+  gboolean corrupt;
+} Test;
+
+static guint8
+pattern (gsize offset)
+{
+  return offset % 251;
+}
+
+static void
+send_some (Test *t)
+{
+  guint8 buf[4096];
+
+  while (t->sent < t->total &&
+      !gibber_transport_buffer_is_full (t->transport))
+    {
+      /* vary the size of the sends so that chunks get partially filled */
+      gsize len = MIN ((t->sent % sizeof (buf)) + 1, t->total - t->sent);
+      gsize i;
+      gboolean ok;
+
+      for (i = 0; i < len; i++)
+        buf[i] = pattern (t->sent + i);
+
+      ok = gibber_transport_send (t->transport, buf, len, NULL);
+      g_assert (ok);
+      t->sent += len;
+    }
+
+  /* a full buffer has something in it */
+  g_assert (t->sent == t->total ||
+      gibber_transport_get_buffered_bytes (t->transport) > 0);
+}
+
+static void
+buffer_drained_cb (GibberTransport *transport,
+    Test *t)
+{
+  t->buffer_drained++;
+  g_assert (!gibber_transport_buffer_is_full (transport));
+  send_some (t);
+}
+
+static void
+buffer_empty_cb (GibberTransport *transport,
+    Test *t)
+{
+  t->buffer_empty++;
+  g_assert (gibber_transport_buffer_is_empty (transport));
+  g_assert (gibber_transport_get_buffered_bytes (transport) == 0);
+}
+
+static gboolean
+peer_readable_cb (GIOChannel *source,
+    GIOCondition condition,
+    gpointer user_data)
+{
+  Test *t = user_data;
+  guint8 buf[65536];
+  ssize_t n, i;
+
+  n = read (t->peer, buf, sizeof (buf));
+
+  if (n < 0 && errno == EAGAIN)
+    return TRUE;
+
+  g_assert (n > 0);
+
+  for (i = 0; i < n; i++)
+    {
+      if (buf[i] != pattern (t->received + i))
+        t->corrupt = TRUE;
+    }
+
+  t->received += n;
+  g_assert (t->received <= t->total);
+
+  if (t->received == t->total)
+    {
+      g_main_loop_quit (t->loop);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+run (gsize total,
+    guint high_watermark,
+    guint low_watermark)
+{
+  Test t = { NULL, };
+  int fds[2];
+  GIOChannel *channel;
+  int ret;
+
+  ret = socketpair (AF_UNIX, SOCK_STREAM, 0, fds);
+  g_assert (ret == 0);
+
+  t.loop = g_main_loop_new (NULL, FALSE);
+  t.total = total;
+  t.peer = fds[1];
+  t.transport = g_object_new (GIBBER_TYPE_FD_TRANSPORT,
+      "high-watermark", high_watermark,
+      "low-watermark", low_watermark,
+      NULL);
+  gibber_fd_transport_set_fd (GIBBER_FD_TRANSPORT (t.transport), fds[0],
+      TRUE);
+  g_signal_connect (t.transport, "buffer-drained",
+      G_CALLBACK (buffer_drained_cb), &t);
+  g_signal_connect (t.transport, "buffer-empty",
+      G_CALLBACK (buffer_empty_cb), &t);
+
+  gibber_socket_set_nonblocking (t.peer);
+  channel = g_io_channel_unix_new (t.peer);
+  g_io_add_watch (channel, G_IO_IN, peer_readable_cb, &t);
+
+  send_some (&t);
+  g_main_loop_run (t.loop);
+
+  g_assert (!t.corrupt);
+  g_assert (t.sent == total);
+  g_assert (t.received == total);
+  g_assert (t.buffer_drained > 0);
+  g_assert (t.buffer_empty > 0);
+  g_assert (gibber_transport_buffer_is_empty (t.transport));
+  g_assert (!gibber_transport_buffer_is_full (t.transport));
+  g_assert (gibber_transport_get_buffered_bytes (t.transport) == 0);
+
+  gibber_transport_disconnect (t.transport);
+  g_object_unref (t.transport);
+  g_io_channel_unref (channel);
+  close (t.peer);
+  g_main_loop_unref (t.loop);
+}
+
+typedef struct {
+  GMainLoop *loop;
+  GibberTransport *transport;
+  int peer;
+  gsize total;
+  gsize sent;
+  gsize received;
+  guint reads;
+  guint block_every;
+  gboolean blocked;
+  gboolean corrupt;
+} ReadTest;
+
+static gboolean
+peer_writable_cb (GIOChannel *source,
+    GIOCondition condition,
+    gpointer user_data)
+{
+  ReadTest *t = user_data;
+  guint8 buf[65536];
+  gsize len = MIN (sizeof (buf), t->total - t->sent);
+  gsize i;
+  ssize_t n;
+
+  for (i = 0; i < len; i++)
+    buf[i] = pattern (t->sent + i);
+
+  n = write (t->peer, buf, len);
+
+  if (n < 0 && errno == EAGAIN)
+    return TRUE;
+
+  g_assert (n > 0);
+  t->sent += n;
+
+  return (t->sent < t->total);
+}
+
+static gboolean
+unblock_cb (gpointer user_data)
+{
+  ReadTest *t = user_data;
+
+  t->blocked = FALSE;
+  gibber_transport_block_receiving (t->transport, FALSE);
+  return FALSE;
+}
+
+static void
+transport_handler (GibberTransport *transport,
+    GibberBuffer *buffer,
+    gpointer user_data)
+{
+  ReadTest *t = user_data;
+  gsize i;
+
+  g_assert (!t->blocked);
+  t->reads++;
+
+  for (i = 0; i < buffer->length; i++)
+    {
+      if (buffer->data[i] != pattern (t->received + i))
+        t->corrupt = TRUE;
+    }
+
+  t->received += buffer->length;
+  g_assert (t->received <= t->total);
+
+  if (t->received == t->total)
+    {
+      g_main_loop_quit (t->loop);
+    }
+  else if (t->block_every != 0 && t->reads % t->block_every == 0)
+    {
+      /* no more data should be delivered until we unblock */
+      t->blocked = TRUE;
+      gibber_transport_block_receiving (transport, TRUE);
+      g_idle_add (unblock_cb, t);
+    }
+}
+
+static void
+run_read (gsize total,
+    guint max_read_size,
+    guint read_budget,
+    guint block_every)
+{
+  ReadTest t = { NULL, };
+  int fds[2];
+  GIOChannel *channel;
+  int ret;
+
+  ret = socketpair (AF_UNIX, SOCK_STREAM, 0, fds);
+  g_assert (ret == 0);
+
+  t.loop = g_main_loop_new (NULL, FALSE);
+  t.total = total;
+  t.block_every = block_every;
+  t.peer = fds[1];
+  t.transport = g_object_new (GIBBER_TYPE_FD_TRANSPORT,
+      "max-read-size", max_read_size,
+      "read-budget", read_budget,
+      NULL);
+  gibber_transport_set_handler (t.transport, transport_handler, &t);
+  gibber_fd_transport_set_fd (GIBBER_FD_TRANSPORT (t.transport), fds[0],
+      TRUE);
+
+  gibber_socket_set_nonblocking (t.peer);
+  channel = g_io_channel_unix_new (t.peer);
+  g_io_add_watch (channel, G_IO_OUT, peer_writable_cb, &t);
+
+  g_main_loop_run (t.loop);
+
+  g_assert (!t.corrupt);
+  g_assert (t.received == total);
+
+  gibber_transport_disconnect (t.transport);
+  g_object_unref (t.transport);
+  g_io_channel_unref (channel);
+  close (t.peer);
+  g_main_loop_unref (t.loop);
+}
+
+static void
+forward_handler (GibberTransport *transport,
+    GibberBuffer *buffer,
+    gpointer user_data)
+{
+  GibberTransport *dest = user_data;
+  gboolean ok;
+
+  ok = gibber_transport_send (dest, buffer->data, buffer->length, NULL);
+  g_assert (ok);
+}
+
+static void
+spliced_cb (GibberFdTransport *source,
+    gsize count,
+    gpointer user_data)
+{
+  gsize *spliced = user_data;
+
+  *spliced += count;
+}
+
+/* Relays data from one socketpair to another, splicing if we can and
+ * forwarding it through the handler otherwise */
+static void
+run_relay (gsize total,
+    gboolean splice)
+{
+  ReadTest in = { NULL, };
+  Test out = { NULL, };
+  int in_fds[2], out_fds[2];
+  GibberTransport *source, *dest;
+  GIOChannel *in_channel, *out_channel;
+  gsize spliced = 0;
+  gboolean splicing = FALSE;
+  int ret;
+
+  ret = socketpair (AF_UNIX, SOCK_STREAM, 0, in_fds);
+  g_assert (ret == 0);
+  ret = socketpair (AF_UNIX, SOCK_STREAM, 0, out_fds);
+  g_assert (ret == 0);
+
+  out.loop = g_main_loop_new (NULL, FALSE);
+  in.total = out.total = total;
+  in.peer = in_fds[1];
+  out.peer = out_fds[1];
+
+  source = g_object_new (GIBBER_TYPE_FD_TRANSPORT, NULL);
+  dest = g_object_new (GIBBER_TYPE_FD_TRANSPORT, NULL);
+  gibber_fd_transport_set_fd (GIBBER_FD_TRANSPORT (source), in_fds[0], TRUE);
+  gibber_fd_transport_set_fd (GIBBER_FD_TRANSPORT (dest), out_fds[0], TRUE);
+  gibber_transport_set_handler (source, forward_handler, dest);
+
+  if (splice)
+    splicing = gibber_fd_transport_splice (GIBBER_FD_TRANSPORT (source),
+        GIBBER_FD_TRANSPORT (dest), spliced_cb, &spliced);
+
+  gibber_socket_set_nonblocking (in.peer);
+  in_channel = g_io_channel_unix_new (in.peer);
+  g_io_add_watch (in_channel, G_IO_OUT, peer_writable_cb, &in);
+
+  gibber_socket_set_nonblocking (out.peer);
+  out_channel = g_io_channel_unix_new (out.peer);
+  g_io_add_watch (out_channel, G_IO_IN, peer_readable_cb, &out);
+
+  g_main_loop_run (out.loop);
+
+  g_assert (!out.corrupt);
+  g_assert (out.received == total);
+  /* if the kernel can't splice between these sockets, the source goes
+   * back to using its handler straight away */
+  g_assert (splicing || spliced == 0);
+  g_assert (spliced == 0 || spliced == total);
+
+  gibber_transport_disconnect (source);
+  gibber_transport_disconnect (dest);
+  g_object_unref (source);
+  g_object_unref (dest);
+  g_io_channel_unref (in_channel);
+  g_io_channel_unref (out_channel);
+  close (in.peer);
+  close (out.peer);
+  g_main_loop_unref (out.loop);
+}
+
+static void
+test_write (void)
+{
+  /* the default watermarks */
+  run (4 * 1024 * 1024, 64 * 1024, 16 * 1024);
+  /* full as soon as anything is queued, as the transport used to be */
+  run (1024 * 1024, 0, 0);
+  /* a low watermark above the high one mustn't wedge the writer */
+  run (1024 * 1024, 1024, 8192);
+}
+
+static void
+test_read (void)
+{
+  /* one read per main loop iteration */
+  run_read (4 * 1024 * 1024, 64 * 1024, 0, 0);
+  /* several reads per iteration, interrupted by blocking receiving */
+  run_read (4 * 1024 * 1024, 1024 * 1024, 1024 * 1024, 3);
+}
+
+static void
+test_relay (void)
+{
+  run_relay (4 * 1024 * 1024, FALSE);
+  run_relay (4 * 1024 * 1024, TRUE);
+}
+
+/*
+ * throughput:
+ *
+ * Times writing to and reading from a socketpair peer with the default
+ * settings. Only run with -m perf.
+ */
+static void
+test_throughput (void)
+{
+  gsize total = 256 * 1024 * 1024;
+  gdouble elapsed;
+
+  if (!g_test_perf ())
+    return;
+
+  g_test_timer_start ();
+  run (total, 64 * 1024, 16 * 1024);
+  elapsed = g_test_timer_elapsed ();
+  g_test_maximized_result (total / elapsed / (1024 * 1024),
+      "writing: %.1f MiB/s", total / elapsed / (1024 * 1024));
+
+  g_test_timer_start ();
+  run_read (total, 1024 * 1024, 1024 * 1024, 0);
+  elapsed = g_test_timer_elapsed ();
+  g_test_maximized_result (total / elapsed / (1024 * 1024),
+      "reading: %.1f MiB/s", total / elapsed / (1024 * 1024));
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_type_init ();
+
+  g_test_init (&argc, &argv, NULL);
+  g_test_add_func ("/fd-transport/write", test_write);
+  g_test_add_func ("/fd-transport/read", test_read);
+  g_test_add_func ("/fd-transport/relay", test_relay);
+  g_test_add_func ("/fd-transport/throughput", test_throughput);
+
+  return g_test_run ();
+}
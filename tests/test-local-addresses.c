@@ -0,0 +1,204 @@
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib-object.h>
+
+#include "src/local-addresses.h"
+#include "src/local-addresses-internal.h"
+
+/* Checks which of the addresses found on the interfaces we offer to peers,
+ * and in what order. */
+
+static void
+assert_selected (const LocalAddress *found,
+    guint n_found,
+    const gchar * const *expected)
+{
+  GSList *selected = local_addresses_select (found, n_found);
+  GSList *l;
+  guint i = 0;
+
+  for (l = selected; l != NULL; l = g_slist_next (l), i++)
+    {
+      g_assert (expected[i] != NULL);
+      g_assert_cmpstr (l->data, ==, expected[i]);
+    }
+
+  g_assert (expected[i] == NULL);
+  g_assert_cmpuint (g_slist_length (selected), <=, MAX_ADDRESSES);
+
+  g_slist_foreach (selected, (GFunc) g_free, NULL);
+  g_slist_free (selected);
+}
+
+static void
+test_filter (void)
+{
+  static const LocalAddress found[] = {
+      { "eth0", "169.254.12.34" },
+      { "eth0", "fe80::1" },
+      { "eth0", "127.0.0.2" },
+      { "eth0", "::1" },
+      { "eth0", "0.0.0.0" },
+      { "eth0", "not an address" },
+      { "eth0", "192.0.2.1" },
+      /* the same address on another interface */
+      { "eth1", "192.0.2.1" },
+      /* the same address, spelt differently */
+      { "eth0", "2001:db8::1" },
+      { "eth1", "2001:0db8:0:0::1" },
+      { NULL, "198.51.100.7" },
+  };
+  static const gchar * const expected[] = {
+      "2001:db8::1", "192.0.2.1", "198.51.100.7", NULL };
+
+  assert_selected (found, G_N_ELEMENTS (found), expected);
+  assert_selected (found, 0, expected + 3);
+}
+
+static void
+test_order (void)
+{
+  static const LocalAddress found[] = {
+      { "docker0", "172.17.0.1" },
+      { "eth0", "192.0.2.1" },
+      { "virbr0", "2001:db8:1::1" },
+      { "eth0", "2001:db8::1" },
+      { "wlan0", "192.0.2.2" },
+      { "wlan0", "2001:db8::2" },
+      { "vboxnet0", "192.168.56.1" },
+  };
+  static const gchar * const expected[] = {
+      /* real interfaces' addresses first, IPv6 first, in the order found */
+      "2001:db8::1", "2001:db8::2", "192.0.2.1", "192.0.2.2",
+      /* then the virtual ones, likewise */
+      "2001:db8:1::1", "172.17.0.1", "192.168.56.1", NULL };
+
+  assert_selected (found, G_N_ELEMENTS (found), expected);
+}
+
+static void
+test_cap (void)
+{
+  static const LocalAddress lots_of_ipv6[] = {
+      { "eth0", "2001:db8::1" },
+      { "eth0", "2001:db8::2" },
+      { "eth0", "2001:db8::3" },
+      { "eth0", "2001:db8::4" },
+      { "eth0", "2001:db8::5" },
+      { "eth0", "2001:db8::6" },
+      { "eth0", "2001:db8::7" },
+      { "eth0", "2001:db8::8" },
+      { "eth0", "2001:db8::9" },
+      { "eth0", "2001:db8::a" },
+      { "eth0", "192.0.2.1" },
+      { "eth0", "192.0.2.2" },
+      { "eth0", "192.0.2.3" },
+  };
+  static const gchar * const lots_of_ipv6_expected[] = {
+      /* IPv4 needs three slots, which leaves five for IPv6 */
+      "2001:db8::1", "2001:db8::2", "2001:db8::3", "2001:db8::4",
+      "2001:db8::5", "192.0.2.1", "192.0.2.2", "192.0.2.3", NULL };
+  static const LocalAddress lots_of_both[] = {
+      { "eth0", "2001:db8::1" },
+      { "eth0", "2001:db8::2" },
+      { "eth0", "2001:db8::3" },
+      { "eth0", "2001:db8::4" },
+      { "eth0", "2001:db8::5" },
+      { "eth0", "192.0.2.1" },
+      { "eth0", "192.0.2.2" },
+      { "eth0", "192.0.2.3" },
+      { "eth0", "192.0.2.4" },
+      { "eth0", "192.0.2.5" },
+  };
+  static const gchar * const lots_of_both_expected[] = {
+      "2001:db8::1", "2001:db8::2", "2001:db8::3", "2001:db8::4",
+      "192.0.2.1", "192.0.2.2", "192.0.2.3", "192.0.2.4", NULL };
+  static const LocalAddress only_ipv4[] = {
+      { "eth0", "192.0.2.1" },
+      { "eth0", "192.0.2.2" },
+      { "eth0", "192.0.2.3" },
+      { "eth0", "192.0.2.4" },
+      { "eth0", "192.0.2.5" },
+      { "eth0", "192.0.2.6" },
+      { "eth0", "192.0.2.7" },
+      { "eth0", "192.0.2.8" },
+      { "eth0", "192.0.2.9" },
+  };
+  static const gchar * const only_ipv4_expected[] = {
+      "192.0.2.1", "192.0.2.2", "192.0.2.3", "192.0.2.4",
+      "192.0.2.5", "192.0.2.6", "192.0.2.7", "192.0.2.8", NULL };
+  static const LocalAddress virtual_last[] = {
+      { "docker0", "172.17.0.1" },
+      { "docker0", "2001:db8:1::1" },
+      { "eth0", "2001:db8::1" },
+      { "eth0", "2001:db8::2" },
+      { "eth0", "2001:db8::3" },
+      { "eth0", "2001:db8::4" },
+      { "eth0", "2001:db8::5" },
+      { "eth0", "192.0.2.1" },
+      { "eth0", "192.0.2.2" },
+      { "eth0", "192.0.2.3" },
+      { "eth0", "192.0.2.4" },
+  };
+  static const gchar * const virtual_last_expected[] = {
+      /* the real interfaces use up both families' slots */
+      "2001:db8::1", "2001:db8::2", "2001:db8::3", "2001:db8::4",
+      "192.0.2.1", "192.0.2.2", "192.0.2.3", "192.0.2.4", NULL };
+
+  assert_selected (lots_of_ipv6, G_N_ELEMENTS (lots_of_ipv6),
+      lots_of_ipv6_expected);
+  assert_selected (lots_of_both, G_N_ELEMENTS (lots_of_both),
+      lots_of_both_expected);
+  assert_selected (only_ipv4, G_N_ELEMENTS (only_ipv4), only_ipv4_expected);
+  assert_selected (virtual_last, G_N_ELEMENTS (virtual_last),
+      virtual_last_expected);
+}
+
+/* Whatever interfaces this machine has, we offer a bounded number of
+ * distinct addresses, and the same ones each time */
+static void
+test_get (void)
+{
+  GSList *first = gabble_local_addresses_get ();
+  GSList *second = gabble_local_addresses_get ();
+  GSList *l, *m;
+
+  g_assert_cmpuint (g_slist_length (first), <=, MAX_ADDRESSES);
+
+  for (l = first, m = second;
+      l != NULL && m != NULL;
+      l = g_slist_next (l), m = g_slist_next (m))
+    {
+      g_assert_cmpstr (l->data, ==, m->data);
+      g_assert (g_slist_find_custom (g_slist_next (l), l->data,
+            (GCompareFunc) strcmp) == NULL);
+    }
+
+  g_assert (l == NULL);
+  g_assert (m == NULL);
+
+  g_slist_foreach (first, (GFunc) g_free, NULL);
+  g_slist_free (first);
+  g_slist_foreach (second, (GFunc) g_free, NULL);
+  g_slist_free (second);
+
+  gabble_local_addresses_shutdown ();
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/local-addresses/filter", test_filter);
+  g_test_add_func ("/local-addresses/order", test_order);
+  g_test_add_func ("/local-addresses/cap", test_cap);
+  g_test_add_func ("/local-addresses/get", test_get);
+
+  return g_test_run ();
+}
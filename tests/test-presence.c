@@ -202,6 +202,89 @@ prefer_higher_priority_resources (void)
   g_object_unref (presence);
 }
 
+/*
+ * many_resources:
+ *
+ * Floods a presence with updates from lots of resources (as happens with
+ * bots, or a contact signed in everywhere), checking that the aggregated
+ * status and caps stay right, and reports how long it took. Run with -m perf
+ * for a bigger flood.
+ */
+static void
+many_resources (void)
+{
+  GabblePresence *presence = gabble_presence_new ();
+  GabbleCapabilitySet *voice = gabble_capability_set_new ();
+  GabbleCapabilitySet *video = gabble_capability_set_new ();
+  time_t now = time (NULL);
+  guint n = g_test_perf () ? 5000 : 500;
+  guint i, round;
+  gdouble elapsed;
+
+  gabble_capability_set_add (voice, NS_GOOGLE_FEAT_VOICE);
+  gabble_capability_set_add (video, NS_GOOGLE_FEAT_VIDEO);
+
+  g_test_timer_start ();
+
+  for (i = 0; i < n; i++)
+    {
+      gchar *resource = g_strdup_printf ("bot%u", i);
+
+      gabble_presence_update (presence, resource, GABBLE_PRESENCE_AWAY,
+          "beep", 0, NULL, now);
+      gabble_presence_set_capabilities (presence, resource, voice, 1);
+      g_free (resource);
+    }
+
+  /* everyone changes their status a few times */
+  for (round = 0; round < 4; round++)
+    {
+      now++;
+
+      for (i = 0; i < n; i++)
+        {
+          gchar *resource = g_strdup_printf ("bot%u", i);
+
+          gabble_presence_update (presence, resource,
+              round % 2 ? GABBLE_PRESENCE_AWAY : GABBLE_PRESENCE_XA,
+              "boop", 0, NULL, now);
+          g_assert (gabble_presence_has_cap (presence, NS_GOOGLE_FEAT_VOICE));
+          g_free (resource);
+        }
+    }
+
+  /* the first resource gets video, and becomes the most available */
+  gabble_presence_set_capabilities (presence, "bot0", video, 1);
+  g_assert (gabble_presence_has_cap (presence, NS_GOOGLE_FEAT_VIDEO));
+  gabble_presence_update (presence, "bot0", GABBLE_PRESENCE_CHAT, "hi", 0,
+      NULL, now);
+  g_assert_cmpuint (presence->status, ==, GABBLE_PRESENCE_CHAT);
+  g_assert_cmpstr (presence->status_message, ==, "hi");
+
+  /* and then it and everyone else leaves, one by one */
+  for (i = 0; i < n; i++)
+    {
+      gchar *resource = g_strdup_printf ("bot%u", i);
+
+      gabble_presence_update (presence, resource, GABBLE_PRESENCE_OFFLINE,
+          NULL, 0, NULL, now);
+      g_assert (!gabble_presence_has_cap (presence, NS_GOOGLE_FEAT_VIDEO));
+      g_free (resource);
+    }
+
+  elapsed = g_test_timer_elapsed ();
+
+  g_assert_cmpuint (presence->status, ==, GABBLE_PRESENCE_OFFLINE);
+  g_assert (!gabble_presence_has_resources (presence));
+  g_assert (!gabble_presence_has_cap (presence, NS_GOOGLE_FEAT_VOICE));
+
+  g_test_minimized_result (elapsed, "%u resources: %.3f seconds", n, elapsed);
+
+  gabble_capability_set_free (voice);
+  gabble_capability_set_free (video);
+  g_object_unref (presence);
+}
+
 int main (int argc, char **argv)
 {
   int ret;
@@ -214,6 +297,7 @@ int main (int argc, char **argv)
   g_test_add_func ("/presence/big-test-of-doom", big_test_of_doom);
   g_test_add_func ("/presence/prefer-higher-priority-resources",
       prefer_higher_priority_resources);
+  g_test_add_func ("/presence/many-resources", many_resources);
 
   ret = g_test_run ();
 
@@ -0,0 +1,694 @@
+
+#include "config.h"
+
+#include <glib.h>
+#include <glib-object.h>
+#include <telepathy-glib/util.h>
+#include <wocky/wocky-namespaces.h>
+#include <wocky/wocky-stanza.h>
+
+#include "src/request-pipeline.h"
+#include "src/request-pipeline-internal.h"
+
+/* Instead of being sent on a connection, requests are queued up here, so the
+ * tests can reply to them by hand, in whichever order they like. */
+typedef struct {
+    LmMessage *msg;
+    RequestPipelineReplyFunc reply_func;
+    gpointer reply_data;
+} Sent;
+
+static GQueue sent = G_QUEUE_INIT;
+
+static gboolean
+test_send_with_reply (GabbleRequestPipeline *pipeline,
+    LmMessage *msg,
+    RequestPipelineReplyFunc reply_func,
+    gpointer user_data,
+    GError **error)
+{
+  Sent *s = g_slice_new0 (Sent);
+
+  s->msg = lm_message_ref (msg);
+  s->reply_func = reply_func;
+  s->reply_data = user_data;
+  g_queue_push_tail (&sent, s);
+  return TRUE;
+}
+
+static void
+sent_free (Sent *s)
+{
+  lm_message_unref (s->msg);
+  g_slice_free (Sent, s);
+}
+
+/* Forgets requests which were never answered, once their pipeline has gone */
+static void
+forget_sent (void)
+{
+  Sent *s;
+
+  while ((s = g_queue_pop_head (&sent)) != NULL)
+    sent_free (s);
+}
+
+static GabbleRequestPipeline *
+new_pipeline (gboolean adaptive)
+{
+  return g_object_new (GABBLE_TYPE_REQUEST_PIPELINE, "adaptive", adaptive,
+      NULL);
+}
+
+/* Lets the pipeline send whatever it has scheduled */
+static void
+run (void)
+{
+  while (g_main_context_iteration (NULL, FALSE))
+    ;
+}
+
+static const gchar *
+sent_id (Sent *s)
+{
+  return lm_message_node_get_attribute (wocky_stanza_get_top_node (s->msg),
+      "id");
+}
+
+/* Replies to the oldest request still in flight, successfully or with a
+ * 'wait' error, and returns its ID */
+static const gchar *
+reply_full (gboolean throttle)
+{
+  Sent *s = g_queue_pop_head (&sent);
+  LmMessage *reply;
+  static gchar *id = NULL;
+
+  g_assert (s != NULL);
+
+  if (throttle)
+    reply = wocky_stanza_build (WOCKY_STANZA_TYPE_IQ,
+        WOCKY_STANZA_SUB_TYPE_ERROR, "example.com", NULL,
+        '(', "error", '@', "type", "wait",
+          '(', "resource-constraint", ':', WOCKY_XMPP_NS_STANZAS, ')',
+        ')', NULL);
+  else
+    reply = lm_message_new_with_sub_type ("example.com",
+        LM_MESSAGE_TYPE_IQ, LM_MESSAGE_SUB_TYPE_RESULT);
+
+  g_free (id);
+  id = g_strdup (sent_id (s));
+
+  s->reply_func (NULL, s->msg, reply, NULL, s->reply_data);
+  lm_message_unref (reply);
+  sent_free (s);
+  return id;
+}
+
+static const gchar *
+reply (void)
+{
+  return reply_full (FALSE);
+}
+
+typedef struct {
+    GabbleRequestPipelineItem *item;
+    guint replies;
+    guint errors;
+    guint cancelled;
+    guint disconnected;
+} Request;
+
+static void
+request_cb (GabbleConnection *conn,
+    LmMessage *msg,
+    gpointer user_data,
+    GError *error)
+{
+  Request *request = user_data;
+
+  if (error == NULL)
+    {
+      g_assert (msg != NULL);
+      request->replies++;
+    }
+  else if (g_error_matches (error, GABBLE_REQUEST_PIPELINE_ERROR,
+        GABBLE_REQUEST_PIPELINE_ERROR_CANCELLED))
+    {
+      request->cancelled++;
+    }
+  else if (msg != NULL)
+    {
+      request->errors++;
+    }
+  else
+    {
+      request->disconnected++;
+    }
+}
+
+static void
+cancel_on_reply_cb (GabbleConnection *conn,
+    LmMessage *msg,
+    gpointer user_data,
+    GError *error)
+{
+  Request *request = user_data;
+
+  request_cb (conn, msg, user_data, error);
+
+  /* Cancelling an item from its own callback must not free it from under
+   * the pipeline. */
+  if (error == NULL)
+    gabble_request_pipeline_item_cancel (request->item);
+}
+
+static GabbleRequestPipelineItem *
+enqueue_full (GabbleRequestPipeline *pipeline,
+    const gchar *to,
+    const gchar *id,
+    GabbleRequestPipelinePriority priority,
+    GabbleRequestPipelineCb callback,
+    Request *request)
+{
+  LmMessage *msg = lm_message_new_with_sub_type (to,
+      LM_MESSAGE_TYPE_IQ, LM_MESSAGE_SUB_TYPE_GET);
+  GabbleRequestPipelineItem *item;
+
+  lm_message_node_set_attribute (wocky_stanza_get_top_node (msg), "id", id);
+  item = gabble_request_pipeline_enqueue (pipeline, msg, 0, priority,
+      callback, request);
+  lm_message_unref (msg);
+
+  if (request != NULL)
+    request->item = item;
+
+  return item;
+}
+
+/* Enqueues @n normal requests to @to, which nobody's interested in the
+ * result of */
+static void
+enqueue_many (GabbleRequestPipeline *pipeline,
+    const gchar *to,
+    guint n)
+{
+  static Request ignored;
+  guint i;
+
+  for (i = 0; i < n; i++)
+    enqueue_full (pipeline, to, to, GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL,
+        request_cb, &ignored);
+}
+
+static GabbleRequestPipelineStats *
+get_stats (GabbleRequestPipeline *pipeline)
+{
+  static GabbleRequestPipelineStats stats;
+
+  gabble_request_pipeline_get_stats (pipeline, &stats);
+  return &stats;
+}
+
+static void
+test_cancel_from_callback (void)
+{
+  GabbleRequestPipeline *pipeline = new_pipeline (TRUE);
+  Request first = { NULL, 0, 0, 0, 0 };
+  Request second = { NULL, 0, 0, 0, 0 };
+
+  enqueue_full (pipeline, "example.com", "first",
+      GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL, cancel_on_reply_cb, &first);
+  run ();
+  g_assert_cmpuint (g_queue_get_length (&sent), ==, 1);
+
+  reply ();
+
+  /* The callback was told about the reply, and then that it was cancelled */
+  g_assert_cmpuint (first.replies, ==, 1);
+  g_assert_cmpuint (first.cancelled, ==, 1);
+  g_assert_cmpuint (first.disconnected, ==, 0);
+
+  g_assert_cmpuint (get_stats (pipeline)->in_flight, ==, 0);
+  g_assert_cmpuint (get_stats (pipeline)->zombies, ==, 0);
+  g_assert_cmpuint (get_stats (pipeline)->pending, ==, 0);
+  g_assert_cmpuint (get_stats (pipeline)->completed, ==, 1);
+
+  /* The pipeline carries on as normal afterwards */
+  enqueue_full (pipeline, "example.com", "second",
+      GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL, cancel_on_reply_cb, &second);
+  run ();
+  g_assert_cmpuint (g_queue_get_length (&sent), ==, 1);
+  g_assert_cmpuint (get_stats (pipeline)->in_flight, ==, 1);
+
+  /* Requests still in flight are failed when the pipeline goes away */
+  g_object_unref (pipeline);
+  g_assert_cmpuint (second.replies, ==, 0);
+  g_assert_cmpuint (second.cancelled, ==, 0);
+  g_assert_cmpuint (second.disconnected, ==, 1);
+  forget_sent ();
+}
+
+/* Quick replies open the window by one request per window's worth */
+static void
+test_window_grows (void)
+{
+  GabbleRequestPipeline *pipeline = new_pipeline (TRUE);
+  guint window = REQUEST_PIPELINE_SIZE;
+  guint i;
+
+  enqueue_many (pipeline, "example.com", 200);
+  run ();
+
+  g_assert_cmpuint (get_stats (pipeline)->window, ==, window);
+  g_assert_cmpuint (g_queue_get_length (&sent), ==, window);
+
+  while (window < REQUEST_PIPELINE_SIZE + 3)
+    {
+      for (i = 0; i < window; i++)
+        {
+          g_assert_cmpuint (get_stats (pipeline)->window, ==, window);
+          reply ();
+        }
+
+      window++;
+      g_assert_cmpuint (get_stats (pipeline)->window, ==, window);
+      /* the extra slot is used straight away */
+      g_assert_cmpuint (get_stats (pipeline)->in_flight, ==, window);
+      g_assert_cmpuint (g_queue_get_length (&sent), ==, window);
+    }
+
+  g_assert_cmpuint (get_stats (pipeline)->throttled, ==, 0);
+
+  g_object_unref (pipeline);
+  forget_sent ();
+}
+
+/* Replies getting much slower than the quickest ones means requests are
+ * queueing up on the server, so the window stops growing */
+static void
+test_window_stops_growing_when_rtt_rises (void)
+{
+  GabbleRequestPipeline *pipeline = new_pipeline (TRUE);
+  guint i;
+
+  enqueue_many (pipeline, "example.com", 200);
+  run ();
+
+  /* learn how quick the server can be */
+  for (i = 0; i < REQUEST_PIPELINE_SIZE; i++)
+    reply ();
+
+  g_assert_cmpuint (get_stats (pipeline)->window, ==,
+      REQUEST_PIPELINE_SIZE + 1);
+
+  for (i = 0; i < 3 * (REQUEST_PIPELINE_SIZE + 1); i++)
+    {
+      g_usleep (50 * 1000);
+      reply ();
+    }
+
+  g_assert_cmpuint (get_stats (pipeline)->window, ==,
+      REQUEST_PIPELINE_SIZE + 1);
+  g_assert_cmpuint (get_stats (pipeline)->rtt_p90, >=, 50);
+
+  g_object_unref (pipeline);
+  forget_sent ();
+}
+
+/* The server asking us to wait halves the window, down to a minimum */
+static void
+test_window_shrinks (void)
+{
+  GabbleRequestPipeline *pipeline = new_pipeline (TRUE);
+  guint window = REQUEST_PIPELINE_SIZE;
+  guint i;
+
+  enqueue_many (pipeline, "example.com", 200);
+  run ();
+  g_assert_cmpuint (g_queue_get_length (&sent), ==, window);
+
+  reply_full (TRUE);
+  window /= 2;
+  g_assert_cmpuint (get_stats (pipeline)->window, ==, window);
+  g_assert_cmpuint (get_stats (pipeline)->throttled, ==, 1);
+
+  /* nothing more is sent until fewer than the new window are in flight */
+  while (g_queue_get_length (&sent) > window)
+    {
+      reply ();
+      g_assert_cmpuint (get_stats (pipeline)->in_flight, ==,
+          g_queue_get_length (&sent));
+    }
+
+  /* ...and then it fills up again; the replies may have opened it by one */
+  reply ();
+  g_assert_cmpuint (get_stats (pipeline)->in_flight, ==,
+      get_stats (pipeline)->window);
+  g_assert_cmpuint (get_stats (pipeline)->window, <=, window + 1);
+
+  for (i = 0; i < 10; i++)
+    reply_full (TRUE);
+
+  g_assert_cmpuint (get_stats (pipeline)->window, ==,
+      REQUEST_PIPELINE_MIN_WINDOW);
+  g_assert_cmpuint (get_stats (pipeline)->throttled, ==, 11);
+  g_assert_cmpuint (get_stats (pipeline)->in_flight, ==,
+      REQUEST_PIPELINE_MIN_WINDOW);
+
+  g_object_unref (pipeline);
+  forget_sent ();
+}
+
+/* Each server has its own window */
+static void
+test_window_per_destination (void)
+{
+  GabbleRequestPipeline *pipeline = new_pipeline (TRUE);
+  guint fast_replies = 0, to_slow = 0;
+  GList *l;
+
+  enqueue_many (pipeline, "slow.example.com", 100);
+  enqueue_many (pipeline, "fast.example.com", 100);
+  run ();
+
+  g_assert_cmpuint (get_stats (pipeline)->destinations, ==, 2);
+  g_assert_cmpuint (get_stats (pipeline)->in_flight, ==,
+      2 * REQUEST_PIPELINE_SIZE);
+
+  /* the slow server asks us to back off... */
+  for (l = sent.head; l != NULL; l = l->next)
+    {
+      if (!tp_strdiff (sent_id (l->data), "slow.example.com"))
+        break;
+    }
+
+  g_assert (l != NULL);
+  g_queue_unlink (&sent, l);
+  g_queue_push_head_link (&sent, l);
+  g_assert_cmpstr (reply_full (TRUE), ==, "slow.example.com");
+
+  /* ...which doesn't slow down requests to the other one */
+  while (fast_replies < 2 * REQUEST_PIPELINE_SIZE)
+    {
+      Sent *s = g_queue_peek_head (&sent);
+
+      if (!tp_strdiff (sent_id (s), "slow.example.com"))
+        {
+          /* we'll answer it later */
+          g_queue_push_tail (&sent, g_queue_pop_head (&sent));
+          continue;
+        }
+
+      reply ();
+      fast_replies++;
+    }
+
+  for (l = sent.head; l != NULL; l = l->next)
+    {
+      if (!tp_strdiff (sent_id (l->data), "slow.example.com"))
+        to_slow++;
+    }
+
+  g_assert_cmpuint (to_slow, ==, REQUEST_PIPELINE_SIZE - 1);
+  g_assert_cmpuint (g_queue_get_length (&sent) - to_slow, >,
+      REQUEST_PIPELINE_SIZE);
+  /* the sum of both windows */
+  g_assert_cmpuint (get_stats (pipeline)->window, ==,
+      g_queue_get_length (&sent) - to_slow + REQUEST_PIPELINE_SIZE / 2);
+
+  g_object_unref (pipeline);
+  forget_sent ();
+}
+
+/* In fixed mode, nothing the server does changes the window */
+static void
+test_fixed_window (void)
+{
+  GabbleRequestPipeline *pipeline = new_pipeline (FALSE);
+  guint i;
+
+  enqueue_many (pipeline, "a.example.com", 100);
+  enqueue_many (pipeline, "b.example.com", 100);
+  run ();
+
+  /* the window is shared between all the servers */
+  g_assert_cmpuint (get_stats (pipeline)->window, ==, REQUEST_PIPELINE_SIZE);
+  g_assert_cmpuint (g_queue_get_length (&sent), ==, REQUEST_PIPELINE_SIZE);
+
+  for (i = 0; i < 3 * REQUEST_PIPELINE_SIZE; i++)
+    reply_full (i % 2 == 0);
+
+  g_assert_cmpuint (get_stats (pipeline)->window, ==, REQUEST_PIPELINE_SIZE);
+  g_assert_cmpuint (g_queue_get_length (&sent), ==, REQUEST_PIPELINE_SIZE);
+  g_assert_cmpuint (get_stats (pipeline)->throttled, ==,
+      3 * REQUEST_PIPELINE_SIZE / 2);
+
+  g_object_unref (pipeline);
+  forget_sent ();
+}
+
+static const gchar *
+last_sent_id (void)
+{
+  return sent_id (g_queue_peek_tail (&sent));
+}
+
+static void
+enqueue_priority (GabbleRequestPipeline *pipeline,
+    const gchar *id,
+    GabbleRequestPipelinePriority priority,
+    Request *request)
+{
+  enqueue_full (pipeline, "example.com", id, priority, request_cb, request);
+}
+
+/* Higher priorities get free slots first, whatever order they were enqueued
+ * in */
+static void
+test_priority_order (void)
+{
+  GabbleRequestPipeline *pipeline = new_pipeline (FALSE);
+  Request background = { NULL, 0, 0, 0, 0 };
+  Request normal = { NULL, 0, 0, 0, 0 };
+  Request interactive = { NULL, 0, 0, 0, 0 };
+
+  enqueue_many (pipeline, "example.com", REQUEST_PIPELINE_SIZE);
+  run ();
+  g_assert_cmpuint (g_queue_get_length (&sent), ==, REQUEST_PIPELINE_SIZE);
+
+  enqueue_priority (pipeline, "background",
+      GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND, &background);
+  enqueue_priority (pipeline, "normal",
+      GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL, &normal);
+  enqueue_priority (pipeline, "interactive",
+      GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE, &interactive);
+  run ();
+
+  /* the interactive request doesn't even wait for a free slot */
+  g_assert_cmpuint (g_queue_get_length (&sent), ==,
+      REQUEST_PIPELINE_SIZE + 1);
+  g_assert_cmpstr (last_sent_id (), ==, "interactive");
+  g_assert_cmpuint (get_stats (pipeline)->pending, ==, 2);
+  g_assert_cmpuint (get_stats (pipeline)->pending_by_priority[
+      GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL], ==, 1);
+  g_assert_cmpuint (get_stats (pipeline)->pending_by_priority[
+      GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND], ==, 1);
+
+  /* the interactive request used the headroom, so the first reply only
+   * brings us back to a full window */
+  reply ();
+  g_assert_cmpuint (g_queue_get_length (&sent), ==, REQUEST_PIPELINE_SIZE);
+  g_assert_cmpstr (last_sent_id (), ==, "interactive");
+
+  /* the first slot to come free goes to the normal request */
+  reply ();
+  g_assert_cmpstr (last_sent_id (), ==, "normal");
+  g_assert_cmpuint (get_stats (pipeline)->pending, ==, 1);
+
+  reply ();
+  g_assert_cmpstr (last_sent_id (), ==, "background");
+  g_assert_cmpuint (get_stats (pipeline)->pending, ==, 0);
+
+  while (!g_queue_is_empty (&sent))
+    reply ();
+
+  g_assert_cmpuint (background.replies, ==, 1);
+  g_assert_cmpuint (normal.replies, ==, 1);
+  g_assert_cmpuint (interactive.replies, ==, 1);
+
+  g_object_unref (pipeline);
+}
+
+/* A steady stream of higher-priority requests doesn't hold up lower ones
+ * forever */
+static void
+test_priority_starvation (void)
+{
+  GabbleRequestPipeline *pipeline = new_pipeline (FALSE);
+  Request background = { NULL, 0, 0, 0, 0 };
+  guint i;
+
+  enqueue_many (pipeline, "example.com", REQUEST_PIPELINE_SIZE);
+  run ();
+
+  enqueue_priority (pipeline, "background",
+      GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND, &background);
+  enqueue_many (pipeline, "example.com", 2 * STARVATION_LIMIT);
+  run ();
+  g_assert_cmpuint (g_queue_get_length (&sent), ==, REQUEST_PIPELINE_SIZE);
+
+  for (i = 0; i < STARVATION_LIMIT; i++)
+    {
+      reply ();
+      g_assert_cmpstr (last_sent_id (), ==, "example.com");
+    }
+
+  /* it has been passed over STARVATION_LIMIT times, so it's its turn */
+  reply ();
+  g_assert_cmpstr (last_sent_id (), ==, "background");
+  g_assert_cmpuint (get_stats (pipeline)->pending_by_priority[
+      GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND], ==, 0);
+
+  /* and then the normal requests carry on */
+  reply ();
+  g_assert_cmpstr (last_sent_id (), ==, "example.com");
+
+  g_object_unref (pipeline);
+  forget_sent ();
+  g_assert_cmpuint (background.disconnected, ==, 1);
+}
+
+/* Within a priority, servers take turns */
+static void
+test_lanes_round_robin (void)
+{
+  GabbleRequestPipeline *pipeline = new_pipeline (FALSE);
+  static const gchar * const expected[] = { "a.example.com", "b.example.com",
+      "a.example.com", "b.example.com", "a.example.com", "b.example.com",
+      "a.example.com", "a.example.com", "a.example.com", "a.example.com" };
+  GList *l;
+  guint i;
+
+  enqueue_many (pipeline, "a.example.com", REQUEST_PIPELINE_SIZE);
+  enqueue_many (pipeline, "b.example.com", 3);
+  run ();
+
+  g_assert_cmpuint (g_queue_get_length (&sent), ==, G_N_ELEMENTS (expected));
+
+  for (l = sent.head, i = 0; l != NULL; l = l->next, i++)
+    g_assert_cmpstr (sent_id (l->data), ==, expected[i]);
+
+  g_object_unref (pipeline);
+  forget_sent ();
+}
+
+/* A request can be moved to a higher priority's lane while it's waiting, but
+ * never to a lower one */
+static void
+test_lanes_raise_priority (void)
+{
+  GabbleRequestPipeline *pipeline = new_pipeline (TRUE);
+  Request background = { NULL, 0, 0, 0, 0 };
+  Request normal = { NULL, 0, 0, 0, 0 };
+
+  enqueue_many (pipeline, "example.com", REQUEST_PIPELINE_SIZE);
+  run ();
+
+  enqueue_priority (pipeline, "normal",
+      GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL, &normal);
+  enqueue_priority (pipeline, "background",
+      GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND, &background);
+  run ();
+  g_assert_cmpuint (g_queue_get_length (&sent), ==, REQUEST_PIPELINE_SIZE);
+
+  gabble_request_pipeline_item_raise_priority (normal.item,
+      GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND);
+  g_assert_cmpuint (get_stats (pipeline)->pending_by_priority[
+      GABBLE_REQUEST_PIPELINE_PRIORITY_NORMAL], ==, 1);
+
+  gabble_request_pipeline_item_raise_priority (background.item,
+      GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE);
+  g_assert_cmpuint (get_stats (pipeline)->pending_by_priority[
+      GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND], ==, 0);
+  run ();
+
+  /* now it's interactive, it can use the headroom */
+  g_assert_cmpuint (g_queue_get_length (&sent), ==,
+      REQUEST_PIPELINE_SIZE + 1);
+  g_assert_cmpstr (last_sent_id (), ==, "background");
+
+  /* raising a request which has been sent does nothing */
+  gabble_request_pipeline_item_raise_priority (background.item,
+      GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE);
+  run ();
+  g_assert_cmpuint (g_queue_get_length (&sent), ==,
+      REQUEST_PIPELINE_SIZE + 1);
+
+  g_object_unref (pipeline);
+  forget_sent ();
+  g_assert_cmpuint (normal.disconnected, ==, 1);
+  g_assert_cmpuint (background.disconnected, ==, 1);
+}
+
+/* Interactive requests may go beyond a full window, but only by
+ * INTERACTIVE_HEADROOM */
+static void
+test_lanes_interactive_headroom (void)
+{
+  GabbleRequestPipeline *pipeline = new_pipeline (TRUE);
+  Request interactive = { NULL, 0, 0, 0, 0 };
+  guint i;
+
+  enqueue_many (pipeline, "example.com", REQUEST_PIPELINE_SIZE);
+  run ();
+
+  for (i = 0; i < INTERACTIVE_HEADROOM + 1; i++)
+    enqueue_priority (pipeline, "interactive",
+        GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE, &interactive);
+
+  run ();
+  g_assert_cmpuint (g_queue_get_length (&sent), ==,
+      REQUEST_PIPELINE_SIZE + INTERACTIVE_HEADROOM);
+  g_assert_cmpuint (get_stats (pipeline)->pending_by_priority[
+      GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE], ==, 1);
+
+  /* the last one goes as soon as anything's answered */
+  reply ();
+  g_assert_cmpstr (last_sent_id (), ==, "interactive");
+  g_assert_cmpuint (get_stats (pipeline)->pending, ==, 0);
+
+  g_object_unref (pipeline);
+  forget_sent ();
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+
+  request_pipeline_set_send_func (test_send_with_reply);
+
+  g_test_add_func ("/request-pipeline/cancel-from-callback",
+      test_cancel_from_callback);
+  g_test_add_func ("/request-pipeline/window/grows", test_window_grows);
+  g_test_add_func ("/request-pipeline/window/stops-growing-when-rtt-rises",
+      test_window_stops_growing_when_rtt_rises);
+  g_test_add_func ("/request-pipeline/window/shrinks", test_window_shrinks);
+  g_test_add_func ("/request-pipeline/window/per-destination",
+      test_window_per_destination);
+  g_test_add_func ("/request-pipeline/window/fixed", test_fixed_window);
+  g_test_add_func ("/request-pipeline/priority/order", test_priority_order);
+  g_test_add_func ("/request-pipeline/priority/starvation",
+      test_priority_starvation);
+  g_test_add_func ("/request-pipeline/lanes/round-robin",
+      test_lanes_round_robin);
+  g_test_add_func ("/request-pipeline/lanes/raise-priority",
+      test_lanes_raise_priority);
+  g_test_add_func ("/request-pipeline/lanes/interactive-headroom",
+      test_lanes_interactive_headroom);
+
+  return g_test_run ();
+}
@@ -0,0 +1,199 @@
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib-object.h>
+
+#include "src/bytestream-factory-internal.h"
+
+/* Checks how SOCKS5 streamhosts are scored, and that what we know about
+ * proxies survives being saved and loaded again. */
+
+static const GabbleStreamhostStats unknown = { 0, 0, 0, 0, 0, 0 };
+
+static guint
+cost (guint attempts,
+    guint successes,
+    guint failures,
+    guint latency,
+    guint rtt,
+    guint bandwidth)
+{
+  GabbleStreamhostStats stats = { attempts, successes, failures, latency,
+      rtt, bandwidth };
+
+  return streamhost_stats_get_cost (&stats);
+}
+
+static void
+test_cost (void)
+{
+  g_assert_cmpuint (streamhost_stats_get_cost (&unknown), ==,
+      UNKNOWN_STREAMHOST_COST);
+
+  /* proxies we've only queried cost how long they took to answer */
+  g_assert_cmpuint (cost (0, 0, 0, 0, 200, 0), ==, 200);
+
+  /* the handshake latency is used once we've connected */
+  g_assert_cmpuint (cost (1, 1, 0, 100, 200, 0), ==, 100);
+
+  /* failing a quarter of the time costs a quarter of the penalty */
+  g_assert_cmpuint (cost (4, 3, 1, 100, 0, 0), ==,
+      100 + STREAMHOST_FAILURE_PENALTY / 4);
+
+  /* moving STREAMHOST_COST_TRANSFER_SIZE bytes at the measured bandwidth */
+  g_assert_cmpuint (cost (1, 1, 0, 100, 0, STREAMHOST_COST_TRANSFER_SIZE),
+      ==, 100 + 1000);
+  g_assert_cmpuint (cost (1, 1, 0, 100, 0, 1), ==,
+      100 + STREAMHOST_FAILURE_PENALTY);
+
+  /* faster and more reliable is better */
+  g_assert_cmpuint (cost (1, 1, 0, 100, 0, 0), <, cost (1, 1, 0, 300, 0, 0));
+  g_assert_cmpuint (cost (10, 10, 0, 300, 0, 0), <,
+      cost (10, 9, 1, 100, 0, 0));
+  g_assert_cmpuint (cost (1, 1, 0, 100, 0, 1000 * 1000), <,
+      cost (1, 1, 0, 100, 0, 10 * 1000));
+
+  /* streamhosts which never worked come after all the others, however
+   * badly those did */
+  g_assert_cmpuint (cost (1, 0, 1, 0, 0, 0), >,
+      cost (100, 1, 99, 5000, 0, 1));
+  g_assert_cmpuint (cost (1, 0, 1, 0, 0, 0), >,
+      streamhost_stats_get_cost (&unknown));
+  g_assert_cmpuint (cost (1, 0, 1, 0, 0, 0), <, cost (5, 0, 5, 0, 0, 0));
+}
+
+static StreamhostRecord *
+add_record (GHashTable *records,
+    const gchar *key,
+    gboolean proxy,
+    glong last_used,
+    const GabbleStreamhostStats *stats)
+{
+  StreamhostRecord *record = g_slice_new0 (StreamhostRecord);
+
+  record->proxy = proxy;
+  record->last_used.tv_sec = last_used;
+  record->stats = *stats;
+  g_hash_table_insert (records, g_strdup (key), record);
+  return record;
+}
+
+#define PROXY "proxy.example.com 192.0.2.1:7777"
+
+static void
+test_round_trip (void)
+{
+  static const GabbleStreamhostStats stats = { 5, 4, 1, 120, 80, 100000 };
+  static const GabbleStreamhostStats newer = { 6, 5, 1, 110, 80, 100000 };
+  GHashTable *records = streamhost_records_new ();
+  GHashTable *loaded = streamhost_records_new ();
+  StreamhostRecord *record;
+  GTimeVal now;
+  gchar *data;
+  gsize length;
+
+  g_get_current_time (&now);
+
+  add_record (records, PROXY, TRUE, now.tv_sec - 60, &stats);
+  /* contacts' streamhosts aren't stored */
+  add_record (records, "alice@example.com/Res 198.51.100.1:1234", FALSE,
+      now.tv_sec, &stats);
+  /* nor is anything which would break the file's syntax */
+  add_record (records, "[evil] 192.0.2.2:1", TRUE, now.tv_sec, &stats);
+  /* and proxies we haven't used for too long are forgotten */
+  add_record (records, "old.example.com 192.0.2.3:7777", TRUE,
+      now.tv_sec - STREAMHOST_STATS_MAX_AGE - 1, &stats);
+
+  data = streamhost_records_to_data (records, &length);
+  g_assert_cmpuint (strlen (data), ==, length);
+  streamhost_records_add_from_data (loaded, data, length, now.tv_sec);
+
+  g_assert_cmpuint (g_hash_table_size (loaded), ==, 1);
+  record = g_hash_table_lookup (loaded, PROXY);
+  g_assert (record != NULL);
+  g_assert (record->proxy);
+  g_assert_cmpint (record->last_used.tv_sec, ==, now.tv_sec - 60);
+  g_assert (memcmp (&record->stats, &stats, sizeof (stats)) == 0);
+  g_assert_cmpuint (streamhost_stats_get_cost (&record->stats), ==,
+      streamhost_stats_get_cost (&stats));
+
+  g_hash_table_remove_all (loaded);
+
+  /* what we've learnt since connecting wins over what was stored */
+  add_record (loaded, PROXY, TRUE, now.tv_sec, &newer);
+  streamhost_records_add_from_data (loaded, data, length, now.tv_sec);
+  g_assert_cmpuint (g_hash_table_size (loaded), ==, 1);
+  record = g_hash_table_lookup (loaded, PROXY);
+  g_assert (memcmp (&record->stats, &newer, sizeof (newer)) == 0);
+
+  g_free (data);
+  g_hash_table_destroy (loaded);
+  g_hash_table_destroy (records);
+}
+
+static void
+test_load_bounded (void)
+{
+  static const GabbleStreamhostStats stats = { 1, 1, 0, 100, 0, 0 };
+  static const GabbleStreamhostStats inconsistent = { 1, 3, 2, 100, 0, 0 };
+  GHashTable *records = streamhost_records_new ();
+  GHashTable *loaded = streamhost_records_new ();
+  StreamhostRecord *record;
+  GTimeVal now;
+  gchar *data;
+  gsize length;
+  guint i;
+
+  g_get_current_time (&now);
+
+  for (i = 0; i < 2 * STREAMHOST_STATS_MAX; i++)
+    {
+      gchar *key = g_strdup_printf ("proxy%u.example.com 192.0.2.1:%u", i,
+          i + 1);
+
+      add_record (records, key, TRUE, now.tv_sec, &stats);
+      g_free (key);
+    }
+
+  data = streamhost_records_to_data (records, &length);
+  streamhost_records_add_from_data (loaded, data, length, now.tv_sec);
+  g_assert_cmpuint (g_hash_table_size (loaded), ==, STREAMHOST_STATS_MAX);
+  g_free (data);
+
+  /* a file which was edited by hand can't make the failure rate exceed 1 */
+  g_hash_table_remove_all (records);
+  g_hash_table_remove_all (loaded);
+  add_record (records, PROXY, TRUE, now.tv_sec, &inconsistent);
+  data = streamhost_records_to_data (records, &length);
+  streamhost_records_add_from_data (loaded, data, length, now.tv_sec);
+  record = g_hash_table_lookup (loaded, PROXY);
+  g_assert (record != NULL);
+  g_assert_cmpuint (record->stats.attempts, ==, 5);
+  g_free (data);
+
+  /* nor can a broken one do any harm */
+  g_hash_table_remove_all (loaded);
+  streamhost_records_add_from_data (loaded, "[streamhost ", 12, now.tv_sec);
+  g_assert_cmpuint (g_hash_table_size (loaded), ==, 0);
+  streamhost_records_add_from_data (loaded, "", 0, now.tv_sec);
+  g_assert_cmpuint (g_hash_table_size (loaded), ==, 0);
+
+  g_hash_table_destroy (loaded);
+  g_hash_table_destroy (records);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/streamhost-stats/cost", test_cost);
+  g_test_add_func ("/streamhost-stats/round-trip", test_round_trip);
+  g_test_add_func ("/streamhost-stats/load-bounded", test_load_bounded);
+
+  return g_test_run ();
+}
@@ -0,0 +1,339 @@
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "src/tube-mux.h"
+
+/* Connects two muxes back to back, delivering what each sends to the other
+ * in pieces of random sizes, and checks that streams' data arrives intact,
+ * that a reader which stops reading stops its sender, and that a broken
+ * peer is noticed. */
+
+typedef struct {
+    GabbleTubeMux *mux;
+    /* What this end has sent, not yet delivered to the other one */
+    GString *wire;
+    /* GUINT_TO_POINTER (id) => GString of what arrived on it */
+    GHashTable *received;
+    guint opened;
+    guint closed;
+    guint writable;
+    /* If FALSE, stream_data asks for the peer to be stopped */
+    gboolean reading;
+    /* If TRUE, stream_data frees the mux */
+    gboolean free_on_data;
+} End;
+
+static void
+send_cb (GabbleTubeMux *mux,
+    const gchar *data,
+    gsize len,
+    gpointer user_data)
+{
+  End *end = user_data;
+
+  g_string_append_len (end->wire, data, len);
+}
+
+static void
+stream_opened_cb (GabbleTubeMux *mux,
+    guint id,
+    gpointer user_data)
+{
+  End *end = user_data;
+
+  g_assert (g_hash_table_lookup (end->received, GUINT_TO_POINTER (id))
+      == NULL);
+  g_hash_table_insert (end->received, GUINT_TO_POINTER (id),
+      g_string_new (""));
+  end->opened++;
+}
+
+static gboolean
+stream_data_cb (GabbleTubeMux *mux,
+    guint id,
+    const gchar *data,
+    gsize len,
+    gpointer user_data)
+{
+  End *end = user_data;
+  GString *str = g_hash_table_lookup (end->received, GUINT_TO_POINTER (id));
+
+  g_assert (str != NULL);
+  g_string_append_len (str, data, len);
+
+  if (end->free_on_data)
+    {
+      gabble_tube_mux_free (end->mux);
+      end->mux = NULL;
+    }
+
+  return end->reading;
+}
+
+static void
+stream_closed_cb (GabbleTubeMux *mux,
+    guint id,
+    gpointer user_data)
+{
+  End *end = user_data;
+
+  end->closed++;
+}
+
+static void
+stream_writable_cb (GabbleTubeMux *mux,
+    guint id,
+    gpointer user_data)
+{
+  End *end = user_data;
+
+  end->writable++;
+}
+
+static const GabbleTubeMuxCallbacks callbacks = {
+    send_cb,
+    stream_opened_cb,
+    stream_data_cb,
+    stream_closed_cb,
+    stream_writable_cb
+};
+
+static void
+free_string (gpointer p)
+{
+  g_string_free (p, TRUE);
+}
+
+static void
+end_init (End *end)
+{
+  memset (end, 0, sizeof (End));
+  end->mux = gabble_tube_mux_new (&callbacks, end);
+  end->wire = g_string_new ("");
+  end->received = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+      free_string);
+  end->reading = TRUE;
+}
+
+static void
+end_clear (End *end)
+{
+  gabble_tube_mux_free (end->mux);
+  g_string_free (end->wire, TRUE);
+  g_hash_table_destroy (end->received);
+}
+
+/* Delivers what @from has sent to @to, in random pieces */
+static void
+deliver (GRand *rand,
+    End *from,
+    End *to)
+{
+  gsize done, step;
+
+  for (done = 0; done < from->wire->len && to->mux != NULL; done += step)
+    {
+      gboolean ok;
+
+      step = g_rand_int_range (rand, 1, 200);
+      step = MIN (step, from->wire->len - done);
+      ok = gabble_tube_mux_receive (to->mux, from->wire->str + done, step);
+      g_assert (ok);
+    }
+
+  g_string_truncate (from->wire, 0);
+}
+
+static void
+pump (GRand *rand,
+    End *a,
+    End *b)
+{
+  while (a->wire->len > 0 || b->wire->len > 0)
+    {
+      deliver (rand, a, b);
+      deliver (rand, b, a);
+    }
+}
+
+static void
+test_streams (GRand *rand)
+{
+  End a, b;
+  guint ids[3], i, round;
+  gchar buf[4096];
+  GString *expected[3];
+
+  end_init (&a);
+  end_init (&b);
+
+  for (i = 0; i < 3; i++)
+    {
+      ids[i] = gabble_tube_mux_open_stream (a.mux);
+      g_assert (ids[i] != 0);
+      expected[i] = g_string_new ("");
+    }
+
+  g_assert (ids[0] != ids[1] && ids[1] != ids[2] && ids[0] != ids[2]);
+
+  /* interleave writes of all sizes, including ones spanning several
+   * frames */
+  for (round = 0; round < 60; round++)
+    {
+      gsize len;
+
+      i = g_rand_int_range (rand, 0, 3);
+      len = round == 30 ? 0 : (gsize) g_rand_int_range (rand, 1, sizeof (buf));
+
+      memset (buf, 'a' + round % 26, len);
+      g_string_append_len (expected[i], buf, len);
+      gabble_tube_mux_send (a.mux, ids[i], buf, len);
+      pump (rand, &a, &b);
+    }
+
+  g_assert (b.opened == 3);
+
+  for (i = 0; i < 3; i++)
+    {
+      GString *got = g_hash_table_lookup (b.received,
+          GUINT_TO_POINTER (ids[i]));
+
+      g_assert (got != NULL);
+      g_assert (got->len == expected[i]->len);
+      g_assert (0 == memcmp (got->str, expected[i]->str, got->len));
+      g_string_free (expected[i], TRUE);
+    }
+
+  /* closing is seen by the other end, and late data is ignored */
+  gabble_tube_mux_send (b.mux, ids[1], "late", 4);
+  gabble_tube_mux_close_stream (a.mux, ids[1]);
+  pump (rand, &a, &b);
+  g_assert (b.closed == 1);
+  g_assert (a.closed == 0);
+
+  end_clear (&a);
+  end_clear (&b);
+}
+
+static void
+test_flow_control (GRand *rand)
+{
+  End a, b;
+  guint id;
+  gchar buf[1024];
+  gsize sent = 0;
+  GString *got;
+
+  end_init (&a);
+  end_init (&b);
+  memset (buf, 'x', sizeof (buf));
+
+  id = gabble_tube_mux_open_stream (a.mux);
+  pump (rand, &a, &b);
+
+  /* b's application isn't reading, so a must be stopped eventually... */
+  b.reading = FALSE;
+
+  while (gabble_tube_mux_send (a.mux, id, buf, sizeof (buf)))
+    {
+      sent += sizeof (buf);
+      g_assert (sent < 16 * 1024 * 1024);
+      pump (rand, &a, &b);
+    }
+
+  pump (rand, &a, &b);
+  g_assert (a.writable == 0);
+
+  /* ...and let go again once it reads */
+  b.reading = TRUE;
+  gabble_tube_mux_resume_stream (b.mux, id);
+  pump (rand, &a, &b);
+  g_assert (a.writable == 1);
+
+  got = g_hash_table_lookup (b.received, GUINT_TO_POINTER (id));
+  g_assert (got->len == sent + sizeof (buf));
+
+  /* a reader that keeps up never stops the sender */
+  for (sent = 0; sent < 4 * 1024 * 1024; sent += sizeof (buf))
+    {
+      gboolean more = gabble_tube_mux_send (a.mux, id, buf, sizeof (buf));
+
+      g_assert (more);
+      pump (rand, &a, &b);
+    }
+
+  end_clear (&a);
+  end_clear (&b);
+}
+
+static void
+test_invalid (void)
+{
+  static const struct {
+      const gchar *frame;
+      gsize len;
+  } frames[] = {
+      /* unknown type */
+      { "\x09\0\0\1\0\0\0\0", 8 },
+      /* stream 0 */
+      { "\x01\0\0\0\0\0\0\0", 8 },
+      /* too long */
+      { "\x02\0\0\1\0\1\0\1", 8 },
+      /* OPEN with a payload */
+      { "\x01\0\0\1\0\0\0\1x", 9 },
+      /* the same stream opened twice */
+      { "\x01\0\0\1\0\0\0\0\x01\0\0\1\0\0\0\0", 16 },
+      /* short WINDOW */
+      { "\x01\0\0\1\0\0\0\0\x04\0\0\1\0\0\0\2xx", 18 },
+  };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (frames); i++)
+    {
+      End end;
+      gboolean ok;
+
+      end_init (&end);
+      ok = gabble_tube_mux_receive (end.mux, frames[i].frame, frames[i].len);
+      g_assert (!ok);
+      end_clear (&end);
+    }
+}
+
+/* The mux can be freed by its own callbacks */
+static void
+test_free_from_callback (GRand *rand)
+{
+  End a, b;
+  guint id;
+
+  end_init (&a);
+  end_init (&b);
+
+  id = gabble_tube_mux_open_stream (a.mux);
+  gabble_tube_mux_send (a.mux, id, "hello", 5);
+  gabble_tube_mux_send (a.mux, id, "world", 5);
+  b.free_on_data = TRUE;
+  deliver (rand, &a, &b);
+  g_assert (b.mux == NULL);
+
+  end_clear (&a);
+  end_clear (&b);
+}
+
+int
+main (void)
+{
+  GRand *rand = g_rand_new_with_seed (42);
+
+  test_streams (rand);
+  test_flow_control (rand);
+  test_invalid ();
+  test_free_from_callback (rand);
+
+  g_rand_free (rand);
+  return 0;
+}
@@ -0,0 +1,247 @@
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <glib-object.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <wocky/wocky-node.h>
+
+#include "src/vcard-store.h"
+#include "src/vcard-store-internal.h"
+
+/* Checks that vCards survive from one store to the next, in a temporary
+ * directory, and that writes to each file are done one at a time. */
+
+#define ACCOUNT "me@example.com"
+#define ALICE "alice@example.com"
+
+static gchar *directory = NULL;
+
+static void
+remove_tree (const gchar *path)
+{
+  GDir *dir = g_dir_open (path, 0, NULL);
+  const gchar *name;
+
+  if (dir != NULL)
+    {
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          gchar *child = g_build_filename (path, name, NULL);
+
+          remove_tree (child);
+          g_free (child);
+        }
+
+      g_dir_close (dir);
+      g_rmdir (path);
+    }
+  else
+    {
+      g_unlink (path);
+    }
+}
+
+static void
+wait_for_writes (void)
+{
+  while (vcard_store_writes_in_flight () > 0)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+typedef struct {
+    gboolean done;
+    /* the FN of the vCard found, or NULL */
+    gchar *name;
+} LookupResult;
+
+static void
+lookup_cb (GabbleVCardStore *store,
+    LmMessageNode *vcard,
+    gpointer user_data)
+{
+  LookupResult *result = user_data;
+
+  g_assert (!result->done);
+  result->done = TRUE;
+
+  if (vcard != NULL)
+    result->name = g_strdup (
+        wocky_node_get_content_from_child (vcard, "FN"));
+}
+
+static void
+assert_lookup (GabbleVCardStore *store,
+    const gchar *jid,
+    const gchar *avatar_sha1,
+    const gchar *expected_name)
+{
+  LookupResult result = { FALSE, NULL };
+
+  gabble_vcard_store_lookup (store, jid, avatar_sha1, lookup_cb, &result);
+
+  /* never called back before gabble_vcard_store_lookup () returns */
+  g_assert (!result.done);
+
+  while (!result.done)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpstr (result.name, ==, expected_name);
+  g_free (result.name);
+}
+
+static void
+insert (GabbleVCardStore *store,
+    const gchar *jid,
+    const gchar *name,
+    const gchar *avatar_sha1)
+{
+  WockyNode *vcard = wocky_node_new ("vCard", "vcard-temp");
+
+  wocky_node_add_child_with_content (vcard, "FN", name);
+  gabble_vcard_store_insert (store, jid, vcard, avatar_sha1);
+  wocky_node_free (vcard);
+}
+
+static void
+test_round_trip (void)
+{
+  GabbleVCardStore *store = gabble_vcard_store_new (ACCOUNT);
+
+  g_assert (store != NULL);
+  insert (store, ALICE, "Alice", "abc");
+
+  /* found before it has been written */
+  assert_lookup (store, ALICE, "abc", "Alice");
+  assert_lookup (store, ALICE, "def", NULL);
+  assert_lookup (store, "bob@example.com", NULL, NULL);
+
+  gabble_vcard_store_free (store);
+  wait_for_writes ();
+
+  store = gabble_vcard_store_new (ACCOUNT);
+  g_assert (store != NULL);
+
+  assert_lookup (store, ALICE, "abc", "Alice");
+  /* it has only just been stored, so it's used if we don't know her hash */
+  assert_lookup (store, ALICE, NULL, "Alice");
+  /* but not if she's changed her avatar since */
+  assert_lookup (store, ALICE, "def", NULL);
+  assert_lookup (store, ALICE, "", NULL);
+
+  insert (store, ALICE, "Alice Again", "def");
+  assert_lookup (store, ALICE, "def", "Alice Again");
+  gabble_vcard_store_free (store);
+
+  /* read back while it's still being written */
+  store = gabble_vcard_store_new (ACCOUNT);
+  g_assert (store != NULL);
+  assert_lookup (store, ALICE, "def", "Alice Again");
+  gabble_vcard_store_remove (store, ALICE);
+  assert_lookup (store, ALICE, "def", NULL);
+  gabble_vcard_store_free (store);
+  wait_for_writes ();
+
+  store = gabble_vcard_store_new (ACCOUNT);
+  g_assert (store != NULL);
+  assert_lookup (store, ALICE, "def", NULL);
+  assert_lookup (store, ALICE, NULL, NULL);
+  gabble_vcard_store_free (store);
+  wait_for_writes ();
+
+  /* other accounts have stores of their own */
+  store = gabble_vcard_store_new ("someone-else@example.com");
+  g_assert (store != NULL);
+  insert (store, ALICE, "Alice", "abc");
+  gabble_vcard_store_free (store);
+  wait_for_writes ();
+
+  store = gabble_vcard_store_new (ACCOUNT);
+  g_assert (store != NULL);
+  assert_lookup (store, ALICE, "abc", NULL);
+  gabble_vcard_store_free (store);
+}
+
+static void
+assert_contents (const gchar *path,
+    const gchar *expected)
+{
+  gchar *contents = NULL;
+  gboolean ok;
+
+  ok = g_file_get_contents (path, &contents, NULL, NULL);
+  g_assert (ok);
+  g_assert_cmpstr (contents, ==, expected);
+  g_free (contents);
+}
+
+static void
+test_serialized_writes (void)
+{
+  GFile *dir = g_file_new_for_path (directory);
+  gchar *path = g_build_filename (directory, "serialized", NULL);
+  gchar *other = g_build_filename (directory, "other", NULL);
+
+  vcard_store_write_file (dir, "serialized", g_string_new ("one"));
+  vcard_store_write_file (dir, "serialized", g_string_new ("two"));
+  vcard_store_write_file (dir, "serialized", g_string_new ("three"));
+  g_assert_cmpuint (vcard_store_writes_in_flight (), ==, 1);
+
+  /* writes to different files don't wait for each other */
+  vcard_store_write_file (dir, "other", g_string_new ("other"));
+  g_assert_cmpuint (vcard_store_writes_in_flight (), ==, 2);
+
+  wait_for_writes ();
+
+  /* the latest contents win */
+  assert_contents (path, "three");
+  assert_contents (other, "other");
+
+  /* the file can be written again once it's finished */
+  vcard_store_write_file (dir, "serialized", g_string_new ("four"));
+  g_assert_cmpuint (vcard_store_writes_in_flight (), ==, 1);
+  wait_for_writes ();
+
+  assert_contents (path, "four");
+
+  g_free (other);
+  g_free (path);
+  g_object_unref (dir);
+}
+
+static void
+test_memory (void)
+{
+  g_setenv ("GABBLE_VCARD_CACHE", ":memory:", TRUE);
+  g_assert (gabble_vcard_store_new (ACCOUNT) == NULL);
+  g_setenv ("GABBLE_VCARD_CACHE", directory, TRUE);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  int ret;
+
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+
+  directory = g_build_filename (g_get_tmp_dir (), "test-vcard-store-XXXXXX",
+      NULL);
+  if (mkdtemp (directory) == NULL)
+    g_error ("couldn't create %s", directory);
+
+  g_setenv ("GABBLE_VCARD_CACHE", directory, TRUE);
+
+  g_test_add_func ("/vcard-store/round-trip", test_round_trip);
+  g_test_add_func ("/vcard-store/serialized-writes", test_serialized_writes);
+  g_test_add_func ("/vcard-store/memory", test_memory);
+
+  ret = g_test_run ();
+
+  remove_tree (directory);
+  g_free (directory);
+  return ret;
+}
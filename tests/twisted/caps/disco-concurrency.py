@@ -0,0 +1,107 @@
+"""
+Test how many contacts Gabble asks about a caps node at once:
+- at most three discos about the same node are in flight at a time
+- if nobody answers about a node for a while, another contact is asked too
+- how long it took to learn what a node means is recorded
+"""
+
+from servicetest import EventPattern, assertEquals, ProxyWrapper
+from gabbletest import exec_test, sync_stream
+import ns
+from config import DEBUGGING
+from caps_helper import (
+    compute_caps_hash, send_presence, expect_disco, send_disco_reply)
+
+client = 'http://telepathy.freedesktop.org/fake-client/disco-concurrency'
+features = [
+    ns.JINGLE_015,
+    ns.JINGLE_015_AUDIO,
+    ns.JINGLE_015_VIDEO,
+    ns.GOOGLE_P2P,
+    ]
+
+debug_path = '/org/freedesktop/Telepathy/debug'
+debug_iface = 'org.freedesktop.Telepathy.Debug'
+
+def disco_about(node):
+    return EventPattern('stream-iq', query_ns=ns.DISCO_INFO, query_node=node)
+
+def test_max_discos(q, conn, stream):
+    caps = {
+        'node': client,
+        'ver':  '0.1',
+        }
+    node = client + '#' + caps['ver']
+    contacts = ['bob%d@foo.com/Foo' % i for i in range(5)]
+
+    # Without a hash, five contacts have to agree about the node before we
+    # trust it, but only three of them are asked at once
+    for contact in contacts:
+        send_presence(q, conn, stream, contact, caps)
+
+    asked = []
+    for i in range(3):
+        e = q.expect('stream-iq', query_ns=ns.DISCO_INFO, query_node=node)
+        asked.append(e)
+
+    assertEquals(3, len(set([e.to for e in asked])))
+
+    discos = [disco_about(node)]
+    q.forbid_events(discos)
+    sync_stream(q, stream)
+    q.unforbid_events(discos)
+
+    # Once one of them answers, someone else is asked
+    send_disco_reply(stream, asked[0].stanza, [], features)
+
+    e = q.expect('stream-iq', query_ns=ns.DISCO_INFO, query_node=node)
+    assert e.to not in [a.to for a in asked], e.to
+
+def test_hedge(q, bus, conn, stream):
+    caps = {
+        'node': client,
+        'ver':  compute_caps_hash([], features, {}),
+        'hash': 'sha-1',
+        }
+    node = client + '#' + caps['ver']
+    slow = 'slow@foo.com/Foo'
+    fast = 'fast@foo.com/Foo'
+
+    if DEBUGGING:
+        debug = ProxyWrapper(bus.get_object(conn.bus_name, debug_path),
+            debug_iface)
+        debug.Properties.Set(debug_iface, 'Enabled', True)
+
+    # With a hash, one answer is enough, so only one contact is asked at
+    # first
+    send_presence(q, conn, stream, slow, caps)
+    slow_stanza = expect_disco(q, slow, client, caps)
+
+    discos = [disco_about(node)]
+    q.forbid_events(discos)
+    h = send_presence(q, conn, stream, fast, caps)
+    sync_stream(q, stream)
+    q.unforbid_events(discos)
+
+    # The first contact doesn't answer, so after a few seconds the second one
+    # is asked too, long before the first request would time out
+    fast_stanza = expect_disco(q, fast, client, caps)
+    send_disco_reply(stream, fast_stanza, [], features)
+
+    q.expect('dbus-signal', signal='CapabilitiesChanged',
+        predicate=lambda e: e.args[0][0][0] == h)
+
+    if DEBUGGING:
+        q.expect('dbus-signal', signal='NewDebugMessage',
+            predicate=lambda e: ('time to caps for %s:' % node) in e.args[3])
+
+    # The late answer from the first contact changes nothing
+    send_disco_reply(stream, slow_stanza, [], features)
+    sync_stream(q, stream)
+
+def test(q, bus, conn, stream):
+    test_max_discos(q, conn, stream)
+    test_hedge(q, bus, conn, stream)
+
+if __name__ == '__main__':
+    exec_test(test)
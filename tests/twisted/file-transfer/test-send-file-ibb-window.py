@@ -0,0 +1,137 @@
+"""
+Checks that when sending over IBB, Gabble adapts the number of stanzas it
+has in flight, and their size, to how quickly the peer acks them.
+"""
+
+import base64
+import errno
+import socket
+import time
+
+from twisted.words.xish import xpath
+
+from gabbletest import exec_test, sync_stream, acknowledge_iq, \
+    send_error_reply, elem
+from servicetest import EventPattern, assertEquals
+import bytestream
+from file_transfer_helper import SendFileTest, File
+import ns
+
+import constants as cs
+
+# These match bytestream-ibb.c
+WINDOW_INITIAL = 10
+WINDOW_MIN = 2
+BLOCK_SIZE = 4096
+BLOCK_SIZE_MIN = 1024
+
+# Acks are considered slow if they take much more than 50ms longer than the
+# fastest one
+SLOW_ACK_DELAY = 0.5
+
+class SendFileIBBWindowTest(SendFileTest):
+    def __init__(self):
+        SendFileTest.__init__(self, bytestream.BytestreamIBBMsg,
+            File(data='x' * 1024 * 1024),
+            cs.SOCKET_ADDRESS_TYPE_UNIX,
+            cs.SOCKET_ACCESS_CONTROL_LOCALHOST, "")
+
+    def feed(self):
+        # Gabble stops reading from the socket while its window is full, so
+        # only give it as much as the socket will take without blocking
+        while self.to_write:
+            try:
+                n = self.socket.send(self.to_write)
+            except socket.error, e:
+                if e.args[0] == errno.EAGAIN:
+                    return
+                raise
+
+            self.to_write = self.to_write[n:]
+
+    def expect_stanzas(self, n):
+        """Waits for n new IBB data stanzas, which are left unacked, and
+        checks that no more follow them. Returns their sizes."""
+
+        self.feed()
+
+        stanzas = []
+        while len(stanzas) < n:
+            e = self.q.expect('stream-iq', iq_type='set', query_ns=ns.IBB,
+                query_name='data')
+            stanzas.append(e.stanza)
+
+        forbidden = [EventPattern('stream-iq', iq_type='set',
+            query_ns=ns.IBB, query_name='data')]
+        self.q.forbid_events(forbidden)
+        sync_stream(self.q, self.stream)
+        self.q.unforbid_events(forbidden)
+
+        self.in_flight = stanzas
+        return [len(base64.b64decode(str(data)))
+            for data in [xpath.queryForNodes('/iq/data', s)[0]
+                for s in stanzas]]
+
+    def ack_all(self):
+        for stanza in self.in_flight:
+            acknowledge_iq(self.stream, stanza)
+
+    def send_file(self):
+        self.socket = self.create_socket()
+        self.socket.connect(self.address)
+        self.socket.setblocking(False)
+        self.to_write = self.file.data
+
+        # Nothing has been acked yet
+        assertEquals([BLOCK_SIZE] * WINDOW_INITIAL,
+            self.expect_stanzas(WINDOW_INITIAL))
+
+        # While acks come back quickly, the window grows by one stanza for
+        # each window's worth of them
+        for window in range(WINDOW_INITIAL + 1, WINDOW_INITIAL + 4):
+            self.ack_all()
+            assertEquals([BLOCK_SIZE] * window, self.expect_stanzas(window))
+
+        # The peer refusing a stanza makes Gabble as gentle as it can be
+        # straight away, however many stanzas it had in flight
+        for stanza in self.in_flight:
+            send_error_reply(self.stream, stanza,
+                elem('error', type='wait')(
+                    elem(ns.STANZA, 'resource-constraint')))
+
+        assertEquals([BLOCK_SIZE_MIN] * WINDOW_MIN,
+            self.expect_stanzas(WINDOW_MIN))
+
+        # Once acks are quick again, stanzas go back to the negotiated block
+        # size before the window grows
+        self.ack_all()
+        assertEquals([BLOCK_SIZE_MIN, 2 * BLOCK_SIZE_MIN],
+            self.expect_stanzas(WINDOW_MIN))
+        self.ack_all()
+        assertEquals([2 * BLOCK_SIZE_MIN, BLOCK_SIZE],
+            self.expect_stanzas(WINDOW_MIN))
+
+        for window in range(WINDOW_MIN + 1, WINDOW_MIN + 4):
+            self.ack_all()
+            assertEquals([BLOCK_SIZE] * window, self.expect_stanzas(window))
+
+        # Delaying the acks shrinks the window: the stanzas already in flight
+        # are replaced as they're acked until the window is resized, and none
+        # after that
+        before = len(self.in_flight)
+        time.sleep(SLOW_ACK_DELAY)
+        self.ack_all()
+        assertEquals([BLOCK_SIZE] * (before - 1),
+            self.expect_stanzas(before - 1))
+
+        # Once the window is as small as it gets, the stanzas get smaller
+        # too, down to BLOCK_SIZE_MIN
+        for i in range(3):
+            time.sleep(SLOW_ACK_DELAY)
+            self.ack_all()
+            sizes = self.expect_stanzas(WINDOW_MIN)
+
+        assertEquals([BLOCK_SIZE_MIN] * WINDOW_MIN, sizes)
+
+if __name__ == '__main__':
+    exec_test(SendFileIBBWindowTest().test)
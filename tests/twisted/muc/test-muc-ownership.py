@@ -5,14 +5,19 @@ GetHandleOwners on MUC members.
 
 By default, MUC channels should have the flag set. The flag should be unset
 when presence is received that includes the MUC JID's owner JID.
+
+Presence updates from people already in the room should not change the group
+again.
 """
 
 import dbus
 
-from gabbletest import make_result_iq, exec_test, make_muc_presence
+from gabbletest import (
+    make_result_iq, exec_test, make_muc_presence, sync_stream,
+    )
 from servicetest import (
     call_async, EventPattern, assertEquals, assertFlagsSet, assertFlagsUnset,
-    wrap_channel,
+    wrap_channel, sync_dbus,
     )
 import constants as cs
 
@@ -100,5 +105,46 @@ def test(q, bus, conn, stream):
     assertFlagsSet(cs.GF_PROPERTIES | cs.GF_CHANNEL_SPECIFIC_HANDLES, flags)
     assertFlagsUnset(cs.GF_HANDLE_OWNERS_NOT_AVAILABLE, flags)
 
+    # Status changes from people who are already here don't touch the group
+    forbidden = [EventPattern('dbus-signal', signal='MembersChanged'),
+                 EventPattern('dbus-signal', signal='HandleOwnersChanged')]
+    q.forbid_events(forbidden)
+
+    presence = make_muc_presence('owner', 'moderator', 'chat@conf.localhost',
+        'bob')
+    presence.addElement('show', content='away')
+    stream.send(presence)
+    stream.send(make_muc_presence('none', 'participant', 'chat@conf.localhost',
+        'che', 'che@foo.com'))
+
+    sync_stream(q, stream)
+    sync_dbus(bus, q, conn)
+    q.unforbid_events(forbidden)
+
+    # but people arriving do. Arriving together they're usually added
+    # together, but that depends on timing, so just check they're all added
+    stream.send(make_muc_presence('none', 'participant', 'chat@conf.localhost',
+        'dave', 'dave@foo.com'))
+    stream.send(make_muc_presence('none', 'participant', 'chat@conf.localhost',
+        'eve'))
+
+    [dave, dave_owner, eve] = conn.RequestHandles(cs.HT_CONTACT,
+        ['chat@conf.localhost/dave', 'dave@foo.com',
+         'chat@conf.localhost/eve'])
+
+    added = []
+    owners = {}
+
+    while sorted(added) != sorted([dave, eve]) or len(owners) < 2:
+        event = q.expect('dbus-signal', predicate=lambda e:
+            e.signal in ('MembersChanged', 'HandleOwnersChanged'))
+
+        if event.signal == 'MembersChanged':
+            added.extend(event.args[1])
+        else:
+            owners.update(event.args[0])
+
+    assertEquals({dave: dave_owner, eve: 0}, owners)
+
 if __name__ == '__main__':
     exec_test(test)
@@ -0,0 +1,237 @@
+"""
+Accepts 1-1 stream tube offers from a contact who can multiplex connections:
+- the first connection asks for a bytestream with mux="true"
+- connections made while it is being negotiated wait for it, and all of them
+  are then opened over that one bytestream
+- if the initiator refuses, each connection gets a bytestream of its own
+"""
+
+import os
+
+import dbus
+
+from servicetest import call_async, EventPattern, sync_dbus, assertEquals
+from gabbletest import acknowledge_iq, send_error_reply, make_result_iq, \
+    sync_stream
+
+from twisted.words.xish import domish, xpath
+import ns
+import constants as cs
+from bytestream import create_from_si_offer, announce_socks5_proxy
+import tubetestutil as t
+
+bob_jid = 'bob@localhost/Bob'
+stream_tube_id = 49
+
+si_request = EventPattern('stream-iq', to=bob_jid, query_ns=ns.SI,
+    query_name='si')
+
+def receive_tube_offer(q, bus, conn, stream):
+    message = domish.Element(('jabber:client', 'message'))
+    message['to'] = 'test@localhost/Resource'
+    message['from'] = bob_jid
+    tube_node = message.addElement((ns.TUBES, 'tube'))
+    tube_node['type'] = 'stream'
+    tube_node['service'] = 'http'
+    tube_node['id'] = str(stream_tube_id)
+    stream.send(message)
+
+    def new_stream_tube(e):
+        props = e.args[0][0][1]
+        return props[cs.CHANNEL_TYPE] == cs.CHANNEL_TYPE_STREAM_TUBE
+
+    e = q.expect('dbus-signal', signal='NewChannels',
+        predicate=new_stream_tube)
+
+    tube_chan = bus.get_object(conn.bus_name, e.args[0][0][0])
+    tube_iface = dbus.Interface(tube_chan, cs.CHANNEL_TYPE_STREAM_TUBE)
+
+    return tube_chan, tube_iface
+
+def accept_tube(q, tube_iface, address_type, access_control,
+        access_control_param):
+    call_async(q, tube_iface, 'Accept', address_type, access_control,
+        access_control_param, byte_arrays=True)
+
+    accept_return_event, _ = q.expect_many(
+        EventPattern('dbus-return', method='Accept'),
+        EventPattern('dbus-signal', signal='TubeChannelStateChanged',
+            args=[cs.TUBE_CHANNEL_STATE_OPEN]))
+
+    return accept_return_event.value[0]
+
+def get_stream_node(iq):
+    stream_node = xpath.queryForNodes('/iq/si/stream[@xmlns="%s"]' %
+        ns.TUBES, iq)[0]
+    assertEquals(str(stream_tube_id), stream_node['tube'])
+    return stream_node
+
+def accept_bytestream(q, stream, bytestream_cls, iq):
+    bytestream, profile = create_from_si_offer(stream, q, bytestream_cls,
+        iq, 'test@localhost/Resource')
+    assertEquals(ns.TUBES, profile)
+
+    result, si = bytestream.create_si_reply(iq)
+    si.addElement((ns.TUBES, 'tube'))
+    stream.send(result)
+
+    bytestream.wait_bytestream_open()
+    return bytestream
+
+def test(q, bus, conn, stream, bytestream_cls,
+        address_type, access_control, access_control_param):
+
+    vcard_event, roster_event, disco_event = q.expect_many(
+        EventPattern('stream-iq', to=None, query_ns='vcard-temp',
+            query_name='vCard'),
+        EventPattern('stream-iq', query_ns=ns.ROSTER),
+        EventPattern('stream-iq', to='localhost', query_ns=ns.DISCO_ITEMS))
+
+    acknowledge_iq(stream, vcard_event.stanza)
+
+    announce_socks5_proxy(q, stream, disco_event.stanza)
+
+    roster = roster_event.stanza
+    roster['type'] = 'result'
+    item = roster_event.query.addElement('item')
+    item['jid'] = 'bob@localhost' # Bob can do tubes
+    item['subscription'] = 'both'
+    stream.send(roster)
+
+    # Send Bob presence and his caps, which include multiplexed tubes
+    presence = domish.Element(('jabber:client', 'presence'))
+    presence['from'] = bob_jid
+    presence['to'] = 'test@localhost/Resource'
+    c = presence.addElement('c')
+    c['xmlns'] = 'http://jabber.org/protocol/caps'
+    c['node'] = 'http://example.com/ICantBelieveItsNotTelepathy'
+    c['ver'] = '1.2.3'
+    stream.send(presence)
+
+    event = q.expect('stream-iq', iq_type='get',
+        query_ns='http://jabber.org/protocol/disco#info',
+        to=bob_jid)
+    assert event.query['node'] == \
+        'http://example.com/ICantBelieveItsNotTelepathy#1.2.3'
+    result = make_result_iq(stream, event.stanza)
+    query = result.firstChildElement()
+    feature = query.addElement('feature')
+    feature['var'] = ns.TUBES
+    feature = query.addElement('feature')
+    feature['var'] = ns.TUBES_MUX
+    stream.send(result)
+
+    sync_dbus(bus, q, conn)
+
+    # Receive a tube offer from Bob, and accept it
+    tube_chan, tube_iface = receive_tube_offer(q, bus, conn, stream)
+    socket_address = accept_tube(q, tube_iface, address_type, access_control,
+        access_control_param)
+
+    # The first connection asks for a multiplexed bytestream
+    socket_event, si_event, conn_id1 = t.connect_to_cm_socket(q, bob_jid,
+        address_type, socket_address, access_control, access_control_param)
+    protocol1 = socket_event.protocol
+
+    stream_node = get_stream_node(si_event.stanza)
+    assertEquals('true', stream_node['mux'])
+
+    # A second connection waits for the same bytestream rather than asking
+    # for one of its own
+    q.forbid_events([si_request])
+
+    t.connect_socket(q, address_type, socket_address, access_control,
+        access_control_param)
+    socket_event, sig = q.expect_many(
+        EventPattern('socket-connected'),
+        EventPattern('dbus-signal', signal='NewLocalConnection'))
+    protocol2 = socket_event.protocol
+    conn_id2 = sig.args[0]
+    assert conn_id2 != 0
+    assert conn_id2 != conn_id1
+
+    sync_stream(q, stream)
+    q.unforbid_events([si_request])
+
+    # Bob accepts the multiplexed bytestream; both connections are opened
+    # over it, in the order they were made
+    bytestream = accept_bytestream(q, stream, bytestream_cls,
+        si_event.stanza)
+    reader = t.MuxFrameReader(bytestream)
+
+    assertEquals((t.MUX_OPEN, 1, ''), reader.read())
+    assertEquals((t.MUX_OPEN, 2, ''), reader.read())
+
+    protocol1.sendData('hello from one')
+    assertEquals((t.MUX_DATA, 1, 'hello from one'), reader.read())
+
+    protocol2.sendData('hello from two')
+    assertEquals((t.MUX_DATA, 2, 'hello from two'), reader.read())
+
+    # reply to the second connection
+    bytestream.send_data(t.make_mux_frame(t.MUX_DATA, 2, 'hello joiner'))
+    e = q.expect('socket-data', protocol=protocol2)
+    assertEquals('hello joiner', e.data)
+
+    # Bob closes the first connection; the second one stays up
+    bytestream.send_data(t.make_mux_frame(t.MUX_CLOSE, 1))
+    e, _ = q.expect_many(
+        EventPattern('dbus-signal', signal='ConnectionClosed'),
+        EventPattern('socket-disconnected', protocol=protocol1))
+    assertEquals(conn_id1, e.args[0])
+    assertEquals(cs.CONNECTION_LOST, e.args[1])
+
+    bytestream.send_data(t.make_mux_frame(t.MUX_DATA, 2, 'still here'))
+    e = q.expect('socket-data', protocol=protocol2)
+    assertEquals('still here', e.data)
+
+    tube_chan.Close()
+    bytestream.wait_bytestream_closed()
+
+    # Receive another tube offer from Bob, and accept it
+    tube_chan, tube_iface = receive_tube_offer(q, bus, conn, stream)
+    socket_address = accept_tube(q, tube_iface, address_type, access_control,
+        access_control_param)
+
+    socket_event, si_event, conn_id = t.connect_to_cm_socket(q, bob_jid,
+        address_type, socket_address, access_control, access_control_param)
+    protocol = socket_event.protocol
+
+    stream_node = get_stream_node(si_event.stanza)
+    assertEquals('true', stream_node['mux'])
+
+    # This time Bob refuses the multiplexed bytestream, so the connection
+    # asks for a plain one instead
+    send_error_reply(stream, si_event.stanza)
+
+    si_event = q.expect('stream-iq', to=bob_jid, query_ns=ns.SI,
+        query_name='si')
+    stream_node = get_stream_node(si_event.stanza)
+    assert not stream_node.hasAttribute('mux')
+
+    bytestream = accept_bytestream(q, stream, bytestream_cls,
+        si_event.stanza)
+
+    # data isn't framed on this bytestream
+    data = 'hello initiator'
+    protocol.sendData(data)
+    binary = bytestream.get_data(len(data))
+    assertEquals(data, binary)
+
+    bytestream.send_data('hello joiner')
+    e = q.expect('socket-data', protocol=protocol)
+    assertEquals('hello joiner', e.data)
+
+    tube_chan.Close()
+    e, _ = bytestream.wait_bytestream_closed([
+        EventPattern('dbus-signal', signal='ConnectionClosed'),
+        EventPattern('socket-disconnected')])
+    assertEquals(conn_id, e.args[0])
+    assertEquals(cs.CANCELLED, e.args[1])
+
+if __name__ == '__main__':
+    t.exec_tube_test(test, cs.SOCKET_ADDRESS_TYPE_IPV4,
+        cs.SOCKET_ACCESS_CONTROL_LOCALHOST, "")
+    if os.name == 'posix':
+        t.exec_tube_test(test, cs.SOCKET_ADDRESS_TYPE_UNIX,
+            cs.SOCKET_ACCESS_CONTROL_LOCALHOST, "")
@@ -0,0 +1,165 @@
+"""
+Offers a 1-1 stream tube to a contact who multiplexes all their connections
+to it over one bytestream.
+"""
+
+import os
+
+import dbus
+
+from servicetest import call_async, EventPattern, sync_dbus, assertEquals
+from gabbletest import acknowledge_iq, sync_stream, make_result_iq
+import constants as cs
+import ns
+import tubetestutil as t
+
+from twisted.words.xish import domish, xpath
+
+def open_connection(q, bytestream, reader, id, bob_handle):
+    bytestream.send_data(t.make_mux_frame(t.MUX_OPEN, id))
+
+    new_conn_event, socket_event = q.expect_many(
+        EventPattern('dbus-signal', signal='NewRemoteConnection'),
+        EventPattern('socket-connected'))
+
+    handle, access, conn_id = new_conn_event.args
+    assertEquals(bob_handle, handle)
+
+    # the echo server lowercases what it gets
+    data = 'HELLO, CONNECTION %d' % id
+    bytestream.send_data(t.make_mux_frame(t.MUX_DATA, id, data))
+    assertEquals((t.MUX_DATA, id, data.lower()), reader.read())
+
+    return socket_event.protocol, conn_id
+
+def test(q, bus, conn, stream, bytestream_cls,
+        address_type, access_control, access_control_param):
+    address = t.set_up_echo(q, address_type)
+
+    vcard_event, roster_event = q.expect_many(
+        EventPattern('stream-iq', to=None, query_ns='vcard-temp',
+            query_name='vCard'),
+        EventPattern('stream-iq', query_ns=ns.ROSTER))
+
+    acknowledge_iq(stream, vcard_event.stanza)
+
+    roster = roster_event.stanza
+    roster['type'] = 'result'
+    item = roster_event.query.addElement('item')
+    item['jid'] = 'bob@localhost' # Bob can do tubes
+    item['subscription'] = 'both'
+    stream.send(roster)
+
+    bob_full_jid = 'bob@localhost/Bob'
+    self_full_jid = 'test@localhost/Resource'
+
+    # Send Bob presence and his caps, which include multiplexed tubes
+    presence = domish.Element(('jabber:client', 'presence'))
+    presence['from'] = bob_full_jid
+    presence['to'] = self_full_jid
+    c = presence.addElement('c')
+    c['xmlns'] = 'http://jabber.org/protocol/caps'
+    c['node'] = 'http://example.com/ICantBelieveItsNotTelepathy'
+    c['ver'] = '1.2.3'
+    stream.send(presence)
+
+    event = q.expect('stream-iq', iq_type='get',
+        query_ns='http://jabber.org/protocol/disco#info',
+        to=bob_full_jid)
+    assert event.query['node'] == \
+        'http://example.com/ICantBelieveItsNotTelepathy#1.2.3'
+    result = make_result_iq(stream, event.stanza)
+    query = result.firstChildElement()
+    feature = query.addElement('feature')
+    feature['var'] = ns.TUBES
+    feature = query.addElement('feature')
+    feature['var'] = ns.TUBES_MUX
+    stream.send(result)
+
+    sync_stream(q, stream)
+    sync_dbus(bus, q, conn)
+
+    bob_handle = conn.RequestHandles(cs.HT_CONTACT, ['bob@localhost'])[0]
+
+    call_async(q, conn.Requests, 'CreateChannel',
+            {cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_STREAM_TUBE,
+             cs.TARGET_HANDLE_TYPE: cs.HT_CONTACT,
+             cs.TARGET_HANDLE: bob_handle,
+             cs.STREAM_TUBE_SERVICE: "echo",
+            })
+    ret = q.expect('dbus-return', method='CreateChannel')
+
+    tube_chan = bus.get_object(conn.bus_name, ret.value[0])
+    tube_iface = dbus.Interface(tube_chan, cs.CHANNEL_TYPE_STREAM_TUBE)
+
+    call_async(q, tube_iface, 'Offer', address_type, address, access_control,
+        {})
+
+    msg_event, _ = q.expect_many(
+        EventPattern('stream-message', to=bob_full_jid),
+        EventPattern('dbus-return', method='Offer'))
+
+    tube = xpath.queryForNodes('/message/tube[@xmlns="%s"]' % ns.TUBES,
+        msg_event.stanza)[0]
+    stream_tube_id = long(tube['id'])
+
+    # Bob asks for one bytestream to carry all his connections. Nothing
+    # connects to the local socket until he opens a connection over it.
+    forbidden = [EventPattern('socket-connected')]
+    q.forbid_events(forbidden)
+
+    bytestream = bytestream_cls(stream, q, 'alpha', bob_full_jid,
+        self_full_jid, True)
+    iq, si = bytestream.create_si_offer(ns.TUBES)
+
+    stream_node = si.addElement((ns.TUBES, 'stream'))
+    stream_node['tube'] = str(stream_tube_id)
+    stream_node['mux'] = 'true'
+    stream.send(iq)
+
+    si_reply_event, _ = q.expect_many(
+            EventPattern('stream-iq', iq_type='result'),
+            EventPattern('dbus-signal', signal='TubeChannelStateChanged',
+                args=[cs.TUBE_CHANNEL_STATE_OPEN]))
+
+    bytestream.check_si_reply(si_reply_event.stanza)
+    tube = xpath.queryForNodes('/iq/si/tube[@xmlns="%s"]' % ns.TUBES,
+        si_reply_event.stanza)
+    assert len(tube) == 1
+
+    bytestream.open_bytestream()
+    sync_stream(q, stream)
+    q.unforbid_events(forbidden)
+
+    reader = t.MuxFrameReader(bytestream)
+
+    # Each connection Bob opens gets a connection to the local socket
+    protocol1, conn_id1 = open_connection(q, bytestream, reader, 1,
+        bob_handle)
+    protocol2, conn_id2 = open_connection(q, bytestream, reader, 2,
+        bob_handle)
+    assert conn_id1 != conn_id2
+
+    # Bob closes the first connection; the second one stays up
+    bytestream.send_data(t.make_mux_frame(t.MUX_CLOSE, 1))
+    e, _ = q.expect_many(
+        EventPattern('dbus-signal', signal='ConnectionClosed'),
+        EventPattern('socket-disconnected', protocol=protocol1))
+    assertEquals(conn_id1, e.args[0])
+    assertEquals(cs.CONNECTION_LOST, e.args[1])
+
+    bytestream.send_data(t.make_mux_frame(t.MUX_DATA, 2, 'STILL HERE'))
+    assertEquals((t.MUX_DATA, 2, 'still here'), reader.read())
+
+    # Bob closes the bytestream, and so the connections it carried
+    bytestream.close()
+    e = q.expect('dbus-signal', signal='ConnectionClosed')
+    assertEquals(conn_id2, e.args[0])
+    assertEquals(cs.CONNECTION_LOST, e.args[1])
+
+if __name__ == '__main__':
+    t.exec_tube_test(test, cs.SOCKET_ADDRESS_TYPE_IPV4,
+        cs.SOCKET_ACCESS_CONTROL_LOCALHOST, "")
+    if os.name == 'posix':
+        t.exec_tube_test(test, cs.SOCKET_ADDRESS_TYPE_UNIX,
+            cs.SOCKET_ACCESS_CONTROL_LOCALHOST, "")
@@ -5,6 +5,7 @@ Helper functions for writing tubes tests
 import errno
 import os
 import socket
+import struct
 import sys
 
 import dbus
@@ -353,6 +354,36 @@ def connect_to_cm_socket(q, to, address_type, address, access_control,
     assert connection_id != 0
     return socket_event, si_event, connection_id
 
+# Frame types of the protocol multiplexing several connections to a stream
+# tube over one bytestream (see src/tube-mux.c)
+MUX_OPEN, MUX_DATA, MUX_CLOSE, MUX_WINDOW = 1, 2, 3, 4
+
+def make_mux_frame(type, id, payload=''):
+    return struct.pack('>BBHI', type, 0, id, len(payload)) + payload
+
+class MuxFrameReader(object):
+    """
+    Reads the frames sent by Gabble on a multiplexed bytestream
+    """
+    def __init__(self, bytestream):
+        self.bytestream = bytestream
+        self.buffer = ''
+
+    def read(self):
+        """
+        Returns the next frame as a (type, id, payload) tuple
+        """
+        while True:
+            if len(self.buffer) >= 8:
+                type, _, id, length = struct.unpack('>BBHI', self.buffer[:8])
+
+                if len(self.buffer) >= 8 + length:
+                    payload = self.buffer[8:8 + length]
+                    self.buffer = self.buffer[8 + length:]
+                    return type, id, payload
+
+            self.buffer += self.bytestream.get_data()
+
 def exec_tube_test(test, *args):
     for bytestream_cls in [
             bytestream.BytestreamIBBMsg,